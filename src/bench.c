@@ -0,0 +1,243 @@
+/*
+ * bench.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Measures the ioctl round trip of a device node, or of libmppv4l2 in
+ * process, with concurrent sessions issuing ioctls back to back. Run it
+ * against the daemon with and without --io-uring to compare transports.
+ * QUERYCAP is answered from the daemon's reply cache, the other ioctls go
+ * through a session.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "libmppv4l2.h"
+#include "trace.h"
+#include "utils.h"
+
+static const char *usage =
+"usage: mpp-v4l2m2m-bench [options]\n"
+"\n"
+"options:\n"
+"    -d DEVICE      bench DEVICE, /dev/video0-mpp-dec by default\n"
+"    -l             bench libmppv4l2 in process\n"
+"    -s SESSIONS    concurrent sessions, 16 by default\n"
+"    -t SECONDS     how long to run, 5 by default\n"
+"    -i IOCTL       g_fmt, try_fmt or g_ctrl, served by the session, or\n"
+"                   querycap, from the reply cache, g_fmt by default\n"
+"\n";
+
+/**
+ * struct bench_session - A session issuing ioctls on its own thread
+ * @dev:        In process session, NULL for a device node.
+ * @fd:         Open of the device node.
+ * @thread:     Thread of the session.
+ * @samples:    Round trips in ns.
+ * @count:      Number of samples.
+ * @size:       Room of samples.
+ * @errors:     Ioctls that failed.
+ */
+struct bench_session {
+    struct mppv4l2 *dev;
+    int fd;
+    pthread_t thread;
+
+    uint32_t *samples;
+    size_t count;
+    size_t size;
+    uint64_t errors;
+};
+
+static unsigned long bench_cmd = VIDIOC_G_FMT;
+static uint64_t bench_end;
+
+static int bench_ioctl(struct bench_session *session, unsigned long cmd, void *arg) {
+    if (session->dev)
+        return mppv4l2_ioctl(session->dev, cmd, arg);
+
+    return ioctl(session->fd, cmd, arg);
+}
+
+static void *bench_thread(void *data) {
+    struct bench_session *session = data;
+    union {
+        struct v4l2_capability cap;
+        struct v4l2_format fmt;
+        struct v4l2_control ctrl;
+    } arg;
+    uint64_t start, now;
+    uint32_t *tmp;
+
+    do {
+        memset(&arg, 0, sizeof(arg));
+        if (bench_cmd == VIDIOC_G_FMT) {
+            arg.fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        } else if (bench_cmd == VIDIOC_TRY_FMT) {
+            /* Read and written back, the round trip of a full struct each way */
+            arg.fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            arg.fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
+            arg.fmt.fmt.pix_mp.width = 1920;
+            arg.fmt.fmt.pix_mp.height = 1080;
+            arg.fmt.fmt.pix_mp.num_planes = 1;
+        } else if (bench_cmd == VIDIOC_G_CTRL) {
+            arg.ctrl.id = V4L2_CID_MIN_BUFFERS_FOR_CAPTURE;
+        }
+
+        start = rkmpp_trace_now();
+        if (bench_ioctl(session, bench_cmd, &arg) < 0)
+            session->errors++;
+        now = rkmpp_trace_now();
+
+        if (session->count == session->size) {
+            tmp = realloc(session->samples, (session->size * 2 + 4096) * sizeof(*tmp));
+            if (!tmp)
+                break;
+            session->samples = tmp;
+            session->size = session->size * 2 + 4096;
+        }
+        session->samples[session->count++] = min(now - start, UINT32_MAX);
+    } while (now < bench_end);
+
+    return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+static double bench_percentile(const uint32_t *samples, size_t count, double pct) {
+    size_t i = count * pct / 100;
+
+    return samples[min(i, count - 1)] / 1000.0;
+}
+
+int main(int argc, char **argv) {
+    const char *device = "/dev/video0-mpp-dec";
+    struct bench_session *sessions;
+    bool inprocess = false;
+    unsigned num_sessions = 16, seconds = 5;
+    uint64_t start, elapsed, errors = 0, total = 0;
+    uint32_t *samples;
+    size_t count = 0;
+    unsigned i;
+    int opt, ret = 1;
+
+    while ((opt = getopt(argc, argv, "d:ls:t:i:h")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'l':
+            inprocess = true;
+            break;
+        case 's':
+            num_sessions = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            seconds = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            if (!strcmp(optarg, "querycap")) {
+                bench_cmd = VIDIOC_QUERYCAP;
+            } else if (!strcmp(optarg, "g_fmt")) {
+                bench_cmd = VIDIOC_G_FMT;
+            } else if (!strcmp(optarg, "try_fmt")) {
+                bench_cmd = VIDIOC_TRY_FMT;
+            } else if (!strcmp(optarg, "g_ctrl")) {
+                bench_cmd = VIDIOC_G_CTRL;
+            } else {
+                fprintf(stderr, "%s", usage);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "%s", usage);
+            return opt != 'h';
+        }
+    }
+
+    if (!num_sessions || !seconds) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+
+    sessions = calloc(num_sessions, sizeof(*sessions));
+    if (!sessions)
+        return 1;
+
+    for (i = 0; i < num_sessions; i++)
+        sessions[i].fd = -1;
+
+    for (i = 0; i < num_sessions; i++) {
+        if (inprocess)
+            sessions[i].dev = mppv4l2_open(NULL, 0);
+        else
+            sessions[i].fd = open(device, O_RDWR);
+
+        if (!sessions[i].dev && sessions[i].fd < 0) {
+            fprintf(stderr, "failed to open %s: %s\n", inprocess ? "libmppv4l2" : device,
+                    strerror(errno));
+            goto out;
+        }
+    }
+
+    start = rkmpp_trace_now();
+    bench_end = start + seconds * 1000000000ULL;
+
+    for (i = 0; i < num_sessions; i++)
+        pthread_create(&sessions[i].thread, NULL, bench_thread, &sessions[i]);
+    for (i = 0; i < num_sessions; i++) {
+        pthread_join(sessions[i].thread, NULL);
+        total += sessions[i].count;
+        errors += sessions[i].errors;
+    }
+
+    elapsed = rkmpp_trace_now() - start;
+
+    samples = malloc(max(total, 1) * sizeof(*samples));
+    if (!samples)
+        goto out;
+
+    for (i = 0; i < num_sessions; i++) {
+        memcpy(samples + count, sessions[i].samples, sessions[i].count * sizeof(*samples));
+        count += sessions[i].count;
+    }
+    qsort(samples, count, sizeof(*samples), bench_cmp);
+
+    printf("%s, %u sessions, %s: %zu ioctls in %.2fs, %" PRIu64 " failed\n",
+            inprocess ? "libmppv4l2" : device, num_sessions, rkmpp_cmd2str(bench_cmd),
+            count, elapsed / 1e9, errors);
+    if (count)
+        printf("%.0f ioctls/s, p50 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus\n",
+                count / (elapsed / 1e9), bench_percentile(samples, count, 50),
+                bench_percentile(samples, count, 99),
+                bench_percentile(samples, count, 99.9), samples[count - 1] / 1000.0);
+
+    free(samples);
+    ret = 0;
+
+out:
+    for (i = 0; i < num_sessions; i++) {
+        if (sessions[i].dev)
+            mppv4l2_close(sessions[i].dev);
+        if (sessions[i].fd >= 0)
+            close(sessions[i].fd);
+        free(sessions[i].samples);
+    }
+    free(sessions);
+    return ret;
+}
@@ -0,0 +1,921 @@
+/*
+ * bitstream.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Minimal header parsing for the supported codecs, just enough to tell
+ * keyframes and non-reference frames apart without decoding, and writing of
+ * the H.264 parameter sets stateless clients pass as controls.
+ */
+#include <stdbool.h>
+
+#include "bitstream.h"
+#include "utils.h"
+
+/**
+ * struct rkmpp_bs_reader - MSB first bit reader
+ * @data:       Data to read.
+ * @size:       Size of data in bytes.
+ * @bit:        Current bit position.
+ *
+ * Reading past the end returns zero bits. Emulation prevention bytes are not
+ * removed, which is fine for the first few header fields we look at.
+ */
+struct rkmpp_bs_reader {
+    const uint8_t *data;
+    size_t size;
+    size_t bit;
+};
+
+static uint32_t rkmpp_bs_read(struct rkmpp_bs_reader *br, int bits) {
+    uint32_t val = 0;
+
+    while (bits--) {
+        size_t byte = br->bit >> 3;
+
+        val <<= 1;
+        if (byte < br->size)
+            val |= (br->data[byte] >> (7 - (br->bit & 7))) & 1;
+        br->bit++;
+    }
+
+    return val;
+}
+
+static uint32_t rkmpp_bs_read_ue(struct rkmpp_bs_reader *br) {
+    int zeros = 0;
+
+    while (!rkmpp_bs_read(br, 1) && zeros < 31)
+        zeros++;
+
+    return ((1u << zeros) - 1) + rkmpp_bs_read(br, zeros);
+}
+
+/* Return the first byte after the next annex-b start code, or end */
+static const uint8_t *rkmpp_bs_next_nal(const uint8_t *p, const uint8_t *end) {
+    for (; p + 3 <= end; p++) {
+        if (!p[0] && !p[1] && p[2] == 1)
+            return p + 3;
+    }
+
+    return end;
+}
+
+/* The SEI messages at data hold a recovery point, see D.1.8 */
+static bool rkmpp_bs_h264_recovery_point(const uint8_t *data, const uint8_t *end) {
+    while (data < end && *data != 0x80) {
+        uint32_t type = 0, size = 0;
+
+        while (data < end && *data == 0xff)
+            type += *data++;
+        if (data < end)
+            type += *data++;
+
+        while (data < end && *data == 0xff)
+            size += *data++;
+        if (data < end)
+            size += *data++;
+
+        /* recovery_point */
+        if (type == 6)
+            return true;
+
+        if (size > (size_t) (end - data))
+            break;
+        data += size;
+    }
+
+    return false;
+}
+
+/*
+ * All slices of a picture share the reference idc and the nal type, so the
+ * first slice tells about the picture. A non-IDR I picture is only a place
+ * to start decoding at when a recovery point SEI comes with it or when all
+ * its slices are I, those after the first are looked at for the latter.
+ */
+static uint32_t rkmpp_bs_inspect_h264(const uint8_t *data, size_t size) {
+    const uint8_t *end = data + size;
+    const uint8_t *nal;
+    bool recovery_point = false, first = true;
+    uint32_t flags = 0;
+
+    for (nal = rkmpp_bs_next_nal(data, end); nal < end;
+            nal = rkmpp_bs_next_nal(nal, end)) {
+        struct rkmpp_bs_reader br = { nal + 1, end - nal - 1, 0 };
+        uint32_t first_mb, slice_type;
+        int type = nal[0] & 0x1f;
+        int ref_idc = (nal[0] >> 5) & 0x3;
+
+        if (type == 6 && rkmpp_bs_h264_recovery_point(nal + 1, end))
+            recovery_point = true;
+
+        /* Coded slice (1) or IDR slice (5) */
+        if (type != 1 && type != 5)
+            continue;
+
+        first_mb = rkmpp_bs_read_ue(&br);
+        slice_type = rkmpp_bs_read_ue(&br);
+
+        if (!first) {
+            /* The first slice of the next picture */
+            if (!first_mb)
+                break;
+
+            if (slice_type % 5 != 2 && slice_type % 5 != 4)
+                return flags & ~RKMPP_BS_KEYFRAME;
+            continue;
+        }
+        first = false;
+
+        if (!ref_idc)
+            flags |= RKMPP_BS_NONREF;
+
+        /* I(2, 7) or SI(4, 9), 7 and 9 for all slices of the picture */
+        if (type == 5 || ((slice_type % 5 == 2 || slice_type % 5 == 4) &&
+                (recovery_point || slice_type >= 5)))
+            return flags | RKMPP_BS_KEYFRAME;
+
+        if (slice_type % 5 != 2 && slice_type % 5 != 4)
+            return flags;
+
+        flags |= RKMPP_BS_KEYFRAME;
+    }
+
+    /* Parameter sets or SEI only, never drop these */
+    return first ? RKMPP_BS_KEYFRAME : flags;
+}
+
+/*
+ * A sub-layer non-reference picture can still be referenced by pictures of
+ * higher sub-layers, it's only dropped in the highest one of the stream.
+ */
+static uint32_t rkmpp_bs_inspect_hevc(struct rkmpp_bs_stream *stream,
+        const uint8_t *data, size_t size) {
+    const uint8_t *end = data + size;
+    const uint8_t *nal;
+
+    for (nal = rkmpp_bs_next_nal(data, end); nal < end;
+            nal = rkmpp_bs_next_nal(nal, end)) {
+        int type = (nal[0] >> 1) & 0x3f;
+        int tid = end - nal > 1 ? (nal[1] & 0x7) - 1 : 0;
+
+        /* SPS, sps_video_parameter_set_id then sps_max_sub_layers_minus1 */
+        if (type == 33 && end - nal > 2)
+            stream->hevc_sub_layers = ((nal[2] >> 1) & 0x7) + 1;
+
+        /* VCL nal units are 0 ~ 31 */
+        if (type > 31)
+            continue;
+
+        /* IRAP pictures are BLA(16 ~ 18), IDR(19, 20) and CRA(21) */
+        if (type >= 16 && type <= 23)
+            return RKMPP_BS_KEYFRAME;
+
+        /* Even types below 16 are sub-layer non-reference pictures */
+        return (type < 16 && !(type & 1) && stream->hevc_sub_layers &&
+                tid == stream->hevc_sub_layers - 1) ? RKMPP_BS_NONREF : 0;
+    }
+
+    return RKMPP_BS_KEYFRAME;
+}
+
+static uint32_t rkmpp_bs_inspect_vp8(const uint8_t *data, size_t size) {
+    if (size < 3)
+        return RKMPP_BS_KEYFRAME;
+
+    /* The frame tag's lowest bit is 0 for keyframes */
+    return (data[0] & 1) ? 0 : RKMPP_BS_KEYFRAME;
+}
+
+static uint32_t rkmpp_bs_inspect_vp9(const uint8_t *data, size_t size) {
+    struct rkmpp_bs_reader br = { data, size, 0 };
+    bool is_superframe;
+    int profile;
+    bool show_frame, error_resilient;
+
+    if (!size)
+        return RKMPP_BS_KEYFRAME;
+
+    /* Superframes carry a hidden frame in front of the shown one */
+    is_superframe = (data[size - 1] & 0xe0) == 0xc0;
+
+    /* frame_marker */
+    if (rkmpp_bs_read(&br, 2) != 2)
+        return RKMPP_BS_KEYFRAME;
+
+    profile = rkmpp_bs_read(&br, 1);
+    profile |= rkmpp_bs_read(&br, 1) << 1;
+    if (profile == 3)
+        rkmpp_bs_read(&br, 1);
+
+    /* show_existing_frame, nothing gets decoded */
+    if (rkmpp_bs_read(&br, 1))
+        return is_superframe ? 0 : RKMPP_BS_NONREF;
+
+    /* frame_type, 0 for keyframes */
+    if (!rkmpp_bs_read(&br, 1))
+        return RKMPP_BS_KEYFRAME;
+
+    show_frame = rkmpp_bs_read(&br, 1);
+    error_resilient = rkmpp_bs_read(&br, 1);
+
+    /* intra_only frames need the color config parsed, keep them */
+    if (!show_frame && rkmpp_bs_read(&br, 1))
+        return 0;
+
+    /* reset_frame_context */
+    if (!error_resilient)
+        rkmpp_bs_read(&br, 2);
+
+    /* refresh_frame_flags */
+    if (!rkmpp_bs_read(&br, 8) && !is_superframe)
+        return RKMPP_BS_NONREF;
+
+    return 0;
+}
+
+static uint32_t rkmpp_bs_inspect_av1(const uint8_t *data, size_t size) {
+    const uint8_t *p = data;
+    const uint8_t *end = data + size;
+    bool reduced_still_picture = false;
+
+    while (p < end) {
+        struct rkmpp_bs_reader br;
+        uint8_t header = *p++;
+        int type = (header >> 3) & 0xf;
+        uint64_t obu_size = 0;
+
+        /* obu_extension_flag */
+        if (header & 0x4)
+            p++;
+
+        /* obu_has_size_field, leb128 coded */
+        if (header & 0x2) {
+            for (int i = 0; i < 8 && p < end; i++) {
+                obu_size |= (uint64_t) (*p & 0x7f) << (i * 7);
+                if (!(*p++ & 0x80))
+                    break;
+            }
+        } else {
+            obu_size = end > p ? end - p : 0;
+        }
+
+        if (p >= end || obu_size > (uint64_t) (end - p))
+            break;
+
+        br = (struct rkmpp_bs_reader) { p, obu_size, 0 };
+
+        switch (type) {
+        case 1: /* OBU_SEQUENCE_HEADER */
+            /* seq_profile, still_picture, reduced_still_picture_header */
+            rkmpp_bs_read(&br, 4);
+            reduced_still_picture = rkmpp_bs_read(&br, 1);
+            break;
+        case 3: /* OBU_FRAME_HEADER */
+        case 6: /* OBU_FRAME */
+            if (reduced_still_picture)
+                return RKMPP_BS_KEYFRAME;
+
+            /* show_existing_frame */
+            if (rkmpp_bs_read(&br, 1))
+                return 0;
+
+            /* frame_type, KEY_FRAME(0) or INTRA_ONLY_FRAME(2) */
+            switch (rkmpp_bs_read(&br, 2)) {
+            case 0:
+            case 2:
+                return RKMPP_BS_KEYFRAME;
+            default:
+                return 0;
+            }
+        default:
+            break;
+        }
+
+        p += obu_size;
+    }
+
+    /* No frame header, e.g. a lone sequence header */
+    return RKMPP_BS_KEYFRAME;
+}
+
+uint32_t rkmpp_bs_inspect(struct rkmpp_bs_stream *stream, MppCodingType type,
+        const uint8_t *data, size_t size) {
+    if (!data)
+        return RKMPP_BS_KEYFRAME;
+
+    switch (type) {
+    case MPP_VIDEO_CodingAVC:
+        return rkmpp_bs_inspect_h264(data, size);
+    case MPP_VIDEO_CodingHEVC:
+        return rkmpp_bs_inspect_hevc(stream, data, size);
+    case MPP_VIDEO_CodingVP8:
+        return rkmpp_bs_inspect_vp8(data, size);
+    case MPP_VIDEO_CodingVP9:
+        return rkmpp_bs_inspect_vp9(data, size);
+    case MPP_VIDEO_CodingAV1:
+        return rkmpp_bs_inspect_av1(data, size);
+    default:
+        return RKMPP_BS_KEYFRAME;
+    }
+}
+
+/* Profiles with the chroma format and bit depths in the SPS, see 7.3.2.1.1 */
+static bool rkmpp_bs_h264_high_profile(uint8_t profile_idc) {
+    switch (profile_idc) {
+    case 100: case 110: case 122: case 244: case 44: case 83:
+    case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int32_t rkmpp_bs_read_se(struct rkmpp_bs_reader *br) {
+    uint32_t val = rkmpp_bs_read_ue(br);
+
+    return (val & 1) ? (int32_t) ((val + 1) / 2) : -(int32_t) (val / 2);
+}
+
+/* Read past the end, what was read of a truncated header is garbage */
+static bool rkmpp_bs_overrun(const struct rkmpp_bs_reader *br) {
+    return br->bit > br->size * 8;
+}
+
+/*
+ * Copy the payload of the nal unit at nal, up to the next start code, with
+ * the emulation prevention bytes taken out. Returns the bytes copied.
+ */
+static size_t rkmpp_bs_unescape(uint8_t *dst, size_t size, const uint8_t *nal,
+        const uint8_t *end) {
+    size_t len = 0;
+    int zeros = 0;
+
+    for (; nal < end && len < size; nal++) {
+        if (zeros >= 2 && *nal <= 3) {
+            /* The next start code ends the nal unit */
+            if (*nal < 3)
+                break;
+
+            zeros = 0;
+            continue;
+        }
+
+        dst[len++] = *nal;
+        zeros = *nal ? 0 : zeros + 1;
+    }
+
+    return len;
+}
+
+/* Largest SPS looked at, one with every scaling list and hrd fits */
+#define RKMPP_BS_SPS_MAX    1024
+
+static void rkmpp_bs_skip_h264_scaling_list(struct rkmpp_bs_reader *br, int size) {
+    int last = 8, next = 8;
+
+    for (int i = 0; i < size; i++) {
+        if (next)
+            next = (last + rkmpp_bs_read_se(br) + 256) % 256;
+        last = next ? next : last;
+    }
+}
+
+static void rkmpp_bs_skip_h264_hrd(struct rkmpp_bs_reader *br) {
+    uint32_t cpb_cnt = rkmpp_bs_read_ue(br) + 1;
+
+    /* bit_rate_scale, cpb_size_scale */
+    rkmpp_bs_read(br, 8);
+
+    for (uint32_t i = 0; i < cpb_cnt && i < 32; i++) {
+        rkmpp_bs_read_ue(br);
+        rkmpp_bs_read_ue(br);
+        rkmpp_bs_read(br, 1);
+    }
+
+    /* The delay and time offset lengths */
+    rkmpp_bs_read(br, 20);
+}
+
+/* MaxDpbMbs of Table A-1, 0 for unknown levels */
+static uint32_t rkmpp_bs_h264_max_dpb_mbs(uint32_t level_idc) {
+    switch (level_idc) {
+    case 9: case 10: return 396;
+    case 11: return 900;
+    case 12: case 13: case 20: return 2376;
+    case 21: return 4752;
+    case 22: case 30: return 8100;
+    case 31: return 18000;
+    case 32: return 20480;
+    case 40: case 41: return 32768;
+    case 42: return 34816;
+    case 50: return 110400;
+    case 51: case 52: return 184320;
+    case 60: case 61: case 62: return 696320;
+    default: return 0;
+    }
+}
+
+/*
+ * The dpb an H.264 SPS asks for, max_dec_frame_buffering of its VUI or the
+ * level's MaxDpbFrames when it has none, see 7.3.2.1.1 and E.1.1.
+ */
+static uint32_t rkmpp_bs_h264_sps_dpb(const uint8_t *data, size_t size) {
+    struct rkmpp_bs_reader br = { data, size, 0 };
+    uint32_t profile_idc, level_idc, chroma_format_idc = 1;
+    uint32_t max_num_ref_frames, width_mbs, height_mbs, max_dpb_mbs, dpb;
+    uint32_t max_dec_frame_buffering = 0;
+    bool frame_mbs_only;
+
+    profile_idc = rkmpp_bs_read(&br, 8);
+    rkmpp_bs_read(&br, 8);
+    level_idc = rkmpp_bs_read(&br, 8);
+    rkmpp_bs_read_ue(&br);
+
+    if (rkmpp_bs_h264_high_profile(profile_idc)) {
+        chroma_format_idc = rkmpp_bs_read_ue(&br);
+        if (chroma_format_idc == 3)
+            rkmpp_bs_read(&br, 1);
+
+        /* bit_depth_luma/chroma_minus8, qpprime_y_zero_transform_bypass_flag */
+        rkmpp_bs_read_ue(&br);
+        rkmpp_bs_read_ue(&br);
+        rkmpp_bs_read(&br, 1);
+
+        if (rkmpp_bs_read(&br, 1)) {
+            for (int i = 0; i < (chroma_format_idc != 3 ? 8 : 12); i++)
+                if (rkmpp_bs_read(&br, 1))
+                    rkmpp_bs_skip_h264_scaling_list(&br, i < 6 ? 16 : 64);
+        }
+    }
+
+    /* log2_max_frame_num_minus4 */
+    rkmpp_bs_read_ue(&br);
+
+    switch (rkmpp_bs_read_ue(&br)) {
+    case 0:
+        rkmpp_bs_read_ue(&br);
+        break;
+    case 1: {
+        uint32_t cycle;
+
+        rkmpp_bs_read(&br, 1);
+        rkmpp_bs_read_se(&br);
+        rkmpp_bs_read_se(&br);
+        cycle = rkmpp_bs_read_ue(&br);
+        for (uint32_t i = 0; i < cycle && i < 255; i++)
+            rkmpp_bs_read_se(&br);
+        break;
+    }
+    default:
+        break;
+    }
+
+    max_num_ref_frames = rkmpp_bs_read_ue(&br);
+    rkmpp_bs_read(&br, 1);
+    width_mbs = rkmpp_bs_read_ue(&br) + 1;
+    height_mbs = rkmpp_bs_read_ue(&br) + 1;
+    frame_mbs_only = rkmpp_bs_read(&br, 1);
+    if (!frame_mbs_only) {
+        height_mbs *= 2;
+        rkmpp_bs_read(&br, 1);
+    }
+
+    /* direct_8x8_inference_flag, then the cropping offsets */
+    rkmpp_bs_read(&br, 1);
+    if (rkmpp_bs_read(&br, 1)) {
+        for (int i = 0; i < 4; i++)
+            rkmpp_bs_read_ue(&br);
+    }
+
+    if (rkmpp_bs_overrun(&br))
+        return 0;
+
+    max_dpb_mbs = rkmpp_bs_h264_max_dpb_mbs(level_idc);
+    dpb = max_dpb_mbs ? min(max_dpb_mbs / (width_mbs * height_mbs), 16) : 16;
+
+    /* vui_parameters_present_flag */
+    if (rkmpp_bs_read(&br, 1)) {
+        bool hrd = false;
+
+        if (rkmpp_bs_read(&br, 1) && rkmpp_bs_read(&br, 8) == 255)
+            rkmpp_bs_read(&br, 32);
+        if (rkmpp_bs_read(&br, 1))
+            rkmpp_bs_read(&br, 1);
+        if (rkmpp_bs_read(&br, 1)) {
+            rkmpp_bs_read(&br, 4);
+            if (rkmpp_bs_read(&br, 1))
+                rkmpp_bs_read(&br, 24);
+        }
+        if (rkmpp_bs_read(&br, 1)) {
+            rkmpp_bs_read_ue(&br);
+            rkmpp_bs_read_ue(&br);
+        }
+        if (rkmpp_bs_read(&br, 1)) {
+            rkmpp_bs_read(&br, 32);
+            rkmpp_bs_read(&br, 32);
+            rkmpp_bs_read(&br, 1);
+        }
+        for (int i = 0; i < 2; i++) {
+            if (rkmpp_bs_read(&br, 1)) {
+                rkmpp_bs_skip_h264_hrd(&br);
+                hrd = true;
+            }
+        }
+        if (hrd)
+            rkmpp_bs_read(&br, 1);
+        rkmpp_bs_read(&br, 1);
+
+        /* bitstream_restriction_flag */
+        if (rkmpp_bs_read(&br, 1)) {
+            rkmpp_bs_read(&br, 1);
+            for (int i = 0; i < 5; i++)
+                rkmpp_bs_read_ue(&br);
+            max_dec_frame_buffering = rkmpp_bs_read_ue(&br);
+        }
+
+        if (!rkmpp_bs_overrun(&br) && max_dec_frame_buffering)
+            dpb = min(max_dec_frame_buffering, 16);
+    }
+
+    return max(max(dpb, max_num_ref_frames), 1);
+}
+
+/* Skip a profile_tier_level() of the given sub-layers, see 7.3.3 */
+static void rkmpp_bs_skip_hevc_ptl(struct rkmpp_bs_reader *br, uint32_t sub_layers) {
+    uint32_t profile_present = 0, level_present = 0;
+
+    /* The general profile, tier and level */
+    rkmpp_bs_read(br, 32);
+    rkmpp_bs_read(br, 32);
+    rkmpp_bs_read(br, 32);
+
+    for (uint32_t i = 0; i < sub_layers; i++) {
+        profile_present |= rkmpp_bs_read(br, 1) << i;
+        level_present |= rkmpp_bs_read(br, 1) << i;
+    }
+    if (sub_layers)
+        rkmpp_bs_read(br, 2 * (8 - sub_layers));
+
+    for (uint32_t i = 0; i < sub_layers; i++) {
+        if (profile_present & (1 << i)) {
+            rkmpp_bs_read(br, 32);
+            rkmpp_bs_read(br, 32);
+            rkmpp_bs_read(br, 24);
+        }
+        if (level_present & (1 << i))
+            rkmpp_bs_read(br, 8);
+    }
+}
+
+/* sps_max_dec_pic_buffering of the highest sub-layer of an HEVC SPS */
+static uint32_t rkmpp_bs_hevc_sps_dpb(const uint8_t *data, size_t size) {
+    struct rkmpp_bs_reader br = { data, size, 0 };
+    uint32_t sub_layers, dpb = 0;
+
+    /* sps_video_parameter_set_id, then sps_max_sub_layers_minus1 */
+    rkmpp_bs_read(&br, 4);
+    sub_layers = rkmpp_bs_read(&br, 3);
+    rkmpp_bs_read(&br, 1);
+
+    rkmpp_bs_skip_hevc_ptl(&br, sub_layers);
+
+    rkmpp_bs_read_ue(&br);
+    if (rkmpp_bs_read_ue(&br) == 3)
+        rkmpp_bs_read(&br, 1);
+
+    /* The size, conformance window, bit depths and poc lsb length */
+    rkmpp_bs_read_ue(&br);
+    rkmpp_bs_read_ue(&br);
+    if (rkmpp_bs_read(&br, 1)) {
+        for (int i = 0; i < 4; i++)
+            rkmpp_bs_read_ue(&br);
+    }
+    rkmpp_bs_read_ue(&br);
+    rkmpp_bs_read_ue(&br);
+    rkmpp_bs_read_ue(&br);
+
+    /* Without the ordering info of each sub-layer only the highest is sent */
+    for (uint32_t i = rkmpp_bs_read(&br, 1) ? 0 : sub_layers; i <= sub_layers; i++) {
+        dpb = rkmpp_bs_read_ue(&br) + 1;
+        rkmpp_bs_read_ue(&br);
+        rkmpp_bs_read_ue(&br);
+    }
+
+    if (rkmpp_bs_overrun(&br))
+        return 0;
+
+    return min(dpb, 16);
+}
+
+uint32_t rkmpp_bs_dpb_size(MppCodingType type, const uint8_t *data, size_t size) {
+    const uint8_t *end = data + size;
+    const uint8_t *nal;
+    uint8_t sps[RKMPP_BS_SPS_MAX];
+    size_t len;
+    int nal_type;
+
+    if (!data || (type != MPP_VIDEO_CodingAVC && type != MPP_VIDEO_CodingHEVC))
+        return 0;
+
+    for (nal = rkmpp_bs_next_nal(data, end); nal < end;
+            nal = rkmpp_bs_next_nal(nal, end)) {
+        if (type == MPP_VIDEO_CodingAVC) {
+            nal_type = nal[0] & 0x1f;
+
+            /* Parameter sets come in front of the slices */
+            if (nal_type >= 1 && nal_type <= 5)
+                return 0;
+            if (nal_type != 7)
+                continue;
+
+            len = rkmpp_bs_unescape(sps, sizeof(sps), nal + 1, end);
+            return rkmpp_bs_h264_sps_dpb(sps, len);
+        }
+
+        nal_type = (nal[0] >> 1) & 0x3f;
+        if (nal_type <= 31)
+            return 0;
+        if (nal_type != 33 || end - nal < 2)
+            continue;
+
+        len = rkmpp_bs_unescape(sps, sizeof(sps), nal + 2, end);
+        return rkmpp_bs_hevc_sps_dpb(sps, len);
+    }
+
+    return 0;
+}
+
+/**
+ * struct rkmpp_bs_writer - MSB first bit writer of a rbsp
+ * @data:       Data to write.
+ * @size:       Size of data in bytes.
+ * @bit:        Current bit position.
+ * @overflow:   Bits were written past the end and lost.
+ */
+struct rkmpp_bs_writer {
+    uint8_t *data;
+    size_t size;
+    size_t bit;
+    bool overflow;
+};
+
+static void rkmpp_bs_write(struct rkmpp_bs_writer *bw, uint64_t val, int bits) {
+    while (bits--) {
+        size_t byte = bw->bit >> 3;
+        uint8_t mask = 0x80 >> (bw->bit & 7);
+
+        if (byte >= bw->size) {
+            bw->overflow = true;
+            return;
+        }
+
+        if ((val >> bits) & 1)
+            bw->data[byte] |= mask;
+        else
+            bw->data[byte] &= ~mask;
+        bw->bit++;
+    }
+}
+
+static void rkmpp_bs_write_ue(struct rkmpp_bs_writer *bw, uint32_t val) {
+    uint64_t code = (uint64_t) val + 1;
+    int bits = 64 - __builtin_clzll(code);
+
+    rkmpp_bs_write(bw, 0, bits - 1);
+    rkmpp_bs_write(bw, code, bits);
+}
+
+static void rkmpp_bs_write_se(struct rkmpp_bs_writer *bw, int32_t val) {
+    rkmpp_bs_write_ue(bw, val > 0 ? 2 * (uint32_t) val - 1 : -2 * (int64_t) val);
+}
+
+static void rkmpp_bs_write_trailing(struct rkmpp_bs_writer *bw) {
+    rkmpp_bs_write(bw, 1, 1);
+    while (bw->bit & 7)
+        rkmpp_bs_write(bw, 0, 1);
+}
+
+/*
+ * Put the rbsp into an annex-b nal unit, adding emulation prevention bytes
+ * where it has a start code prefix. Returns the bytes written, 0 when they
+ * don't fit.
+ */
+static size_t rkmpp_bs_put_nal(uint8_t *buf, size_t size, uint8_t header,
+        const struct rkmpp_bs_writer *bw) {
+    size_t len = bw->bit >> 3, pos = 0;
+    int zeros = 0;
+
+    if (bw->overflow || size < 5)
+        return 0;
+
+    buf[pos++] = 0;
+    buf[pos++] = 0;
+    buf[pos++] = 0;
+    buf[pos++] = 1;
+    buf[pos++] = header;
+
+    for (size_t i = 0; i < len; i++) {
+        if (pos + 2 > size)
+            return 0;
+
+        if (zeros == 2 && bw->data[i] <= 3) {
+            buf[pos++] = 3;
+            zeros = 0;
+        }
+
+        buf[pos++] = bw->data[i];
+        zeros = bw->data[i] ? 0 : zeros + 1;
+    }
+
+    return pos;
+}
+
+static void rkmpp_bs_write_h264_sps(struct rkmpp_bs_writer *bw,
+        const struct v4l2_ctrl_h264_sps *sps, uint32_t width, uint32_t height) {
+    uint32_t frame_mbs_only = !!(sps->flags & V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY);
+    uint32_t coded_width = (sps->pic_width_in_mbs_minus1 + 1) * 16;
+    uint32_t coded_height = (sps->pic_height_in_map_units_minus1 + 1) *
+            (2 - frame_mbs_only) * 16;
+    bool separate_planes = sps->flags & V4L2_H264_SPS_FLAG_SEPARATE_COLOUR_PLANE;
+    uint32_t crop_x = 0, crop_y = 0;
+    uint32_t crop_unit_x = 1, crop_unit_y = 2 - frame_mbs_only;
+    uint8_t constraints = 0;
+
+    /* Crop units of the chroma subsampling, see 7.4.2.1.1 */
+    if (sps->chroma_format_idc && !separate_planes) {
+        crop_unit_x = sps->chroma_format_idc < 3 ? 2 : 1;
+        crop_unit_y *= sps->chroma_format_idc == 1 ? 2 : 1;
+    }
+
+    /* V4L2 keeps constraint_set<i>_flag in bit i, the stream sends set0 first */
+    for (int i = 0; i < 6; i++) {
+        if (sps->constraint_set_flags & (1 << i))
+            constraints |= 0x80 >> i;
+    }
+
+    rkmpp_bs_write(bw, sps->profile_idc, 8);
+    rkmpp_bs_write(bw, constraints, 8);
+    rkmpp_bs_write(bw, sps->level_idc, 8);
+    rkmpp_bs_write_ue(bw, sps->seq_parameter_set_id);
+
+    if (rkmpp_bs_h264_high_profile(sps->profile_idc)) {
+        rkmpp_bs_write_ue(bw, sps->chroma_format_idc);
+        if (sps->chroma_format_idc == 3)
+            rkmpp_bs_write(bw, separate_planes, 1);
+        rkmpp_bs_write_ue(bw, sps->bit_depth_luma_minus8);
+        rkmpp_bs_write_ue(bw, sps->bit_depth_chroma_minus8);
+        rkmpp_bs_write(bw, !!(sps->flags & V4L2_H264_SPS_FLAG_QPPRIME_Y_ZERO_TRANSFORM_BYPASS), 1);
+
+        /* seq_scaling_matrix_present_flag, the resolved lists go in the PPS */
+        rkmpp_bs_write(bw, 0, 1);
+    }
+
+    rkmpp_bs_write_ue(bw, sps->log2_max_frame_num_minus4);
+    rkmpp_bs_write_ue(bw, sps->pic_order_cnt_type);
+
+    if (sps->pic_order_cnt_type == 0) {
+        rkmpp_bs_write_ue(bw, sps->log2_max_pic_order_cnt_lsb_minus4);
+    } else if (sps->pic_order_cnt_type == 1) {
+        rkmpp_bs_write(bw, !!(sps->flags & V4L2_H264_SPS_FLAG_DELTA_PIC_ORDER_ALWAYS_ZERO), 1);
+        rkmpp_bs_write_se(bw, sps->offset_for_non_ref_pic);
+        rkmpp_bs_write_se(bw, sps->offset_for_top_to_bottom_field);
+        rkmpp_bs_write_ue(bw, sps->num_ref_frames_in_pic_order_cnt_cycle);
+        for (int i = 0; i < sps->num_ref_frames_in_pic_order_cnt_cycle; i++)
+            rkmpp_bs_write_se(bw, sps->offset_for_ref_frame[i]);
+    }
+
+    rkmpp_bs_write_ue(bw, sps->max_num_ref_frames);
+    rkmpp_bs_write(bw, !!(sps->flags & V4L2_H264_SPS_FLAG_GAPS_IN_FRAME_NUM_VALUE_ALLOWED), 1);
+    rkmpp_bs_write_ue(bw, sps->pic_width_in_mbs_minus1);
+    rkmpp_bs_write_ue(bw, sps->pic_height_in_map_units_minus1);
+    rkmpp_bs_write(bw, frame_mbs_only, 1);
+    if (!frame_mbs_only)
+        rkmpp_bs_write(bw, !!(sps->flags & V4L2_H264_SPS_FLAG_MB_ADAPTIVE_FRAME_FIELD), 1);
+    rkmpp_bs_write(bw, !!(sps->flags & V4L2_H264_SPS_FLAG_DIRECT_8X8_INFERENCE), 1);
+
+    /* The controls carry no cropping, the visible size is the output format's */
+    if (width && width < coded_width)
+        crop_x = (coded_width - width) / crop_unit_x;
+    if (height && height < coded_height)
+        crop_y = (coded_height - height) / crop_unit_y;
+
+    rkmpp_bs_write(bw, crop_x || crop_y, 1);
+    if (crop_x || crop_y) {
+        rkmpp_bs_write_ue(bw, 0);
+        rkmpp_bs_write_ue(bw, crop_x);
+        rkmpp_bs_write_ue(bw, 0);
+        rkmpp_bs_write_ue(bw, crop_y);
+    }
+
+    /* vui_parameters_present_flag */
+    rkmpp_bs_write(bw, 0, 1);
+    rkmpp_bs_write_trailing(bw);
+}
+
+/* Zigzag scans of frame macroblocks, the controls hold the lists in raster order */
+static const uint8_t rkmpp_bs_zigzag_4x4[16] = {
+    0, 1, 4, 8, 5, 2, 3, 6, 9, 12, 13, 10, 7, 11, 14, 15,
+};
+
+static const uint8_t rkmpp_bs_zigzag_8x8[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+static void rkmpp_bs_write_scaling_list(struct rkmpp_bs_writer *bw,
+        const uint8_t *list, const uint8_t *zigzag, int size) {
+    int last = 8;
+
+    /* scaling_list_present_flag, every list is sent as it is */
+    rkmpp_bs_write(bw, 1, 1);
+
+    for (int i = 0; i < size; i++) {
+        int delta = list[zigzag[i]] - last;
+
+        /* delta_scale wraps around in -128 ~ 127 */
+        if (delta > 127)
+            delta -= 256;
+        else if (delta < -128)
+            delta += 256;
+
+        rkmpp_bs_write_se(bw, delta);
+        last = list[zigzag[i]];
+    }
+}
+
+static void rkmpp_bs_write_h264_pps(struct rkmpp_bs_writer *bw,
+        const struct v4l2_ctrl_h264_sps *sps, const struct v4l2_ctrl_h264_pps *pps,
+        const struct v4l2_ctrl_h264_scaling_matrix *scaling) {
+    bool transform_8x8 = pps->flags & V4L2_H264_PPS_FLAG_TRANSFORM_8X8_MODE;
+    bool scaling_present = scaling && (pps->flags & V4L2_H264_PPS_FLAG_SCALING_MATRIX_PRESENT);
+
+    rkmpp_bs_write_ue(bw, pps->pic_parameter_set_id);
+    rkmpp_bs_write_ue(bw, pps->seq_parameter_set_id);
+    rkmpp_bs_write(bw, !!(pps->flags & V4L2_H264_PPS_FLAG_ENTROPY_CODING_MODE), 1);
+    rkmpp_bs_write(bw, !!(pps->flags & V4L2_H264_PPS_FLAG_BOTTOM_FIELD_PIC_ORDER_IN_FRAME_PRESENT), 1);
+
+    /* num_slice_groups_minus1, slice groups are refused with the controls */
+    rkmpp_bs_write_ue(bw, 0);
+
+    rkmpp_bs_write_ue(bw, pps->num_ref_idx_l0_default_active_minus1);
+    rkmpp_bs_write_ue(bw, pps->num_ref_idx_l1_default_active_minus1);
+    rkmpp_bs_write(bw, !!(pps->flags & V4L2_H264_PPS_FLAG_WEIGHTED_PRED), 1);
+    rkmpp_bs_write(bw, pps->weighted_bipred_idc, 2);
+    rkmpp_bs_write_se(bw, pps->pic_init_qp_minus26);
+    rkmpp_bs_write_se(bw, pps->pic_init_qs_minus26);
+    rkmpp_bs_write_se(bw, pps->chroma_qp_index_offset);
+    rkmpp_bs_write(bw, !!(pps->flags & V4L2_H264_PPS_FLAG_DEBLOCKING_FILTER_CONTROL_PRESENT), 1);
+    rkmpp_bs_write(bw, !!(pps->flags & V4L2_H264_PPS_FLAG_CONSTRAINED_INTRA_PRED), 1);
+    rkmpp_bs_write(bw, !!(pps->flags & V4L2_H264_PPS_FLAG_REDUNDANT_PIC_CNT_PRESENT), 1);
+
+    /* The high profile tail, left out when it holds the defaults */
+    if (transform_8x8 || scaling_present ||
+            pps->second_chroma_qp_index_offset != pps->chroma_qp_index_offset) {
+        rkmpp_bs_write(bw, transform_8x8, 1);
+        rkmpp_bs_write(bw, scaling_present, 1);
+
+        if (scaling_present) {
+            int lists_8x8 = transform_8x8 ? (sps->chroma_format_idc == 3 ? 6 : 2) : 0;
+
+            for (int i = 0; i < 6; i++)
+                rkmpp_bs_write_scaling_list(bw, scaling->scaling_list_4x4[i],
+                        rkmpp_bs_zigzag_4x4, 16);
+            for (int i = 0; i < lists_8x8; i++)
+                rkmpp_bs_write_scaling_list(bw, scaling->scaling_list_8x8[i],
+                        rkmpp_bs_zigzag_8x8, 64);
+        }
+
+        rkmpp_bs_write_se(bw, pps->second_chroma_qp_index_offset);
+    }
+
+    rkmpp_bs_write_trailing(bw);
+}
+
+size_t rkmpp_bs_write_h264_headers(uint8_t *buf, size_t size,
+        const struct v4l2_ctrl_h264_sps *sps, const struct v4l2_ctrl_h264_pps *pps,
+        const struct v4l2_ctrl_h264_scaling_matrix *scaling,
+        uint32_t width, uint32_t height) {
+    uint8_t rbsp[RKMPP_BS_H264_HEADERS_MAX / 2];
+    struct rkmpp_bs_writer bw = { rbsp, sizeof(rbsp), 0, false };
+    size_t sps_len, pps_len;
+
+    /* nal_ref_idc 3, SPS(7) */
+    rkmpp_bs_write_h264_sps(&bw, sps, width, height);
+    sps_len = rkmpp_bs_put_nal(buf, size, 0x67, &bw);
+    if (!sps_len)
+        return 0;
+
+    /* nal_ref_idc 3, PPS(8) */
+    bw = (struct rkmpp_bs_writer) { rbsp, sizeof(rbsp), 0, false };
+    rkmpp_bs_write_h264_pps(&bw, sps, pps, scaling);
+    pps_len = rkmpp_bs_put_nal(buf + sps_len, size - sps_len, 0x68, &bw);
+    if (!pps_len)
+        return 0;
+
+    return sps_len + pps_len;
+}
@@ -0,0 +1,64 @@
+/*
+ * bitstream.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ */
+
+#ifndef SRC_BITSTREAM_H_
+#define SRC_BITSTREAM_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <linux/videodev2.h>
+#include <rockchip/rk_mpi.h>
+
+/**
+ * enum rkmpp_bs_flag - Packet properties found by bitstream inspection
+ * @KEYFRAME:   Packet is a random access point.
+ * @NONREF:     No other frame references the packet, it can be dropped.
+ */
+enum rkmpp_bs_flag {
+    RKMPP_BS_KEYFRAME   = 1 << 0,
+    RKMPP_BS_NONREF     = 1 << 1,
+};
+
+/**
+ * struct rkmpp_bs_stream - What inspection keeps of the packets before
+ * @hevc_sub_layers:    Sub-layers of the last HEVC SPS, 0 before any.
+ */
+struct rkmpp_bs_stream {
+    uint8_t hevc_sub_layers;
+};
+
+/*
+ * Inspect a compressed packet of the given coding type and return a mask of
+ * rkmpp_bs_flag. Unknown coding types are reported as keyframes, so that
+ * nothing is ever dropped for a stream we can't parse. The stream starts
+ * zeroed and is updated from the parameter sets in the packet.
+ */
+uint32_t rkmpp_bs_inspect(struct rkmpp_bs_stream *stream, MppCodingType type,
+        const uint8_t *data, size_t size);
+
+/*
+ * Frames the dpb of an H.264 or HEVC stream needs, from an SPS in front of
+ * the packet's first slice. H.264 takes max_dec_frame_buffering of the VUI or
+ * the limit of the level at the coded size, HEVC sps_max_dec_pic_buffering
+ * of the highest sub-layer. Returns 0 when the packet has no SPS.
+ */
+uint32_t rkmpp_bs_dpb_size(MppCodingType type, const uint8_t *data, size_t size);
+
+/* Room for the largest parameter sets, 255 poc offsets and all scaling lists */
+#define RKMPP_BS_H264_HEADERS_MAX   8192
+
+/*
+ * Write the annex-b SPS and PPS of stateless controls, the SPS cropped to
+ * width x height. The scaling matrix goes into the PPS when its flag is set.
+ * Returns the bytes written, or 0 when they don't fit in size.
+ */
+size_t rkmpp_bs_write_h264_headers(uint8_t *buf, size_t size,
+        const struct v4l2_ctrl_h264_sps *sps, const struct v4l2_ctrl_h264_pps *pps,
+        const struct v4l2_ctrl_h264_scaling_matrix *scaling,
+        uint32_t width, uint32_t height);
+
+#endif /* SRC_BITSTREAM_H_ */
@@ -0,0 +1,243 @@
+/*
+ * bufpool.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Daemon-wide pool of mpp buffers, so sessions opening and closing with the
+ * same formats recycle each other's buffers instead of going back to the drm
+ * allocator every time.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <time.h>
+
+#include "bufpool.h"
+#include "logger.h"
+
+/* One internal group per buffer type, created on first use */
+#define RKMPP_POOL_GROUPS   4
+
+/**
+ * struct rkmpp_pool_entry - Idle buffer in the pool
+ * @entry:      Entry of the idle list, most recently used first.
+ * @buffer:     The buffer, the pool holds its reference.
+ * @type:       Type of the buffer.
+ * @size:       Size of the buffer.
+ * @idle_since: Monotonic time it went idle, in seconds.
+ */
+struct rkmpp_pool_entry {
+    TAILQ_ENTRY(rkmpp_pool_entry) entry;
+    MppBuffer buffer;
+    MppBufferType type;
+    uint32_t size;
+    uint64_t idle_since;
+};
+
+static struct {
+    MppBufferType type;
+    MppBufferGroup group;
+} rkmpp_pool_groups[RKMPP_POOL_GROUPS];
+
+static TAILQ_HEAD(rkmpp_pool_head, rkmpp_pool_entry) rkmpp_pool_list =
+        TAILQ_HEAD_INITIALIZER(rkmpp_pool_list);
+static pthread_mutex_t rkmpp_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t rkmpp_pool_idle_bytes;
+
+/* Ages idle buffers out when no session gets or puts any */
+static pthread_once_t rkmpp_pool_once = PTHREAD_ONCE_INIT;
+static pthread_cond_t rkmpp_pool_cond;
+static bool rkmpp_pool_timer;
+
+static uint64_t rkmpp_pool_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static MppBufferGroup rkmpp_pool_group(MppBufferType type) {
+    int i;
+
+    for (i = 0; i < RKMPP_POOL_GROUPS && rkmpp_pool_groups[i].group; i++) {
+        if (rkmpp_pool_groups[i].type == type)
+            return rkmpp_pool_groups[i].group;
+    }
+
+    if (i == RKMPP_POOL_GROUPS)
+        return NULL;
+
+    if (mpp_buffer_group_get_internal(&rkmpp_pool_groups[i].group, type) != MPP_OK) {
+        rkmpp_pool_groups[i].group = NULL;
+        return NULL;
+    }
+
+    rkmpp_pool_groups[i].type = type;
+    return rkmpp_pool_groups[i].group;
+}
+
+/*
+ * Free idle buffers over the byte cap or the age limit, oldest first. The
+ * groups keep released buffers for themselves, so they're cleared after.
+ */
+static void rkmpp_pool_trim(void) {
+    struct rkmpp_pool_entry *entry;
+    uint64_t now = rkmpp_pool_now();
+    int freed = 0;
+
+    while ((entry = TAILQ_LAST(&rkmpp_pool_list, rkmpp_pool_head))) {
+        if (rkmpp_pool_idle_bytes <= RKMPP_POOL_MAX_IDLE &&
+                now - entry->idle_since < RKMPP_POOL_IDLE_SEC)
+            break;
+
+        TAILQ_REMOVE(&rkmpp_pool_list, entry, entry);
+        rkmpp_pool_idle_bytes -= entry->size;
+        mpp_buffer_put(entry->buffer);
+        free(entry);
+        freed++;
+    }
+
+    if (!freed)
+        return;
+
+    for (int i = 0; i < RKMPP_POOL_GROUPS && rkmpp_pool_groups[i].group; i++)
+        mpp_buffer_group_clear(rkmpp_pool_groups[i].group);
+
+    LOGV(2, "pool: freed %d buffers, %" PRIu64 "KiB idle\n", freed,
+            rkmpp_pool_idle_bytes >> 10);
+}
+
+/*
+ * Sleeps until the oldest idle buffer is due, or until there is one, and
+ * trims. It never stops, the pool lives as long as the process.
+ */
+static void *rkmpp_pool_thread(void *data) {
+    struct rkmpp_pool_entry *entry;
+    struct timespec ts = { 0 };
+
+    (void) data;
+
+    pthread_mutex_lock(&rkmpp_pool_mutex);
+    while (1) {
+        entry = TAILQ_LAST(&rkmpp_pool_list, rkmpp_pool_head);
+        if (!entry) {
+            pthread_cond_wait(&rkmpp_pool_cond, &rkmpp_pool_mutex);
+            continue;
+        }
+
+        ts.tv_sec = entry->idle_since + RKMPP_POOL_IDLE_SEC;
+        if (pthread_cond_timedwait(&rkmpp_pool_cond, &rkmpp_pool_mutex, &ts) == ETIMEDOUT)
+            rkmpp_pool_trim();
+    }
+
+    return NULL;
+}
+
+static void rkmpp_pool_start_timer(void) {
+    pthread_condattr_t attr;
+    pthread_attr_t thread_attr;
+    pthread_t thread;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&rkmpp_pool_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &thread_attr, rkmpp_pool_thread, NULL))
+        LOGE("pool: no timer, idle buffers only age out on get and put\n");
+    else
+        rkmpp_pool_timer = true;
+    pthread_attr_destroy(&thread_attr);
+}
+
+/* Buffers of the pool may have been another client's, they go out zeroed */
+static void rkmpp_pool_clear(MppBuffer buffer, uint32_t size) {
+    void *ptr = mpp_buffer_get_ptr(buffer);
+
+    if (!ptr)
+        return;
+
+    mpp_buffer_sync_begin(buffer);
+    memset(ptr, 0, size);
+    mpp_buffer_sync_end(buffer);
+}
+
+int rkmpp_pool_get(MppBufferType type, uint32_t size, MppBuffer *buffer) {
+    struct rkmpp_pool_entry *entry;
+    MppBufferGroup group;
+    bool reused = false;
+    int ret = 0;
+
+    pthread_mutex_lock(&rkmpp_pool_mutex);
+
+    /* The most recently used first, its pages are the likeliest still hot */
+    TAILQ_FOREACH(entry, &rkmpp_pool_list, entry) {
+        if (entry->type == type && entry->size == size)
+            break;
+    }
+
+    if (entry) {
+        TAILQ_REMOVE(&rkmpp_pool_list, entry, entry);
+        rkmpp_pool_idle_bytes -= entry->size;
+        *buffer = entry->buffer;
+        reused = true;
+        free(entry);
+    } else {
+        group = rkmpp_pool_group(type);
+        if (!group || mpp_buffer_get(group, buffer, size) != MPP_OK) {
+            LOGE("pool: failed to alloc buffer of %d bytes\n", size);
+            errno = ENOMEM;
+            ret = -1;
+        }
+    }
+
+    rkmpp_pool_trim();
+
+    pthread_mutex_unlock(&rkmpp_pool_mutex);
+
+    if (reused)
+        rkmpp_pool_clear(*buffer, size);
+
+    return ret;
+}
+
+void rkmpp_pool_put(MppBufferType type, MppBuffer buffer) {
+    struct rkmpp_pool_entry *entry;
+
+    entry = calloc(1, sizeof(*entry));
+    if (!entry) {
+        mpp_buffer_put(buffer);
+        return;
+    }
+
+    entry->buffer = buffer;
+    entry->type = type;
+    entry->size = mpp_buffer_get_size(buffer);
+    entry->idle_since = rkmpp_pool_now();
+
+    pthread_once(&rkmpp_pool_once, rkmpp_pool_start_timer);
+
+    pthread_mutex_lock(&rkmpp_pool_mutex);
+    TAILQ_INSERT_HEAD(&rkmpp_pool_list, entry, entry);
+    rkmpp_pool_idle_bytes += entry->size;
+    rkmpp_pool_trim();
+    if (rkmpp_pool_timer)
+        pthread_cond_signal(&rkmpp_pool_cond);
+    pthread_mutex_unlock(&rkmpp_pool_mutex);
+}
+
+uint64_t rkmpp_pool_idle(void) {
+    uint64_t idle;
+
+    pthread_mutex_lock(&rkmpp_pool_mutex);
+    idle = rkmpp_pool_idle_bytes;
+    pthread_mutex_unlock(&rkmpp_pool_mutex);
+
+    return idle;
+}
@@ -0,0 +1,32 @@
+/*
+ * bufpool.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ */
+
+#ifndef SRC_BUFPOOL_H_
+#define SRC_BUFPOOL_H_
+
+#include <inttypes.h>
+#include <rockchip/rk_mpi.h>
+
+/* Idle bytes kept for reuse, the least recently used go first beyond it */
+#define RKMPP_POOL_MAX_IDLE     (64 << 20)
+
+/* Idle buffers not reused within this many seconds are freed, by a timer */
+#define RKMPP_POOL_IDLE_SEC     10
+
+/*
+ * Get a buffer of exactly size bytes, reusing an idle one of any session
+ * when there is one, zeroed. Returns 0 on success.
+ */
+int rkmpp_pool_get(MppBufferType type, uint32_t size, MppBuffer *buffer);
+
+/* Give a buffer back to the pool, its contents are not preserved */
+void rkmpp_pool_put(MppBufferType type, MppBuffer buffer);
+
+/* Bytes held idle by the pool */
+uint64_t rkmpp_pool_idle(void);
+
+#endif /* SRC_BUFPOOL_H_ */
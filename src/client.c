@@ -0,0 +1,331 @@
+/*
+ * client.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Process helpers shared by the cuse daemon and the in-process library,
+ * which have nothing of fuse in them.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "cusedev.h"
+#include "logger.h"
+
+int app_log_level = 0;
+
+/* Client thread of the request this worker is serving, 0 when in process */
+static __thread pid_t cuse_client;
+
+/*
+ * Client memory the kernel copied in after the ioctl arg on a retry, for a
+ * client the daemon has no ptrace access to. Reads take it in turn, and
+ * record what they wanted for the next retry when it runs out.
+ */
+static __thread const uint8_t *cuse_client_in;
+static __thread size_t cuse_client_in_size;
+static __thread bool cuse_client_denied;
+static __thread bool cuse_client_short;
+static __thread struct iovec cuse_client_iov[CUSE_CLIENT_MAX_IOV];
+static __thread int cuse_client_num_iov;
+
+void cuse_set_client(pid_t pid) {
+    cuse_client = pid;
+}
+
+pid_t cuse_get_client(void) {
+    return cuse_client;
+}
+
+void cuse_set_client_in(const void *buf, size_t size) {
+    cuse_client_in = buf;
+    cuse_client_in_size = buf ? size : 0;
+    cuse_client_denied = buf != NULL;
+    cuse_client_short = false;
+    cuse_client_num_iov = 0;
+}
+
+int cuse_get_client_retry(struct iovec *iov, int max) {
+    if (!cuse_client_short || cuse_client_num_iov > max)
+        return 0;
+
+    memcpy(iov, cuse_client_iov, cuse_client_num_iov * sizeof(*iov));
+    return cuse_client_num_iov;
+}
+
+/* The reads of a request come in the same order on its retry */
+static int cuse_read_client_in(void *dst, unsigned long src, size_t size) {
+    if (cuse_client_num_iov == CUSE_CLIENT_MAX_IOV) {
+        LOGE("too many client reads for a retry\n");
+        RETURN_ERR(EFAULT, -1);
+    }
+
+    cuse_client_iov[cuse_client_num_iov].iov_base = (void *) src;
+    cuse_client_iov[cuse_client_num_iov].iov_len = size;
+    cuse_client_num_iov++;
+
+    if (cuse_client_short || size > cuse_client_in_size) {
+        LOGV(2, "client memory at %#lx of %zu bytes comes with a retry\n", src, size);
+        cuse_client_short = true;
+        RETURN_ERR(EFAULT, -1);
+    }
+
+    memcpy(dst, cuse_client_in, size);
+    cuse_client_in += size;
+    cuse_client_in_size -= size;
+    return 0;
+}
+
+static int cuse_access_client(void *local_ptr, unsigned long remote_ptr,
+        size_t size, bool write) {
+    struct iovec local = { local_ptr, size };
+    struct iovec remote = { (void *) remote_ptr, size };
+    ssize_t ret;
+
+    /* Served in process, the pointers are ours */
+    if (!cuse_client) {
+        if (write)
+            memcpy((void *) remote_ptr, local_ptr, size);
+        else
+            memcpy(local_ptr, (void *) remote_ptr, size);
+        return 0;
+    }
+
+    if (!write && cuse_client_denied)
+        return cuse_read_client_in(local_ptr, remote_ptr, size);
+
+    while (local.iov_len) {
+        if (write)
+            ret = process_vm_writev(cuse_client, &local, 1, &remote, 1, 0);
+        else
+            ret = process_vm_readv(cuse_client, &local, 1, &remote, 1, 0);
+
+        /* No ptrace access to the client, the kernel copies for us instead */
+        if (ret < 0 && errno == EPERM && !write) {
+            cuse_client_denied = true;
+            return cuse_read_client_in(local_ptr, remote_ptr, size);
+        }
+
+        if (ret <= 0) {
+            if (!ret)
+                errno = EFAULT;
+            LOGE("failed to access client memory: %s\n", strerror(errno));
+            return -1;
+        }
+
+        local.iov_base = (uint8_t *) local.iov_base + ret;
+        local.iov_len -= ret;
+        remote.iov_base = (uint8_t *) remote.iov_base + ret;
+        remote.iov_len -= ret;
+    }
+
+    return 0;
+}
+
+int cuse_read_client(void *dst, unsigned long src, size_t size) {
+    return cuse_access_client(dst, src, size, false);
+}
+
+int cuse_write_client(unsigned long dst, const void *src, size_t size) {
+    return cuse_access_client((void *) src, dst, size, true);
+}
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open  434
+#endif
+
+#ifndef SYS_pidfd_getfd
+#define SYS_pidfd_getfd 438
+#endif
+
+#ifndef PIDFD_THREAD
+#define PIDFD_THREAD    O_EXCL
+#endif
+
+pid_t cuse_get_client_tgid(void) {
+    char path[32], line[64];
+    pid_t tgid = -1;
+    FILE *status;
+
+    if (!cuse_client)
+        return getpid();
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int) cuse_client);
+    status = fopen(path, "re");
+    if (!status)
+        return -1;
+
+    while (fgets(line, sizeof(line), status)) {
+        if (sscanf(line, "Tgid: %d", &tgid) == 1)
+            break;
+    }
+    fclose(status);
+
+    if (tgid <= 0)
+        RETURN_ERR(ESRCH, -1);
+
+    return tgid;
+}
+
+/*
+ * The client is the thread that made the request, which only kernels with
+ * PIDFD_THREAD open a pidfd of. Older ones need the process it's in.
+ */
+static int cuse_open_client(void) {
+    pid_t tgid;
+    int pidfd;
+
+    pidfd = syscall(SYS_pidfd_open, cuse_client, PIDFD_THREAD);
+    if (pidfd >= 0 || errno != EINVAL)
+        return pidfd;
+
+    tgid = cuse_get_client_tgid();
+    if (tgid < 0)
+        return -1;
+
+    return syscall(SYS_pidfd_open, tgid, 0);
+}
+
+int cuse_get_client_fd(int fd) {
+    int pidfd, ret;
+
+    /* Served in process, the fd is ours */
+    if (!cuse_client)
+        return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+
+    /* Needs the same ptrace access as reading the client memory */
+    pidfd = cuse_open_client();
+    if (pidfd < 0) {
+        LOGE("failed to open client %d: %s\n", (int) cuse_client, strerror(errno));
+        return -1;
+    }
+
+    ret = syscall(SYS_pidfd_getfd, pidfd, fd, 0);
+    if (ret < 0)
+        LOGE("failed to get fd %d of client: %s\n", fd, strerror(errno));
+
+    close(pidfd);
+    return ret;
+}
+
+/* File status flags of an fd of the process, octal in its fdinfo with its close-on-exec */
+static int cuse_read_fd_flags(pid_t tgid, int fd) {
+    char path[64], line[64];
+    unsigned int flags;
+    int ret = -1;
+    FILE *info;
+
+    snprintf(path, sizeof(path), "/proc/%d/fdinfo/%d", (int) tgid, fd);
+    info = fopen(path, "re");
+    if (!info)
+        return -1;
+
+    while (fgets(line, sizeof(line), info)) {
+        if (sscanf(line, "flags: %o", &flags) == 1) {
+            ret = flags & ~O_CLOEXEC;
+            break;
+        }
+    }
+    fclose(info);
+
+    return ret;
+}
+
+/*
+ * Fds are told apart by the path they were opened at, only read off their
+ * links: a stat could wait on whatever filesystem another fd is on.
+ */
+int cuse_get_client_flags(const char *path) {
+    char fd_path[32], target[PATH_MAX];
+    struct dirent *entry;
+    int flags = -1, fd_flags;
+    ssize_t len;
+    pid_t tgid;
+    DIR *dir;
+
+    tgid = cuse_get_client_tgid();
+    if (tgid < 0)
+        return -1;
+
+    snprintf(fd_path, sizeof(fd_path), "/proc/%d/fd", (int) tgid);
+    dir = opendir(fd_path);
+    if (!dir)
+        return -1;
+
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        len = readlinkat(dirfd(dir), entry->d_name, target, sizeof(target) - 1);
+        if (len < 0)
+            continue;
+        target[len] = '\0';
+        if (strcmp(target, path))
+            continue;
+
+        fd_flags = cuse_read_fd_flags(tgid, atoi(entry->d_name));
+        if (fd_flags < 0)
+            continue;
+
+        /* Opens told apart by nothing else */
+        if (flags >= 0 && flags != fd_flags) {
+            closedir(dir);
+            RETURN_ERR(EEXIST, -1);
+        }
+        flags = fd_flags;
+    }
+    closedir(dir);
+
+    if (flags < 0)
+        RETURN_ERR(ENOENT, -1);
+
+    return flags;
+}
+
+int cuse_set_thread_sched(pthread_t thread, uint64_t cpus, int prio) {
+    struct sched_param param = { .sched_priority = prio };
+    cpu_set_t set;
+    int ret = 0, err;
+
+    if (cpus) {
+        CPU_ZERO(&set);
+        for (int i = 0; i < 64; i++)
+            if (cpus & (1ULL << i))
+                CPU_SET(i, &set);
+
+        ret = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if (ret)
+            LOGE("failed to set cpu affinity: %s\n", strerror(ret));
+    }
+
+    /* Needs CAP_SYS_NICE, the thread keeps running normally without it */
+    if (prio) {
+        err = pthread_setschedparam(thread, SCHED_FIFO, &param);
+        if (err)
+            LOGE("failed to set SCHED_FIFO(%d): %s\n", prio, strerror(err));
+
+        /* The first failure is the one reported */
+        if (!ret)
+            ret = err;
+    }
+
+    if (ret)
+        RETURN_ERR(ret, -1);
+
+    return 0;
+}
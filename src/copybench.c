@@ -0,0 +1,163 @@
+/*
+ * copybench.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Times staging a userptr packet into drm memory per MB, the way each path
+ * of QBUF does it: a plain copy in process, process_vm_readv from a client
+ * the daemon can ptrace, and for one it can't the kernel's copy into the
+ * retried ioctl's buffer followed by the copy out of it.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include <rockchip/rk_mpi.h>
+
+#include "trace.h"
+#include "utils.h"
+
+static const char *usage =
+"usage: mpp-v4l2m2m-copybench [options]\n"
+"\n"
+"options:\n"
+"    -n PACKETS     packets of each run, 200 by default\n"
+"\n";
+
+/* From a slice of a low rate stream to a 4K intra frame */
+static const size_t copybench_sizes[] = { 64 << 10, 256 << 10, 1 << 20, 4 << 20 };
+
+static int copybench_readv(pid_t pid, void *dst, const void *src, size_t size) {
+    struct iovec local = { dst, size };
+    struct iovec remote = { (void *) src, size };
+
+    return process_vm_readv(pid, &local, 1, &remote, 1, 0) == (ssize_t) size ? 0 : -1;
+}
+
+static void copybench_report(const char *name, size_t size, unsigned packets, uint64_t ns) {
+    printf("%-10s %5zuKiB: %8.1fus/MB %8.1fMB/s\n", name, size >> 10,
+            ns / 1e3 / packets / (size / 1e6), (double) size * packets / (ns / 1e9) / 1e6);
+}
+
+int main(int argc, char **argv) {
+    size_t max_size = copybench_sizes[ARRAY_SIZE(copybench_sizes) - 1];
+    MppBufferGroup group = NULL;
+    MppBuffer staging = NULL;
+    unsigned packets = 200;
+    uint8_t *src, *dst, *bounce;
+    uint64_t start;
+    pid_t client;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            packets = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "%s", usage);
+            return opt != 'h';
+        }
+    }
+
+    if (!packets) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+
+    src = malloc(max_size);
+    bounce = malloc(max_size);
+    if (!src || !bounce)
+        return 1;
+
+    for (size_t i = 0; i < max_size; i++)
+        src[i] = i * 7 + i / 4096;
+
+    /* The staging QBUF copies into, plain memory where there's no drm */
+    if (mpp_buffer_group_get_internal(&group, MPP_BUFFER_TYPE_DRM) == MPP_OK &&
+            mpp_buffer_get(group, &staging, max_size) == MPP_OK) {
+        dst = mpp_buffer_get_ptr(staging);
+    } else {
+        printf("no drm staging, copying to plain memory\n");
+        dst = malloc(max_size);
+        if (!dst)
+            return 1;
+    }
+
+    /* A client with the same bytes at the same address, to read from */
+    client = fork();
+    if (client < 0)
+        return 1;
+    if (!client) {
+        pause();
+        _exit(0);
+    }
+
+    if (copybench_readv(client, dst, src, 4096) < 0)
+        printf("process_vm_readv: %s, only the in process copy is timed\n", strerror(errno));
+
+    printf("%u packets of each size\n", packets);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(copybench_sizes); i++) {
+        size_t size = copybench_sizes[i];
+        bool readv = !copybench_readv(client, dst, src, size);
+
+        start = rkmpp_trace_now();
+        for (unsigned n = 0; n < packets; n++) {
+            if (staging)
+                mpp_buffer_sync_begin(staging);
+            memcpy(dst, src, size);
+            if (staging)
+                mpp_buffer_sync_end(staging);
+        }
+        copybench_report("memcpy", size, packets, rkmpp_trace_now() - start);
+
+        if (!readv)
+            continue;
+
+        start = rkmpp_trace_now();
+        for (unsigned n = 0; n < packets; n++) {
+            if (staging)
+                mpp_buffer_sync_begin(staging);
+            copybench_readv(client, dst, src, size);
+            if (staging)
+                mpp_buffer_sync_end(staging);
+        }
+        copybench_report("vm_readv", size, packets, rkmpp_trace_now() - start);
+
+        /* The kernel's copy of the retry is a cross process copy too */
+        start = rkmpp_trace_now();
+        for (unsigned n = 0; n < packets; n++) {
+            copybench_readv(client, bounce, src, size);
+            if (staging)
+                mpp_buffer_sync_begin(staging);
+            memcpy(dst, bounce, size);
+            if (staging)
+                mpp_buffer_sync_end(staging);
+        }
+        copybench_report("retry", size, packets, rkmpp_trace_now() - start);
+    }
+
+    kill(client, SIGKILL);
+    waitpid(client, NULL, 0);
+
+    if (staging)
+        mpp_buffer_put(staging);
+    else
+        free(dst);
+    if (group)
+        mpp_buffer_group_put(group);
+    free(bounce);
+    free(src);
+    return 0;
+}
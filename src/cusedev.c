@@ -1,21 +1,37 @@
-#define FUSE_USE_VERSION 31
+#define FUSE_USE_VERSION 312
+#define _GNU_SOURCE
 
 #include <cuse_lowlevel.h>
 #include <fuse_opt.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <linux/fuse.h>
 
 #include "cusedev.h"
+#include "handoff.h"
 #include "logger.h"
+#include "replies.h"
+#include "trace.h"
 #include "utils.h"
 
-int app_log_level = 0;
+/* Libfuse serves sessions over io_uring from 3.18 on */
+#if FUSE_MAKE_VERSION(FUSE_MAJOR_VERSION, FUSE_MINOR_VERSION) >= FUSE_MAKE_VERSION(3, 18)
+#define CUSE_HAVE_IO_URING
+#endif
 
 static const char *usage =
 "usage: executable [options]\n"
@@ -24,51 +40,415 @@ static const char *usage =
 "    --help|-h                  print this help message\n"
 "    -d   -o debug              enable debug output (implies -f)\n"
 "    --loglevel=LEVEL|-m level  device minor number\n"
+"    --max-session-mem=MIB      cap the drm memory of each open, 0 for none\n"
+"    --max-total-mem=MIB        cap the drm memory of all opens, 0 for none\n"
 "    -s                         disable multi-threaded operation\n"
+"    --threads=N                max fuse workers of each node\n"
+"    --worker-cpus=LIST         pin fuse workers to cpus, like 4-7 or 0,4-5\n"
+"    --worker-prio=PRIO         run fuse workers SCHED_FIFO at PRIO\n"
+"    --decoder-cpus=LIST        pin decoder threads to cpus\n"
+"    --decoder-prio=PRIO        run decoder threads SCHED_FIFO at PRIO\n"
+"    --vpu-balance              put new sessions on the least loaded of the\n"
+"                               decoder blocks able to decode them\n"
+"    --trace=DIR                record every session's ioctls to a file in DIR\n"
+"    --trace-payload            record bitstreams whole, not only their hash\n"
+"    --io-uring                 take requests over io_uring when the kernel can,\n"
+"                               the read loop serves them otherwise, as it does\n"
+"                               for cuse on every kernel so far\n"
+"    --io-uring-depth=N         entries of each io_uring queue\n"
+"    --handoff=PATH             take the opens of the daemon listening on PATH\n"
+"                               over, then listen there for the next one\n"
+"    --node=NAME[,codecs=C1+C2][,max=WxH][,threads=N]\n"
+"                               add a device node, codecs by format name like\n"
+"                               H.264, may be repeated. Without it a single\n"
+"                               node with every codec is created.\n"
 "\n";
 
-static void codec_open(fuse_req_t req, struct fuse_file_info *fi) {
-    struct cuse_codec *codec = fuse_req_userdata(req);
-    int ret = codec->init(codec);
+/* Request the worker is serving and its open, for callbacks to park */
+static __thread fuse_req_t cuse_request;
+static __thread struct cuse_codec *cuse_request_codec;
+
+/* What a parked request of a traced open is traced with */
+static __thread int cuse_request_cmd;
+static __thread uint64_t cuse_request_start;
+static __thread const void *cuse_request_arg;
+static __thread size_t cuse_request_argsize;
+static __thread struct cuse_parked *cuse_request_parked;
+
+/**
+ * struct cuse_parked - Trace record of a parked request
+ * @entry:      Entry in cuse_parked.
+ * @req:        The request.
+ * @trace:      Trace of its open.
+ * @pending:    Its record, in the trace where it was issued.
+ */
+struct cuse_parked {
+    TAILQ_ENTRY(cuse_parked) entry;
+    fuse_req_t req;
+    struct rkmpp_trace *trace;
+    struct rkmpp_trace_pending *pending;
+};
+
+static pthread_mutex_t cuse_parked_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(, cuse_parked) cuse_parked = TAILQ_HEAD_INITIALIZER(cuse_parked);
+
+static void cuse_trace_park(void) {
+    struct cuse_parked *parked;
+
+    parked = calloc(1, sizeof(*parked));
+    if (!parked)
+        return;
+
+    parked->pending = rkmpp_trace_park(cuse_request_codec->trace, cuse_request_cmd,
+            cuse_request_start, cuse_request_arg, cuse_request_argsize);
+    if (!parked->pending) {
+        free(parked);
+        return;
+    }
+    parked->req = cuse_request;
+    parked->trace = cuse_request_codec->trace;
+
+    pthread_mutex_lock(&cuse_parked_mutex);
+    TAILQ_INSERT_TAIL(&cuse_parked, parked, entry);
+    pthread_mutex_unlock(&cuse_parked_mutex);
+
+    cuse_request_parked = parked;
+}
+
+/* Write the record of a request that was parked with its result */
+static void cuse_trace_complete(struct cuse_parked *parked, int err) {
+    pthread_mutex_lock(&cuse_parked_mutex);
+    TAILQ_REMOVE(&cuse_parked, parked, entry);
+    pthread_mutex_unlock(&cuse_parked_mutex);
+
+    rkmpp_trace_complete(parked->trace, parked->pending, err);
+    free(parked);
+}
+
+static struct cuse_parked *cuse_find_parked(fuse_req_t req) {
+    struct cuse_parked *parked;
+
+    pthread_mutex_lock(&cuse_parked_mutex);
+    TAILQ_FOREACH(parked, &cuse_parked, entry)
+        if (parked->req == req)
+            break;
+    pthread_mutex_unlock(&cuse_parked_mutex);
 
-    if (!ret)
-        fuse_reply_open(req, fi);
+    return parked;
+}
+
+/*
+ * Called with the lock of the request held, a reply doesn't need it. One
+ * interrupted before it was parked is for the parking callback to check.
+ */
+static void cuse_interrupt(fuse_req_t req, void *data) {
+    struct cuse_codec *codec = data;
+
+    if (req == cuse_request)
+        return;
+
+    LOGV(2, "request %p interrupted\n", (void *) req);
+    codec->interrupt(codec);
+}
+
+struct cuse_request *cuse_park_request(void) {
+    if (cuse_request && cuse_request_codec->interrupt)
+        fuse_req_interrupt_func(cuse_request, cuse_interrupt, cuse_request_codec);
+
+    /* Its record keeps its place among those issued after it */
+    if (cuse_request && cuse_request_codec->trace && !cuse_request_parked)
+        cuse_trace_park();
+
+    return (struct cuse_request *) cuse_request;
+}
+
+bool cuse_request_interrupted(struct cuse_request *request) {
+    return fuse_req_interrupted((fuse_req_t) request);
+}
+
+void cuse_complete_request(struct cuse_request *request, int err, const void *out_buf,
+        size_t size) {
+    fuse_req_t req = (fuse_req_t) request;
+    struct cuse_parked *parked = cuse_find_parked(req);
+
+    if (parked)
+        cuse_trace_complete(parked, err);
+
+    if (err)
+        fuse_reply_err(req, err);
     else
-        fuse_reply_err(req, ret);
+        fuse_reply_ioctl(req, 0, out_buf, size);
+}
+
+/* The kernel drops a poll handle once notified, the next poll brings a new one */
+void cuse_notify_poll(struct cuse_codec *codec) {
+    pthread_mutex_lock(&codec->poll_mutex);
+    if (codec->poll_handle) {
+        fuse_lowlevel_notify_poll(codec->poll_handle);
+        fuse_pollhandle_destroy(codec->poll_handle);
+        codec->poll_handle = NULL;
+    }
+    pthread_mutex_unlock(&codec->poll_mutex);
+}
+
+/* Fuse zeroes the flags of an ioctl, the client's fds of the node have them */
+bool cuse_request_nonblock(struct cuse_codec *codec) {
+    char path[sizeof(codec->filename) + 8];
+    int flags;
+
+    snprintf(path, sizeof(path), "/dev/%s", codec->filename);
+    flags = cuse_get_client_flags(path);
+    if (flags < 0) {
+        LOGV(2, "flags of %s not known: %s\n", path, strerror(errno));
+        return codec->nonblock;
+    }
+
+    return flags & O_NONBLOCK;
+}
+
+/* Opens of every node, those taken over from a previous daemon keep its fh */
+static pthread_mutex_t cuse_opens_mutex = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(, cuse_codec) cuse_opens = TAILQ_HEAD_INITIALIZER(cuse_opens);
+static unsigned cuse_num_adopted;
+
+static struct cuse_codec *cuse_find_open(uint64_t fh) {
+    struct cuse_codec *codec;
+
+    TAILQ_FOREACH(codec, &cuse_opens, entry) {
+        if (codec->fh == fh)
+            return codec;
+    }
+
+    return NULL;
+}
+
+/* The open of a request, NULL for an fh nobody knows */
+static struct cuse_codec *cuse_codec_of(struct fuse_file_info *fi) {
+    struct cuse_codec *codec;
+
+    if (!__atomic_load_n(&cuse_num_adopted, __ATOMIC_ACQUIRE))
+        return (struct cuse_codec *) (uintptr_t) fi->fh;
+
+    pthread_mutex_lock(&cuse_opens_mutex);
+    codec = cuse_find_open(fi->fh);
+    pthread_mutex_unlock(&cuse_opens_mutex);
+
+    return codec;
+}
+
+/*
+ * The fh of an open is its address, one an open taken over already has is
+ * held on to until malloc comes up with another.
+ */
+static struct cuse_codec *cuse_alloc_open(void) {
+    struct cuse_codec *held[8], *codec;
+    unsigned num = 0;
+
+    pthread_mutex_lock(&cuse_opens_mutex);
+    while ((codec = malloc(sizeof(*codec))) && cuse_num_adopted &&
+            cuse_find_open((uintptr_t) codec)) {
+        if (num == ARRAY_SIZE(held)) {
+            free(codec);
+            codec = NULL;
+            break;
+        }
+        held[num++] = codec;
+    }
+    pthread_mutex_unlock(&cuse_opens_mutex);
+
+    while (num)
+        free(held[--num]);
+
+    return codec;
+}
+
+static void cuse_add_open(struct cuse_codec *codec, bool adopted) {
+    pthread_mutex_lock(&cuse_opens_mutex);
+    TAILQ_INSERT_TAIL(&cuse_opens, codec, entry);
+    if (adopted)
+        __atomic_add_fetch(&cuse_num_adopted, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cuse_opens_mutex);
+}
+
+static void cuse_remove_open(struct cuse_codec *codec) {
+    pthread_mutex_lock(&cuse_opens_mutex);
+    TAILQ_REMOVE(&cuse_opens, codec, entry);
+    if (codec->fh != (uintptr_t) codec)
+        __atomic_sub_fetch(&cuse_num_adopted, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&cuse_opens_mutex);
+}
+
+/*
+ * Every open gets its own copy of the node, so the codec's session lives in
+ * the copy's priv and is found again through the file handle.
+ */
+static void codec_open(fuse_req_t req, struct fuse_file_info *fi) {
+    struct cuse_codec *node = fuse_req_userdata(req);
+    struct cuse_codec *codec = cuse_alloc_open();
+
+    if (!codec) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    *codec = *node;
+    codec->priv = NULL;
+    codec->trace = NULL;
+    codec->nonblock = fi->flags & O_NONBLOCK;
+    codec->fh = (uintptr_t) codec;
+    codec->lost = false;
+    codec->poll_handle = NULL;
+    pthread_mutex_init(&codec->poll_mutex, NULL);
+
+    if (codec->trace_dir)
+        codec->trace = rkmpp_trace_open(codec->trace_dir, codec->filename,
+                fuse_req_ctx(req)->pid, codec->trace_payload, codec->nonblock);
+
+    errno = 0;
+    if (codec->init(codec)) {
+        fuse_reply_err(req, errno ? errno : ENODEV);
+        rkmpp_trace_close(codec->trace);
+        pthread_mutex_destroy(&codec->poll_mutex);
+        free(codec);
+        return;
+    }
+
+    cuse_add_open(codec, false);
+    fi->fh = codec->fh;
+    fuse_reply_open(req, fi);
 }
 
 static void codec_close(fuse_req_t req, struct fuse_file_info *fi) {
-    struct cuse_codec *codec = fuse_req_userdata(req);
-    codec->deinit(codec);
+    struct cuse_codec *codec = cuse_codec_of(fi);
+
+    if (!codec) {
+        fuse_reply_err(req, 0);
+        return;
+    }
+
+    cuse_remove_open(codec);
+    if (!codec->lost)
+        codec->deinit(codec);
+    rkmpp_trace_close(codec->trace);
+    if (codec->poll_handle)
+        fuse_pollhandle_destroy(codec->poll_handle);
+    pthread_mutex_destroy(&codec->poll_mutex);
+    free(codec);
     fuse_reply_err(req, 0);
 }
 
 static void codec_ioctl(fuse_req_t req, int cmd, void *arg, struct fuse_file_info *fi, unsigned flags,
         const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
-    struct cuse_codec *codec = fuse_req_userdata(req);
-    int ret;
-    bool iswrite = getbit(cmd, 30) && !in_bufsz;
-    bool isread = getbit(cmd, 31) && !out_bufsz;
-    int argsize = getint(cmd, 16, 14);
+    struct cuse_codec *codec = cuse_codec_of(fi);
+    int ret, err;
+    bool haswrite = getbit(cmd, 30);
+    bool hasread = getbit(cmd, 31);
+    bool iswrite = haswrite && !in_bufsz;
+    bool isread = hasread && !out_bufsz;
+    size_t argsize = getint(cmd, 16, 14);
+    const struct cuse_reply *reply;
     const char* ioctlcmd;
 
+    /* The session didn't survive the daemon it was opened on */
+    if (!codec || codec->lost) {
+        fuse_reply_err(req, ENODEV);
+        return;
+    }
+
+    /* Structs of 32 bit clients are laid out differently */
+    if (flags & FUSE_IOCTL_COMPAT) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+
     for (int i = 0; i < codec->num_ioctls; i++) {
         if (cmd == codec->ioctls[i].cmd) {
             // request the buffers
             struct iovec iovout = { arg, argsize };
             struct iovec iovin = { arg, argsize };
-            struct iovec *iovinp = iswrite ? &iovout : NULL;
-            struct iovec *iovoutp = isread ? &iovin : NULL;
+            struct iovec *iovinp = haswrite ? &iovout : NULL;
+            struct iovec *iovoutp = hasread ? &iovin : NULL;
 
-            if (iovinp || iovoutp) {
+            /* A retry brings only what it asks for, so it asks for both ways */
+            if (iswrite || isread) {
                 fuse_reply_ioctl_retry(req, iovinp, !!iovinp, iovoutp, !!iovoutp);
+            } else if ((haswrite && in_bufsz < argsize) ||
+                    (hasread && out_bufsz < argsize)) {
+                /* Callbacks take the whole struct for granted */
+                LOGE("short ioctl buffers: %zu/%zu of %zu\n", in_bufsz, out_bufsz, argsize);
+                fuse_reply_err(req, EINVAL);
+            } else if ((reply = codec->replies ?
+                    cuse_replies_find(codec->replies, cmd, haswrite ? in_buf : NULL) : NULL)) {
+                /* Probing queries, answered with no session involved */
+                if (codec->trace)
+                    rkmpp_trace_ioctl(codec->trace, cmd, rkmpp_trace_now(), reply->err,
+                            haswrite ? in_buf : NULL, argsize);
+
+                if (reply->err)
+                    fuse_reply_err(req, reply->err);
+                else
+                    fuse_reply_ioctl(req, 0, reply->arg, reply->size);
             } else {
-                void* out_buf = iswrite && !isread ? NULL : calloc(1, argsize);
-                ret = codec->ioctls->callback(codec, in_buf, out_buf);
+                void* out_buf = hasread ? calloc(1, argsize) : NULL;
+                struct iovec retry[CUSE_CLIENT_MAX_IOV + 1];
+                int num_retry;
+
+                if (hasread && !out_buf) {
+                    fuse_reply_err(req, ENOMEM);
+                    return;
+                }
+
+                uint64_t start = codec->trace ? rkmpp_trace_now() : 0;
+
+                cuse_set_client(fuse_req_ctx(req)->pid);
+                cuse_set_client_in(in_bufsz > argsize ? (const uint8_t *) in_buf + argsize : NULL,
+                        in_bufsz - argsize);
+                cuse_request = req;
+                cuse_request_codec = codec;
+                if (codec->trace) {
+                    cuse_request_cmd = cmd;
+                    cuse_request_start = start;
+                    cuse_request_arg = haswrite ? in_buf : NULL;
+                    cuse_request_argsize = argsize;
+                }
+                errno = 0;
+                ret = codec->ioctls[i].callback(codec, haswrite ? in_buf : NULL, out_buf);
+                cuse_request = NULL;
+                cuse_request_codec = NULL;
+                if (ret < 0 && !errno)
+                    errno = EIO;
+                err = ret < 0 ? errno : 0;
+
+                /* Client memory it couldn't read comes with the retry */
+                if (ret < 0 && haswrite && (num_retry =
+                        cuse_get_client_retry(retry + 1, CUSE_CLIENT_MAX_IOV))) {
+                    retry[0] = iovout;
+                    fuse_reply_ioctl_retry(req, retry, num_retry + 1, hasread ? &iovin : NULL,
+                            hasread);
+                    cuse_set_client_in(NULL, 0);
+                    free(out_buf);
+                    return;
+                }
+                cuse_set_client_in(NULL, 0);
+
+                /*
+                 * A parked request is traced when it completes, possibly
+                 * already. One that got a place but didn't park fills it.
+                 */
+                if (cuse_request_parked) {
+                    if (ret != CUSE_IOCTL_PARKED)
+                        cuse_trace_complete(cuse_request_parked, err);
+                    cuse_request_parked = NULL;
+                } else if (codec->trace && ret != CUSE_IOCTL_PARKED) {
+                    rkmpp_trace_ioctl(codec->trace, cmd, start, err,
+                            haswrite ? in_buf : NULL, argsize);
+                }
+
+                /* A parked request gets its reply from another thread */
                 if (ret < 0)
-                    fuse_reply_err(req, ret);
-                else {
-                    fuse_reply_ioctl(req, 0, out_buf, argsize);
+                    fuse_reply_err(req, err);
+                else if (ret != CUSE_IOCTL_PARKED) {
+                    fuse_reply_ioctl(req, 0, out_buf, out_buf ? argsize : 0);
                 }
                 if(out_buf)
                     free(out_buf);
@@ -98,42 +478,207 @@ static void codec_write(fuse_req_t req, const char *buf, size_t size, off_t off,
 }
 
 static void codec_poll(fuse_req_t req, struct fuse_file_info *fi, struct fuse_pollhandle *ph) {
-    return;
+    struct cuse_codec *codec = cuse_codec_of(fi);
+
+    if (!codec || codec->lost) {
+        if (ph)
+            fuse_pollhandle_destroy(ph);
+        fuse_reply_poll(req, POLLERR);
+        return;
+    }
+
+    if (ph) {
+        pthread_mutex_lock(&codec->poll_mutex);
+        if (codec->poll_handle)
+            fuse_pollhandle_destroy(codec->poll_handle);
+        codec->poll_handle = ph;
+        pthread_mutex_unlock(&codec->poll_mutex);
+    }
+
+    fuse_reply_poll(req, codec->poll ? codec->poll(codec) : 0);
 }
 
+/* Device nodes a single daemon may expose */
+#define CUSE_MAX_NODES  8
+
+#define CUSE_KEY_HELP   0
+#define CUSE_KEY_NODE   1
+
 struct params {
     int is_help;
     unsigned loglevel;
-
+    unsigned max_session_mem;
+    unsigned max_total_mem;
+    unsigned threads;
+    char *worker_cpus;
+    int worker_prio;
+    char *decoder_cpus;
+    int decoder_prio;
+    int vpu_balance;
+    char *trace_dir;
+    int trace_payload;
+    int io_uring;
+    unsigned io_uring_depth;
+    char *handoff;
+    struct cuse_codec nodes[CUSE_MAX_NODES];
+    int num_nodes;
 };
 
 #define CUSE_OPT(t, p) { t, offsetof(struct params, p), 1 }
 
 static const struct fuse_opt cuse_opts[] = {
-    FUSE_OPT_KEY("-h",         0),
-    FUSE_OPT_KEY("--help",     0),
+    FUSE_OPT_KEY("-h",         CUSE_KEY_HELP),
+    FUSE_OPT_KEY("--help",     CUSE_KEY_HELP),
+    FUSE_OPT_KEY("--node=",    CUSE_KEY_NODE),
     CUSE_OPT("--loglevel %d",  loglevel),
     CUSE_OPT("-l %d",         loglevel),
+    CUSE_OPT("--max-session-mem=%u", max_session_mem),
+    CUSE_OPT("--max-total-mem=%u", max_total_mem),
+    CUSE_OPT("--threads=%u",   threads),
+    CUSE_OPT("--worker-cpus=%s", worker_cpus),
+    CUSE_OPT("--worker-prio=%d", worker_prio),
+    CUSE_OPT("--decoder-cpus=%s", decoder_cpus),
+    CUSE_OPT("--decoder-prio=%d", decoder_prio),
+    CUSE_OPT("--vpu-balance",  vpu_balance),
+    CUSE_OPT("--trace=%s",     trace_dir),
+    CUSE_OPT("--trace-payload", trace_payload),
+    CUSE_OPT("--io-uring",     io_uring),
+    CUSE_OPT("--io-uring-depth=%u", io_uring_depth),
+    CUSE_OPT("--handoff=%s",   handoff),
     FUSE_OPT_END
 };
 
+/* Parse a cpu list like 0,4-7 into a mask */
+static int cuse_parse_cpus(const char *list, uint64_t *cpus) {
+    unsigned first, last;
+    int len;
+
+    *cpus = 0;
+    if (!list)
+        return 0;
+
+    while (*list) {
+        if (sscanf(list, "%u%n", &first, &len) != 1)
+            return -1;
+        list += len;
+        last = first;
+
+        if (*list == '-') {
+            if (sscanf(++list, "%u%n", &last, &len) != 1)
+                return -1;
+            list += len;
+        }
+
+        if (first > last || last >= 64)
+            return -1;
+
+        for (; first <= last; first++)
+            *cpus |= 1ULL << first;
+
+        if (*list == ',')
+            list++;
+        else if (*list)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Parse NAME[,codecs=C1+C2][,max=WxH][,threads=N] into the node */
+static int cuse_parse_node(struct cuse_codec *node, const char *arg) {
+    char buf[256], *opt, *save;
+
+    snprintf(buf, sizeof(buf), "%s", arg);
+
+    opt = strtok_r(buf, ",", &save);
+    if (!opt || strlen(opt) >= sizeof(node->filename))
+        return -1;
+    strcpy(node->filename, opt);
+
+    while ((opt = strtok_r(NULL, ",", &save))) {
+        if (!strncmp(opt, "codecs=", 7)) {
+            if (strlen(opt + 7) >= sizeof(node->codecs))
+                return -1;
+            strcpy(node->codecs, opt + 7);
+        } else if (sscanf(opt, "max=%ux%u", &node->max_width, &node->max_height) == 2) {
+            continue;
+        } else if (sscanf(opt, "threads=%u", &node->threads) == 1) {
+            continue;
+        } else {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
 static int cuse_process_arg(void *data, const char *arg, int key,
                    struct fuse_args *outargs)
 {
     struct params *param = data;
 
     (void)outargs;
-    (void)arg;
 
-    if(!key) {
+    switch (key) {
+    case CUSE_KEY_HELP:
         param->is_help = 1;
         fprintf(stderr, "%s", usage);
+        return 1;
+    case CUSE_KEY_NODE:
+        if (param->num_nodes == CUSE_MAX_NODES ||
+                cuse_parse_node(&param->nodes[param->num_nodes],
+                        arg + strlen("--node="))) {
+            fprintf(stderr, "invalid or too many nodes: %s\n", arg);
+            return -1;
+        }
+        param->num_nodes++;
+        return 0;
+    default:
+        return 1;
     }
+}
+
+/**
+ * struct cuse_node - A device node served by the daemon
+ * @codec:      Template of the opens of the node.
+ * @se:         Cuse session of the node.
+ * @thread:     Thread running the node's loop.
+ * @multithreaded:  Dispatch requests from a worker pool.
+ * @proto_minor:    Minor of the fuse protocol the kernel settled on at init.
+ * @adopt_fd:   Cuse device a previous daemon handed over, -1 for none.
+ * @adopted:    The node was taken over, with the opens on it.
+ * @running:    Its loop runs on @thread, to be joined.
+ * @io_uring:   Its session was set up to take requests over io_uring.
+ */
+struct cuse_node {
+    struct cuse_codec codec;
+    struct fuse_session *se;
+    pthread_t thread;
+    int multithreaded;
+    uint32_t proto_minor;
+    int adopt_fd;
+    bool adopted;
+    bool running;
+    bool io_uring;
+};
+
+/* The protocol the kernel settled on, for a daemon taking the node over */
+static void codec_init_conn(void *userdata, struct fuse_conn_info *conn) {
+    struct cuse_node *node = (struct cuse_node *)
+            ((char *) userdata - offsetof(struct cuse_node, codec));
+
+    node->proto_minor = conn->proto_minor;
 
-    return 1;
+#if defined(CUSE_HAVE_IO_URING) && defined(FUSE_CAP_OVER_IO_URING)
+    /* Kernels so far negotiate io_uring for fuse mounts only, never for cuse */
+    if (node->io_uring && !fuse_get_feature_flag(conn, FUSE_CAP_OVER_IO_URING))
+        LOGE("node %s: the kernel has no io_uring for cuse, using the read loop\n",
+                node->codec.filename);
+#endif
 }
 
 static const struct cuse_lowlevel_ops cuse_clop = {
+    .init       = codec_init_conn,
     .open       = codec_open,
     .release    = codec_close,
     .read       = codec_read,
@@ -142,15 +687,531 @@ static const struct cuse_lowlevel_ops cuse_clop = {
     .ioctl      = codec_ioctl,
 };
 
+static int cuse_run_node(struct cuse_node *node) {
+    struct fuse_loop_config *config;
+    int ret;
+
+    /* Workers are spawned by the loop thread and inherit its placement */
+    if (node->codec.worker_cpus || node->codec.worker_prio)
+        cuse_set_thread_sched(pthread_self(), node->codec.worker_cpus,
+                node->codec.worker_prio);
+
+    if (!node->multithreaded)
+        return fuse_session_loop(node->se);
+
+    config = fuse_loop_cfg_create();
+    if (!config)
+        return -1;
+
+    /* Keep every worker around, respawning them would be a latency hit */
+    if (node->codec.threads) {
+        fuse_loop_cfg_set_max_threads(config, node->codec.threads);
+        fuse_loop_cfg_set_idle_threads(config, node->codec.threads);
+    }
+
+    ret = fuse_session_loop_mt(node->se, config);
+    fuse_loop_cfg_destroy(config);
+
+    return ret;
+}
+
+/*
+ * Set up the session of a node. Over io_uring the workers take requests
+ * from per cpu queues of submissions, instead of a read and a write of the
+ * device per request. Libfuse only moves a session there when the kernel
+ * offers it at init, the read loop serves it otherwise, and so it does
+ * when libfuse can't be asked at all.
+ */
+static struct fuse_session *cuse_setup_node(struct fuse_args *args,
+        const struct cuse_info *ci, struct cuse_node *node, const struct params *param) {
+#ifdef CUSE_HAVE_IO_URING
+    struct fuse_args uring_args = FUSE_ARGS_INIT(0, NULL);
+    struct fuse_session *se;
+    char depth[64];
+
+    if (param->io_uring) {
+        for (int i = 0; i < args->argc; i++)
+            fuse_opt_add_arg(&uring_args, args->argv[i]);
+        fuse_opt_add_arg(&uring_args, "-oio_uring");
+        if (param->io_uring_depth) {
+            snprintf(depth, sizeof(depth), "-oio_uring_q_depth=%u", param->io_uring_depth);
+            fuse_opt_add_arg(&uring_args, depth);
+        }
+
+        node->io_uring = true;
+        se = cuse_lowlevel_setup(uring_args.argc, uring_args.argv, ci, &cuse_clop,
+                &node->multithreaded, &node->codec);
+        fuse_opt_free_args(&uring_args);
+        if (se)
+            return se;
+        node->io_uring = false;
+
+        LOGE("node %s: io_uring refused, using the read loop\n", node->codec.filename);
+    }
+#else
+    if (param->io_uring)
+        LOGE("node %s: libfuse has no io_uring, using the read loop\n", node->codec.filename);
+#endif
+
+    return cuse_lowlevel_setup(args->argc, args->argv, ci, &cuse_clop,
+            &node->multithreaded, &node->codec);
+}
+
+static void *cuse_node_thread(void *data) {
+    cuse_run_node(data);
+    return NULL;
+}
+
+/* Unique of the init a taken over session is fed, no request of the kernel's */
+#define CUSE_ADOPT_UNIQUE   (UINT64_MAX - 1)
+
+/*
+ * Serve the cuse device a previous daemon handed over instead of creating
+ * one. The kernel set the device up with that daemon, so the session is told
+ * about it with an init of our making, the reply to which the kernel drops as
+ * it answers nothing it sent. The fd is the session's, whatever happens.
+ */
+static struct fuse_session *cuse_adopt_node(struct fuse_args *args,
+        const struct cuse_info *ci, struct cuse_node *node) {
+    struct fuse_args copy = FUSE_ARGS_INIT(0, NULL);
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se = NULL;
+    char mountpoint[32];
+    struct {
+        struct fuse_in_header in;
+        struct cuse_init_in init;
+    } init = {
+        .in = {
+            .len = sizeof(init),
+            .opcode = CUSE_INIT,
+            .unique = CUSE_ADOPT_UNIQUE,
+            .pid = getpid(),
+        },
+        .init = {
+            .major = FUSE_KERNEL_VERSION,
+            .minor = node->proto_minor,
+            .flags = CUSE_UNRESTRICTED_IOCTL,
+        },
+    };
+    struct fuse_buf buf = { .size = sizeof(init), .mem = &init };
+    int fd = node->adopt_fd;
+
+    node->adopt_fd = -1;
+
+    for (int i = 0; i < args->argc; i++)
+        fuse_opt_add_arg(&copy, args->argv[i]);
+
+    memset(&opts, 0, sizeof(opts));
+    if (fuse_parse_cmdline(&copy, &opts) == -1)
+        goto err_fd;
+    node->multithreaded = !opts.singlethread;
+
+    se = cuse_lowlevel_new(&copy, ci, &cuse_clop, &node->codec);
+    if (!se)
+        goto err_fd;
+
+    snprintf(mountpoint, sizeof(mountpoint), "/dev/fd/%d", fd);
+    if (fuse_session_mount(se, mountpoint))
+        goto err_fd;
+
+    node->proto_minor = 0;
+    fuse_session_process_buf(se, &buf);
+    if (!node->proto_minor) {
+        LOGE("node %s: the session refused its init\n", node->codec.filename);
+        goto err_se;
+    }
+
+    if (fuse_set_signal_handlers(se) == -1)
+        goto err_se;
+
+    if (fuse_daemonize(opts.foreground) == -1) {
+        cuse_lowlevel_teardown(se);
+        se = NULL;
+    }
+    goto out;
+
+err_fd:
+    close(fd);
+err_se:
+    if (se)
+        fuse_session_destroy(se);
+    se = NULL;
+out:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&copy);
+    return se;
+}
+
+/* Breaks the loops of the nodes out of their waits */
+#define CUSE_HANDOFF_SIGNAL     SIGUSR2
+
+/* How often the signal is sent until a loop returns */
+#define CUSE_HANDOFF_RETRY_NS   (100 * 1000000)
+
+/**
+ * struct cuse_handoff - Hands the opens over to a daemon taking our place
+ * @listen_fd:  Socket the next daemon connects to, -1 for none.
+ * @sock:       Connection of the daemon taking over, -1 until one does.
+ * @thread:     Thread waiting for it.
+ * @nodes:      Nodes it stops the first of, the main thread stops the rest.
+ * @version:    Handoff version of the codec, checked on both ends.
+ * @stopped:    The loop of the first node returned.
+ */
+static struct cuse_handoff {
+    int listen_fd;
+    int sock;
+    pthread_t thread;
+    struct cuse_node *nodes;
+    uint32_t version;
+    bool stopped;
+} cuse_handoff = { .listen_fd = -1, .sock = -1 };
+
+/* Daemons of another build may lay out what the codec hands over differently */
+static uint32_t cuse_handoff_version_of(const struct cuse_codec *codec) {
+    return codec->state_version ? codec->state_version() : CUSE_HANDOFF_VERSION;
+}
+
+/* The daemon on the other end runs as us, nobody else gets or gives opens */
+static bool cuse_handoff_peer_ok(int sock) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) || len != sizeof(cred)) {
+        LOGE("no credentials of the handoff peer: %s\n", strerror(errno));
+        return false;
+    }
+
+    if (cred.uid != getuid()) {
+        LOGE("refused a handoff with pid %d of uid %u\n", cred.pid, cred.uid);
+        return false;
+    }
+
+    return true;
+}
+
+/* No SA_RESTART, the waits of the loops fail with EINTR */
+static void cuse_handoff_wake(int sig) {
+    (void) sig;
+}
+
+/*
+ * Make the loop of a node return from another thread. A signal that lands
+ * before the loop waits again is missed, so it's sent until the loop is seen
+ * to return.
+ */
+static void cuse_stop_node(struct cuse_node *node) {
+    fuse_session_exit(node->se);
+    pthread_kill(node->thread, CUSE_HANDOFF_SIGNAL);
+}
+
+static void cuse_join_node(struct cuse_node *node) {
+    struct timespec deadline;
+
+    do {
+        cuse_stop_node(node);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += CUSE_HANDOFF_RETRY_NS;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    } while (pthread_timedjoin_np(node->thread, NULL, &deadline) == ETIMEDOUT);
+}
+
+static void *cuse_handoff_thread(void *data) {
+    struct timeval timeout = { .tv_sec = 5 };
+    struct cuse_handoff_hello hello;
+    struct timespec retry = { .tv_nsec = CUSE_HANDOFF_RETRY_NS };
+    int sock;
+
+    (void) data;
+
+    for (;;) {
+        sock = accept4(cuse_handoff.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            LOGE("handoff socket failed: %s\n", strerror(errno));
+            return NULL;
+        }
+
+        if (!cuse_handoff_peer_ok(sock)) {
+            close(sock);
+            continue;
+        }
+
+        /* Only a daemon handing over the same way gets the opens */
+        memset(&hello, 0, sizeof(hello));
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (recv(sock, &hello, sizeof(hello), MSG_WAITALL) == sizeof(hello) &&
+                hello.magic == CUSE_HANDOFF_MAGIC &&
+                hello.version == cuse_handoff.version)
+            break;
+
+        LOGE("refused a handoff of version %#x, ours %#x\n", hello.version,
+                cuse_handoff.version);
+        close(sock);
+    }
+
+    LOGV(1, "handing the opens over\n");
+    cuse_handoff.sock = sock;
+
+    while (!__atomic_load_n(&cuse_handoff.stopped, __ATOMIC_ACQUIRE)) {
+        cuse_stop_node(&cuse_handoff.nodes[0]);
+        nanosleep(&retry, NULL);
+    }
+
+    return NULL;
+}
+
+/* Listen on path for the daemon taking over from this one */
+static int cuse_handoff_listen(const char *path, struct cuse_node *nodes) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        RETURN_ERR(ENAMETOOLONG, -1);
+    strcpy(addr.sun_path, path);
+
+    cuse_handoff.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (cuse_handoff.listen_fd < 0)
+        return -1;
+
+    /* The socket of the daemon we took over from, or a stale one */
+    unlink(path);
+
+    /* Nothing connects before the listen, by then only we may */
+    cuse_handoff.nodes = nodes;
+    cuse_handoff.version = cuse_handoff_version_of(&nodes[0].codec);
+    if (bind(cuse_handoff.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+            chmod(path, S_IRUSR | S_IWUSR) ||
+            listen(cuse_handoff.listen_fd, 1) ||
+            (errno = pthread_create(&cuse_handoff.thread, NULL, cuse_handoff_thread, NULL))) {
+        close(cuse_handoff.listen_fd);
+        cuse_handoff.listen_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Hand the nodes and their opens over once the loops of all nodes returned.
+ * Each open goes in a piece of its own, one that fails to save is lost to
+ * its client without taking the others along. The clients' polls are woken
+ * up to poll again, which the next daemon answers.
+ */
+static int cuse_handoff_give(struct cuse_node *nodes, int num_nodes) {
+    struct cuse_state state, sub;
+    struct cuse_codec *codec;
+    uint32_t num = num_nodes, saved;
+    int ret;
+
+    cuse_state_init(&state);
+
+    cuse_state_put(&state, &num, sizeof(num));
+    for (int i = 0; i < num_nodes; i++) {
+        cuse_state_put(&state, nodes[i].codec.filename, sizeof(nodes[i].codec.filename));
+        cuse_state_put(&state, &nodes[i].proto_minor, sizeof(nodes[i].proto_minor));
+        cuse_state_put_fd(&state, fuse_session_fd(nodes[i].se));
+    }
+
+    num = 0;
+    TAILQ_FOREACH(codec, &cuse_opens, entry)
+        num++;
+    cuse_state_put(&state, &num, sizeof(num));
+
+    TAILQ_FOREACH(codec, &cuse_opens, entry) {
+        cuse_state_init(&sub);
+        saved = !codec->lost && codec->save && !codec->save(codec, &sub) && !sub.error;
+        if (!saved)
+            LOGE("open %#" PRIx64 " of %s lost in the handoff\n", codec->fh, codec->filename);
+
+        cuse_state_put(&state, codec->filename, sizeof(codec->filename));
+        cuse_state_put(&state, &codec->fh, sizeof(codec->fh));
+        cuse_state_put(&state, &codec->nonblock, sizeof(codec->nonblock));
+        cuse_state_put(&state, &saved, sizeof(saved));
+        if (saved)
+            cuse_state_put_state(&state, &sub);
+        cuse_state_free(&sub);
+
+        cuse_notify_poll(codec);
+    }
+
+    ret = cuse_state_send(cuse_handoff.sock, &state, cuse_handoff.version);
+    if (ret)
+        LOGE("failed to hand the opens over: %s\n", strerror(errno));
+    else
+        LOGV(1, "handed %u opens over\n", num);
+
+    cuse_state_free(&state);
+    close(cuse_handoff.sock);
+    cuse_handoff.sock = -1;
+
+    return ret;
+}
+
+/*
+ * Connect to the daemon listening on path and take its state over. Returns
+ * 1 with the state, 0 when there's no daemon to take over from.
+ */
+static int cuse_handoff_take(const char *path, uint32_t version, struct cuse_state *state) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct cuse_handoff_hello hello = {
+        .magic = CUSE_HANDOFF_MAGIC,
+        .version = version,
+    };
+    int sock, ret = 0;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return 0;
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return 0;
+
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr))) {
+        LOGV(1, "no daemon to take over from on %s\n", path);
+        close(sock);
+        return 0;
+    }
+
+    if (cuse_handoff_peer_ok(sock) &&
+            send(sock, &hello, sizeof(hello), MSG_NOSIGNAL) == sizeof(hello) &&
+            !cuse_state_recv(sock, state, version))
+        ret = 1;
+    else
+        LOGE("the daemon on %s handed nothing over\n", path);
+
+    close(sock);
+    return ret;
+}
+
+/* Give the cuse devices handed over to the nodes of the same name */
+static void cuse_handoff_nodes(struct cuse_node *nodes, int num_nodes,
+        struct cuse_state *state) {
+    char filename[sizeof(nodes->codec.filename)];
+    uint32_t num, proto_minor;
+    int fd, i;
+
+    cuse_state_get(state, &num, sizeof(num));
+    for (; num && !state->error; num--) {
+        cuse_state_get(state, filename, sizeof(filename));
+        cuse_state_get(state, &proto_minor, sizeof(proto_minor));
+        fd = cuse_state_get_fd(state);
+        filename[sizeof(filename) - 1] = '\0';
+
+        for (i = 0; i < num_nodes; i++) {
+            if (!strcmp(nodes[i].codec.filename, filename))
+                break;
+        }
+
+        if (fd < 0 || i == num_nodes || nodes[i].adopt_fd >= 0) {
+            LOGE("node %s is not served anymore\n", filename);
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+
+        nodes[i].adopt_fd = fd;
+        nodes[i].proto_minor = proto_minor;
+    }
+}
+
+/*
+ * Take the opens handed over on the nodes taken over. One whose state didn't
+ * make it is kept to fail its client's requests, so its fh is no one else's
+ * until the client closes it.
+ */
+static void cuse_handoff_opens(struct cuse_node *nodes, int num_nodes,
+        struct cuse_state *state) {
+    char filename[sizeof(nodes->codec.filename)];
+    struct cuse_state sub;
+    struct cuse_codec *codec;
+    uint32_t num, saved;
+    uint64_t fh;
+    bool nonblock;
+    int i;
+
+    cuse_state_get(state, &num, sizeof(num));
+    for (; num && !state->error; num--) {
+        cuse_state_get(state, filename, sizeof(filename));
+        cuse_state_get(state, &fh, sizeof(fh));
+        cuse_state_get(state, &nonblock, sizeof(nonblock));
+        cuse_state_get(state, &saved, sizeof(saved));
+        filename[sizeof(filename) - 1] = '\0';
+
+        cuse_state_init(&sub);
+        if (saved && !cuse_state_get_state(state, &sub))
+            break;
+
+        /* Its device went away with the previous daemon */
+        for (i = 0; i < num_nodes; i++) {
+            if (nodes[i].adopted && !strcmp(nodes[i].codec.filename, filename))
+                break;
+        }
+        if (i == num_nodes) {
+            cuse_state_free(&sub);
+            continue;
+        }
+
+        codec = malloc(sizeof(*codec));
+        if (!codec) {
+            cuse_state_free(&sub);
+            continue;
+        }
+
+        *codec = nodes[i].codec;
+        codec->priv = NULL;
+        codec->trace = NULL;
+        codec->nonblock = nonblock;
+        codec->fh = fh;
+        codec->lost = !saved;
+        codec->poll_handle = NULL;
+        pthread_mutex_init(&codec->poll_mutex, NULL);
+
+        if (!codec->lost) {
+            if (codec->init(codec)) {
+                codec->lost = true;
+            } else if (!codec->restore || codec->restore(codec, &sub)) {
+                codec->deinit(codec);
+                codec->lost = true;
+            }
+        }
+        cuse_state_free(&sub);
+
+        if (codec->lost)
+            LOGE("open %#" PRIx64 " of %s lost in the handoff\n", fh, filename);
+        else
+            LOGV(1, "took open %#" PRIx64 " of %s over\n", fh, filename);
+
+        cuse_add_open(codec, true);
+    }
+
+    if (state->error)
+        LOGE("handoff state cut short\n");
+}
+
+/*
+ * Each node is its own cuse session with its own request loop and workers,
+ * all in one process so they share the buffer pool. The first node runs on
+ * the main thread and gets the signal handlers, stopping it ends the daemon.
+ */
 int initcodec(struct cuse_codec *codec, int argc, char **argv) {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct params param = { 0 };
-    char dev_name[128] = "DEVNAME=";
+    struct cuse_node *nodes = NULL;
+    char dev_name[128];
     const char *dev_info_argv[] = { dev_name };
     struct cuse_info ci;
+    struct cuse_state handoff;
+    struct sigaction sa = { .sa_handler = cuse_handoff_wake };
+    uint64_t worker_cpus, decoder_cpus;
+    int num_nodes, i;
     int ret = 1;
 
-    strcat(dev_name, codec->filename);
+    cuse_state_init(&handoff);
+
     if (fuse_opt_parse(&args, &param, cuse_opts, cuse_process_arg)) {
         printf("failed to parse option\n");
         goto out;
@@ -161,14 +1222,141 @@ int initcodec(struct cuse_codec *codec, int argc, char **argv) {
 
     app_log_level = param.loglevel;
 
+    if (cuse_parse_cpus(param.worker_cpus, &worker_cpus) ||
+            cuse_parse_cpus(param.decoder_cpus, &decoder_cpus)) {
+        fprintf(stderr, "invalid cpu list\n");
+        goto out;
+    }
+
+    num_nodes = param.num_nodes ? param.num_nodes : 1;
+    nodes = calloc(num_nodes, sizeof(*nodes));
+    if (!nodes)
+        goto out;
+
+    for (i = 0; i < num_nodes; i++) {
+        nodes[i].codec = *codec;
+        nodes[i].codec.max_session_mem = param.max_session_mem;
+        nodes[i].codec.max_total_mem = param.max_total_mem;
+        nodes[i].codec.threads = param.threads;
+        nodes[i].codec.worker_cpus = worker_cpus;
+        nodes[i].codec.worker_prio = param.worker_prio;
+        nodes[i].codec.decoder_cpus = decoder_cpus;
+        nodes[i].codec.decoder_prio = param.decoder_prio;
+        nodes[i].codec.vpu_balance = param.vpu_balance;
+        nodes[i].codec.trace_dir = param.trace_dir;
+        nodes[i].codec.trace_payload = param.trace_payload;
+        nodes[i].adopt_fd = -1;
+
+        if (param.num_nodes) {
+            strcpy(nodes[i].codec.filename, param.nodes[i].filename);
+            strcpy(nodes[i].codec.codecs, param.nodes[i].codecs);
+            nodes[i].codec.max_width = param.nodes[i].max_width;
+            nodes[i].codec.max_height = param.nodes[i].max_height;
+            if (param.nodes[i].threads)
+                nodes[i].codec.threads = param.nodes[i].threads;
+        }
+    }
+
+    /* Before daemonizing, nothing a probe starts is left behind */
+    for (i = 0; i < num_nodes; i++)
+        if (codec->probe)
+            nodes[i].codec.replies = codec->probe(&nodes[i].codec);
+
+    /* The nodes a previous daemon serves are taken over, with their opens */
+    if (param.handoff &&
+            cuse_handoff_take(param.handoff, cuse_handoff_version_of(codec), &handoff) > 0)
+        cuse_handoff_nodes(nodes, num_nodes, &handoff);
+
     memset(&ci, 0, sizeof(ci));
     ci.dev_info_argc = 1;
     ci.dev_info_argv = dev_info_argv;
     ci.flags = CUSE_UNRESTRICTED_IOCTL;
 
-    ret = cuse_lowlevel_main(args.argc, args.argv, &ci, &cuse_clop, codec);
+    /* The last node set up owns the signal handlers, so go backwards */
+    for (i = num_nodes - 1; i >= 0; i--) {
+        snprintf(dev_name, sizeof(dev_name), "DEVNAME=%s", nodes[i].codec.filename);
 
-    out:
+        if (nodes[i].adopt_fd >= 0) {
+            nodes[i].se = cuse_adopt_node(&args, &ci, &nodes[i]);
+            nodes[i].adopted = !!nodes[i].se;
+        } else {
+            nodes[i].se = cuse_setup_node(&args, &ci, &nodes[i], &param);
+        }
+        if (!nodes[i].se) {
+            LOGE("failed to set up node: %s\n", nodes[i].codec.filename);
+            goto out_teardown;
+        }
+
+        /* Only daemonize once */
+        if (i == num_nodes - 1)
+            fuse_opt_add_arg(&args, "-f");
+
+        LOGV(1, "node %s: codecs: %s max: %dx%d threads: %d\n",
+                nodes[i].codec.filename,
+                nodes[i].codec.codecs[0] ? nodes[i].codec.codecs : "all",
+                nodes[i].codec.max_width, nodes[i].codec.max_height,
+                nodes[i].codec.threads);
+    }
+
+    /* Decoder threads started before daemonizing would be left behind */
+    if (handoff.data)
+        cuse_handoff_opens(nodes, num_nodes, &handoff);
+    cuse_state_free(&handoff);
+
+    if (param.handoff && cuse_handoff_listen(param.handoff, nodes))
+        LOGE("failed to listen for a handoff on %s: %s\n", param.handoff, strerror(errno));
+
+    /* The loops of the other nodes are stopped with it, at exit as at a handoff */
+    sigemptyset(&sa.sa_mask);
+    sigaction(CUSE_HANDOFF_SIGNAL, &sa, NULL);
+
+    nodes[0].thread = pthread_self();
+    for (i = 1; i < num_nodes; i++) {
+        nodes[i].running = !pthread_create(&nodes[i].thread, NULL, cuse_node_thread, &nodes[i]);
+        if (!nodes[i].running)
+            LOGE("failed to start node: %s\n", nodes[i].codec.filename);
+    }
+
+    ret = cuse_run_node(&nodes[0]) < 0;
+
+    /* The other loops may be blocked reading their device, the signal ends them */
+    for (i = 1; i < num_nodes; i++)
+        if (nodes[i].running)
+            cuse_join_node(&nodes[i]);
+
+    if (cuse_handoff.listen_fd >= 0) {
+        __atomic_store_n(&cuse_handoff.stopped, true, __ATOMIC_RELEASE);
+        pthread_cancel(cuse_handoff.thread);
+        pthread_join(cuse_handoff.thread, NULL);
+        close(cuse_handoff.listen_fd);
+
+        /* The daemon taking over listens there next */
+        if (cuse_handoff.sock >= 0)
+            ret = cuse_handoff_give(nodes, num_nodes) < 0;
+        else
+            unlink(param.handoff);
+    }
+
+    /* The first node's teardown takes the signal handlers along, so it goes last */
+    for (i = num_nodes - 1; i >= 0; i--)
+        cuse_lowlevel_teardown(nodes[i].se);
+    goto out;
+
+out_teardown:
+    for (i++; i < num_nodes; i++)
+        cuse_lowlevel_teardown(nodes[i].se);
+out:
+    for (i = 0; nodes && i < num_nodes; i++) {
+        if (nodes[i].adopt_fd >= 0)
+            close(nodes[i].adopt_fd);
+        cuse_replies_free(nodes[i].codec.replies);
+    }
+    cuse_state_free(&handoff);
+    free(nodes);
+    free(param.worker_cpus);
+    free(param.decoder_cpus);
+    free(param.trace_dir);
+    free(param.handoff);
     fuse_opt_free_args(&args);
     return ret;
 }
@@ -1,15 +1,66 @@
+#ifndef SRC_CUSEDEV_H_
+#define SRC_CUSEDEV_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * The callback gets the whole argument struct in in_buf when cmd has _IOC_WRITE,
+ * NULL otherwise, and out_buf zeroed when cmd has _IOC_READ, NULL otherwise.
+ * It returns a negative value with errno set on failure.
+ */
 struct cuse_ioctl {
     int cmd;
     int (*callback)(void *userdata, const void *in_buf, void *out_buf);
 };
 
+struct rkmpp_trace;
+struct cuse_request;
+struct cuse_replies;
+struct cuse_state;
+
+/* Returned by ioctl callbacks that reply later with cuse_complete_request */
+#define CUSE_IOCTL_PARKED   1
+
 struct cuse_codec {
     char filename[64];
+    char codecs[64];            /* coded format names, all when empty */
+    unsigned max_width;         /* 0 for the format limits */
+    unsigned max_height;
+    unsigned threads;           /* max fuse workers, 0 for the default */
+    uint64_t worker_cpus;       /* affinity of fuse workers, 0 for any */
+    int worker_prio;            /* SCHED_FIFO priority of workers, 0 for none */
+    uint64_t decoder_cpus;      /* affinity of decoder threads, 0 for any */
+    int decoder_prio;           /* SCHED_FIFO priority of decoders, 0 for none */
+    bool vpu_balance;           /* place decoders on the least loaded block */
     int fd;
     int loglevel;
+    unsigned max_session_mem;   /* MiB, 0 for no cap */
+    unsigned max_total_mem;     /* MiB, 0 for no cap */
+    const char *trace_dir;      /* where to trace sessions, NULL for none */
+    bool trace_payload;         /* trace bitstreams whole, not their hash */
+    struct rkmpp_trace *trace;  /* trace of the open, NULL for none */
+    bool nonblock;              /* opened with O_NONBLOCK */
+    uint64_t fh;                /* fuse fh of the open */
+    bool lost;                  /* taken over without its state, requests fail */
+    TAILQ_ENTRY(cuse_codec) entry;  /* in the opens of the daemon */
+    void *poll_handle;          /* poll to notify, NULL for none */
+    pthread_mutex_t poll_mutex;
+    unsigned (*poll)(void *userdata);   /* POLL* events of the open */
+    void (*interrupt)(void *userdata);  /* a parked request's client got a signal */
+    struct cuse_replies *replies;       /* served without a callback */
+    struct cuse_replies *(*probe)(struct cuse_codec *node); /* work them out */
     void* priv;
     int (*init)(void *userdata);
     void (*deinit)(void *userdata);
+    int (*save)(void *userdata, struct cuse_state *state);      /* hand the open over */
+    int (*restore)(void *userdata, struct cuse_state *state);   /* take one over, after init */
+    uint32_t (*state_version)(void);    /* handoff version of what save puts */
     struct cuse_ioctl* ioctls;
     int num_ioctls;
 };
@@ -17,3 +68,83 @@ struct cuse_codec {
 
 int initcodec(struct cuse_codec* codec, int argc, char **argv);
 
+/*
+ * Copy from or to the memory of the client whose ioctl is being served, for
+ * pointers nested in ioctl args like userptr buffers. Returns 0 on success.
+ */
+void cuse_set_client(pid_t pid);
+pid_t cuse_get_client(void);
+int cuse_read_client(void *dst, unsigned long src, size_t size);
+int cuse_write_client(unsigned long dst, const void *src, size_t size);
+
+/* Client reads a single retry can bring in, fuse allows up to 256 iovecs */
+#define CUSE_CLIENT_MAX_IOV     32
+
+/*
+ * Reads of a client the daemon can't ptrace fail with EFAULT, and the
+ * regions they wanted are retried through the kernel: the ioctl comes again
+ * with them copied in after its arg, which is what gets set here for the
+ * reads to take in order. NULL for an ioctl that isn't such a retry. The
+ * kernel takes up to max_pages of the fuse connection that way, bigger
+ * packets need the ptrace access.
+ */
+void cuse_set_client_in(const void *buf, size_t size);
+
+/*
+ * The regions of client memory to retry the ioctl with, after its arg, or
+ * 0 when its reads didn't run short.
+ */
+int cuse_get_client_retry(struct iovec *iov, int max);
+
+/*
+ * Duplicate an fd of the client whose ioctl is being served into the daemon,
+ * for dma-bufs. The client may be any thread of its process. Returns the
+ * new fd, or -1 with errno set.
+ */
+int cuse_get_client_fd(int fd);
+
+/*
+ * Process of the client thread whose ioctl is being served, ours in
+ * process. Returns -1 with errno set when it's gone.
+ */
+pid_t cuse_get_client_tgid(void);
+
+/*
+ * File status flags the client process has path open with, which an ioctl
+ * doesn't carry. Returns -1 with errno set when it has no open of it, or
+ * several with different flags.
+ */
+int cuse_get_client_flags(const char *path);
+
+/*
+ * Pin a thread to the cpus of the mask, 0 leaving it as is, and run it
+ * SCHED_FIFO at prio when it's not 0. Returns 0 on success.
+ */
+int cuse_set_thread_sched(pthread_t thread, uint64_t cpus, int prio);
+
+/*
+ * Keep the ioctl this thread is serving open past its callback, which then
+ * returns CUSE_IOCTL_PARKED. NULL when it can't be, in process, and the
+ * callback has to block instead. An interrupt of the client calls the
+ * interrupt op of the open, which completes the request if it's still
+ * parked.
+ */
+struct cuse_request *cuse_park_request(void);
+
+/* The client of a request not completed yet was interrupted */
+bool cuse_request_interrupted(struct cuse_request *request);
+
+/* Reply to a parked ioctl with out_buf, or with err when it's not 0 */
+void cuse_complete_request(struct cuse_request *request, int err, const void *out_buf,
+        size_t size);
+
+/*
+ * The file of the ioctl being served is O_NONBLOCK now, which may have
+ * been set after its open. What it was opened with when that can't be told.
+ */
+bool cuse_request_nonblock(struct cuse_codec *codec);
+
+/* Wake up the poll of an open, its events changed */
+void cuse_notify_poll(struct cuse_codec *codec);
+
+#endif /* SRC_CUSEDEV_H_ */
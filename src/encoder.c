@@ -0,0 +1,282 @@
+/*
+ * encoder.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Mpp encoder of transcoding sessions. Decoded frames are fed to it by their
+ * drm buffers and the packets are written straight into the client buffers,
+ * so frames never leave the vpu's memory on the way.
+ */
+#include <errno.h>
+#include <stdlib.h>
+
+#include "encoder.h"
+#include "logger.h"
+#include "utils.h"
+
+bool rkmpp_encoder_supported(MppCodingType type) {
+    return mpp_check_support_format(MPP_CTX_ENC, type) == MPP_OK;
+}
+
+/* The strides can change with every info change of the decoder */
+static int rkmpp_encoder_set_strides(struct rkmpp_encoder *enc, uint32_t hor_stride,
+        uint32_t ver_stride) {
+    mpp_enc_cfg_set_s32(enc->cfg, "prep:hor_stride", hor_stride);
+    mpp_enc_cfg_set_s32(enc->cfg, "prep:ver_stride", ver_stride);
+
+    if (enc->mpi->control(enc->mpp, MPP_ENC_SET_CFG, enc->cfg) != MPP_OK) {
+        LOGE("failed to set encoder strides: %dx%d\n", hor_stride, ver_stride);
+        return -1;
+    }
+
+    enc->hor_stride = hor_stride;
+    enc->ver_stride = ver_stride;
+    return 0;
+}
+
+/* The usual bits per pixel of a hardware encoder at its default quality */
+static void rkmpp_encoder_set_rc(struct rkmpp_encoder *enc, uint32_t fps) {
+    uint32_t bitrate = enc->bitrate ? enc->bitrate : enc->width * enc->height / 8 * fps;
+
+    mpp_enc_cfg_set_s32(enc->cfg, "rc:bps_target", bitrate);
+    mpp_enc_cfg_set_s32(enc->cfg, "rc:bps_max", bitrate / 16 * 17);
+    mpp_enc_cfg_set_s32(enc->cfg, "rc:bps_min", bitrate / 16 * 15);
+    mpp_enc_cfg_set_s32(enc->cfg, "rc:fps_in_flex", 0);
+    mpp_enc_cfg_set_s32(enc->cfg, "rc:fps_in_num", fps);
+    mpp_enc_cfg_set_s32(enc->cfg, "rc:fps_in_denom", 1);
+    mpp_enc_cfg_set_s32(enc->cfg, "rc:fps_out_flex", 0);
+    mpp_enc_cfg_set_s32(enc->cfg, "rc:fps_out_num", fps);
+    mpp_enc_cfg_set_s32(enc->cfg, "rc:fps_out_denom", 1);
+}
+
+int rkmpp_encoder_set_fps(struct rkmpp_encoder *enc, uint32_t fps) {
+    uint32_t drift = max(enc->fps / 16, 1);
+
+    if (!fps || (fps + drift >= enc->fps && fps <= enc->fps + drift))
+        return 0;
+
+    rkmpp_encoder_set_rc(enc, fps);
+    if (enc->mpi->control(enc->mpp, MPP_ENC_SET_CFG, enc->cfg) != MPP_OK) {
+        LOGE("failed to set encoder rate: %d fps\n", fps);
+        return -1;
+    }
+
+    LOGV(1, "encoder: %d fps, was %d\n", fps, enc->fps);
+
+    enc->fps = fps;
+    return 0;
+}
+
+struct rkmpp_encoder *rkmpp_encoder_create(MppCodingType type, uint32_t width,
+        uint32_t height, uint32_t fps, uint32_t bitrate, uint32_t gop) {
+    MppEncHeaderMode header_mode = MPP_ENC_HEADER_MODE_EACH_IDR;
+    MppPollType timeout = RKMPP_ENCODER_TIMEOUT_MS;
+    struct rkmpp_encoder *enc;
+
+    enc = calloc(1, sizeof(*enc));
+    if (!enc)
+        return NULL;
+
+    enc->type = type;
+    enc->fps = max(fps, 1);
+    enc->bitrate = bitrate;
+    enc->width = width;
+    enc->height = height;
+    enc->hor_stride = round_up(width, 16);
+    enc->ver_stride = round_up(height, 16);
+
+    if (mpp_create(&enc->mpp, &enc->mpi) != MPP_OK) {
+        LOGE("failed to create encoder\n");
+        enc->mpp = NULL;
+        goto err;
+    }
+
+    /* A hung encoder fails its frame instead of holding the decoder thread */
+    enc->mpi->control(enc->mpp, MPP_SET_INPUT_TIMEOUT, &timeout);
+    enc->mpi->control(enc->mpp, MPP_SET_OUTPUT_TIMEOUT, &timeout);
+
+    if (mpp_init(enc->mpp, MPP_CTX_ENC, type) != MPP_OK) {
+        LOGE("failed to init encoder of coding %x\n", type);
+        goto err;
+    }
+
+    if (mpp_enc_cfg_init(&enc->cfg) != MPP_OK) {
+        enc->cfg = NULL;
+        goto err;
+    }
+
+    enc->mpi->control(enc->mpp, MPP_ENC_GET_CFG, enc->cfg);
+
+    mpp_enc_cfg_set_s32(enc->cfg, "prep:width", width);
+    mpp_enc_cfg_set_s32(enc->cfg, "prep:height", height);
+    mpp_enc_cfg_set_s32(enc->cfg, "prep:hor_stride", enc->hor_stride);
+    mpp_enc_cfg_set_s32(enc->cfg, "prep:ver_stride", enc->ver_stride);
+    mpp_enc_cfg_set_s32(enc->cfg, "prep:format", MPP_FMT_YUV420SP);
+
+    mpp_enc_cfg_set_s32(enc->cfg, "rc:mode", MPP_ENC_RC_MODE_CBR);
+    rkmpp_encoder_set_rc(enc, enc->fps);
+    mpp_enc_cfg_set_s32(enc->cfg, "rc:gop", gop);
+
+    mpp_enc_cfg_set_s32(enc->cfg, "codec:type", type);
+    if (type == MPP_VIDEO_CodingAVC) {
+        /* High profile, level 4.0 */
+        mpp_enc_cfg_set_s32(enc->cfg, "h264:profile", 100);
+        mpp_enc_cfg_set_s32(enc->cfg, "h264:level", 40);
+        mpp_enc_cfg_set_s32(enc->cfg, "h264:cabac_en", 1);
+        mpp_enc_cfg_set_s32(enc->cfg, "h264:cabac_idc", 0);
+    }
+
+    if (enc->mpi->control(enc->mpp, MPP_ENC_SET_CFG, enc->cfg) != MPP_OK) {
+        LOGE("failed to configure encoder: %dx%d %d fps %d bps\n", width, height,
+                enc->fps, bitrate);
+        goto err;
+    }
+
+    /* Every idr can be decoded on its own, streams may be cut anywhere */
+    enc->mpi->control(enc->mpp, MPP_ENC_SET_HEADER_MODE, &header_mode);
+
+    LOGV(1, "encoder: coding %x %dx%d %d fps %d bps gop %d\n", type, width, height,
+            enc->fps, bitrate, gop);
+
+    return enc;
+err:
+    rkmpp_encoder_destroy(enc);
+    errno = ENODEV;
+    return NULL;
+}
+
+void rkmpp_encoder_destroy(struct rkmpp_encoder *enc) {
+    if (!enc)
+        return;
+
+    if (enc->mpp) {
+        enc->mpi->reset(enc->mpp);
+        mpp_destroy(enc->mpp);
+    }
+
+    if (enc->cfg)
+        mpp_enc_cfg_deinit(enc->cfg);
+
+    if (enc->scaled)
+        mpp_buffer_put(enc->scaled);
+    if (enc->group)
+        mpp_buffer_group_put(enc->group);
+
+    free(enc);
+}
+
+size_t rkmpp_encoder_mem(struct rkmpp_encoder *enc) {
+    return enc->scaled ? mpp_buffer_get_size(enc->scaled) : 0;
+}
+
+/* Scale a frame of another size, or 4:2:2, into the frame kept for it */
+static int rkmpp_encoder_scale(struct rkmpp_encoder *enc, const struct rkmpp_image *src) {
+    uint32_t hor_stride = round_up(enc->width, 16);
+    uint32_t ver_stride = round_up(enc->height, 16);
+    struct rkmpp_image dst;
+    int ret;
+
+    if (!enc->scaled) {
+        if (mpp_buffer_group_get_internal(&enc->group, MPP_BUFFER_TYPE_DRM) != MPP_OK) {
+            enc->group = NULL;
+            return -1;
+        }
+
+        if (mpp_buffer_get(enc->group, &enc->scaled, hor_stride * ver_stride * 3 / 2)) {
+            LOGE("failed to alloc scaled frame\n");
+            enc->scaled = NULL;
+            return -1;
+        }
+    }
+
+    dst = (struct rkmpp_image) {
+        .ptr = mpp_buffer_get_ptr(enc->scaled),
+        .fd = mpp_buffer_get_fd(enc->scaled),
+        .width = enc->width,
+        .height = enc->height,
+        .hor_stride = hor_stride,
+        .ver_stride = ver_stride,
+    };
+
+    mpp_buffer_sync_begin(enc->scaled);
+    ret = rkmpp_image_scale_nv12(src, &dst);
+    mpp_buffer_sync_end(enc->scaled);
+
+    return ret;
+}
+
+ssize_t rkmpp_encoder_encode(struct rkmpp_encoder *enc, const struct rkmpp_image *src,
+        MppBuffer src_buf, int64_t pts, MppBuffer out, bool *keyframe) {
+    MppFrame frame = NULL;
+    MppPacket packet = NULL, encoded = NULL;
+    MppBuffer buffer = src_buf;
+    uint32_t hor_stride = src->hor_stride;
+    uint32_t ver_stride = src->ver_stride;
+    RK_S32 intra = 0;
+    ssize_t length = -1;
+    MPP_RET ret;
+
+    /* Frames of the encoded size go by reference, the rest through the scaler */
+    if (src->width != enc->width || src->height != enc->height || src->uv_stride) {
+        if (rkmpp_encoder_scale(enc, src)) {
+            LOGE("failed to scale frame for encoder\n");
+            return -1;
+        }
+
+        buffer = enc->scaled;
+        hor_stride = round_up(enc->width, 16);
+        ver_stride = round_up(enc->height, 16);
+    }
+
+    if ((hor_stride != enc->hor_stride || ver_stride != enc->ver_stride) &&
+            rkmpp_encoder_set_strides(enc, hor_stride, ver_stride))
+        return -1;
+
+    if (mpp_frame_init(&frame) != MPP_OK)
+        return -1;
+
+    mpp_frame_set_width(frame, enc->width);
+    mpp_frame_set_height(frame, enc->height);
+    mpp_frame_set_hor_stride(frame, hor_stride);
+    mpp_frame_set_ver_stride(frame, ver_stride);
+    mpp_frame_set_fmt(frame, MPP_FMT_YUV420SP);
+    mpp_frame_set_buffer(frame, buffer);
+    mpp_frame_set_pts(frame, pts);
+
+    /* The packet is written into the client buffer, not copied there */
+    if (mpp_packet_init_with_buffer(&packet, out) != MPP_OK) {
+        packet = NULL;
+        goto out;
+    }
+    mpp_packet_set_length(packet, 0);
+    mpp_meta_set_packet(mpp_frame_get_meta(frame), KEY_OUTPUT_PACKET, packet);
+
+    ret = enc->mpi->encode_put_frame(enc->mpp, frame);
+    if (ret != MPP_OK) {
+        LOGE("failed to put frame(%lld) to encoder\n", (long long) pts);
+        errno = ret == MPP_ERR_TIMEOUT ? ETIMEDOUT : EIO;
+        goto out;
+    }
+
+    ret = enc->mpi->encode_get_packet(enc->mpp, &encoded);
+    if (ret != MPP_OK || !encoded) {
+        LOGE("failed to get packet of frame(%lld)\n", (long long) pts);
+        errno = ret == MPP_OK || ret == MPP_ERR_TIMEOUT ? ETIMEDOUT : EIO;
+        goto out;
+    }
+
+    length = mpp_packet_get_length(encoded);
+    mpp_meta_get_s32(mpp_packet_get_meta(encoded), KEY_OUTPUT_INTRA, &intra);
+    *keyframe = intra;
+
+    LOGV(3, "encoded frame(%lld): %zd bytes%s\n", (long long) pts, length,
+            intra ? ", idr" : "");
+out:
+    if (encoded && encoded != packet)
+        mpp_packet_deinit(&encoded);
+    if (packet)
+        mpp_packet_deinit(&packet);
+    mpp_frame_deinit(&frame);
+    return length;
+}
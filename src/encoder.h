@@ -0,0 +1,85 @@
+/*
+ * encoder.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ */
+
+#ifndef SRC_ENCODER_H_
+#define SRC_ENCODER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <rockchip/rk_mpi.h>
+
+#include "imgproc.h"
+
+/* Longest wait for the encoder to take a frame or give its packet */
+#define RKMPP_ENCODER_TIMEOUT_MS    200
+
+/**
+ * struct rkmpp_encoder - Mpp encoder re-encoding decoded frames
+ * @mpp:        Mpp context.
+ * @mpi:        Mpp api.
+ * @cfg:        Encoder config, kept to change the input strides.
+ * @type:       Coding of the encoded stream.
+ * @fps:        Frame rate the rate control is set for.
+ * @bitrate:    Bits per second asked for, 0 to follow the size and rate.
+ * @width:      Encoded width.
+ * @height:     Encoded height.
+ * @hor_stride: Bytes per line of the frames being fed.
+ * @ver_stride: Lines of the frames being fed.
+ * @scaled:     Frame scaled to the encoded size, NULL until one is needed.
+ * @group:      Group of the scaled frame.
+ */
+struct rkmpp_encoder {
+    MppCtx mpp;
+    MppApi *mpi;
+    MppEncCfg cfg;
+
+    MppCodingType type;
+    uint32_t fps;
+    uint32_t bitrate;
+    uint32_t width;
+    uint32_t height;
+    uint32_t hor_stride;
+    uint32_t ver_stride;
+
+    MppBuffer scaled;
+    MppBufferGroup group;
+};
+
+/* Whether the vpu encodes the given coding */
+bool rkmpp_encoder_supported(MppCodingType type);
+
+/*
+ * Create an encoder of width x height frames coming at fps, at bitrate bits
+ * per second, 0 picks one from the size and rate, with a keyframe every gop
+ * frames. Returns NULL with errno set on failure.
+ */
+struct rkmpp_encoder *rkmpp_encoder_create(MppCodingType type, uint32_t width,
+        uint32_t height, uint32_t fps, uint32_t bitrate, uint32_t gop);
+void rkmpp_encoder_destroy(struct rkmpp_encoder *enc);
+
+/*
+ * Follow the frame rate of the stream, which the rate control spreads the
+ * bits over. Small drifts are left alone. Returns -1 on failure.
+ */
+int rkmpp_encoder_set_fps(struct rkmpp_encoder *enc, uint32_t fps);
+
+/* Drm memory held by the encoder for scaling */
+size_t rkmpp_encoder_mem(struct rkmpp_encoder *enc);
+
+/*
+ * Encode the NV12 image of the mpp buffer src_buf into the mpp buffer out,
+ * by reference when it already has the encoded size and scaled otherwise.
+ * Returns the length of the packet, with keyframe telling whether it's an
+ * idr, or -1 with errno set on failure. ETIMEDOUT is an encoder that may
+ * still write the packet into out, until it's destroyed.
+ */
+ssize_t rkmpp_encoder_encode(struct rkmpp_encoder *enc, const struct rkmpp_image *src,
+        MppBuffer src_buf, int64_t pts, MppBuffer out, bool *keyframe);
+
+#endif /* SRC_ENCODER_H_ */
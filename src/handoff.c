@@ -0,0 +1,372 @@
+/*
+ * handoff.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "handoff.h"
+#include "logger.h"
+#include "utils.h"
+
+/* Fds of one message, under the SCM_MAX_FD of the kernel */
+#define CUSE_STATE_FDS_PER_MSG  250
+
+/* Sanity limits of a received state */
+#define CUSE_STATE_MAX_LEN      (256 << 20)
+#define CUSE_STATE_MAX_FDS      65536
+
+/**
+ * struct cuse_state_header - Leads the state on the socket
+ * @magic:      CUSE_HANDOFF_MAGIC.
+ * @version:    Handoff version of the sender.
+ * @len:        Bytes of the state.
+ * @num_fds:    Fds of the state, sent after it.
+ */
+struct cuse_state_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t len;
+    uint32_t num_fds;
+};
+
+/* FNV-1a of the sizes, as 64 bits whatever the build */
+uint32_t cuse_handoff_version(uint32_t version, const size_t *sizes, unsigned int num) {
+    uint32_t hash = 2166136261u ^ version;
+    uint64_t size;
+
+    for (unsigned int i = 0; i < num; i++) {
+        size = sizes[i];
+        for (unsigned int j = 0; j < sizeof(size); j++)
+            hash = (hash ^ (uint8_t) (size >> (j * 8))) * 16777619u;
+    }
+
+    return hash;
+}
+
+void cuse_state_init(struct cuse_state *state) {
+    memset(state, 0, sizeof(*state));
+}
+
+void cuse_state_free(struct cuse_state *state) {
+    for (uint32_t i = 0; i < state->num_fds; i++) {
+        if (state->fds[i] >= 0)
+            close(state->fds[i]);
+    }
+
+    free(state->fds);
+    free(state->data);
+    cuse_state_init(state);
+}
+
+void cuse_state_put(struct cuse_state *state, const void *data, size_t size) {
+    size_t room;
+    uint8_t *tmp;
+
+    if (state->error)
+        return;
+
+    if (state->len + size > state->room) {
+        room = max(state->room * 2, state->len + size + 4096);
+        tmp = realloc(state->data, room);
+        if (!tmp) {
+            state->error = true;
+            return;
+        }
+        state->data = tmp;
+        state->room = room;
+    }
+
+    memcpy(state->data + state->len, data, size);
+    state->len += size;
+}
+
+bool cuse_state_get(struct cuse_state *state, void *data, size_t size) {
+    if (state->error || state->len - state->pos < size) {
+        state->error = true;
+        memset(data, 0, size);
+        return false;
+    }
+
+    memcpy(data, state->data + state->pos, size);
+    state->pos += size;
+    return true;
+}
+
+void cuse_state_put_fd(struct cuse_state *state, int fd) {
+    int32_t slot = -1;
+    uint32_t room;
+    int *tmp;
+
+    if (fd >= 0 && !state->error) {
+        if (state->num_fds == state->room_fds) {
+            room = state->room_fds * 2 + 64;
+            tmp = realloc(state->fds, room * sizeof(*tmp));
+            if (!tmp) {
+                state->error = true;
+                return;
+            }
+            state->fds = tmp;
+            state->room_fds = room;
+        }
+
+        /* The session may close its own before the state is sent */
+        state->fds[state->num_fds] = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (state->fds[state->num_fds] < 0) {
+            LOGE("failed to dup fd %d: %s\n", fd, strerror(errno));
+            state->error = true;
+            return;
+        }
+        slot = state->num_fds++;
+    }
+
+    cuse_state_put(state, &slot, sizeof(slot));
+}
+
+int cuse_state_get_fd(struct cuse_state *state) {
+    int32_t slot;
+    int fd;
+
+    if (!cuse_state_get(state, &slot, sizeof(slot)) || slot < 0)
+        return -1;
+
+    if ((uint32_t) slot >= state->num_fds || state->fds[slot] < 0) {
+        state->error = true;
+        return -1;
+    }
+
+    fd = state->fds[slot];
+    state->fds[slot] = -1;
+    return fd;
+}
+
+void cuse_state_put_state(struct cuse_state *state, const struct cuse_state *sub) {
+    uint64_t len = sub->len;
+    uint32_t num_fds = sub->num_fds;
+
+    if (sub->error) {
+        state->error = true;
+        return;
+    }
+
+    cuse_state_put(state, &len, sizeof(len));
+    cuse_state_put(state, sub->data, sub->len);
+    cuse_state_put(state, &num_fds, sizeof(num_fds));
+    for (uint32_t i = 0; i < num_fds; i++)
+        cuse_state_put_fd(state, sub->fds[i]);
+}
+
+bool cuse_state_get_state(struct cuse_state *state, struct cuse_state *sub) {
+    uint64_t len;
+    uint32_t num_fds;
+
+    cuse_state_init(sub);
+
+    if (!cuse_state_get(state, &len, sizeof(len)) || len > state->len - state->pos) {
+        state->error = true;
+        return false;
+    }
+
+    sub->data = malloc(max(len, 1));
+    if (!sub->data) {
+        state->error = true;
+        return false;
+    }
+    cuse_state_get(state, sub->data, len);
+    sub->len = sub->room = len;
+
+    if (!cuse_state_get(state, &num_fds, sizeof(num_fds)) || num_fds > state->num_fds)
+        goto err;
+
+    sub->fds = malloc(max(num_fds, 1) * sizeof(int));
+    if (!sub->fds)
+        goto err;
+    sub->room_fds = num_fds;
+
+    /* A missing fd stays a hole, the sub state tells which it had */
+    for (; sub->num_fds < num_fds; sub->num_fds++)
+        sub->fds[sub->num_fds] = cuse_state_get_fd(state);
+
+    if (state->error)
+        goto err;
+
+    return true;
+
+err:
+    state->error = true;
+    cuse_state_free(sub);
+    return false;
+}
+
+static int cuse_state_write(int sock, const void *data, size_t size) {
+    const uint8_t *ptr = data;
+    ssize_t ret;
+
+    while (size) {
+        ret = send(sock, ptr, size, MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+
+        ptr += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+static int cuse_state_read(int sock, void *data, size_t size) {
+    uint8_t *ptr = data;
+    ssize_t ret;
+
+    while (size) {
+        ret = recv(sock, ptr, size, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            if (!ret)
+                errno = EPIPE;
+            return -1;
+        }
+
+        ptr += ret;
+        size -= ret;
+    }
+
+    return 0;
+}
+
+int cuse_state_send(int sock, const struct cuse_state *state, uint32_t version) {
+    struct cuse_state_header header = {
+        .magic = CUSE_HANDOFF_MAGIC,
+        .version = version,
+        .len = state->len,
+        .num_fds = state->num_fds,
+    };
+    char control[CMSG_SPACE(CUSE_STATE_FDS_PER_MSG * sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    uint32_t i, num;
+    char byte = 0;
+
+    if (state->error)
+        RETURN_ERR(ENOMEM, -1);
+
+    if (cuse_state_write(sock, &header, sizeof(header)) ||
+            cuse_state_write(sock, state->data, state->len))
+        return -1;
+
+    /* Each batch of fds rides on a byte of its own */
+    for (i = 0; i < state->num_fds; i += num) {
+        num = min(state->num_fds - i, CUSE_STATE_FDS_PER_MSG);
+
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(num * sizeof(int));
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(num * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), state->fds + i, num * sizeof(int));
+
+        while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+            if (errno != EINTR)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+int cuse_state_recv(int sock, struct cuse_state *state, uint32_t version) {
+    struct cuse_state_header header;
+    char control[CMSG_SPACE(CUSE_STATE_FDS_PER_MSG * sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    uint32_t num;
+    ssize_t ret;
+    char byte;
+
+    cuse_state_init(state);
+
+    if (cuse_state_read(sock, &header, sizeof(header)))
+        return -1;
+
+    if (header.magic != CUSE_HANDOFF_MAGIC || header.version != version ||
+            header.len > CUSE_STATE_MAX_LEN || header.num_fds > CUSE_STATE_MAX_FDS) {
+        LOGE("invalid handoff state: version %#x, ours %#x, %" PRIu64 " bytes, %u fds\n",
+                header.version, version, header.len, header.num_fds);
+        RETURN_ERR(EPROTO, -1);
+    }
+
+    state->data = malloc(max(header.len, 1));
+    state->fds = malloc(max(header.num_fds, 1) * sizeof(int));
+    if (!state->data || !state->fds) {
+        cuse_state_free(state);
+        RETURN_ERR(ENOMEM, -1);
+    }
+    state->room = header.len;
+    state->room_fds = header.num_fds;
+
+    if (cuse_state_read(sock, state->data, header.len))
+        goto err;
+    state->len = header.len;
+
+    while (state->num_fds < header.num_fds) {
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base = &byte;
+        iov.iov_len = 1;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            goto err;
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            goto err_proto;
+
+        num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (num > header.num_fds - state->num_fds) {
+            /* Only what was taken is ours to close */
+            for (uint32_t i = 0; i < num; i++)
+                close(((int *) CMSG_DATA(cmsg))[i]);
+            goto err_proto;
+        }
+
+        memcpy(state->fds + state->num_fds, CMSG_DATA(cmsg), num * sizeof(int));
+        state->num_fds += num;
+
+        if (msg.msg_flags & MSG_CTRUNC)
+            goto err_proto;
+    }
+
+    return 0;
+
+err_proto:
+    errno = EPROTO;
+err:
+    LOGE("failed to receive handoff state: %s\n", strerror(errno));
+    cuse_state_free(state);
+    return -1;
+}
@@ -0,0 +1,95 @@
+/*
+ * handoff.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * State a daemon hands over to the one taking its place, and the unix socket
+ * it goes over. The state is a byte stream written and read back in the same
+ * order, with the fds that go with it passed as SCM_RIGHTS.
+ */
+
+#ifndef SRC_HANDOFF_H_
+#define SRC_HANDOFF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CUSE_HANDOFF_MAGIC      0x46464f48 /* "HOFF" */
+
+/* Bumped with any change of what is handed over, daemons only hand to their own */
+#define CUSE_HANDOFF_VERSION    1
+
+/**
+ * struct cuse_handoff_hello - Sent by the daemon taking over on connecting
+ * @magic:      CUSE_HANDOFF_MAGIC.
+ * @version:    Handoff version of the daemon, see cuse_handoff_version.
+ */
+struct cuse_handoff_hello {
+    uint32_t magic;
+    uint32_t version;
+};
+
+/**
+ * struct cuse_state - Serialized state and its fds
+ * @data:       Bytes of the state.
+ * @len:        Bytes written.
+ * @pos:        Bytes read back.
+ * @room:       Room of data.
+ * @fds:        Fds of the state, referred to from the data by their slot.
+ * @num_fds:    Number of fds.
+ * @room_fds:   Room of fds.
+ * @error:      A put or get failed, the ones after it do nothing.
+ */
+struct cuse_state {
+    uint8_t *data;
+    size_t len;
+    size_t pos;
+    size_t room;
+
+    int *fds;
+    uint32_t num_fds;
+    uint32_t room_fds;
+
+    bool error;
+};
+
+/*
+ * Mix the sizes of structs handed over as they are into a handoff version,
+ * CUSE_HANDOFF_VERSION to begin with. Another build may lay them out
+ * differently without it being bumped, both ends check the result.
+ */
+uint32_t cuse_handoff_version(uint32_t version, const size_t *sizes, unsigned int num);
+
+void cuse_state_init(struct cuse_state *state);
+
+/* Free the state, closing the fds nobody took */
+void cuse_state_free(struct cuse_state *state);
+
+void cuse_state_put(struct cuse_state *state, const void *data, size_t size);
+
+/* Read the next size bytes back, false when there aren't as many */
+bool cuse_state_get(struct cuse_state *state, void *data, size_t size);
+
+/* A copy of fd goes with the state, -1 for none */
+void cuse_state_put_fd(struct cuse_state *state, int fd);
+
+/* Take the fd put in this place over, -1 for none */
+int cuse_state_get_fd(struct cuse_state *state);
+
+/*
+ * Put a state of its own into the state, as one piece a failure of the other
+ * half doesn't spill over from. Get it back into sub, for the caller to free.
+ */
+void cuse_state_put_state(struct cuse_state *state, const struct cuse_state *sub);
+bool cuse_state_get_state(struct cuse_state *state, struct cuse_state *sub);
+
+/*
+ * Send or receive the state over a unix socket, a state of another handoff
+ * version is refused with EPROTO. Returns 0 on success.
+ */
+int cuse_state_send(int sock, const struct cuse_state *state, uint32_t version);
+int cuse_state_recv(int sock, struct cuse_state *state, uint32_t version);
+
+#endif /* SRC_HANDOFF_H_ */
@@ -0,0 +1,178 @@
+/*
+ * imgbench.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Times the capture copy stage, packing the visible rect of a padded NV12
+ * frame into each capture format in one pass, against what clients of
+ * padded frames do without it: crop the frame out of the capture buffer,
+ * then convert it with plain row loops like the libyuv C paths.
+ */
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imgproc.h"
+#include "trace.h"
+#include "utils.h"
+
+static const char *usage =
+"usage: mpp-v4l2m2m-imgbench [options]\n"
+"\n"
+"options:\n"
+"    -s WxH         visible size, 1920x1080 by default\n"
+"    -a ALIGN       stride alignment of the padded frame, 256 by default\n"
+"    -n FRAMES      frames of each run, 200 by default\n"
+"\n";
+
+static const uint32_t imgbench_fourccs[] = {
+    V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420, V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_RGB24,
+};
+
+static uint8_t imgbench_clamp(int v) {
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* Crop the visible rect out of a padded NV12 frame, as a client has to */
+static void imgbench_crop(const struct rkmpp_image *src, uint8_t *dst) {
+    const uint8_t *uv = src->ptr + src->hor_stride * src->ver_stride;
+    uint8_t *dst_uv = dst + src->width * src->height;
+
+    for (uint32_t y = 0; y < src->height; y++)
+        memcpy(dst + y * src->width, src->ptr + y * src->hor_stride, src->width);
+    for (uint32_t y = 0; y < src->height / 2; y++)
+        memcpy(dst_uv + y * src->width, uv + y * src->hor_stride, src->width);
+}
+
+/* Convert a packed NV12 frame row by row, the way libyuv's C fallbacks do */
+static void imgbench_convert(const uint8_t *src, uint32_t width, uint32_t height,
+        uint8_t *dst, uint32_t fourcc) {
+    const uint8_t *uv = src + width * height;
+
+    switch (fourcc) {
+    case V4L2_PIX_FMT_YUV420:
+        memcpy(dst, src, width * height);
+        for (uint32_t i = 0; i < width * height / 4; i++) {
+            dst[width * height + i] = uv[i * 2];
+            dst[width * height * 5 / 4 + i] = uv[i * 2 + 1];
+        }
+        break;
+    case V4L2_PIX_FMT_YUYV:
+        for (uint32_t y = 0; y < height; y++) {
+            const uint8_t *row = src + y * width, *c = uv + y / 2 * width;
+            uint8_t *out = dst + y * width * 2;
+
+            for (uint32_t x = 0; x < width; x += 2) {
+                out[x * 2] = row[x];
+                out[x * 2 + 1] = c[x];
+                out[x * 2 + 2] = row[x + 1];
+                out[x * 2 + 3] = c[x + 1];
+            }
+        }
+        break;
+    case V4L2_PIX_FMT_RGB24:
+        /* BT.601 limited range in 8.8 fixed point */
+        for (uint32_t y = 0; y < height; y++) {
+            const uint8_t *row = src + y * width, *c = uv + y / 2 * width;
+            uint8_t *out = dst + y * width * 3;
+
+            for (uint32_t x = 0; x < width; x++) {
+                int l = (row[x] - 16) * 298, u = c[x & ~1] - 128, v = c[x | 1] - 128;
+
+                out[x * 3] = imgbench_clamp((l + 409 * v + 128) >> 8);
+                out[x * 3 + 1] = imgbench_clamp((l - 100 * u - 208 * v + 128) >> 8);
+                out[x * 3 + 2] = imgbench_clamp((l + 516 * u + 128) >> 8);
+            }
+        }
+        break;
+    default:
+        memcpy(dst, src, width * height * 3 / 2);
+        break;
+    }
+}
+
+static void imgbench_report(const char *name, uint32_t fourcc, unsigned frames,
+        uint64_t ns, uint32_t size) {
+    printf("%-10s %.4s: %7.3fms/frame %8.1fMB/s\n", name, (const char *) &fourcc,
+            ns / 1e6 / frames, (double) size * frames / (ns / 1e9) / 1e6);
+}
+
+int main(int argc, char **argv) {
+    struct rkmpp_image src = { .fd = -1 };
+    uint32_t width = 1920, height = 1080, align = 256;
+    unsigned frames = 200;
+    uint8_t *crop, *dst;
+    uint64_t start;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:a:n:h")) != -1) {
+        switch (opt) {
+        case 's':
+            if (sscanf(optarg, "%ux%u", &width, &height) != 2) {
+                fprintf(stderr, "%s", usage);
+                return 1;
+            }
+            break;
+        case 'a':
+            align = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            frames = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "%s", usage);
+            return opt != 'h';
+        }
+    }
+
+    /* Both paths work on 2x2 blocks */
+    width &= ~1;
+    height &= ~1;
+    if (!width || !height || !align || !frames) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+
+    src.width = width;
+    src.height = height;
+    src.hor_stride = (width + align - 1) / align * align;
+    src.ver_stride = (height + 15) / 16 * 16;
+
+    src.ptr = malloc(src.hor_stride * src.ver_stride * 3 / 2);
+    crop = malloc(width * height * 3 / 2);
+    dst = malloc(width * height * 3);
+    if (!src.ptr || !crop || !dst)
+        return 1;
+
+    /* Ramps keep every converter busy, all black frames would too little */
+    for (uint32_t i = 0; i < src.hor_stride * src.ver_stride * 3 / 2; i++)
+        src.ptr[i] = i * 7 + i / src.hor_stride;
+
+    printf("%ux%u in %ux%u, %u frames\n", width, height, src.hor_stride, src.ver_stride,
+            frames);
+
+    for (unsigned i = 0; i < ARRAY_SIZE(imgbench_fourccs); i++) {
+        uint32_t fourcc = imgbench_fourccs[i];
+        uint32_t size = rkmpp_image_size(fourcc, width, height);
+
+        start = rkmpp_trace_now();
+        for (unsigned n = 0; n < frames; n++)
+            rkmpp_image_convert_nv12(&src, dst, fourcc);
+        imgbench_report("stage", fourcc, frames, rkmpp_trace_now() - start, size);
+
+        start = rkmpp_trace_now();
+        for (unsigned n = 0; n < frames; n++) {
+            imgbench_crop(&src, crop);
+            imgbench_convert(crop, width, height, dst, fourcc);
+        }
+        imgbench_report("userspace", fourcc, frames, rkmpp_trace_now() - start, size);
+    }
+
+    free(dst);
+    free(crop);
+    free(src.ptr);
+    return 0;
+}
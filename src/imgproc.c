@@ -0,0 +1,640 @@
+/*
+ * imgproc.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#define HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef HAVE_RGA
+#include <rga/im2d.h>
+#include <rga/rga.h>
+#endif
+
+#include "imgproc.h"
+#include "logger.h"
+#include "utils.h"
+
+/**
+ * struct rkmpp_plane - One plane of an image
+ * @ptr:        Address of the first line.
+ * @width:      Width in pixels.
+ * @height:     Height in lines.
+ * @stride:     Bytes per line.
+ * @channels:   Interleaved bytes per pixel, 1 for luma and 2 for chroma.
+ */
+struct rkmpp_plane {
+    uint8_t *ptr;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    int channels;
+};
+
+#ifdef HAVE_NEON
+/* Rounded average of four vectors, widened so it rounds once like the C loop */
+static inline uint8x16_t rkmpp_avg4_u8(uint8x16_t a, uint8x16_t b, uint8x16_t c,
+        uint8x16_t d) {
+    uint16x8_t lo = vaddq_u16(vaddl_u8(vget_low_u8(a), vget_low_u8(b)),
+            vaddl_u8(vget_low_u8(c), vget_low_u8(d)));
+    uint16x8_t hi = vaddq_u16(vaddl_u8(vget_high_u8(a), vget_high_u8(b)),
+            vaddl_u8(vget_high_u8(c), vget_high_u8(d)));
+
+    return vcombine_u8(vrshrn_n_u16(lo, 2), vrshrn_n_u16(hi, 2));
+}
+#elif defined(HAVE_SSE2)
+/* Sums of the byte pairs of a line and the next, in 16 bit lanes */
+static inline __m128i rkmpp_sum4_epu8(__m128i a, __m128i b) {
+    const __m128i even = _mm_set1_epi16(0xff);
+
+    return _mm_add_epi16(_mm_add_epi16(_mm_and_si128(a, even), _mm_srli_epi16(a, 8)),
+            _mm_add_epi16(_mm_and_si128(b, even), _mm_srli_epi16(b, 8)));
+}
+#endif
+
+/* Average 2x2 blocks of two source lines into width destination pixels */
+static void rkmpp_halve_row(uint8_t *dst, const uint8_t *r0, const uint8_t *r1,
+        uint32_t width, int channels) {
+    uint32_t x = 0;
+
+#ifdef HAVE_NEON
+    if (channels == 1) {
+        for (; x + 16 <= width; x += 16) {
+            uint8x16x2_t a = vld2q_u8(r0 + x * 2);
+            uint8x16x2_t b = vld2q_u8(r1 + x * 2);
+
+            vst1q_u8(dst + x, rkmpp_avg4_u8(a.val[0], a.val[1], b.val[0], b.val[1]));
+        }
+    } else if (channels == 2) {
+        for (; x + 16 <= width; x += 16) {
+            uint8x16x4_t a = vld4q_u8(r0 + x * 4);
+            uint8x16x4_t b = vld4q_u8(r1 + x * 4);
+            uint8x16x2_t out;
+
+            out.val[0] = rkmpp_avg4_u8(a.val[0], a.val[2], b.val[0], b.val[2]);
+            out.val[1] = rkmpp_avg4_u8(a.val[1], a.val[3], b.val[1], b.val[3]);
+            vst2q_u8(dst + x * 2, out);
+        }
+    }
+#elif defined(HAVE_SSE2)
+    if (channels == 1) {
+        const __m128i round = _mm_set1_epi16(2);
+
+        for (; x + 16 <= width; x += 16) {
+            __m128i lo = rkmpp_sum4_epu8(_mm_loadu_si128((const __m128i *) (r0 + x * 2)),
+                    _mm_loadu_si128((const __m128i *) (r1 + x * 2)));
+            __m128i hi = rkmpp_sum4_epu8(_mm_loadu_si128((const __m128i *) (r0 + x * 2 + 16)),
+                    _mm_loadu_si128((const __m128i *) (r1 + x * 2 + 16)));
+
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 2);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 2);
+            _mm_storeu_si128((__m128i *) (dst + x), _mm_packus_epi16(lo, hi));
+        }
+    }
+#endif
+
+    for (; x < width; x++) {
+        for (int c = 0; c < channels; c++) {
+            uint32_t i = x * 2 * channels + c;
+
+            dst[x * channels + c] = (r0[i] + r0[i + channels] +
+                    r1[i] + r1[i + channels] + 2) >> 2;
+        }
+    }
+}
+
+/* Blend two lines, weight is the share of r1 in 1/128 units */
+static void rkmpp_blend_row(uint8_t *dst, const uint8_t *r0, const uint8_t *r1,
+        uint32_t size, uint8_t weight) {
+    uint32_t i = 0;
+
+#ifdef HAVE_NEON
+    uint8x8_t w0 = vdup_n_u8(128 - weight);
+    uint8x8_t w1 = vdup_n_u8(weight);
+
+    for (; i + 8 <= size; i += 8) {
+        uint16x8_t acc = vmull_u8(vld1_u8(r0 + i), w0);
+
+        acc = vmlal_u8(acc, vld1_u8(r1 + i), w1);
+        vst1_u8(dst + i, vrshrn_n_u16(acc, 7));
+    }
+#elif defined(HAVE_SSE2)
+    const __m128i w0 = _mm_set1_epi16(128 - weight);
+    const __m128i w1 = _mm_set1_epi16(weight);
+    const __m128i round = _mm_set1_epi16(64);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *) (r0 + i));
+        __m128i b = _mm_loadu_si128((const __m128i *) (r1 + i));
+        __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), w0),
+                _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), w1));
+        __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), w0),
+                _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), w1));
+
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 7);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 7);
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+
+    /* Plain loop, auto vectorized on other targets */
+    for (; i < size; i++)
+        dst[i] = (r0[i] * (128 - weight) + r1[i] * weight + 64) >> 7;
+}
+
+/* Position of the source sample for a destination pixel, in 1/128 units */
+static uint32_t rkmpp_sample_pos(uint32_t pos, uint32_t src_size, uint32_t dst_size) {
+    int64_t spos = ((int64_t) (2 * pos + 1) * src_size * 128) / (2 * dst_size) - 64;
+
+    return clamp(spos, 0, (int64_t) (src_size - 1) * 128);
+}
+
+/* Bilinear resampling, a vertical pass into a line buffer then horizontal */
+static int rkmpp_resample_plane(const struct rkmpp_plane *src, const struct rkmpp_plane *dst) {
+    int channels = src->channels;
+    uint8_t *row = malloc(src->width * channels);
+    uint32_t *xofs = malloc(dst->width * sizeof(*xofs));
+    uint8_t *xweight = malloc(dst->width);
+    uint32_t x, y;
+    int ret = -1;
+
+    if (!row || !xofs || !xweight)
+        goto out;
+
+    for (x = 0; x < dst->width; x++) {
+        uint32_t sx = rkmpp_sample_pos(x, src->width, dst->width);
+
+        xofs[x] = sx >> 7;
+        xweight[x] = sx & 127;
+    }
+
+    for (y = 0; y < dst->height; y++) {
+        uint32_t sy = rkmpp_sample_pos(y, src->height, dst->height);
+        uint32_t y0 = sy >> 7;
+        uint32_t y1 = min(y0 + 1, src->height - 1);
+        uint8_t *out = dst->ptr + y * dst->stride;
+
+        rkmpp_blend_row(row, src->ptr + y0 * src->stride,
+                src->ptr + y1 * src->stride, src->width * channels, sy & 127);
+
+        for (x = 0; x < dst->width; x++) {
+            const uint8_t *a = row + xofs[x] * channels;
+            const uint8_t *b = row + min(xofs[x] + 1, src->width - 1) * channels;
+            uint8_t w = xweight[x];
+
+            for (int c = 0; c < channels; c++)
+                out[x * channels + c] = (a[c] * (128 - w) + b[c] * w + 64) >> 7;
+        }
+    }
+
+    ret = 0;
+out:
+    free(xweight);
+    free(xofs);
+    free(row);
+    return ret;
+}
+
+static int rkmpp_scale_plane(const struct rkmpp_plane *src, const struct rkmpp_plane *dst) {
+    struct rkmpp_plane cur = *src;
+    uint8_t *tmp = NULL;
+    int ret;
+
+    /*
+     * Box filter down to less than twice the target size first, so that the
+     * bilinear pass doesn't skip source pixels. Halving works in place after
+     * the first pass, the lines written never overtake the lines read.
+     */
+    while (cur.width >= dst->width * 2 && cur.height >= dst->height * 2) {
+        struct rkmpp_plane half = {
+            .width = cur.width / 2,
+            .height = cur.height / 2,
+            .stride = cur.width / 2 * cur.channels,
+            .channels = cur.channels,
+        };
+
+        if (!tmp) {
+            tmp = malloc(half.stride * half.height);
+            if (!tmp)
+                return -1;
+        }
+        half.ptr = tmp;
+
+        for (uint32_t y = 0; y < half.height; y++)
+            rkmpp_halve_row(half.ptr + y * half.stride,
+                    cur.ptr + y * 2 * cur.stride,
+                    cur.ptr + (y * 2 + 1) * cur.stride,
+                    half.width, cur.channels);
+
+        cur = half;
+    }
+
+    ret = rkmpp_resample_plane(&cur, dst);
+
+    free(tmp);
+    return ret;
+}
+
+static uint32_t rkmpp_image_uv_stride(const struct rkmpp_image *image) {
+    return image->uv_stride ? image->uv_stride : image->hor_stride;
+}
+
+#ifdef HAVE_RGA
+static int rkmpp_rga_scale_nv12(const struct rkmpp_image *src, const struct rkmpp_image *dst) {
+    rga_buffer_t src_buf, dst_buf;
+    IM_STATUS ret;
+
+    if (src->fd < 0 || dst->fd < 0)
+        return -1;
+
+    src_buf = wrapbuffer_fd_t(src->fd, src->width, src->height,
+            src->hor_stride, src->ver_stride,
+            rkmpp_image_uv_stride(src) > src->hor_stride ?
+                    RK_FORMAT_YCbCr_422_SP : RK_FORMAT_YCbCr_420_SP);
+    dst_buf = wrapbuffer_fd_t(dst->fd, dst->width, dst->height,
+            dst->hor_stride, dst->ver_stride, RK_FORMAT_YCbCr_420_SP);
+
+    ret = imresize_t(src_buf, dst_buf, 0, 0, INTER_LINEAR, 1);
+    if (ret != IM_STATUS_SUCCESS) {
+        LOGV(2, "rga resize failed: %s\n", imStrError_t(ret));
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+int rkmpp_image_scale_nv12(const struct rkmpp_image *src, const struct rkmpp_image *dst) {
+    struct rkmpp_plane src_plane, dst_plane;
+
+    if (!src->width || !src->height || !dst->width || !dst->height ||
+            (dst->width | dst->height) & 1)
+        return -1;
+
+#ifdef HAVE_RGA
+    /* Rga has limits on the scaling ratio, use software beyond those */
+    if (!rkmpp_rga_scale_nv12(src, dst))
+        return 0;
+#endif
+
+    src_plane = (struct rkmpp_plane) {
+        src->ptr, src->width, src->height, src->hor_stride, 1
+    };
+    dst_plane = (struct rkmpp_plane) {
+        dst->ptr, dst->width, dst->height, dst->hor_stride, 1
+    };
+    if (rkmpp_scale_plane(&src_plane, &dst_plane))
+        return -1;
+
+    src_plane = (struct rkmpp_plane) {
+        src->ptr + src->hor_stride * src->ver_stride,
+        src->width / 2, src->height / 2, rkmpp_image_uv_stride(src), 2
+    };
+    dst_plane = (struct rkmpp_plane) {
+        dst->ptr + dst->hor_stride * dst->ver_stride,
+        dst->width / 2, dst->height / 2, dst->hor_stride, 2
+    };
+    return rkmpp_scale_plane(&src_plane, &dst_plane);
+}
+
+uint32_t rkmpp_image_bytesperline(uint32_t fourcc, uint32_t width) {
+    switch (fourcc) {
+    case V4L2_PIX_FMT_NV15:
+        return (width * 10 + 7) / 8;
+    case V4L2_PIX_FMT_YUYV:
+        return width * 2;
+    case V4L2_PIX_FMT_RGB24:
+        return width * 3;
+    default:
+        return width;
+    }
+}
+
+uint32_t rkmpp_image_size(uint32_t fourcc, uint32_t width, uint32_t height) {
+    switch (fourcc) {
+    case V4L2_PIX_FMT_NV15:
+        return rkmpp_image_bytesperline(fourcc, width) * height * 3 / 2;
+    case V4L2_PIX_FMT_NV12:
+    case V4L2_PIX_FMT_YUV420:
+        return width * height * 3 / 2;
+    case V4L2_PIX_FMT_YUYV:
+        return width * height * 2;
+    case V4L2_PIX_FMT_RGB24:
+        return width * height * 3;
+    default:
+        return 0;
+    }
+}
+
+static void rkmpp_split_uv_row(uint8_t *u, uint8_t *v, const uint8_t *uv, uint32_t width) {
+    uint32_t x = 0;
+
+#ifdef HAVE_NEON
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x2_t in = vld2q_u8(uv + x * 2);
+
+        vst1q_u8(u + x, in.val[0]);
+        vst1q_u8(v + x, in.val[1]);
+    }
+#endif
+
+    for (; x < width; x++) {
+        u[x] = uv[x * 2];
+        v[x] = uv[x * 2 + 1];
+    }
+}
+
+static void rkmpp_yuyv_row(uint8_t *dst, const uint8_t *y, const uint8_t *uv, uint32_t width) {
+    uint32_t x = 0;
+
+#ifdef HAVE_NEON
+    for (; x + 32 <= width; x += 32) {
+        uint8x16x2_t luma = vld2q_u8(y + x);
+        uint8x16x2_t chroma = vld2q_u8(uv + x);
+        uint8x16x4_t out = {
+            { luma.val[0], chroma.val[0], luma.val[1], chroma.val[1] }
+        };
+
+        vst4q_u8(dst + x * 2, out);
+    }
+#endif
+
+    for (; x + 2 <= width; x += 2) {
+        dst[x * 2] = y[x];
+        dst[x * 2 + 1] = uv[x];
+        dst[x * 2 + 2] = y[x + 1];
+        dst[x * 2 + 3] = uv[x + 1];
+    }
+}
+
+/*
+ * Limited range YUV to RGB coefficients in 1/64 units: luma, V to red,
+ * U and V to green, U to blue.
+ */
+static const int16_t rkmpp_bt601_coef[5] = { 74, 102, 25, 52, 129 };
+static const int16_t rkmpp_bt709_coef[5] = { 74, 115, 14, 34, 135 };
+
+static inline uint8_t rkmpp_clip_u8(int val) {
+    return val < 0 ? 0 : val > 255 ? 255 : val;
+}
+
+static void rkmpp_rgb24_row(uint8_t *dst, const uint8_t *y, const uint8_t *uv,
+        uint32_t width, const int16_t *coef) {
+    uint32_t x = 0;
+
+#ifdef HAVE_NEON
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t luma = vld1q_u8(y + x);
+        uint8x8x2_t chroma = vld2_u8(uv + x);
+        /* Each chroma sample covers two pixels */
+        uint8x8x2_t u = vzip_u8(chroma.val[0], chroma.val[0]);
+        uint8x8x2_t v = vzip_u8(chroma.val[1], chroma.val[1]);
+
+        for (int half = 0; half < 2; half++) {
+            uint8x8_t yh = half ? vget_high_u8(luma) : vget_low_u8(luma);
+            int16x8_t yy = vmulq_n_s16(vreinterpretq_s16_u16(
+                    vsubl_u8(yh, vdup_n_u8(16))), coef[0]);
+            int16x8_t uu = vreinterpretq_s16_u16(vsubl_u8(u.val[half], vdup_n_u8(128)));
+            int16x8_t vv = vreinterpretq_s16_u16(vsubl_u8(v.val[half], vdup_n_u8(128)));
+            int16x8_t g = vaddq_s16(vmulq_n_s16(uu, coef[2]), vmulq_n_s16(vv, coef[3]));
+            uint8x8x3_t rgb;
+
+            rgb.val[0] = vqrshrun_n_s16(vqaddq_s16(yy, vmulq_n_s16(vv, coef[1])), 6);
+            rgb.val[1] = vqrshrun_n_s16(vqsubq_s16(yy, g), 6);
+            rgb.val[2] = vqrshrun_n_s16(vqaddq_s16(yy, vmulq_n_s16(uu, coef[4])), 6);
+            vst3_u8(dst + (x + half * 8) * 3, rgb);
+        }
+    }
+#endif
+
+    for (; x < width; x++) {
+        int yy = (y[x] - 16) * coef[0];
+        int u = uv[x & ~1] - 128;
+        int v = uv[x | 1] - 128;
+
+        dst[x * 3] = rkmpp_clip_u8((yy + v * coef[1] + 32) >> 6);
+        dst[x * 3 + 1] = rkmpp_clip_u8((yy - u * coef[2] - v * coef[3] + 32) >> 6);
+        dst[x * 3 + 2] = rkmpp_clip_u8((yy + u * coef[4] + 32) >> 6);
+    }
+}
+
+/* Matrix of the source, guessed by the resolution when the stream has none */
+static const int16_t *rkmpp_image_coef(const struct rkmpp_image *src) {
+    switch (src->ycbcr_enc) {
+    case V4L2_YCBCR_ENC_709:
+        return rkmpp_bt709_coef;
+    case V4L2_YCBCR_ENC_601:
+        return rkmpp_bt601_coef;
+    default:
+        return src->height > 576 ? rkmpp_bt709_coef : rkmpp_bt601_coef;
+    }
+}
+
+int rkmpp_image_convert_nv12(const struct rkmpp_image *src, uint8_t *dst, uint32_t fourcc) {
+    const uint8_t *src_uv = src->ptr + src->hor_stride * src->ver_stride;
+    uint32_t uv_stride = rkmpp_image_uv_stride(src);
+    uint32_t width = src->width & ~1;
+    uint32_t height = src->height & ~1;
+    uint32_t bytesperline = rkmpp_image_bytesperline(fourcc, width);
+    const int16_t *coef = rkmpp_image_coef(src);
+    uint8_t *dst_u, *dst_v;
+    uint32_t y;
+
+    switch (fourcc) {
+    case V4L2_PIX_FMT_NV12:
+        for (y = 0; y < height; y++)
+            memcpy(dst + y * width, src->ptr + y * src->hor_stride, width);
+
+        dst += width * height;
+        for (y = 0; y < height / 2; y++)
+            memcpy(dst + y * width, src_uv + y * uv_stride, width);
+        break;
+    case V4L2_PIX_FMT_YUV420:
+        for (y = 0; y < height; y++)
+            memcpy(dst + y * width, src->ptr + y * src->hor_stride, width);
+
+        dst_u = dst + width * height;
+        dst_v = dst_u + width * height / 4;
+        for (y = 0; y < height / 2; y++)
+            rkmpp_split_uv_row(dst_u + y * width / 2, dst_v + y * width / 2,
+                    src_uv + y * uv_stride, width / 2);
+        break;
+    case V4L2_PIX_FMT_YUYV:
+        for (y = 0; y < height; y++)
+            rkmpp_yuyv_row(dst + y * bytesperline, src->ptr + y * src->hor_stride,
+                    src_uv + y / 2 * uv_stride, width);
+        break;
+    case V4L2_PIX_FMT_RGB24:
+        for (y = 0; y < height; y++)
+            rkmpp_rgb24_row(dst + y * bytesperline, src->ptr + y * src->hor_stride,
+                    src_uv + y / 2 * uv_stride, width, coef);
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Top 8 bits of 10 bit samples, four of them packed in five bytes */
+static void rkmpp_nv15_row(uint8_t *dst, const uint8_t *src, uint32_t samples) {
+    uint32_t x = 0;
+
+    /* Plain loop, auto vectorized where the target allows */
+    for (; x + 4 <= samples; x += 4) {
+        const uint8_t *in = src + x / 4 * 5;
+
+        dst[x] = in[0] >> 2 | in[1] << 6;
+        dst[x + 1] = in[1] >> 4 | in[2] << 4;
+        dst[x + 2] = in[2] >> 6 | in[3] << 2;
+        dst[x + 3] = in[4];
+    }
+
+    for (; x < samples; x++) {
+        uint32_t bit = x * 10;
+        uint32_t val = src[bit / 8] | src[bit / 8 + 1] << 8;
+
+        dst[x] = (val >> (bit % 8)) >> 2;
+    }
+}
+
+static int rkmpp_image_unpack_nv15(const struct rkmpp_image *src, const struct rkmpp_image *dst) {
+    const uint8_t *src_uv = src->ptr + src->hor_stride * src->ver_stride;
+    uint8_t *dst_uv = dst->ptr + dst->hor_stride * dst->ver_stride;
+    uint32_t y;
+
+    for (y = 0; y < src->height; y++)
+        rkmpp_nv15_row(dst->ptr + y * dst->hor_stride, src->ptr + y * src->hor_stride,
+                src->width);
+
+    for (y = 0; y < src->height / 2; y++)
+        rkmpp_nv15_row(dst_uv + y * dst->hor_stride, src_uv + y * rkmpp_image_uv_stride(src),
+                src->width);
+
+    return 0;
+}
+
+#ifdef HAVE_RGA
+static int rkmpp_rga_format(uint32_t fourcc) {
+    switch (fourcc) {
+    case V4L2_PIX_FMT_NV12:
+        return RK_FORMAT_YCbCr_420_SP;
+    case V4L2_PIX_FMT_NV15:
+        return RK_FORMAT_YCbCr_420_SP_10B;
+    case V4L2_PIX_FMT_RGB24:
+        return RK_FORMAT_RGB_888;
+    default:
+        return -1;
+    }
+}
+
+/* Rga strides are in pixels */
+static uint32_t rkmpp_rga_stride(const struct rkmpp_image *image, uint32_t fourcc) {
+    switch (fourcc) {
+    case V4L2_PIX_FMT_NV15:
+        return image->hor_stride * 8 / 10;
+    case V4L2_PIX_FMT_RGB24:
+        return image->hor_stride / 3;
+    default:
+        return image->hor_stride;
+    }
+}
+
+static int rkmpp_rga_blit(const struct rkmpp_image *src, uint32_t src_fourcc,
+        const struct rkmpp_image *dst, uint32_t dst_fourcc) {
+    rga_buffer_t src_buf, dst_buf;
+    IM_STATUS ret;
+
+    if (src->fd < 0 || dst->fd < 0 || src->uv_stride ||
+            rkmpp_rga_format(src_fourcc) < 0 || rkmpp_rga_format(dst_fourcc) < 0)
+        return -1;
+
+    src_buf = wrapbuffer_fd_t(src->fd, src->width, src->height,
+            rkmpp_rga_stride(src, src_fourcc), src->ver_stride, rkmpp_rga_format(src_fourcc));
+    dst_buf = wrapbuffer_fd_t(dst->fd, dst->width, dst->height,
+            rkmpp_rga_stride(dst, dst_fourcc), dst->ver_stride, rkmpp_rga_format(dst_fourcc));
+
+    /* The formats of the buffers make it convert on the way */
+    ret = imresize_t(src_buf, dst_buf, 0, 0, INTER_LINEAR, 1);
+    if (ret != IM_STATUS_SUCCESS) {
+        LOGV(2, "rga blit failed: %s\n", imStrError_t(ret));
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
+int rkmpp_image_blit(const struct rkmpp_image *src, uint32_t src_fourcc,
+        const struct rkmpp_image *dst, uint32_t dst_fourcc) {
+    struct rkmpp_image nv12 = *src, scaled;
+    uint8_t *unpacked = NULL, *tmp = NULL;
+    int ret = -1;
+
+    if (src_fourcc != V4L2_PIX_FMT_NV12 && src_fourcc != V4L2_PIX_FMT_NV15)
+        return -1;
+
+#ifdef HAVE_RGA
+    if (!rkmpp_rga_blit(src, src_fourcc, dst, dst_fourcc))
+        return 0;
+#endif
+
+    /* Software goes through NV12 of the source size, then of the target one */
+    if (src_fourcc == V4L2_PIX_FMT_NV15) {
+        unpacked = malloc(src->width * src->height * 3 / 2);
+        if (!unpacked)
+            return -1;
+
+        nv12.ptr = unpacked;
+        nv12.fd = -1;
+        nv12.hor_stride = src->width;
+        nv12.ver_stride = src->height;
+        nv12.uv_stride = 0;
+        rkmpp_image_unpack_nv15(src, &nv12);
+    }
+
+    switch (dst_fourcc) {
+    case V4L2_PIX_FMT_NV12:
+        ret = rkmpp_image_scale_nv12(&nv12, dst);
+        break;
+    case V4L2_PIX_FMT_RGB24:
+        if (nv12.width == dst->width && nv12.height == dst->height) {
+            ret = rkmpp_image_convert_nv12(&nv12, dst->ptr, dst_fourcc);
+            break;
+        }
+
+        tmp = malloc(dst->width * dst->height * 3 / 2);
+        if (!tmp)
+            break;
+
+        scaled = (struct rkmpp_image) {
+            .ptr = tmp,
+            .fd = -1,
+            .width = dst->width,
+            .height = dst->height,
+            .hor_stride = dst->width,
+            .ver_stride = dst->height,
+            .ycbcr_enc = src->ycbcr_enc,
+        };
+        ret = rkmpp_image_scale_nv12(&nv12, &scaled);
+        if (!ret)
+            ret = rkmpp_image_convert_nv12(&scaled, dst->ptr, dst_fourcc);
+        break;
+    default:
+        break;
+    }
+
+    free(tmp);
+    free(unpacked);
+    return ret;
+}
@@ -0,0 +1,67 @@
+/*
+ * imgproc.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ */
+
+#ifndef SRC_IMGPROC_H_
+#define SRC_IMGPROC_H_
+
+#include <inttypes.h>
+#include "linux/videodev2.h"
+
+#ifndef V4L2_PIX_FMT_NV15
+#define V4L2_PIX_FMT_NV15   v4l2_fourcc('N', 'V', '1', '5') /* 15 Y/CbCr 4:2:0 10-bit packed */
+#endif
+
+/**
+ * struct rkmpp_image - Semi-planar image in memory
+ * @ptr:        Mapped address of the luma plane, chroma follows.
+ * @fd:         Dma fd of the image, -1 if there is none.
+ * @width:      Visible width.
+ * @height:     Visible height.
+ * @hor_stride: Bytes per line.
+ * @ver_stride: Lines of the luma plane.
+ * @uv_stride:  Bytes between the chroma lines used, 0 for hor_stride. Twice
+ *              hor_stride reads a 4:2:2 image as 4:2:0.
+ * @ycbcr_enc:  V4L2 YCbCr matrix of the source, the default guesses by size.
+ */
+struct rkmpp_image {
+    uint8_t *ptr;
+    int fd;
+    uint32_t width;
+    uint32_t height;
+    uint32_t hor_stride;
+    uint32_t ver_stride;
+    uint32_t uv_stride;
+    uint32_t ycbcr_enc;
+};
+
+/* Bytes per line of the first plane for a tightly packed image */
+uint32_t rkmpp_image_bytesperline(uint32_t fourcc, uint32_t width);
+
+/* Size of a tightly packed image, 0 for unsupported formats */
+uint32_t rkmpp_image_size(uint32_t fourcc, uint32_t width, uint32_t height);
+
+/*
+ * Copy the visible rect of an NV12 image into a tightly packed image of the
+ * given format, one of NV12, YUV420, YUYV or RGB24. Returns 0 on success.
+ */
+int rkmpp_image_convert_nv12(const struct rkmpp_image *src, uint8_t *dst, uint32_t fourcc);
+
+/*
+ * Scale an NV12 image into another one, using rga when it is available and
+ * the software scaler otherwise. Returns 0 on success.
+ */
+int rkmpp_image_scale_nv12(const struct rkmpp_image *src, const struct rkmpp_image *dst);
+
+/*
+ * Scale and convert an NV12 or NV15 image into an NV12 or RGB24 one of any
+ * size, in one rga pass when it is available and in software otherwise.
+ * Returns 0 on success.
+ */
+int rkmpp_image_blit(const struct rkmpp_image *src, uint32_t src_fourcc,
+        const struct rkmpp_image *dst, uint32_t dst_fourcc);
+
+#endif /* SRC_IMGPROC_H_ */
@@ -0,0 +1,180 @@
+/*
+ * libmppv4l2.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Dispatches ioctls to the decoder callbacks the way codec_ioctl does, with
+ * the caller's own memory standing in for the client's.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/ioctl.h>
+#include <sys/eventfd.h>
+
+#include "libmppv4l2.h"
+#include "mppdec.h"
+
+/* Larger than any v4l2 ioctl struct */
+#define MPPV4L2_MAX_ARG     1024
+
+/*
+ * The codec goes first, the session of a codec is the codec. The eventfd
+ * is signalled where the daemon notifies the kernel's poll, and its flags
+ * are those of the session's file.
+ */
+struct mppv4l2 {
+    struct cuse_codec codec;
+    int eventfd;
+    pthread_mutex_t poll_mutex;     /* clears of a blocking eventfd */
+};
+
+/* Callers block in their own thread, there's no request to park */
+struct cuse_request *cuse_park_request(void) {
+    return NULL;
+}
+
+bool cuse_request_interrupted(struct cuse_request *request) {
+    return false;
+}
+
+void cuse_complete_request(struct cuse_request *request, int err, const void *out_buf,
+        size_t size) {
+}
+
+/* The client may have set O_NONBLOCK on the eventfd, or a dup of it, since */
+bool cuse_request_nonblock(struct cuse_codec *codec) {
+    struct mppv4l2 *dev = (struct mppv4l2 *) codec;
+    int flags = fcntl(dev->eventfd, F_GETFL);
+
+    if (flags < 0)
+        return codec->nonblock;
+
+    return flags & O_NONBLOCK;
+}
+
+void cuse_notify_poll(struct cuse_codec *codec) {
+    struct mppv4l2 *dev = (struct mppv4l2 *) codec;
+    uint64_t one = 1;
+
+    /* Only fails when the count is about to overflow, it's readable then */
+    if (dev->eventfd >= 0 && write(dev->eventfd, &one, sizeof(one)) < 0)
+        LOGV(3, "poll already signalled: %s\n", strerror(errno));
+}
+
+struct mppv4l2 *mppv4l2_open(const char *codecs, int flags) {
+    struct mppv4l2 *dev;
+    const char *level = getenv("MPPV4L2_LOGLEVEL");
+
+    if (level)
+        app_log_level = atoi(level);
+
+    if (codecs && strlen(codecs) >= sizeof(dev->codec.codecs)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    dev = calloc(1, sizeof(*dev));
+    if (!dev) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    dev->eventfd = eventfd(0, (flags & O_NONBLOCK ? EFD_NONBLOCK : 0) | EFD_CLOEXEC);
+    if (dev->eventfd < 0) {
+        free(dev);
+        return NULL;
+    }
+
+    dev->codec = rkmpp_dec_codec;
+    dev->codec.nonblock = flags & O_NONBLOCK;
+    if (codecs)
+        strcpy(dev->codec.codecs, codecs);
+    pthread_mutex_init(&dev->poll_mutex, NULL);
+
+    errno = 0;
+    if (dev->codec.init(&dev->codec)) {
+        if (!errno)
+            errno = ENODEV;
+        pthread_mutex_destroy(&dev->poll_mutex);
+        close(dev->eventfd);
+        free(dev);
+        return NULL;
+    }
+
+    return dev;
+}
+
+void mppv4l2_close(struct mppv4l2 *dev) {
+    if (!dev)
+        return;
+
+    dev->codec.deinit(&dev->codec);
+    pthread_mutex_destroy(&dev->poll_mutex);
+    close(dev->eventfd);
+    free(dev);
+}
+
+int mppv4l2_fd(struct mppv4l2 *dev) {
+    return dev->eventfd;
+}
+
+unsigned mppv4l2_poll(struct mppv4l2 *dev) {
+    struct pollfd pfd = { .fd = dev->eventfd, .events = POLLIN };
+    uint64_t count;
+
+    /*
+     * Cleared first, what comes after it signals again. The eventfd may
+     * block, so it's only read once readable, by one clear at a time.
+     */
+    pthread_mutex_lock(&dev->poll_mutex);
+    if (poll(&pfd, 1, 0) == 1 && read(dev->eventfd, &count, sizeof(count)) < 0 &&
+            errno != EAGAIN)
+        LOGE("failed to clear poll: %s\n", strerror(errno));
+    pthread_mutex_unlock(&dev->poll_mutex);
+
+    return dev->codec.poll(&dev->codec);
+}
+
+int mppv4l2_ioctl(struct mppv4l2 *dev, unsigned long request, void *arg) {
+    uint8_t out_buf[MPPV4L2_MAX_ARG];
+    size_t argsize = _IOC_SIZE(request);
+    int ret;
+
+    if (argsize > sizeof(out_buf) || (argsize && !arg)) {
+        errno = argsize ? EFAULT : EINVAL;
+        return -1;
+    }
+
+    for (int i = 0; i < dev->codec.num_ioctls; i++) {
+        if ((int) request != dev->codec.ioctls[i].cmd)
+            continue;
+
+        if (_IOC_DIR(request) & _IOC_READ)
+            memset(out_buf, 0, argsize);
+
+        errno = 0;
+        ret = dev->codec.ioctls[i].callback(&dev->codec,
+                _IOC_DIR(request) & _IOC_WRITE ? arg : NULL,
+                _IOC_DIR(request) & _IOC_READ ? out_buf : NULL);
+        if (ret < 0) {
+            if (!errno)
+                errno = EIO;
+            return -1;
+        }
+
+        if (_IOC_DIR(request) & _IOC_READ)
+            memcpy(arg, out_buf, argsize);
+
+        return 0;
+    }
+
+    LOGV(3, "Unsupported IOCTL: %s\n", rkmpp_cmd2str(request));
+    errno = EINVAL;
+    return -1;
+}
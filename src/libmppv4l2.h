@@ -0,0 +1,59 @@
+/*
+ * libmppv4l2.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * In-process mpp v4l2 m2m decoder. It runs the same code as the cuse daemon,
+ * without the round trips through the kernel, for clients that can link it
+ * or be run with libmppv4l2-preload.so in LD_PRELOAD.
+ */
+
+#ifndef SRC_LIBMPPV4L2_H_
+#define SRC_LIBMPPV4L2_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A decoder session, what an open of the device node would be */
+struct mppv4l2;
+
+/*
+ * Open a decoder session of the coded formats given by name, like
+ * "H.264+H.265", or all of them for NULL. With O_NONBLOCK in flags DQBUF
+ * fails with EAGAIN instead of blocking, as it does once O_NONBLOCK is set
+ * on the fd of the session or a dup of it. Returns NULL with errno set on
+ * failure.
+ */
+struct mppv4l2 *mppv4l2_open(const char *codecs, int flags);
+
+/* Close a session, freeing its buffers */
+void mppv4l2_close(struct mppv4l2 *dev);
+
+/*
+ * An eventfd that becomes readable when something the session polls for may
+ * have changed: a buffer to dequeue, or a queue stopping. It belongs to the
+ * session, callers wait on it and ask mppv4l2_poll what happened. Its file
+ * status flags are the session's.
+ */
+int mppv4l2_fd(struct mppv4l2 *dev);
+
+/*
+ * Clear the eventfd and return the POLL* events of the session, like poll(2)
+ * on the device node would: POLLIN for a capture buffer to dequeue, POLLOUT
+ * for an output one and POLLERR when neither queue streams.
+ */
+unsigned mppv4l2_poll(struct mppv4l2 *dev);
+
+/*
+ * Run a VIDIOC_* request with the same arguments and results as ioctl(2) on
+ * the device node. Returns -1 with errno set on failure.
+ */
+int mppv4l2_ioctl(struct mppv4l2 *dev, unsigned long request, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_LIBMPPV4L2_H_ */
@@ -4,15 +4,21 @@
  *  Created on: Dec 26, 2023
  *      Author: boogie
  */
+#define _GNU_SOURCE
 #include <alloca.h>
 #include <assert.h>
 #include <errno.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "bitstream.h"
 #include "cusedev.h"
+#include "handoff.h"
+#include "imgproc.h"
 #include "mppdec.h"
+#include "mppv4l2_ring.h"
 
 static struct rkmpp_fmt rkmpp_dec_fmts[] = {
     {
@@ -23,6 +29,68 @@ static struct rkmpp_fmt rkmpp_dec_fmts[] = {
         .format = MPP_FMT_YUV420SP,
         .depth = { 12 },
     },
+    {
+        .name = "4:2:2 1 plane Y/CbCr",
+        .fourcc = V4L2_PIX_FMT_NV16,
+        .num_planes = 1,
+        .type = MPP_VIDEO_CodingUnused,
+        .format = MPP_FMT_YUV422SP,
+        .depth = { 16 },
+    },
+    {
+        .name = "4:2:0 3 plane Y/Cb/Cr",
+        .fourcc = V4L2_PIX_FMT_YUV420,
+        .num_planes = 1,
+        .type = MPP_VIDEO_CodingUnused,
+        .format = MPP_FMT_YUV420P,
+        .depth = { 12 },
+    },
+    {
+        .name = "4:2:2 1 plane YUYV",
+        .fourcc = V4L2_PIX_FMT_YUYV,
+        .num_planes = 1,
+        .type = MPP_VIDEO_CodingUnused,
+        .format = MPP_FMT_YUV422_YUYV,
+        .depth = { 16 },
+    },
+    {
+        .name = "RGB 1 plane 24 bit",
+        .fourcc = V4L2_PIX_FMT_RGB24,
+        .num_planes = 1,
+        .type = MPP_VIDEO_CodingUnused,
+        .format = MPP_FMT_RGB888,
+        .depth = { 24 },
+    },
+    {
+        .name = "Motion-JPEG",
+        .fourcc = V4L2_PIX_FMT_MJPEG,
+        .num_planes = 1,
+        .type = MPP_VIDEO_CodingMJPEG,
+        .format = MPP_FMT_BUTT,
+        .frmsize = {
+            .min_width = 48,
+            .max_width = 8192,
+            .step_width = 8,
+            .min_height = 48,
+            .max_height = 8192,
+            .step_height = 8,
+        },
+    },
+    {
+        .name = "JFIF JPEG",
+        .fourcc = V4L2_PIX_FMT_JPEG,
+        .num_planes = 1,
+        .type = MPP_VIDEO_CodingMJPEG,
+        .format = MPP_FMT_BUTT,
+        .frmsize = {
+            .min_width = 48,
+            .max_width = 8192,
+            .step_width = 8,
+            .min_height = 48,
+            .max_height = 8192,
+            .step_height = 8,
+        },
+    },
     {
         .name = "AV1",
         .fourcc = V4L2_PIX_FMT_AV1,
@@ -68,6 +136,23 @@ static struct rkmpp_fmt rkmpp_dec_fmts[] = {
             .step_height = RKMPP_MB_DIM,
         },
     },
+    {
+        .name = "H.264 Parsed Slice Data",
+        .fourcc = V4L2_PIX_FMT_H264_SLICE,
+        .num_planes = 1,
+        .type = MPP_VIDEO_CodingAVC,
+        .format = MPP_FMT_BUTT,
+        .frmsize = {
+            .min_width = 48,
+            .max_width = 3840,
+            .step_width = RKMPP_MB_DIM,
+            .min_height = 48,
+            .max_height = 2160,
+            .step_height = RKMPP_MB_DIM,
+        },
+        /* Annex-b access units are rebuilt from the slices and controls */
+        .queues = RKMPP_FMT_QUEUE(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE),
+    },
     {
         .name = "VP8",
         .fourcc = V4L2_PIX_FMT_VP8,
@@ -100,12 +185,503 @@ static struct rkmpp_fmt rkmpp_dec_fmts[] = {
     },
 };
 
+static const char * const rkmpp_dec_error_policies[] = {
+    [RKMPP_ERROR_POLICY_DROP] = "Drop",
+    [RKMPP_ERROR_POLICY_CONCEAL] = "Return Concealed",
+    [RKMPP_ERROR_POLICY_ALL] = "Return All",
+};
+
+static const char * const rkmpp_dec_decode_modes[] = {
+    [V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED] = "Frame-Based",
+};
+
+static const char * const rkmpp_dec_start_codes[] = {
+    [V4L2_STATELESS_H264_START_CODE_ANNEX_B] = "Annex B Start Code",
+};
+
+/* Controls of the stateless api, only served by the extended control ioctls */
+static const struct v4l2_query_ext_ctrl rkmpp_dec_stateless_ctrls[] = {
+    {
+        .id = V4L2_CID_STATELESS_H264_DECODE_MODE,
+        .type = V4L2_CTRL_TYPE_MENU,
+        .name = "H264 Decode Mode",
+        .minimum = V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED,
+        .maximum = V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED,
+        .step = 1,
+        .default_value = V4L2_STATELESS_H264_DECODE_MODE_FRAME_BASED,
+        .elem_size = sizeof(int32_t),
+        .elems = 1,
+    },
+    {
+        .id = V4L2_CID_STATELESS_H264_START_CODE,
+        .type = V4L2_CTRL_TYPE_MENU,
+        .name = "H264 Start Code",
+        .minimum = V4L2_STATELESS_H264_START_CODE_ANNEX_B,
+        .maximum = V4L2_STATELESS_H264_START_CODE_ANNEX_B,
+        .step = 1,
+        .default_value = V4L2_STATELESS_H264_START_CODE_ANNEX_B,
+        .elem_size = sizeof(int32_t),
+        .elems = 1,
+    },
+    {
+        .id = V4L2_CID_STATELESS_H264_SPS,
+        .type = V4L2_CTRL_TYPE_H264_SPS,
+        .name = "H264 Sequence Parameter Set",
+        .flags = V4L2_CTRL_FLAG_HAS_PAYLOAD,
+        .elem_size = sizeof(struct v4l2_ctrl_h264_sps),
+        .elems = 1,
+    },
+    {
+        .id = V4L2_CID_STATELESS_H264_PPS,
+        .type = V4L2_CTRL_TYPE_H264_PPS,
+        .name = "H264 Picture Parameter Set",
+        .flags = V4L2_CTRL_FLAG_HAS_PAYLOAD,
+        .elem_size = sizeof(struct v4l2_ctrl_h264_pps),
+        .elems = 1,
+    },
+    {
+        .id = V4L2_CID_STATELESS_H264_SCALING_MATRIX,
+        .type = V4L2_CTRL_TYPE_H264_SCALING_MATRIX,
+        .name = "H264 Scaling Matrix",
+        .flags = V4L2_CTRL_FLAG_HAS_PAYLOAD,
+        .elem_size = sizeof(struct v4l2_ctrl_h264_scaling_matrix),
+        .elems = 1,
+    },
+    {
+        .id = V4L2_CID_STATELESS_H264_DECODE_PARAMS,
+        .type = V4L2_CTRL_TYPE_H264_DECODE_PARAMS,
+        .name = "H264 Decode Parameters",
+        .flags = V4L2_CTRL_FLAG_HAS_PAYLOAD,
+        .elem_size = sizeof(struct v4l2_ctrl_h264_decode_params),
+        .elems = 1,
+    },
+};
+
+/* HDR10 metadata of the last frame, read only */
+static const struct v4l2_query_ext_ctrl rkmpp_dec_hdr_ctrls[] = {
+    {
+        .id = V4L2_CID_COLORIMETRY_HDR10_CLL_INFO,
+        .type = V4L2_CTRL_TYPE_HDR10_CLL_INFO,
+        .name = "HDR10 Content Light Info",
+        .flags = V4L2_CTRL_FLAG_HAS_PAYLOAD | V4L2_CTRL_FLAG_READ_ONLY |
+                V4L2_CTRL_FLAG_VOLATILE,
+        .elem_size = sizeof(struct v4l2_ctrl_hdr10_cll_info),
+        .elems = 1,
+    },
+    {
+        .id = V4L2_CID_COLORIMETRY_HDR10_MASTERING_DISPLAY,
+        .type = V4L2_CTRL_TYPE_HDR10_MASTERING_DISPLAY,
+        .name = "HDR10 Mastering Display",
+        .flags = V4L2_CTRL_FLAG_HAS_PAYLOAD | V4L2_CTRL_FLAG_READ_ONLY |
+                V4L2_CTRL_FLAG_VOLATILE,
+        .elem_size = sizeof(struct v4l2_ctrl_hdr10_mastering_display),
+        .elems = 1,
+    },
+};
+
+static const struct v4l2_queryctrl rkmpp_dec_ctrls[] = {
+    {
+        .id = V4L2_CID_MIN_BUFFERS_FOR_CAPTURE,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Min Number of Capture Buffers",
+        .minimum = 1,
+        .maximum = VIDEO_MAX_FRAME,
+        .step = 1,
+        .default_value = 1,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_MIN_BUFFERS_FOR_OUTPUT,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Min Number of Output Buffers",
+        .minimum = 1,
+        .maximum = VIDEO_MAX_FRAME,
+        .step = 1,
+        .default_value = RKMPP_MIN_OUTPUT_BUFFERS,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_SKIP_NONREF,
+        .type = V4L2_CTRL_TYPE_BOOLEAN,
+        .name = "Skip Non-Reference Frames",
+        .minimum = 0,
+        .maximum = 1,
+        .step = 1,
+        .default_value = 0,
+    },
+    {
+        .id = V4L2_CID_RKMPP_KEYFRAME_ONLY,
+        .type = V4L2_CTRL_TYPE_BOOLEAN,
+        .name = "Decode Keyframes Only",
+        .minimum = 0,
+        .maximum = 1,
+        .step = 1,
+        .default_value = 0,
+    },
+    {
+        .id = V4L2_CID_RKMPP_OUTPUT_NTH,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Output Every Nth Frame",
+        .minimum = 1,
+        .maximum = 1024,
+        .step = 1,
+        .default_value = 1,
+    },
+    {
+        .id = V4L2_CID_RKMPP_THUMBNAIL,
+        .type = V4L2_CTRL_TYPE_BOOLEAN,
+        .name = "Thumbnail Mode",
+        .minimum = 0,
+        .maximum = 1,
+        .step = 1,
+        .default_value = 0,
+    },
+    {
+        .id = V4L2_CID_RKMPP_THUMBNAIL_WIDTH,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Thumbnail Width",
+        .minimum = 32,
+        .maximum = 1920,
+        .step = RKMPP_MB_DIM,
+        .default_value = 320,
+    },
+    {
+        .id = V4L2_CID_RKMPP_THUMBNAIL_HEIGHT,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Thumbnail Height",
+        .minimum = 32,
+        .maximum = 1080,
+        .step = 2,
+        .default_value = 180,
+    },
+    {
+        .id = V4L2_CID_RKMPP_SESSION_MEM,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Session DRM Memory KiB",
+        .minimum = 0,
+        .maximum = INT32_MAX,
+        .step = 1,
+        .default_value = 0,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_TOTAL_MEM,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Total DRM Memory KiB",
+        .minimum = 0,
+        .maximum = INT32_MAX,
+        .step = 1,
+        .default_value = 0,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_ERROR_POLICY,
+        .type = V4L2_CTRL_TYPE_MENU,
+        .name = "Error Policy",
+        .minimum = RKMPP_ERROR_POLICY_DROP,
+        .maximum = RKMPP_ERROR_POLICY_ALL,
+        .step = 1,
+        .default_value = RKMPP_ERROR_POLICY_DROP,
+    },
+    {
+        .id = V4L2_CID_RKMPP_CORRUPTED_FRAMES,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Corrupted Frames",
+        .minimum = 0,
+        .maximum = INT32_MAX,
+        .step = 1,
+        .default_value = 0,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_DISCARDED_FRAMES,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Discarded Frames",
+        .minimum = 0,
+        .maximum = INT32_MAX,
+        .step = 1,
+        .default_value = 0,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_CONCEALED_FRAMES,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Concealed Frames Returned",
+        .minimum = 0,
+        .maximum = INT32_MAX,
+        .step = 1,
+        .default_value = 0,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_DQBUF_WAIT_P99,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Capture DQBUF Wait p99 (us)",
+        .minimum = 0,
+        .maximum = INT32_MAX,
+        .step = 1,
+        .default_value = 0,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_FRAME_IDLE_P99,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Capture Frame Idle p99 (us)",
+        .minimum = 0,
+        .maximum = INT32_MAX,
+        .step = 1,
+        .default_value = 0,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_MPEG_VIDEO_BITRATE,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Transcode Bitrate",
+        .minimum = 0,
+        .maximum = 100000000,
+        .step = 1,
+        .default_value = 0,
+    },
+    {
+        .id = V4L2_CID_MPEG_VIDEO_GOP_SIZE,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Transcode GOP Size",
+        .minimum = 1,
+        .maximum = 1024,
+        .step = 1,
+        .default_value = 60,
+    },
+    {
+        .id = V4L2_CID_RKMPP_WATCHDOG_FRAMES,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Hang Watchdog Frames",
+        .minimum = 0,
+        .maximum = 3600,
+        .step = 1,
+        .default_value = RKMPP_WATCHDOG_FRAMES,
+    },
+    {
+        .id = V4L2_CID_RKMPP_RECOVERIES,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Hang Recoveries",
+        .minimum = 0,
+        .maximum = INT32_MAX,
+        .step = 1,
+        .default_value = 0,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_RECOVERY_TIME,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Last Hang Recovery Time (us)",
+        .minimum = 0,
+        .maximum = INT32_MAX,
+        .step = 1,
+        .default_value = 0,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_VPU_BLOCK,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "VPU Block",
+        .minimum = -1,
+        .maximum = RKMPP_VPU_MAX_BLOCKS - 1,
+        .step = 1,
+        .default_value = -1,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_VPU_LOAD,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "VPU Block Load (%)",
+        .minimum = 0,
+        .maximum = INT32_MAX,
+        .step = 1,
+        .default_value = 0,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_DECODER_CPUS,
+        .type = V4L2_CTRL_TYPE_BITMASK,
+        .name = "Decoder Thread CPU Mask",
+        .minimum = 0,
+        .maximum = INT32_MAX,
+        .step = 0,
+        .default_value = 0,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_DECODER_PRIO,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Decoder Thread FIFO Priority",
+        .minimum = 0,
+        .maximum = 99,
+        .step = 1,
+        .default_value = 0,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+    {
+        .id = V4L2_CID_RKMPP_DECODER_CPU,
+        .type = V4L2_CTRL_TYPE_INTEGER,
+        .name = "Decoder Thread Last CPU",
+        .minimum = -1,
+        .maximum = INT32_MAX,
+        .step = 1,
+        .default_value = -1,
+        .flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_VOLATILE,
+    },
+};
+
+static bool rkmpp_dec_is_key_pts(struct rkmpp_dec_context *dec, uint64_t pts) {
+    for (int i = 0; i < RKMPP_KEY_PTS_NUM; i++) {
+        if (dec->skip.key_pts[i] == pts)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Inspect the packet, flag keyframes and tell whether it can be dropped
+ * without feeding it to mpp. A packet mpp refused is inspected only once.
+ */
+static bool rkmpp_dec_skip_packet(struct rkmpp_dec_context *dec,
+        struct rkmpp_buffer *rkmpp_buffer) {
+    struct rkmpp_context *ctx = dec->ctx;
+    const struct rkmpp_fmt *fmt = ctx->output.rkmpp_format;
+    uint32_t flags;
+
+    if (!rkmpp_buffer_inspected(rkmpp_buffer)) {
+        flags = rkmpp_bs_inspect(&dec->skip.bs, fmt ? fmt->type : MPP_VIDEO_CodingUnused,
+                mpp_buffer_get_ptr(rkmpp_buffer->rkmpp_buf), rkmpp_buffer->bytesused);
+
+        rkmpp_buffer->flags &= ~(RKMPP_BUFFER_KEYFRAME | RKMPP_BUFFER_NONREF);
+        if (flags & RKMPP_BS_KEYFRAME)
+            rkmpp_buffer_set_keyframe(rkmpp_buffer);
+        if (flags & RKMPP_BS_NONREF)
+            rkmpp_buffer_set_nonref(rkmpp_buffer);
+
+        rkmpp_buffer_set_inspected(rkmpp_buffer);
+    }
+
+    if ((dec->skip.keyframe_only || dec->thumbnail.enable ||
+            rkmpp_buffer_skip_nonkey(rkmpp_buffer)) &&
+            !rkmpp_buffer_keyframe(rkmpp_buffer))
+        return true;
+
+    if ((dec->skip.skip_nonref || rkmpp_buffer_skip_nonref(rkmpp_buffer)) &&
+            rkmpp_buffer_nonref(rkmpp_buffer))
+        return true;
+
+    return false;
+}
+
+/* The session is fed slices and controls through the stateless api */
+static bool rkmpp_dec_stateless(struct rkmpp_dec_context *dec) {
+    return dec->stateless &&
+            dec->ctx->output.format.pixelformat == V4L2_PIX_FMT_H264_SLICE;
+}
+
+/* Tune mpp for the skip settings, needs to be redone after mpp_init */
+static void rkmpp_dec_apply_skip(struct rkmpp_dec_context *dec) {
+    struct rkmpp_context *ctx = dec->ctx;
+    bool keyframe_only = dec->skip.keyframe_only || dec->thumbnail.enable;
+    RK_U32 immediate_out = keyframe_only || rkmpp_dec_stateless(dec);
+    RK_U32 disable_error = keyframe_only || dec->skip.skip_nonref ||
+            dec->error.policy != RKMPP_ERROR_POLICY_DROP;
+
+    if (!ctx->mpp)
+        return;
+
+    /*
+     * Nothing to reorder when only intra frames reach mpp, and stateless
+     * clients reorder on their own, taking frames in decode order
+     */
+    ctx->mpi->control(ctx->mpp, MPP_DEC_SET_IMMEDIATE_OUT, &immediate_out);
+
+    /*
+     * Dropped packets leave holes in the references, and concealed frames
+     * are wanted as they are, keep outputting
+     */
+    ctx->mpi->control(ctx->mpp, MPP_DEC_SET_DISABLE_ERROR, &disable_error);
+}
+
+/* Learn the frame interval and start the clock of a packet waiting for frames */
+static void rkmpp_dec_watch_packet(struct rkmpp_dec_context *dec, uint64_t pts) {
+    struct rkmpp_watchdog_info *watchdog = &dec->watchdog;
+    uint64_t delta;
+
+    if (!watchdog->packets++)
+        watchdog->progress = rkmpp_now_us();
+
+    if (watchdog->last_pts != (uint64_t) -1 && pts > watchdog->last_pts) {
+        delta = clamp(pts - watchdog->last_pts, RKMPP_WATCHDOG_MIN_INTERVAL_US,
+                RKMPP_WATCHDOG_MAX_INTERVAL_US);
+        watchdog->interval = (watchdog->interval * 7 + delta) / 8;
+    }
+    watchdog->last_pts = pts;
+}
+
+/*
+ * Rebuild the access unit of a stateless packet, the parameter sets of its
+ * controls in front of its slices when mpp doesn't have them yet. Packets
+ * carrying nothing new are fed as they are. Returns 1 when the parameter
+ * sets went in front, for them to count as sent once mpp took the packet.
+ */
+static int rkmpp_dec_stateless_au(struct rkmpp_dec_context *dec,
+        struct rkmpp_buffer *rkmpp_buffer, void **data, size_t *size) {
+    struct rkmpp_context *ctx = dec->ctx;
+    struct rkmpp_stateless_info *stateless = dec->stateless;
+    const struct rkmpp_h264_ctrls *frame = &stateless->frames[rkmpp_buffer->index];
+    bool scaling = frame->pps.flags & V4L2_H264_PPS_FLAG_SCALING_MATRIX_PRESENT;
+    size_t len, need = RKMPP_BS_H264_HEADERS_MAX + *size;
+    uint8_t *au;
+
+    if (stateless->sent_valid &&
+            !(frame->decode.flags & V4L2_H264_DECODE_PARAM_FLAG_IDR_PIC) &&
+            !memcmp(&frame->sps, &stateless->sent.sps, sizeof(frame->sps)) &&
+            !memcmp(&frame->pps, &stateless->sent.pps, sizeof(frame->pps)) &&
+            (!scaling || !memcmp(&frame->scaling, &stateless->sent.scaling,
+                    sizeof(frame->scaling))))
+        return 0;
+
+    if (need > stateless->au_size) {
+        au = realloc(stateless->au, need);
+        if (!au)
+            RETURN_ERR(ENOMEM, -1);
+
+        stateless->au = au;
+        stateless->au_size = need;
+    }
+
+    len = rkmpp_bs_write_h264_headers(stateless->au, RKMPP_BS_H264_HEADERS_MAX,
+            &frame->sps, &frame->pps, &frame->scaling,
+            ctx->output.format.width, ctx->output.format.height);
+    if (!len) {
+        LOGE("parameter sets of packet %d don't fit\n", rkmpp_buffer->index);
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    memcpy(stateless->au + len, *data, *size);
+    *data = stateless->au;
+    *size += len;
+
+    LOGV(3, "parameter sets of %zu bytes before packet %d\n", len, rkmpp_buffer->index);
+
+    return 1;
+}
+
 static void rkmpp_put_packets(struct rkmpp_dec_context *dec) {
     struct rkmpp_context *ctx = dec->ctx;
+    const struct rkmpp_fmt *fmt = ctx->output.rkmpp_format;
     struct rkmpp_buffer *rkmpp_buffer;
     MppPacket packet;
     MPP_RET ret;
-    bool is_eos;
+    bool is_eos, is_skipped;
+    int headers;
+    uint32_t dpb;
+    void *data;
+    size_t size;
 
     ENTER();
 
@@ -113,20 +689,65 @@ static void rkmpp_put_packets(struct rkmpp_dec_context *dec) {
     while (!TAILQ_EMPTY(&ctx->output.pending_buffers)) {
         rkmpp_buffer = TAILQ_FIRST(&ctx->output.pending_buffers);
 
-        mpp_packet_init(&packet, mpp_buffer_get_ptr(rkmpp_buffer->rkmpp_buf), rkmpp_buffer->bytesused);
-        mpp_packet_set_pts(packet, rkmpp_buffer->timestamp);
-
         // TODO: Support start/stop decode cmd
         /* The chromium uses -2 as special flush timestamp. */
         is_eos = rkmpp_buffer->timestamp == (uint64_t) -2000000;
-        if (is_eos)
-            mpp_packet_set_eos(packet);
+        is_skipped = !is_eos && rkmpp_dec_skip_packet(dec, rkmpp_buffer);
+
+        /* A recreated mpp starts over at a keyframe */
+        if (!is_eos && !is_skipped && dec->watchdog.wait_keyframe) {
+            if (rkmpp_buffer_keyframe(rkmpp_buffer))
+                dec->watchdog.wait_keyframe = false;
+            else
+                is_skipped = true;
+        }
 
-        ret = ctx->mpi->decode_put_packet(ctx->mpp, packet);
-        mpp_packet_deinit(&packet);
+        data = mpp_buffer_get_ptr(rkmpp_buffer->rkmpp_buf);
+        size = rkmpp_buffer->bytesused;
 
-        if (ret != MPP_OK)
-            break;
+        headers = 0;
+        if (!is_eos && !is_skipped && rkmpp_dec_stateless(dec)) {
+            headers = rkmpp_dec_stateless_au(dec, rkmpp_buffer, &data, &size);
+            if (headers < 0)
+                is_skipped = true;
+        }
+
+        if (is_skipped) {
+            LOGV(3, "skip packet: %d(%" PRIu64 ")\n",
+                    rkmpp_buffer->index, rkmpp_buffer->timestamp);
+            dec->skip.dropped++;
+        } else {
+            mpp_packet_init(&packet, data, size);
+            mpp_packet_set_pts(packet, rkmpp_buffer->timestamp);
+
+            if (is_eos)
+                mpp_packet_set_eos(packet);
+
+            ret = ctx->mpi->decode_put_packet(ctx->mpp, packet);
+            mpp_packet_deinit(&packet);
+
+            if (ret != MPP_OK)
+                break;
+
+            /* Mpp has the parameter sets once it took them, not when refused */
+            if (headers > 0) {
+                dec->stateless->sent = dec->stateless->frames[rkmpp_buffer->index];
+                dec->stateless->sent_valid = true;
+            }
+
+            /* The info change of a new SPS comes after mpp took it */
+            dpb = rkmpp_bs_dpb_size(fmt ? fmt->type : MPP_VIDEO_CodingUnused, data, size);
+            if (dpb)
+                dec->sps_dpb = dpb;
+
+            /* Remember keyframes to flag the frames decoded from them */
+            if (rkmpp_buffer_keyframe(rkmpp_buffer)) {
+                dec->skip.key_pts[dec->skip.key_pts_idx] = rkmpp_buffer->timestamp;
+                dec->skip.key_pts_idx = (dec->skip.key_pts_idx + 1) % RKMPP_KEY_PTS_NUM;
+            }
+
+            rkmpp_dec_watch_packet(dec, rkmpp_buffer->timestamp);
+        }
 
         TAILQ_REMOVE(&ctx->output.pending_buffers, rkmpp_buffer, entry);
         rkmpp_buffer_clr_pending(rkmpp_buffer);
@@ -146,14 +767,22 @@ static void rkmpp_put_packets(struct rkmpp_dec_context *dec) {
 
         LOGV(3, "return packet: %d\n", rkmpp_buffer->index);
 
-        TAILQ_INSERT_TAIL(&ctx->output.avail_buffers, rkmpp_buffer, entry);
-        rkmpp_buffer_set_available(rkmpp_buffer);
+        rkmpp_return_buffer(ctx, &ctx->output, rkmpp_buffer);
     }
-    pthread_mutex_unlock(&ctx->output.queue_mutex);
+    rkmpp_queue_unlock(&ctx->output);
 
     LEAVE();
 }
 
+/*
+ * Thumbnails, post-processed and transcoded frames are decoded into the
+ * internal group and copied or encoded into the client buffers, which mpp
+ * never gets.
+ */
+static bool rkmpp_dec_copy_out(struct rkmpp_dec_context *dec) {
+    return dec->thumbnail.enable || dec->postproc_fourcc;
+}
+
 /* Feed all available frames to mpp */
 static void rkmpp_put_frames(struct rkmpp_dec_context *dec) {
     struct rkmpp_context *ctx = dec->ctx;
@@ -161,6 +790,13 @@ static void rkmpp_put_frames(struct rkmpp_dec_context *dec) {
 
     ENTER();
 
+    rkmpp_take_ring_buffers(ctx);
+
+    if (rkmpp_dec_copy_out(dec)) {
+        LEAVE();
+        return;
+    }
+
     pthread_mutex_lock(&ctx->capture.queue_mutex);
     while (!TAILQ_EMPTY(&ctx->capture.pending_buffers)) {
         rkmpp_buffer = TAILQ_FIRST(&ctx->capture.pending_buffers);
@@ -177,169 +813,2386 @@ static void rkmpp_put_frames(struct rkmpp_dec_context *dec) {
     LEAVE();
 }
 
-static void rkmpp_apply_info_change(struct rkmpp_dec_context *dec, MppFrame frame) {
-    struct rkmpp_context *ctx = dec->ctx;
-    struct rkmpp_video_info video_info;
-
-    ENTER();
+/*
+ * Colorimetry of the frame in the capture format. It can show up or change
+ * without an info change, so it's picked up from every frame.
+ */
+static void rkmpp_dec_update_color(struct rkmpp_dec_context *dec, MppFrame frame) {
+    struct v4l2_pix_format_mplane *fmt = &dec->ctx->capture.format;
+    uint32_t colorspace, xfer_func, ycbcr_enc, quantization;
+
+    switch (mpp_frame_get_color_primaries(frame)) {
+    case MPP_FRAME_PRI_BT709:
+        colorspace = V4L2_COLORSPACE_REC709;
+        break;
+    case MPP_FRAME_PRI_BT470M:
+        colorspace = V4L2_COLORSPACE_470_SYSTEM_M;
+        break;
+    case MPP_FRAME_PRI_BT470BG:
+        colorspace = V4L2_COLORSPACE_470_SYSTEM_BG;
+        break;
+    case MPP_FRAME_PRI_SMPTE170M:
+        colorspace = V4L2_COLORSPACE_SMPTE170M;
+        break;
+    case MPP_FRAME_PRI_SMPTE240M:
+        colorspace = V4L2_COLORSPACE_SMPTE240M;
+        break;
+    case MPP_FRAME_PRI_BT2020:
+        colorspace = V4L2_COLORSPACE_BT2020;
+        break;
+    default:
+        colorspace = V4L2_COLORSPACE_DEFAULT;
+        break;
+    }
 
-    memcpy((void*) &video_info, (void*) &dec->video_info, sizeof(video_info));
+    switch (mpp_frame_get_color_trc(frame)) {
+    case MPP_FRAME_TRC_BT709:
+    case MPP_FRAME_TRC_SMPTE170M:
+    case MPP_FRAME_TRC_BT2020_10:
+    case MPP_FRAME_TRC_BT2020_12:
+        xfer_func = V4L2_XFER_FUNC_709;
+        break;
+    case MPP_FRAME_TRC_SMPTE240M:
+        xfer_func = V4L2_XFER_FUNC_SMPTE240M;
+        break;
+    case MPP_FRAME_TRC_LINEAR:
+        xfer_func = V4L2_XFER_FUNC_NONE;
+        break;
+    case MPP_FRAME_TRC_IEC61966_2_1:
+        xfer_func = V4L2_XFER_FUNC_SRGB;
+        break;
+    case MPP_FRAME_TRC_SMPTEST2084:
+        xfer_func = V4L2_XFER_FUNC_SMPTE2084;
+        break;
+    default:
+        xfer_func = V4L2_XFER_FUNC_DEFAULT;
+        break;
+    }
 
-    video_info.mpp_format = mpp_frame_get_fmt(frame);
-    video_info.width = mpp_frame_get_width(frame);
-    video_info.height = mpp_frame_get_height(frame);
-    video_info.hor_stride = mpp_frame_get_hor_stride(frame);
-    video_info.ver_stride = mpp_frame_get_ver_stride(frame);
-    video_info.size = mpp_frame_get_buf_size(frame);
-    video_info.valid = true;
+    switch (mpp_frame_get_colorspace(frame)) {
+    case MPP_FRAME_SPC_BT709:
+        ycbcr_enc = V4L2_YCBCR_ENC_709;
+        break;
+    case MPP_FRAME_SPC_BT470BG:
+    case MPP_FRAME_SPC_SMPTE170M:
+        ycbcr_enc = V4L2_YCBCR_ENC_601;
+        break;
+    case MPP_FRAME_SPC_SMPTE240M:
+        ycbcr_enc = V4L2_YCBCR_ENC_SMPTE240M;
+        break;
+    case MPP_FRAME_SPC_BT2020_NCL:
+        ycbcr_enc = V4L2_YCBCR_ENC_BT2020;
+        break;
+    case MPP_FRAME_SPC_BT2020_CL:
+        ycbcr_enc = V4L2_YCBCR_ENC_BT2020_CONST_LUM;
+        break;
+    default:
+        ycbcr_enc = V4L2_YCBCR_ENC_DEFAULT;
+        break;
+    }
 
-    if (!memcmp((void*) &video_info, (void*) &dec->video_info, sizeof(video_info))) {
-        LOGV(1, "ignore unchanged frame info\n");
+    switch (mpp_frame_get_color_range(frame)) {
+    case MPP_FRAME_RANGE_MPEG:
+        quantization = V4L2_QUANTIZATION_LIM_RANGE;
+        break;
+    case MPP_FRAME_RANGE_JPEG:
+        quantization = V4L2_QUANTIZATION_FULL_RANGE;
+        break;
+    default:
+        quantization = V4L2_QUANTIZATION_DEFAULT;
+        break;
+    }
 
-        ctx->mpi->control(ctx->mpp, MPP_DEC_SET_INFO_CHANGE_READY,
-        NULL);
+    if (fmt->colorspace == colorspace && fmt->xfer_func == xfer_func &&
+            fmt->ycbcr_enc == ycbcr_enc && fmt->quantization == quantization)
         return;
-    }
 
-    dec->video_info = video_info;
-    dec->video_info.dirty = true;
-    dec->video_info.event = dec->event_subscribed;
+    fmt->colorspace = colorspace;
+    fmt->xfer_func = xfer_func;
+    fmt->ycbcr_enc = ycbcr_enc;
+    fmt->quantization = quantization;
 
-    LOGV(1, "frame info changed: %dx%d(%dx%d:%d), mpp format(%d)\n",
-            dec->video_info.width, dec->video_info.height,
-            dec->video_info.hor_stride, dec->video_info.ver_stride,
-            dec->video_info.size, dec->video_info.mpp_format);
+    LOGV(1, "colorimetry: colorspace %d xfer %d ycbcr %d quantization %d\n",
+            colorspace, xfer_func, ycbcr_enc, quantization);
+}
 
-    /*
-     * Use ver_stride as new height, the visible rect would be returned
-     * in g_selection.
-     */
-    ctx->capture.format.num_planes = 1;
-    ctx->capture.format.width = dec->video_info.hor_stride;
-    ctx->capture.format.height = dec->video_info.ver_stride;
-    ctx->capture.format.plane_fmt[0].bytesperline = dec->video_info.hor_stride;
-    ctx->capture.format.plane_fmt[0].sizeimage = dec->video_info.size;
+/* Per frame metadata carried by the capture buffer */
+static void rkmpp_dec_fill_meta(struct rkmpp_dec_context *dec, MppFrame frame,
+        struct rkmpp_buffer *rkmpp_buffer) {
+    struct rkmpp_frame_meta *meta = &rkmpp_buffer->meta;
+
+    switch (mpp_frame_get_mode(frame) & MPP_FRAME_FLAG_FIELD_ORDER_MASK) {
+    case MPP_FRAME_FLAG_TOP_FIRST:
+        meta->field = V4L2_FIELD_INTERLACED_TB;
+        break;
+    case MPP_FRAME_FLAG_BOT_FIRST:
+        meta->field = V4L2_FIELD_INTERLACED_BT;
+        break;
+    default:
+        meta->field = V4L2_FIELD_NONE;
+        break;
+    }
 
-    assert(dec->video_info.mpp_format == MPP_FMT_YUV420SP);
-    ctx->capture.format.pixelformat = V4L2_PIX_FMT_NV12;
+    meta->errinfo = mpp_frame_get_errinfo(frame);
+    meta->mastering = mpp_frame_get_mastering_display(frame);
+    meta->content_light = mpp_frame_get_content_light(frame);
+    dec->hdr = *meta;
 
-    LEAVE();
+    if (!dec->thumbnail.enable)
+        dec->ctx->capture.format.field = meta->field;
 }
 
-static void *decoder_thread_fn(void *data){
-    struct rkmpp_dec_context *dec = data;
-    struct rkmpp_context *ctx = dec->ctx;
-    struct rkmpp_buffer *rkmpp_buffer;
-    MppFrame frame;
-    MppBuffer buffer;
-    MPP_RET ret;
-    int index;
+/* Jpegs decode to NV16 when 4:2:2 sampled, everything else to NV12 */
+static uint32_t rkmpp_dec_native_fourcc(struct rkmpp_dec_context *dec) {
+    switch (dec->video_info.mpp_format & MPP_FRAME_FMT_MASK) {
+    case MPP_FMT_YUV420SP:
+        return V4L2_PIX_FMT_NV12;
+    case MPP_FMT_YUV422SP:
+        return V4L2_PIX_FMT_NV16;
+    default:
+        LOGE("unsupported mpp format: %d\n", dec->video_info.mpp_format);
+        return V4L2_PIX_FMT_NV12;
+    }
+}
 
-    ENTER();
+/* Coded capture formats the decoded frames can be re-encoded to */
+static const struct rkmpp_fmt *rkmpp_dec_encoding(struct rkmpp_context *ctx, uint32_t fourcc) {
+    for (unsigned int i = 0; i < ctx->num_formats; i++) {
+        const struct rkmpp_fmt *fmt = &ctx->formats[i];
 
-    LOGV(1, "ctx(%p): starting decoder thread\n", (void*) ctx);
+        if (fmt->fourcc != fourcc)
+            continue;
 
-    while (1) {
-        pthread_mutex_lock(&dec->decoder_mutex);
+        if (fmt->type != MPP_VIDEO_CodingAVC && fmt->type != MPP_VIDEO_CodingHEVC)
+            return NULL;
 
-        while (!dec->mpp_streaming)
-            pthread_cond_wait(&dec->decoder_cond, &dec->decoder_mutex);
+        if (fmt->queues && !(fmt->queues & RKMPP_FMT_QUEUE(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)))
+            return NULL;
 
-        /* Feed available packets and frames to mpp */
-        rkmpp_put_packets(dec);
-        rkmpp_put_frames(dec);
+        return rkmpp_encoder_supported(fmt->type) ? fmt : NULL;
+    }
 
-        frame = NULL;
-        ret = ctx->mpi->decode_get_frame(ctx->mpp, &frame);
+    return NULL;
+}
 
-        pthread_mutex_unlock(&dec->decoder_mutex);
+/* Thumbnails are returned raw even when the capture format is coded */
+static bool rkmpp_dec_transcoding(struct rkmpp_dec_context *dec) {
+    return dec->transcode.fmt && !dec->thumbnail.enable;
+}
 
-        if (ret != MPP_OK || !frame) {
+/*
+ * Encoded size of the asked one, or of the stream. Until the stream size is
+ * known the buffers have room for the largest frame.
+ */
+static void rkmpp_dec_fill_encoded_fmt(struct rkmpp_dec_context *dec,
+        struct v4l2_pix_format_mplane *fmt, const struct rkmpp_fmt *coded,
+        uint32_t width, uint32_t height) {
+    struct rkmpp_context *ctx = dec->ctx;
+    uint32_t size;
+
+    if (!width || !height) {
+        width = dec->video_info.width;
+        height = dec->video_info.height;
+    }
+
+    if (width && height) {
+        width = clamp(width, coded->frmsize.min_width, coded->frmsize.max_width);
+        height = clamp(height, coded->frmsize.min_height, coded->frmsize.max_height);
+        if (ctx->max_width && ctx->max_height) {
+            width = min(width, ctx->max_width);
+            height = min(height, ctx->max_height);
+        }
+        width &= ~1;
+        height &= ~1;
+        size = width * height;
+    } else {
+        size = coded->frmsize.max_width * coded->frmsize.max_height;
+    }
+
+    fmt->num_planes = 1;
+    fmt->field = V4L2_FIELD_NONE;
+    fmt->width = width;
+    fmt->height = height;
+    fmt->pixelformat = coded->fourcc;
+    fmt->plane_fmt[0].bytesperline = 0;
+    fmt->plane_fmt[0].sizeimage = max(size * 3 / 4, RKMPP_TRANSCODE_MIN_SIZE);
+}
+
+/* Capture format for the current video info and output mode */
+static void rkmpp_dec_fill_capture_fmt(struct rkmpp_dec_context *dec,
+        struct v4l2_pix_format_mplane *fmt, uint32_t fourcc) {
+    const struct rkmpp_fmt *coded;
+    uint32_t width, height;
+
+    fmt->num_planes = 1;
+    fmt->field = V4L2_FIELD_NONE;
+
+    if (dec->thumbnail.enable) {
+        width = dec->thumbnail.width;
+        height = dec->thumbnail.height;
+        fourcc = V4L2_PIX_FMT_NV12;
+    } else if ((coded = rkmpp_dec_encoding(dec->ctx, fourcc))) {
+        rkmpp_dec_fill_encoded_fmt(dec, fmt, coded, dec->transcode.width,
+                dec->transcode.height);
+        return;
+    } else if (fourcc) {
+        /* Tightly packed visible rect */
+        width = dec->video_info.width & ~1;
+        height = dec->video_info.height & ~1;
+    } else {
+        /*
+         * Use ver_stride as new height, the visible rect would be returned
+         * in g_selection.
+         */
+        fmt->width = dec->video_info.hor_stride;
+        fmt->height = dec->video_info.ver_stride;
+        fmt->plane_fmt[0].bytesperline = dec->video_info.hor_stride;
+        fmt->plane_fmt[0].sizeimage = dec->video_info.size;
+        fmt->pixelformat = rkmpp_dec_native_fourcc(dec);
+        return;
+    }
+
+    fmt->width = width;
+    fmt->height = height;
+    fmt->pixelformat = fourcc;
+    fmt->plane_fmt[0].bytesperline = rkmpp_image_bytesperline(fourcc, width);
+    fmt->plane_fmt[0].sizeimage = rkmpp_image_size(fourcc, width, height);
+}
+
+/*
+ * Reference frames the stream may keep, as its SPS tells for H.264 and HEVC.
+ * Without one it's the limit of the highest level the vpu decodes at the
+ * coded size.
+ */
+static uint32_t rkmpp_dec_dpb_size(struct rkmpp_dec_context *dec) {
+    const struct rkmpp_fmt *fmt = dec->ctx->output.rkmpp_format;
+    uint32_t width = dec->video_info.width;
+    uint32_t height = dec->video_info.height;
+    uint64_t luma = (uint64_t) width * height;
+    uint32_t mbs;
+
+    switch (fmt ? fmt->type : MPP_VIDEO_CodingUnused) {
+    case MPP_VIDEO_CodingAVC:
+        if (dec->sps_dpb)
+            return dec->sps_dpb;
+
+        /* MaxDpbMbs of level 5.1 */
+        mbs = (round_up(width, 16) / 16) * (round_up(height, 16) / 16);
+        return clamp(184320 / max(mbs, 1), 1, 16);
+    case MPP_VIDEO_CodingHEVC:
+        if (dec->sps_dpb)
+            return dec->sps_dpb;
+
+        /* maxDpbSize from MaxLumaPs of level 5.1, see A.4.2 */
+        if (luma <= 8912896 / 4)
+            return 16;
+        if (luma <= 8912896 / 2)
+            return 12;
+        if (luma <= 8912896 * 3 / 4)
+            return 8;
+        return 6;
+    case MPP_VIDEO_CodingVP8:
+        /* Last, golden and altref */
+        return 3;
+    case MPP_VIDEO_CodingVP9:
+    case MPP_VIDEO_CodingAV1:
+        /* NUM_REF_FRAMES */
+        return 8;
+    case MPP_VIDEO_CodingMJPEG:
+        /* Every frame stands alone and comes out as soon as it's decoded */
+        return 0;
+    default:
+        return 16;
+    }
+}
+
+/*
+ * Size the frame group to the dpb and charge it against the drm memory caps.
+ * A group over a cap shrinks towards the frames mpp can't decode without,
+ * never below the keyframes a thumbnail session holds. Returns the frames of
+ * the group, 0 when even those don't fit.
+ */
+static uint32_t rkmpp_dec_charge_frame_group(struct rkmpp_dec_context *dec) {
+    struct rkmpp_context *ctx = dec->ctx;
+    uint32_t count = dec->dpb_size + RKMPP_DPB_EXTRA_FRAMES;
+    uint32_t least = dec->dpb_size + 1;
+
+    if (dec->thumbnail.enable) {
+        count = max(count, RKMPP_THUMBNAIL_FRAMES);
+        least = max(least, RKMPP_THUMBNAIL_FRAMES);
+    }
+
+    rkmpp_mem_uncharge(ctx, dec->frame_group_mem);
+    dec->frame_group_mem = 0;
+
+    while (rkmpp_mem_charge(ctx, (uint64_t) dec->video_info.size * count)) {
+        if (count <= least)
+            return 0;
+        count--;
+    }
+
+    dec->frame_group_mem = (uint64_t) dec->video_info.size * count;
+    mpp_buffer_group_limit_config(dec->frame_group, dec->video_info.size, count);
+
+    return count;
+}
+
+/*
+ * When copying out, the capture format doesn't depend on the client buffers
+ * being reallocated, so mpp is pointed at the frame group and the info
+ * change is acked right away. Without the memory for the group decoding
+ * stops, the info change isn't acked and waiting DQBUFs fail with ENOMEM.
+ */
+static void rkmpp_dec_use_internal_group(struct rkmpp_dec_context *dec) {
+    struct rkmpp_context *ctx = dec->ctx;
+
+    ENTER();
+
+    mpp_buffer_group_clear(dec->frame_group);
+
+    if (!rkmpp_dec_charge_frame_group(dec)) {
+        LOGE("ctx(%p): internal frames exceed the drm memory cap, decoding stopped\n",
+                (void *) ctx);
+
+        pthread_mutex_lock(&dec->decoder_mutex);
+        dec->mpp_streaming = false;
+        pthread_mutex_unlock(&dec->decoder_mutex);
+
+        rkmpp_cancel_waiters(ctx, &ctx->capture, ENOMEM);
+        LEAVE();
+        return;
+    }
+
+    ctx->mpi->control(ctx->mpp, MPP_DEC_SET_EXT_BUF_GROUP, dec->frame_group);
+    ctx->mpi->control(ctx->mpp, MPP_DEC_SET_INFO_CHANGE_READY, NULL);
+
+    dec->video_info.dirty = false;
+
+    LEAVE();
+}
+
+/*
+ * Count a corrupted frame and apply the error policy. Returns 0 for a clean
+ * frame, 1 for one returned with an error flag and -1 for one returned empty.
+ */
+static int rkmpp_dec_frame_error(struct rkmpp_dec_context *dec, MppFrame frame) {
+    bool discard = mpp_frame_get_discard(frame);
+    bool keep;
+
+    if (!discard && !mpp_frame_get_errinfo(frame))
+        return 0;
+
+    if (discard)
+        dec->error.discarded++;
+    else
+        dec->error.corrupted++;
+
+    switch (dec->error.policy) {
+    case RKMPP_ERROR_POLICY_CONCEAL:
+        keep = !discard;
+        break;
+    case RKMPP_ERROR_POLICY_ALL:
+        keep = true;
+        break;
+    default:
+        keep = false;
+        break;
+    }
+
+    if (keep)
+        dec->error.concealed++;
+
+    LOGV(2, "frame(%lld) %s, %s, %" PRIu64 " corrupted %" PRIu64 " discarded\n",
+            mpp_frame_get_pts(frame), discard ? "discarded" : "corrupted",
+            keep ? "returned" : "emptied", dec->error.corrupted, dec->error.discarded);
+
+    return keep ? 1 : -1;
+}
+
+/* The first pending capture buffer, for a frame copied or encoded into it */
+static struct rkmpp_buffer *rkmpp_dec_take_capture(struct rkmpp_dec_context *dec,
+        MppFrame frame) {
+    struct rkmpp_context *ctx = dec->ctx;
+    struct rkmpp_buffer *rkmpp_buffer;
+
+    pthread_mutex_lock(&ctx->capture.queue_mutex);
+    rkmpp_buffer = TAILQ_FIRST(&ctx->capture.pending_buffers);
+    if (rkmpp_buffer) {
+        TAILQ_REMOVE(&ctx->capture.pending_buffers, rkmpp_buffer, entry);
+        rkmpp_buffer_clr_pending(rkmpp_buffer);
+    }
+    pthread_mutex_unlock(&ctx->capture.queue_mutex);
+
+    if (!rkmpp_buffer) {
+        LOGV(2, "no capture buffer, drop frame(%lld)\n", mpp_frame_get_pts(frame));
+        if (dec->thumbnail.enable)
+            dec->thumbnail.dropped++;
+    }
+
+    return rkmpp_buffer;
+}
+
+/*
+ * The capture buffer a frame was copied or encoded into out of the ioctl
+ * lock, found again under it when it's still the one taken by its memory:
+ * not stopped, freed or queued again meanwhile. NULL for one that went.
+ */
+static struct rkmpp_buffer *rkmpp_dec_retake_capture(struct rkmpp_dec_context *dec,
+        uint32_t index, MppBuffer memory) {
+    struct rkmpp_buf_queue *capture = &dec->ctx->capture;
+    struct rkmpp_buffer *rkmpp_buffer = NULL;
+
+    pthread_mutex_lock(&capture->queue_mutex);
+    if (capture->streaming && index < capture->num_buffers &&
+            capture->buffers[index].rkmpp_buf == memory &&
+            rkmpp_buffer_queued(&capture->buffers[index]) &&
+            !rkmpp_buffer_pending(&capture->buffers[index]) &&
+            !rkmpp_buffer_available(&capture->buffers[index]))
+        rkmpp_buffer = &capture->buffers[index];
+    pthread_mutex_unlock(&capture->queue_mutex);
+
+    if (!rkmpp_buffer)
+        LOGV(2, "capture buffer %d went while copying into it\n", index);
+
+    return rkmpp_buffer;
+}
+
+static void rkmpp_dec_frame_image(struct rkmpp_dec_context *dec, MppFrame frame,
+        struct rkmpp_image *src) {
+    MppBuffer buffer = mpp_frame_get_buffer(frame);
+
+    *src = (struct rkmpp_image) {
+        .ptr = mpp_buffer_get_ptr(buffer),
+        .fd = mpp_buffer_get_fd(buffer),
+        .width = mpp_frame_get_width(frame),
+        .height = mpp_frame_get_height(frame),
+        .hor_stride = mpp_frame_get_hor_stride(frame),
+        .ver_stride = mpp_frame_get_ver_stride(frame),
+        .ycbcr_enc = dec->ctx->capture.format.ycbcr_enc,
+    };
+    /* Only every other chroma line of 4:2:2 jpegs is read */
+    if (rkmpp_dec_native_fourcc(dec) == V4L2_PIX_FMT_NV16)
+        src->uv_stride = src->hor_stride * 2;
+}
+
+/*
+ * Scale or convert a decoded frame into the first pending capture buffer.
+ * Called with the ioctl_mutex held, which the copy runs without. The
+ * buffer's memory keeps a reference meanwhile.
+ */
+static void rkmpp_dec_return_copy(struct rkmpp_dec_context *dec, MppFrame frame,
+        int error) {
+    struct rkmpp_context *ctx = dec->ctx;
+    struct v4l2_pix_format_mplane fmt = ctx->capture.format;
+    bool thumbnail = dec->thumbnail.enable;
+    struct rkmpp_buffer *rkmpp_buffer;
+    MppBuffer buffer = mpp_frame_get_buffer(frame);
+    MppBuffer memory;
+    struct rkmpp_image src, dst;
+    uint32_t index, size;
+    int ret;
+
+    ENTER();
+
+    rkmpp_buffer = rkmpp_dec_take_capture(dec, frame);
+    if (!rkmpp_buffer) {
+        LEAVE();
+        return;
+    }
+
+    index = rkmpp_buffer->index;
+    size = rkmpp_buffer->size;
+    memory = rkmpp_buffer->rkmpp_buf;
+    mpp_buffer_inc_ref(memory);
+
+    rkmpp_dec_frame_image(dec, frame, &src);
+    dst = (struct rkmpp_image) {
+        .ptr = mpp_buffer_get_ptr(memory),
+        .fd = mpp_buffer_get_fd(memory),
+        .width = fmt.width,
+        .height = fmt.height,
+        .hor_stride = fmt.plane_fmt[0].bytesperline,
+        .ver_stride = fmt.height,
+    };
+
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    /* Buffers of the format before an info change can be too small for it */
+    if (fmt.plane_fmt[0].sizeimage > size) {
+        LOGE("capture buffer %d too small: %u < %u\n", index, size,
+                fmt.plane_fmt[0].sizeimage);
+        ret = -1;
+    } else if (error < 0) {
+        ret = -1;
+    } else {
+        mpp_buffer_sync_begin(buffer);
+        mpp_buffer_sync_begin(memory);
+
+        if (thumbnail)
+            ret = rkmpp_image_scale_nv12(&src, &dst);
+        else
+            ret = rkmpp_image_convert_nv12(&src, dst.ptr, fmt.pixelformat);
+
+        mpp_buffer_sync_end(memory);
+        mpp_buffer_sync_end(buffer);
+
+        if (ret)
+            LOGE("failed to copy frame\n");
+    }
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    rkmpp_buffer = rkmpp_dec_retake_capture(dec, index, memory);
+    mpp_buffer_put(memory);
+    if (!rkmpp_buffer) {
+        LEAVE();
+        return;
+    }
+
+    if (rkmpp_buffer_error(rkmpp_buffer))
+        rkmpp_buffer_clr_error(rkmpp_buffer);
+
+    if (ret) {
+        rkmpp_buffer->bytesused = 0;
+        rkmpp_buffer_set_error(rkmpp_buffer);
+    } else {
+        rkmpp_buffer->bytesused = fmt.plane_fmt[0].sizeimage;
+        if (error)
+            rkmpp_buffer_set_error(rkmpp_buffer);
+    }
+
+    rkmpp_buffer->timestamp = mpp_frame_get_pts(frame);
+    rkmpp_dec_fill_meta(dec, frame, rkmpp_buffer);
+
+    /* Scaling works on whole frames, fields come out progressive */
+    if (thumbnail)
+        rkmpp_buffer->meta.field = V4L2_FIELD_NONE;
+
+    if (rkmpp_buffer_keyframe(rkmpp_buffer))
+        rkmpp_buffer_clr_keyframe(rkmpp_buffer);
+
+    if (thumbnail || rkmpp_dec_is_key_pts(dec, rkmpp_buffer->timestamp))
+        rkmpp_buffer_set_keyframe(rkmpp_buffer);
+
+    LOGV(3, "return copied frame: %d(%" PRIu64 ")\n", rkmpp_buffer->index,
+            rkmpp_buffer->timestamp);
+
+    pthread_mutex_lock(&ctx->capture.queue_mutex);
+    rkmpp_return_buffer(ctx, &ctx->capture, rkmpp_buffer);
+    rkmpp_queue_unlock(&ctx->capture);
+
+    LEAVE();
+}
+
+static void rkmpp_dec_drop_encoder(struct rkmpp_dec_context *dec) {
+    rkmpp_encoder_destroy(dec->transcode.encoder);
+    dec->transcode.encoder = NULL;
+    dec->transcode.generation++;
+
+    rkmpp_mem_uncharge(dec->ctx, dec->transcode.mem);
+    dec->transcode.mem = 0;
+}
+
+/*
+ * The scaled frame shows up with the first frame of another size. An encoder
+ * over the drm memory cap is dropped, its frames come back with errors.
+ */
+static int rkmpp_dec_charge_encoder(struct rkmpp_dec_context *dec) {
+    uint64_t mem = rkmpp_encoder_mem(dec->transcode.encoder);
+
+    if (mem == dec->transcode.mem)
+        return 0;
+
+    rkmpp_mem_uncharge(dec->ctx, dec->transcode.mem);
+    dec->transcode.mem = 0;
+    if (rkmpp_mem_charge(dec->ctx, mem)) {
+        LOGE("encoder frames exceed the drm memory cap\n");
+        rkmpp_dec_drop_encoder(dec);
+        RETURN_ERR(EBUSY, -1);
+    }
+
+    dec->transcode.mem = mem;
+    return 0;
+}
+
+/* Frame rate of the stream, from the interval its timestamps tell */
+static uint32_t rkmpp_dec_fps(struct rkmpp_dec_context *dec) {
+    uint64_t interval = max(dec->watchdog.interval, 1);
+
+    return (1000000 + interval / 2) / interval;
+}
+
+/*
+ * Encode a decoded frame into the first pending capture buffer. The frame
+ * goes to the encoder by its drm buffer and the packet is written into the
+ * client buffer, neither is copied. Called with the ioctl_mutex held, which
+ * the encoder runs without: it's taken off the session meanwhile, and one
+ * dropped for new settings in between is stale when it comes back.
+ */
+static void rkmpp_dec_return_encoded(struct rkmpp_dec_context *dec, MppFrame frame,
+        int error) {
+    struct rkmpp_context *ctx = dec->ctx;
+    struct v4l2_pix_format_mplane *fmt = &ctx->capture.format;
+    const struct rkmpp_transcode_info transcode = dec->transcode;
+    struct rkmpp_encoder *encoder;
+    struct rkmpp_buffer *rkmpp_buffer;
+    struct rkmpp_image src;
+    uint32_t fps = rkmpp_dec_fps(dec);
+    uint32_t width = fmt->width, height = fmt->height, index;
+    bool keyframe = false;
+    ssize_t length = -1;
+    MppBuffer memory;
+
+    ENTER();
+
+    rkmpp_buffer = rkmpp_dec_take_capture(dec, frame);
+    if (!rkmpp_buffer) {
+        LEAVE();
+        return;
+    }
+
+    index = rkmpp_buffer->index;
+    memory = rkmpp_buffer->rkmpp_buf;
+    mpp_buffer_inc_ref(memory);
+
+    rkmpp_dec_frame_image(dec, frame, &src);
+    encoder = dec->transcode.encoder;
+    dec->transcode.encoder = NULL;
+
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    if (!encoder && error >= 0)
+        encoder = rkmpp_encoder_create(transcode.fmt->type, width, height, fps,
+                transcode.bitrate, transcode.gop);
+    else if (encoder)
+        rkmpp_encoder_set_fps(encoder, fps);
+
+    if (encoder && error >= 0) {
+        length = rkmpp_encoder_encode(encoder, &src, mpp_frame_get_buffer(frame),
+                mpp_frame_get_pts(frame), memory, &keyframe);
+
+        /* Its packet may still come into the buffer, it goes before the buffer does */
+        if (length < 0 && errno == ETIMEDOUT) {
+            rkmpp_encoder_destroy(encoder);
+            encoder = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    if (dec->transcode.generation != transcode.generation) {
+        rkmpp_encoder_destroy(encoder);
+        length = -1;
+    } else if (!encoder) {
+        rkmpp_dec_drop_encoder(dec);
+    } else {
+        dec->transcode.encoder = encoder;
+        if (rkmpp_dec_charge_encoder(dec) < 0)
+            length = -1;
+    }
+
+    rkmpp_buffer = rkmpp_dec_retake_capture(dec, index, memory);
+    mpp_buffer_put(memory);
+    if (!rkmpp_buffer) {
+        LEAVE();
+        return;
+    }
+
+    if (rkmpp_buffer_error(rkmpp_buffer))
+        rkmpp_buffer_clr_error(rkmpp_buffer);
+
+    if (length < 0) {
+        rkmpp_buffer->bytesused = 0;
+        rkmpp_buffer_set_error(rkmpp_buffer);
+    } else {
+        rkmpp_buffer->bytesused = length;
+        if (error)
+            rkmpp_buffer_set_error(rkmpp_buffer);
+    }
+
+    rkmpp_buffer->timestamp = mpp_frame_get_pts(frame);
+    rkmpp_dec_fill_meta(dec, frame, rkmpp_buffer);
+
+    if (rkmpp_buffer_keyframe(rkmpp_buffer))
+        rkmpp_buffer_clr_keyframe(rkmpp_buffer);
+
+    /* The encoder picks its own idrs, the source keyframes don't matter */
+    if (keyframe)
+        rkmpp_buffer_set_keyframe(rkmpp_buffer);
+
+    LOGV(3, "return encoded frame: %d(%" PRIu64 ") %d bytes\n", rkmpp_buffer->index,
+            rkmpp_buffer->timestamp, rkmpp_buffer->bytesused);
+
+    pthread_mutex_lock(&ctx->capture.queue_mutex);
+    rkmpp_return_buffer(ctx, &ctx->capture, rkmpp_buffer);
+    rkmpp_queue_unlock(&ctx->capture);
+
+    LEAVE();
+}
+
+/*
+ * Stateless clients size their capture buffers from the output format and
+ * never wait for a source change, which is taken as it is when the buffers
+ * they have fit the stream.
+ */
+static bool rkmpp_dec_stateless_fits(struct rkmpp_dec_context *dec,
+        const struct rkmpp_video_info *info) {
+    const struct rkmpp_buf_queue *capture = &dec->ctx->capture;
+
+    return rkmpp_dec_stateless(dec) && !rkmpp_dec_copy_out(dec) &&
+            capture->num_buffers &&
+            (info->mpp_format & MPP_FRAME_FMT_MASK) == MPP_FMT_YUV420SP &&
+            capture->format.pixelformat == V4L2_PIX_FMT_NV12 &&
+            capture->format.plane_fmt[0].bytesperline == info->hor_stride &&
+            capture->format.height == info->ver_stride &&
+            capture->format.plane_fmt[0].sizeimage >= info->size;
+}
+
+static void rkmpp_apply_info_change(struct rkmpp_dec_context *dec, MppFrame frame) {
+    struct rkmpp_context *ctx = dec->ctx;
+    struct rkmpp_video_info video_info;
+    bool fits;
+
+    ENTER();
+
+    memcpy((void*) &video_info, (void*) &dec->video_info, sizeof(video_info));
+
+    video_info.mpp_format = mpp_frame_get_fmt(frame);
+    video_info.width = mpp_frame_get_width(frame);
+    video_info.height = mpp_frame_get_height(frame);
+    video_info.hor_stride = mpp_frame_get_hor_stride(frame);
+    video_info.ver_stride = mpp_frame_get_ver_stride(frame);
+    video_info.size = mpp_frame_get_buf_size(frame);
+    video_info.valid = true;
+
+    if (!memcmp((void*) &video_info, (void*) &dec->video_info, sizeof(video_info))) {
+        LOGV(1, "ignore unchanged frame info\n");
+
+        ctx->mpi->control(ctx->mpp, MPP_DEC_SET_INFO_CHANGE_READY,
+        NULL);
+        return;
+    }
+
+    fits = rkmpp_dec_stateless_fits(dec, &video_info);
+
+    dec->video_info = video_info;
+    dec->video_info.dirty = true;
+    dec->video_info.event = dec->event_subscribed && !fits;
+
+    LOGV(1, "frame info changed: %dx%d(%dx%d:%d), mpp format(%d)\n",
+            dec->video_info.width, dec->video_info.height,
+            dec->video_info.hor_stride, dec->video_info.ver_stride,
+            dec->video_info.size, dec->video_info.mpp_format);
+
+    rkmpp_dec_fill_capture_fmt(dec, &ctx->capture.format, dec->postproc_fourcc);
+
+    /* A stream followed in size needs an encoder of the new one */
+    rkmpp_dec_drop_encoder(dec);
+
+    dec->dpb_size = rkmpp_dec_dpb_size(dec);
+
+    /* Copied out frames never stay with mpp, their buffers come back at once */
+    ctx->capture.min_buffers = rkmpp_dec_copy_out(dec) ?
+            1 : dec->dpb_size + RKMPP_DPB_EXTRA_FRAMES;
+
+    LOGV(1, "dpb size: %d, min capture buffers: %d\n",
+            dec->dpb_size, ctx->capture.min_buffers);
+
+    if (rkmpp_dec_copy_out(dec))
+        rkmpp_dec_use_internal_group(dec);
+
+    if (fits) {
+        LOGV(1, "stateless capture buffers fit the stream\n");
+        ctx->mpi->control(ctx->mpp, MPP_DEC_SET_INFO_CHANGE_READY, NULL);
+        dec->video_info.dirty = false;
+    }
+
+    LEAVE();
+}
+
+/* Pixels per second of the stream, the coded size at the packet rate */
+static uint64_t rkmpp_dec_pixel_rate(struct rkmpp_dec_context *dec) {
+    const struct v4l2_pix_format_mplane *output = &dec->ctx->output.format;
+    uint64_t pixels;
+
+    if (dec->video_info.valid)
+        pixels = (uint64_t) dec->video_info.width * dec->video_info.height;
+    else if (output->width && output->height)
+        pixels = (uint64_t) output->width * output->height;
+    else
+        pixels = 1920 * 1080;
+
+    return pixels * 1000000 / max(dec->watchdog.interval, 1);
+}
+
+/*
+ * Put the session on the least loaded decoder block able to decode it,
+ * before mpp_init opens the device. A recreated mpp stays where it was.
+ */
+static void rkmpp_dec_place(struct rkmpp_dec_context *dec, MppCodingType type) {
+    struct rkmpp_context *ctx = dec->ctx;
+    MppDecCfg cfg;
+
+    if (!ctx->codec->vpu_balance)
+        return;
+
+    if (!dec->vpu.placed) {
+        rkmpp_vpu_place(&dec->vpu, type,
+                dec->video_info.valid ? dec->video_info.width : ctx->output.format.width,
+                dec->video_info.valid ? dec->video_info.height : ctx->output.format.height,
+                rkmpp_dec_pixel_rate(dec));
+    }
+
+    if (dec->vpu.hw_type < 0 || mpp_dec_cfg_init(&cfg) != MPP_OK)
+        return;
+
+    mpp_dec_cfg_set_s32(cfg, "base:hw_type", dec->vpu.hw_type);
+    if (ctx->mpi->control(ctx->mpp, MPP_DEC_SET_CFG, cfg) != MPP_OK)
+        LOGE("failed to put mpp on block %d\n", dec->vpu.block);
+    mpp_dec_cfg_deinit(cfg);
+}
+
+/*
+ * Create the mpp of the output coding with the session's settings. The
+ * frame timeout keeps the decoder thread, and the watchdog, running while
+ * mpp has nothing to give.
+ */
+static int rkmpp_dec_open_mpp(struct rkmpp_dec_context *dec) {
+    struct rkmpp_context *ctx = dec->ctx;
+    const struct rkmpp_fmt *fmt = ctx->output.rkmpp_format;
+    MppPollType timeout = RKMPP_DEC_FRAME_TIMEOUT_MS;
+
+    if (!fmt)
+        RETURN_ERR(EINVAL, -1);
+
+    if (mpp_create(&ctx->mpp, &ctx->mpi) != MPP_OK) {
+        LOGE("failed to create mpp\n");
+        ctx->mpp = NULL;
+        RETURN_ERR(ENODEV, -1);
+    }
+
+    ctx->mpi->control(ctx->mpp, MPP_SET_OUTPUT_TIMEOUT, &timeout);
+    rkmpp_dec_place(dec, fmt->type);
+
+    if (mpp_init(ctx->mpp, MPP_CTX_DEC, fmt->type) != MPP_OK) {
+        LOGE("failed to init mpp of coding %x\n", fmt->type);
+        mpp_destroy(ctx->mpp);
+        ctx->mpp = NULL;
+        RETURN_ERR(ENODEV, -1);
+    }
+
+    ctx->mpi->control(ctx->mpp, MPP_DEC_SET_EXT_BUF_GROUP, rkmpp_dec_copy_out(dec) ?
+            dec->frame_group : ctx->capture.external_group);
+    rkmpp_dec_apply_skip(dec);
+
+    /* A new mpp needs the parameter sets of stateless packets again */
+    if (dec->stateless)
+        dec->stateless->sent_valid = false;
+
+    return 0;
+}
+
+/* A capture buffer put to mpp and not returned yet */
+static bool rkmpp_dec_held_by_mpp(const struct rkmpp_buffer *rkmpp_buffer) {
+    return rkmpp_buffer_queued(rkmpp_buffer) && !rkmpp_buffer_pending(rkmpp_buffer) &&
+            !rkmpp_buffer_available(rkmpp_buffer) && !rkmpp_buffer_locked(rkmpp_buffer);
+}
+
+/* Mpp can't make frames without a capture buffer, that's no hang */
+static bool rkmpp_dec_capture_starved(struct rkmpp_dec_context *dec) {
+    struct rkmpp_context *ctx = dec->ctx;
+    bool starved = true;
+    unsigned int i;
+
+    pthread_mutex_lock(&ctx->capture.queue_mutex);
+    if (rkmpp_dec_copy_out(dec)) {
+        starved = TAILQ_EMPTY(&ctx->capture.pending_buffers);
+    } else {
+        for (i = 0; i < ctx->capture.num_buffers && starved; i++)
+            starved = !rkmpp_dec_held_by_mpp(&ctx->capture.buffers[i]);
+    }
+    pthread_mutex_unlock(&ctx->capture.queue_mutex);
+
+    return starved;
+}
+
+/*
+ * Mpp has what it needs to make a frame: a capture buffer, and packets past
+ * what the dpb can hold back for reordering or more waiting for it to take
+ * them. Until then a wait for a frame is a wait for the client.
+ */
+static bool rkmpp_dec_fed(struct rkmpp_dec_context *dec) {
+    struct rkmpp_context *ctx = dec->ctx;
+    bool waiting;
+
+    if (!dec->watchdog.packets || rkmpp_dec_capture_starved(dec))
+        return false;
+
+    pthread_mutex_lock(&ctx->output.queue_mutex);
+    waiting = !TAILQ_EMPTY(&ctx->output.pending_buffers);
+    pthread_mutex_unlock(&ctx->output.queue_mutex);
+
+    return waiting || dec->watchdog.packets > dec->dpb_size;
+}
+
+/*
+ * Packets went in and nothing came out for the watchdog's frame intervals.
+ * Fewer packets than the dpb can be held back for reordering, unless more
+ * are waiting for mpp to take them.
+ */
+static bool rkmpp_dec_hung(struct rkmpp_dec_context *dec) {
+    struct rkmpp_context *ctx = dec->ctx;
+    struct rkmpp_watchdog_info *watchdog = &dec->watchdog;
+    uint64_t now = rkmpp_now_us();
+    bool waiting;
+
+    if (!watchdog->frames || !watchdog->packets || !dec->mpp_streaming ||
+            !ctx->capture.streaming || dec->video_info.dirty)
+        return false;
+
+    if (rkmpp_dec_capture_starved(dec)) {
+        watchdog->progress = now;
+        return false;
+    }
+
+    pthread_mutex_lock(&ctx->output.queue_mutex);
+    waiting = !TAILQ_EMPTY(&ctx->output.pending_buffers);
+    pthread_mutex_unlock(&ctx->output.queue_mutex);
+
+    if (!waiting && watchdog->packets <= dec->dpb_size)
+        return false;
+
+    return now - watchdog->progress > watchdog->frames * watchdog->interval;
+}
+
+/*
+ * Give the capture buffers mpp holds, and a held eos packet, back to the
+ * client flagged with an error before mpp goes. Returns the frames returned.
+ */
+static unsigned int rkmpp_dec_return_held(struct rkmpp_dec_context *dec) {
+    struct rkmpp_context *ctx = dec->ctx;
+    struct rkmpp_buffer *rkmpp_buffer;
+    unsigned int i, returned = 0;
+
+    /* Referenced before mpp goes, so destroying it doesn't free them */
+    pthread_mutex_lock(&ctx->capture.queue_mutex);
+    for (i = 0; i < ctx->capture.num_buffers && !rkmpp_dec_copy_out(dec); i++) {
+        rkmpp_buffer = &ctx->capture.buffers[i];
+        if (!rkmpp_dec_held_by_mpp(rkmpp_buffer))
+            continue;
+
+        mpp_buffer_inc_ref(rkmpp_buffer->rkmpp_buf);
+        rkmpp_buffer_set_locked(rkmpp_buffer);
+
+        rkmpp_buffer->bytesused = 0;
+        if (!rkmpp_buffer_error(rkmpp_buffer))
+            rkmpp_buffer_set_error(rkmpp_buffer);
+
+        rkmpp_return_buffer(ctx, &ctx->capture, rkmpp_buffer);
+        returned++;
+    }
+    rkmpp_queue_unlock(&ctx->capture);
+
+    /* The flush it was held for won't finish */
+    if (dec->eos_packet) {
+        dec->eos_packet->bytesused = 0;
+        if (!rkmpp_buffer_error(dec->eos_packet))
+            rkmpp_buffer_set_error(dec->eos_packet);
+
+        pthread_mutex_lock(&ctx->output.queue_mutex);
+        rkmpp_return_buffer(ctx, &ctx->output, dec->eos_packet);
+        rkmpp_queue_unlock(&ctx->output);
+        dec->eos_packet = NULL;
+    }
+
+    return returned;
+}
+
+/*
+ * Recreate a hung mpp in place. The capture buffers it held and a held eos
+ * packet go back to the client flagged with an error, and decoding goes on
+ * from the next keyframe, so the session loses a gop instead of the stream.
+ */
+static void rkmpp_dec_recover(struct rkmpp_dec_context *dec) {
+    struct rkmpp_context *ctx = dec->ctx;
+    struct rkmpp_watchdog_info *watchdog = &dec->watchdog;
+    uint64_t start = rkmpp_now_us();
+    unsigned int returned;
+
+    ENTER();
+
+    LOGE("ctx(%p): no frame for %" PRIu64 "us after %" PRIu64 " packets, recreating mpp\n",
+            (void *) ctx, start - watchdog->progress, watchdog->packets);
+
+    returned = rkmpp_dec_return_held(dec);
+
+    ctx->mpi->reset(ctx->mpp);
+    mpp_destroy(ctx->mpp);
+    ctx->mpp = NULL;
+
+    if (rkmpp_dec_open_mpp(dec)) {
+        LOGE("ctx(%p): failed to recreate mpp, decoding stopped\n", (void *) ctx);
+        dec->mpp_streaming = false;
+    }
+
+    /* The references of anything before the next keyframe went with it */
+    watchdog->wait_keyframe = true;
+    watchdog->packets = 0;
+    watchdog->last_pts = (uint64_t) -1;
+    watchdog->progress = rkmpp_now_us();
+
+    watchdog->recoveries++;
+    watchdog->recovery_time = watchdog->progress - start;
+
+    LOGE("ctx(%p): mpp recreated in %" PRIu64 "us, %d frames returned empty, %" PRIu64
+            " recoveries\n", (void *) ctx, watchdog->recovery_time, returned,
+            watchdog->recoveries);
+
+    LEAVE();
+}
+
+/* Called with the ioctl_mutex held, like every change of the decoding state */
+static void rkmpp_dec_watchdog(struct rkmpp_dec_context *dec) {
+    pthread_mutex_lock(&dec->decoder_mutex);
+
+    if (rkmpp_dec_hung(dec))
+        rkmpp_dec_recover(dec);
+
+    pthread_mutex_unlock(&dec->decoder_mutex);
+}
+
+static void rkmpp_dec_unlock(void *mutex) {
+    pthread_mutex_unlock(mutex);
+}
+
+/*
+ * The decoder thread only takes a cancel while it waits for mpp to stream,
+ * holding nothing but the decoder mutex its cleanup releases. Anywhere else
+ * it may hold the ioctl or a queue mutex, and leave it locked for good.
+ */
+static void rkmpp_dec_cancel_thread(struct rkmpp_dec_context *dec) {
+    struct rkmpp_context *ctx = dec->ctx;
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+    pthread_mutex_lock(&dec->decoder_mutex);
+    dec->mpp_streaming = false;
+    pthread_mutex_unlock(&dec->decoder_mutex);
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    pthread_cancel(dec->decoder_thread);
+    pthread_join(dec->decoder_thread, NULL);
+    dec->decoder_thread = 0;
+}
+
+static void *decoder_thread_fn(void *data){
+    struct rkmpp_dec_context *dec = data;
+    struct rkmpp_context *ctx = dec->ctx;
+    struct rkmpp_buffer *rkmpp_buffer;
+    MppFrame frame;
+    MppBuffer buffer;
+    MPP_RET ret;
+    uint64_t start;
+    int index, error;
+    bool fed;
+
+    ENTER();
+
+    LOGV(1, "ctx(%p): starting decoder thread\n", (void*) ctx);
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    while (1) {
+        pthread_mutex_lock(&dec->decoder_mutex);
+
+        while (!dec->mpp_streaming) {
+            pthread_cleanup_push(rkmpp_dec_unlock, &dec->decoder_mutex);
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+            pthread_cond_wait(&dec->decoder_cond, &dec->decoder_mutex);
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+            pthread_cleanup_pop(0);
+        }
+
+        dec->decoder_cpu = sched_getcpu();
+
+        /* Feed available packets and frames to mpp */
+        rkmpp_put_packets(dec);
+        rkmpp_put_frames(dec);
+
+        frame = NULL;
+        fed = rkmpp_dec_fed(dec);
+        start = rkmpp_now_us();
+        ret = ctx->mpi->decode_get_frame(ctx->mpp, &frame);
+
+        if (ret == MPP_OK && frame) {
+            /* Only a wait mpp had everything for is the block's latency */
+            rkmpp_vpu_update(&dec->vpu, rkmpp_dec_pixel_rate(dec),
+                    fed ? rkmpp_now_us() - start : 0);
+
+            dec->watchdog.packets = 0;
+            dec->watchdog.progress = rkmpp_now_us();
+        }
+
+        pthread_mutex_unlock(&dec->decoder_mutex);
+
+        if (ret != MPP_OK || !frame) {
             if (ret != MPP_ERR_TIMEOUT)
                 LOGE("failed to get frame\n");
             goto next;
         }
 
-        pthread_mutex_lock(&ctx->ioctl_mutex);
+        pthread_mutex_lock(&ctx->ioctl_mutex);
+
+        if (!dec->mpp_streaming)
+            goto next_locked;
+
+        /* Handle info change frame */
+        if (mpp_frame_get_info_change(frame)) {
+            rkmpp_apply_info_change(dec, frame);
+            goto next_locked;
+        }
+
+        /* Handle eos frame, returning eos packet to userspace */
+        if (mpp_frame_get_eos(frame)) {
+            if (dec->eos_packet) {
+                assert(ctx->output.streaming);
+
+                dec->eos_packet->bytesused = 0;
+
+                LOGV(1, "return eos packet: %d\n", dec->eos_packet->index);
+
+                pthread_mutex_lock(&ctx->output.queue_mutex);
+                rkmpp_return_buffer(ctx, &ctx->output, dec->eos_packet);
+                rkmpp_queue_unlock(&ctx->output);
+                dec->eos_packet = NULL;
+            }
+
+            goto next_locked;
+        }
+
+        if (!ctx->capture.streaming)
+            goto next_locked;
+
+        /* Handle normal frame */
+        buffer = mpp_frame_get_buffer(frame);
+        if (!buffer) {
+            LOGE("frame(%lld) doesn't have buf\n", mpp_frame_get_pts(frame));
+
+            goto next_locked;
+        }
+
+        /* Only every Nth frame is returned, mpp reclaims the others on deinit */
+        if (dec->skip.frame_count++ % dec->skip.output_nth) {
+            LOGV(3, "skip frame(%lld)\n", mpp_frame_get_pts(frame));
+            goto next_locked;
+        }
+
+        rkmpp_dec_update_color(dec, frame);
+        error = rkmpp_dec_frame_error(dec, frame);
+
+        if (rkmpp_dec_transcoding(dec)) {
+            rkmpp_dec_return_encoded(dec, frame, error);
+            goto next_locked;
+        }
+
+        if (rkmpp_dec_copy_out(dec)) {
+            rkmpp_dec_return_copy(dec, frame, error);
+            goto next_locked;
+        }
+
+        /* Mpp decodes into committed capture buffers only */
+        index = mpp_buffer_get_index(buffer);
+        if (index < 0 || index >= (int) ctx->capture.num_buffers ||
+                ctx->capture.buffers[index].rkmpp_buf != buffer) {
+            LOGE("frame(%lld) in a buffer not ours: %d\n", mpp_frame_get_pts(frame), index);
+            goto next_locked;
+        }
+
+        mpp_buffer_inc_ref(buffer);
+        rkmpp_buffer = &ctx->capture.buffers[index];
+
+        rkmpp_buffer->timestamp = mpp_frame_get_pts(frame);
+        rkmpp_dec_fill_meta(dec, frame, rkmpp_buffer);
+        rkmpp_buffer_set_locked(rkmpp_buffer);
+
+        if (rkmpp_buffer_keyframe(rkmpp_buffer))
+            rkmpp_buffer_clr_keyframe(rkmpp_buffer);
+
+        if (rkmpp_dec_is_key_pts(dec, rkmpp_buffer->timestamp))
+            rkmpp_buffer_set_keyframe(rkmpp_buffer);
+
+        if (rkmpp_buffer_error(rkmpp_buffer))
+            rkmpp_buffer_clr_error(rkmpp_buffer);
+
+        if (error < 0) {
+            rkmpp_buffer->bytesused = 0;
+        } else {
+            /* Size of NV12 or NV16 image */
+            rkmpp_buffer->bytesused = dec->video_info.hor_stride * dec->video_info.ver_stride;
+            if (rkmpp_dec_native_fourcc(dec) == V4L2_PIX_FMT_NV16)
+                rkmpp_buffer->bytesused *= 2;
+            else
+                rkmpp_buffer->bytesused = rkmpp_buffer->bytesused * 3 / 2;
+        }
+
+        if (error)
+            rkmpp_buffer_set_error(rkmpp_buffer);
+
+        LOGV(3, "return frame: %d(%" PRIu64 ")\n", index, rkmpp_buffer->timestamp);
+
+        pthread_mutex_lock(&ctx->capture.queue_mutex);
+        rkmpp_return_buffer(ctx, &ctx->capture, rkmpp_buffer);
+        rkmpp_queue_unlock(&ctx->capture);
+next_locked:
+        pthread_mutex_unlock(&ctx->ioctl_mutex);
+next:
+        /* Update poll event after every loop */
+        pthread_mutex_lock(&ctx->ioctl_mutex);
+        if (!frame)
+            rkmpp_dec_watchdog(dec);
+        rkmpp_update_poll_event(ctx);
+        pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+        if (frame)
+            mpp_frame_deinit(&frame);
+    }
+
+    LEAVE();
+    return NULL;
+}
+
+static const struct v4l2_queryctrl *rkmpp_dec_find_ctrl(uint32_t id, bool next) {
+    const struct v4l2_queryctrl *found = NULL;
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(rkmpp_dec_ctrls); i++) {
+        const struct v4l2_queryctrl *ctrl = &rkmpp_dec_ctrls[i];
+
+        if (!next && ctrl->id == id)
+            return ctrl;
+
+        /* The lowest id above the given one */
+        if (next && ctrl->id > id && (!found || ctrl->id < found->id))
+            found = ctrl;
+    }
+
+    return found;
+}
+
+static int rkmpp_dec_queryctrl(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    const struct v4l2_queryctrl *query = in_buf;
+    struct v4l2_queryctrl *qctrl = out_buf;
+    const struct v4l2_queryctrl *ctrl;
+    uint32_t id = query->id & ~(V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND);
+
+    ENTER();
+
+    ctrl = rkmpp_dec_find_ctrl(id, query->id & V4L2_CTRL_FLAG_NEXT_CTRL);
+    if (!ctrl) {
+        LOGV(3, "unsupported ctrl: %x\n", query->id);
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    *qctrl = *ctrl;
+
+    LEAVE();
+    return 0;
+}
+
+/* Compound controls are only walked with V4L2_CTRL_FLAG_NEXT_COMPOUND */
+static const struct v4l2_query_ext_ctrl *rkmpp_dec_find_ext_ctrl(
+        const struct v4l2_query_ext_ctrl *ctrls, unsigned int num, uint32_t id,
+        uint32_t next) {
+    const struct v4l2_query_ext_ctrl *found = NULL;
+
+    for (unsigned int i = 0; i < num; i++) {
+        const struct v4l2_query_ext_ctrl *ctrl = &ctrls[i];
+        bool compound = ctrl->type >= V4L2_CTRL_COMPOUND_TYPES;
+
+        if (!next && ctrl->id == id)
+            return ctrl;
+
+        if (!(next & (compound ? V4L2_CTRL_FLAG_NEXT_COMPOUND : V4L2_CTRL_FLAG_NEXT_CTRL)))
+            continue;
+
+        if (ctrl->id > id && (!found || ctrl->id < found->id))
+            found = ctrl;
+    }
+
+    return found;
+}
+
+static const struct v4l2_query_ext_ctrl *rkmpp_dec_find_stateless_ctrl(uint32_t id,
+        uint32_t next) {
+    return rkmpp_dec_find_ext_ctrl(rkmpp_dec_stateless_ctrls,
+            ARRAY_SIZE(rkmpp_dec_stateless_ctrls), id, next);
+}
+
+static const struct v4l2_query_ext_ctrl *rkmpp_dec_find_hdr_ctrl(uint32_t id,
+        uint32_t next) {
+    return rkmpp_dec_find_ext_ctrl(rkmpp_dec_hdr_ctrls,
+            ARRAY_SIZE(rkmpp_dec_hdr_ctrls), id, next);
+}
+
+static int rkmpp_dec_query_ext_ctrl(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    const struct v4l2_query_ext_ctrl *query = in_buf;
+    struct v4l2_query_ext_ctrl *qctrl = out_buf;
+    const struct v4l2_query_ext_ctrl *stateless, *hdr;
+    const struct v4l2_queryctrl *ctrl;
+    uint32_t next = query->id & (V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND);
+    uint32_t id = query->id & ~next;
+
+    ENTER();
+
+    ctrl = !next || (next & V4L2_CTRL_FLAG_NEXT_CTRL) ?
+            rkmpp_dec_find_ctrl(id, next) : NULL;
+    stateless = rkmpp_dec_find_stateless_ctrl(id, next);
+    hdr = rkmpp_dec_find_hdr_ctrl(id, next);
+
+    if (hdr && (!stateless || hdr->id < stateless->id))
+        stateless = hdr;
+
+    if (stateless && (!ctrl || stateless->id < ctrl->id)) {
+        *qctrl = *stateless;
+    } else if (ctrl) {
+        qctrl->id = ctrl->id;
+        qctrl->type = ctrl->type;
+        snprintf(qctrl->name, sizeof(qctrl->name), "%s", (const char *) ctrl->name);
+        qctrl->minimum = ctrl->minimum;
+        qctrl->maximum = ctrl->maximum;
+        qctrl->step = ctrl->step;
+        qctrl->default_value = ctrl->default_value;
+        qctrl->flags = ctrl->flags;
+        qctrl->elem_size = ctrl->type == V4L2_CTRL_TYPE_INTEGER64 ?
+                sizeof(int64_t) : sizeof(int32_t);
+        qctrl->elems = 1;
+    } else {
+        LOGV(3, "unsupported ctrl: %x\n", query->id);
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    LEAVE();
+    return 0;
+}
+
+/* Cpus the decoder thread may run on, the first 31 of them */
+static int32_t rkmpp_dec_thread_cpus(struct rkmpp_dec_context *dec) {
+    cpu_set_t set;
+    int32_t cpus = 0;
+
+    if (pthread_getaffinity_np(dec->decoder_thread, sizeof(set), &set))
+        return 0;
+
+    for (int i = 0; i < 31; i++)
+        if (CPU_ISSET(i, &set))
+            cpus |= 1 << i;
+
+    return cpus;
+}
+
+static int rkmpp_dec_thread_prio(struct rkmpp_dec_context *dec) {
+    struct sched_param param;
+    int policy;
+
+    if (pthread_getschedparam(dec->decoder_thread, &policy, &param) ||
+            policy != SCHED_FIFO)
+        return 0;
+
+    return param.sched_priority;
+}
+
+static int rkmpp_dec_querymenu(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct v4l2_querymenu *menu = out_buf;
+    const char * const *names;
+    unsigned int num;
+
+    ENTER();
+
+    *menu = *(const struct v4l2_querymenu *) in_buf;
+
+    switch (menu->id) {
+    case V4L2_CID_RKMPP_ERROR_POLICY:
+        names = rkmpp_dec_error_policies;
+        num = ARRAY_SIZE(rkmpp_dec_error_policies);
+        break;
+    case V4L2_CID_STATELESS_H264_DECODE_MODE:
+        names = rkmpp_dec_decode_modes;
+        num = ARRAY_SIZE(rkmpp_dec_decode_modes);
+        break;
+    case V4L2_CID_STATELESS_H264_START_CODE:
+        names = rkmpp_dec_start_codes;
+        num = ARRAY_SIZE(rkmpp_dec_start_codes);
+        break;
+    default:
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    /* Menus of the stateless api skip the modes that aren't supported */
+    if (menu->index >= num || !names[menu->index])
+        RETURN_ERR(EINVAL, -1);
+
+    snprintf((char *) menu->name, sizeof(menu->name), "%s", names[menu->index]);
+    menu->reserved = 0;
+
+    LEAVE();
+    return 0;
+}
+
+static int rkmpp_dec_g_ctrl(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_dec_context *dec = ctx->subctx;
+    struct v4l2_control *ctrl = out_buf;
+    int ret = 0;
+
+    ENTER();
+
+    *ctrl = *(const struct v4l2_control *) in_buf;
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+    switch (ctrl->id) {
+    case V4L2_CID_MIN_BUFFERS_FOR_CAPTURE:
+        ctrl->value = ctx->capture.min_buffers;
+        break;
+    case V4L2_CID_MIN_BUFFERS_FOR_OUTPUT:
+        ctrl->value = ctx->output.min_buffers;
+        break;
+    case V4L2_CID_RKMPP_SESSION_MEM:
+        ctrl->value = min(ctx->mem_used >> 10, INT32_MAX);
+        break;
+    case V4L2_CID_RKMPP_TOTAL_MEM:
+        ctrl->value = min(rkmpp_mem_total() >> 10, INT32_MAX);
+        break;
+    case V4L2_CID_RKMPP_ERROR_POLICY:
+        ctrl->value = dec->error.policy;
+        break;
+    case V4L2_CID_RKMPP_CORRUPTED_FRAMES:
+        ctrl->value = min(dec->error.corrupted, INT32_MAX);
+        break;
+    case V4L2_CID_RKMPP_DISCARDED_FRAMES:
+        ctrl->value = min(dec->error.discarded, INT32_MAX);
+        break;
+    case V4L2_CID_RKMPP_CONCEALED_FRAMES:
+        ctrl->value = min(dec->error.concealed, INT32_MAX);
+        break;
+    case V4L2_CID_RKMPP_DQBUF_WAIT_P99:
+        pthread_mutex_lock(&ctx->capture.queue_mutex);
+        ctrl->value = min(rkmpp_hist_percentile(&ctx->capture.client_wait, 99), INT32_MAX);
+        pthread_mutex_unlock(&ctx->capture.queue_mutex);
+        break;
+    case V4L2_CID_RKMPP_FRAME_IDLE_P99:
+        pthread_mutex_lock(&ctx->capture.queue_mutex);
+        ctrl->value = min(rkmpp_hist_percentile(&ctx->capture.buffer_wait, 99), INT32_MAX);
+        pthread_mutex_unlock(&ctx->capture.queue_mutex);
+        break;
+    case V4L2_CID_RKMPP_DECODER_CPUS:
+        ctrl->value = rkmpp_dec_thread_cpus(dec);
+        break;
+    case V4L2_CID_RKMPP_DECODER_PRIO:
+        ctrl->value = rkmpp_dec_thread_prio(dec);
+        break;
+    case V4L2_CID_RKMPP_DECODER_CPU:
+        ctrl->value = dec->decoder_cpu;
+        break;
+    case V4L2_CID_RKMPP_SKIP_NONREF:
+        ctrl->value = dec->skip.skip_nonref;
+        break;
+    case V4L2_CID_RKMPP_KEYFRAME_ONLY:
+        ctrl->value = dec->skip.keyframe_only;
+        break;
+    case V4L2_CID_RKMPP_OUTPUT_NTH:
+        ctrl->value = dec->skip.output_nth;
+        break;
+    case V4L2_CID_RKMPP_THUMBNAIL:
+        ctrl->value = dec->thumbnail.enable;
+        break;
+    case V4L2_CID_RKMPP_THUMBNAIL_WIDTH:
+        ctrl->value = dec->thumbnail.width;
+        break;
+    case V4L2_CID_RKMPP_THUMBNAIL_HEIGHT:
+        ctrl->value = dec->thumbnail.height;
+        break;
+    case V4L2_CID_MPEG_VIDEO_BITRATE:
+        ctrl->value = dec->transcode.bitrate;
+        break;
+    case V4L2_CID_MPEG_VIDEO_GOP_SIZE:
+        ctrl->value = dec->transcode.gop;
+        break;
+    case V4L2_CID_RKMPP_WATCHDOG_FRAMES:
+        ctrl->value = dec->watchdog.frames;
+        break;
+    case V4L2_CID_RKMPP_RECOVERIES:
+        ctrl->value = min(dec->watchdog.recoveries, INT32_MAX);
+        break;
+    case V4L2_CID_RKMPP_RECOVERY_TIME:
+        ctrl->value = min(dec->watchdog.recovery_time, INT32_MAX);
+        break;
+    case V4L2_CID_RKMPP_VPU_BLOCK:
+        ctrl->value = dec->vpu.block;
+        break;
+    case V4L2_CID_RKMPP_VPU_LOAD:
+        ctrl->value = min(rkmpp_vpu_session_load(&dec->vpu), INT32_MAX);
+        break;
+    default:
+        LOGV(3, "unsupported ctrl: %x\n", ctrl->id);
+        errno = EINVAL;
+        ret = -1;
+        break;
+    }
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LEAVE();
+    return ret;
+}
+
+static int rkmpp_dec_s_ctrl(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_dec_context *dec = ctx->subctx;
+    struct v4l2_control *ctrl = out_buf;
+    const struct v4l2_queryctrl *qctrl;
+
+    ENTER();
+
+    *ctrl = *(const struct v4l2_control *) in_buf;
+
+    qctrl = rkmpp_dec_find_ctrl(ctrl->id, false);
+    if (!qctrl) {
+        LOGV(3, "unsupported ctrl: %x\n", ctrl->id);
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    if (qctrl->flags & V4L2_CTRL_FLAG_READ_ONLY)
+        RETURN_ERR(EACCES, -1);
+
+    ctrl->value = clamp(ctrl->value, qctrl->minimum, qctrl->maximum);
+    ctrl->value -= (ctrl->value - qctrl->minimum) % qctrl->step;
+
+    /* Packets are fed under decoder_mutex, frames returned under ioctl_mutex */
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    /* The thumbnail mode decides where mpp decodes to, fixed while streaming */
+    if (dec->mpp_streaming && (ctrl->id == V4L2_CID_RKMPP_THUMBNAIL ||
+            ctrl->id == V4L2_CID_RKMPP_THUMBNAIL_WIDTH ||
+            ctrl->id == V4L2_CID_RKMPP_THUMBNAIL_HEIGHT)) {
+        pthread_mutex_unlock(&ctx->ioctl_mutex);
+        LOGE("thumbnail mode can't change while streaming\n");
+        RETURN_ERR(EBUSY, -1);
+    }
+
+    pthread_mutex_lock(&dec->decoder_mutex);
+
+    switch (ctrl->id) {
+    case V4L2_CID_RKMPP_SKIP_NONREF:
+        dec->skip.skip_nonref = ctrl->value;
+        break;
+    case V4L2_CID_RKMPP_KEYFRAME_ONLY:
+        dec->skip.keyframe_only = ctrl->value;
+        break;
+    case V4L2_CID_RKMPP_OUTPUT_NTH:
+        dec->skip.output_nth = ctrl->value;
+        dec->skip.frame_count = 0;
+        break;
+    case V4L2_CID_RKMPP_THUMBNAIL:
+        dec->thumbnail.enable = ctrl->value;
+        break;
+    case V4L2_CID_RKMPP_THUMBNAIL_WIDTH:
+        dec->thumbnail.width = ctrl->value;
+        break;
+    case V4L2_CID_RKMPP_THUMBNAIL_HEIGHT:
+        dec->thumbnail.height = ctrl->value;
+        break;
+    case V4L2_CID_RKMPP_ERROR_POLICY:
+        dec->error.policy = ctrl->value;
+        break;
+    case V4L2_CID_MPEG_VIDEO_BITRATE:
+        dec->transcode.bitrate = ctrl->value;
+        rkmpp_dec_drop_encoder(dec);
+        break;
+    case V4L2_CID_MPEG_VIDEO_GOP_SIZE:
+        dec->transcode.gop = ctrl->value;
+        rkmpp_dec_drop_encoder(dec);
+        break;
+    case V4L2_CID_RKMPP_WATCHDOG_FRAMES:
+        dec->watchdog.frames = ctrl->value;
+        break;
+    }
+
+    LOGV(1, "skip nonref: %d keyframe only: %d output nth: %d thumbnail: %d(%dx%d) error policy: %d\n",
+            dec->skip.skip_nonref, dec->skip.keyframe_only,
+            dec->skip.output_nth, dec->thumbnail.enable,
+            dec->thumbnail.width, dec->thumbnail.height, dec->error.policy);
+
+    rkmpp_dec_apply_skip(dec);
+
+    pthread_mutex_unlock(&dec->decoder_mutex);
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LEAVE();
+    return 0;
+}
+
+/* The stateless frontend, made when the session first uses it */
+static struct rkmpp_stateless_info *rkmpp_dec_stateless_info(struct rkmpp_dec_context *dec) {
+    struct rkmpp_stateless_info *stateless = dec->stateless;
+
+    if (stateless)
+        return stateless;
+
+    stateless = calloc(1, sizeof(*stateless));
+    if (!stateless)
+        RETURN_ERR(ENOMEM, NULL);
+
+    for (int i = 0; i < RKMPP_STATELESS_REQUESTS; i++)
+        stateless->requests[i].fd = -1;
+
+    dec->stateless = stateless;
+    return stateless;
+}
+
+/*
+ * Controls set in the client's request fd. There is no media device, so no
+ * MEDIA_IOC_REQUEST_ALLOC either: a cuse node can't hand fds to its client,
+ * and the fd is only a name the client picked for a set of controls, never
+ * polled or queued. Clients that can't make one set the current controls
+ * before each QBUF. A new request starts from the current controls, taking
+ * the slot of the one set longest ago when all are in use, as a client that
+ * never queues its requests only leaks its own.
+ */
+static struct rkmpp_stateless_request *rkmpp_dec_find_request(
+        struct rkmpp_stateless_info *stateless, int fd, bool create) {
+    struct rkmpp_stateless_request *request, *oldest = NULL;
+
+    for (int i = 0; i < RKMPP_STATELESS_REQUESTS; i++) {
+        request = &stateless->requests[i];
+
+        if (request->fd == fd)
+            return request;
+
+        if (!oldest || (oldest->fd >= 0 &&
+                (request->fd < 0 || request->age < oldest->age)))
+            oldest = request;
+    }
+
+    if (!create)
+        return NULL;
+
+    if (oldest->fd >= 0)
+        LOGE("dropping controls of request %d, never queued\n", oldest->fd);
+
+    oldest->fd = fd;
+    oldest->ctrls = stateless->cur;
+
+    return oldest;
+}
+
+/* Get, set or try one stateless control of vals */
+static int rkmpp_dec_stateless_ctrl(struct rkmpp_h264_ctrls *vals,
+        struct v4l2_ext_control *ctrl, unsigned long cmd) {
+    const struct v4l2_query_ext_ctrl *query;
+    void *payload;
+
+    query = rkmpp_dec_find_stateless_ctrl(ctrl->id, 0);
+    if (!query)
+        RETURN_ERR(EINVAL, -1);
+
+    switch (ctrl->id) {
+    case V4L2_CID_STATELESS_H264_DECODE_MODE:
+    case V4L2_CID_STATELESS_H264_START_CODE:
+        if (cmd == VIDIOC_G_EXT_CTRLS)
+            ctrl->value = query->default_value;
+        else if (ctrl->value != query->default_value)
+            RETURN_ERR(EINVAL, -1);
+        return 0;
+    case V4L2_CID_STATELESS_H264_SPS:
+        payload = &vals->sps;
+        break;
+    case V4L2_CID_STATELESS_H264_PPS:
+        payload = &vals->pps;
+        break;
+    case V4L2_CID_STATELESS_H264_SCALING_MATRIX:
+        payload = &vals->scaling;
+        break;
+    case V4L2_CID_STATELESS_H264_DECODE_PARAMS:
+        payload = &vals->decode;
+        break;
+    default:
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    if (ctrl->size < query->elem_size) {
+        ctrl->size = query->elem_size;
+        RETURN_ERR(ENOSPC, -1);
+    }
+
+    if (cmd == VIDIOC_G_EXT_CTRLS) {
+        if (cuse_write_client((unsigned long) ctrl->ptr, payload, query->elem_size) < 0)
+            RETURN_ERR(EFAULT, -1);
+        return 0;
+    }
+
+    if (cuse_read_client(payload, (unsigned long) ctrl->ptr, query->elem_size) < 0)
+        RETURN_ERR(EFAULT, -1);
+
+    /* Slice groups are baseline only and need their maps in the pps */
+    if (ctrl->id == V4L2_CID_STATELESS_H264_PPS && vals->pps.num_slice_groups_minus1) {
+        LOGE("slice groups are not supported\n");
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    if (ctrl->id == V4L2_CID_STATELESS_H264_SPS && vals->sps.chroma_format_idc > 3)
+        RETURN_ERR(EINVAL, -1);
+
+    return 0;
+}
+
+/* The HDR10 metadata of the last frame, in the v4l2 layout */
+static int rkmpp_dec_hdr_ctrl(struct rkmpp_dec_context *dec,
+        struct v4l2_ext_control *ctrl) {
+    const MppFrameMasteringDisplayMetadata *mastering = &dec->hdr.mastering;
+    const MppFrameContentLightMetadata *content_light = &dec->hdr.content_light;
+    struct v4l2_ctrl_hdr10_mastering_display display;
+    struct v4l2_ctrl_hdr10_cll_info cll;
+    const struct v4l2_query_ext_ctrl *query;
+    void *payload;
+
+    query = rkmpp_dec_find_hdr_ctrl(ctrl->id, 0);
+    if (!query)
+        RETURN_ERR(EINVAL, -1);
+
+    if (ctrl->size < query->elem_size) {
+        ctrl->size = query->elem_size;
+        RETURN_ERR(ENOSPC, -1);
+    }
+
+    if (ctrl->id == V4L2_CID_COLORIMETRY_HDR10_CLL_INFO) {
+        cll.max_content_light_level = content_light->MaxCLL;
+        cll.max_pic_average_light_level = content_light->MaxFALL;
+        payload = &cll;
+    } else {
+        for (int i = 0; i < 3; i++) {
+            display.display_primaries_x[i] = mastering->display_primaries[i][0];
+            display.display_primaries_y[i] = mastering->display_primaries[i][1];
+        }
+        display.white_point_x = mastering->white_point[0];
+        display.white_point_y = mastering->white_point[1];
+        display.max_display_mastering_luminance = mastering->max_luminance;
+        display.min_display_mastering_luminance = mastering->min_luminance;
+        payload = &display;
+    }
+
+    if (cuse_write_client((unsigned long) ctrl->ptr, payload, query->elem_size) < 0)
+        RETURN_ERR(EFAULT, -1);
+
+    return 0;
+}
+
+/* The plain controls through the extended ioctls, one by one */
+static int rkmpp_dec_plain_ext_ctrls(struct cuse_codec *codec,
+        struct v4l2_ext_controls *ctrls, struct v4l2_ext_control *ctrl,
+        unsigned long cmd) {
+    struct v4l2_control in, out;
+    const struct v4l2_queryctrl *qctrl;
+    int ret = 0;
+
+    for (uint32_t i = 0; i < ctrls->count; i++) {
+        in = (struct v4l2_control) { .id = ctrl[i].id, .value = ctrl[i].value };
+        out = in;
+
+        if (cmd == VIDIOC_G_EXT_CTRLS) {
+            ret = rkmpp_dec_g_ctrl(codec, &in, &out);
+        } else if (cmd == VIDIOC_S_EXT_CTRLS) {
+            ret = rkmpp_dec_s_ctrl(codec, &in, &out);
+        } else {
+            qctrl = rkmpp_dec_find_ctrl(ctrl[i].id, false);
+            if (!qctrl)
+                RETURN_ERR(EINVAL, -1);
+            if (qctrl->flags & V4L2_CTRL_FLAG_READ_ONLY)
+                RETURN_ERR(EACCES, -1);
+        }
+
+        if (ret < 0) {
+            ctrls->error_idx = i;
+            return ret;
+        }
+
+        ctrl[i].value = out.value;
+    }
+
+    return 0;
+}
+
+/*
+ * Stateless controls are set in a request, to go with the output buffer
+ * queued with its fd, or as the current ones. The request fd is the
+ * client's and only names its controls, which are taken over on QBUF.
+ */
+static int rkmpp_dec_ext_ctrls(struct cuse_codec *codec, const void *in_buf,
+        void *out_buf, unsigned long cmd) {
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_dec_context *dec = ctx->subctx;
+    struct v4l2_ext_controls *ctrls = out_buf;
+    struct v4l2_ext_control ctrl[RKMPP_EXT_CTRLS_MAX];
+    struct rkmpp_stateless_info *stateless;
+    struct rkmpp_stateless_request *request = NULL;
+    struct rkmpp_h264_ctrls *vals = NULL;
+    bool is_stateless = false;
+    int ret = -1;
+
+    ENTER();
+
+    *ctrls = *(const struct v4l2_ext_controls *) in_buf;
+    ctrls->error_idx = ctrls->count;
+
+    if (!ctrls->count) {
+        LEAVE();
+        return 0;
+    }
+
+    if (ctrls->count > RKMPP_EXT_CTRLS_MAX)
+        RETURN_ERR(EINVAL, -1);
+
+    if (cuse_read_client(ctrl, (unsigned long) ctrls->controls,
+            ctrls->count * sizeof(*ctrl)) < 0)
+        RETURN_ERR(EFAULT, -1);
+
+    /* The HDR10 controls only read, in calls of their own too */
+    if (rkmpp_dec_find_hdr_ctrl(ctrl[0].id, 0)) {
+        if (cmd != VIDIOC_G_EXT_CTRLS || ctrls->which == V4L2_CTRL_WHICH_REQUEST_VAL)
+            RETURN_ERR(EACCES, -1);
+
+        ret = 0;
+        pthread_mutex_lock(&ctx->ioctl_mutex);
+        for (uint32_t i = 0; i < ctrls->count && !ret; i++) {
+            ret = rkmpp_dec_hdr_ctrl(dec, &ctrl[i]);
+            if (ret < 0)
+                ctrls->error_idx = i;
+        }
+        pthread_mutex_unlock(&ctx->ioctl_mutex);
+        goto write_back;
+    }
+
+    /* Stateless controls come in calls of their own, apart from the plain ones */
+    for (uint32_t i = 0; i < ctrls->count; i++) {
+        bool found = rkmpp_dec_find_stateless_ctrl(ctrl[i].id, 0);
+
+        if (i && found != is_stateless) {
+            ctrls->error_idx = i;
+            RETURN_ERR(EINVAL, -1);
+        }
+        is_stateless = found;
+    }
+
+    if (!is_stateless) {
+        if (ctrls->which == V4L2_CTRL_WHICH_REQUEST_VAL)
+            RETURN_ERR(EACCES, -1);
+
+        ret = rkmpp_dec_plain_ext_ctrls(codec, ctrls, ctrl, cmd);
+        goto write_back;
+    }
+
+    vals = malloc(sizeof(*vals));
+    if (!vals)
+        RETURN_ERR(ENOMEM, -1);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    stateless = rkmpp_dec_stateless_info(dec);
+    if (!stateless)
+        goto out;
+
+    if (ctrls->which == V4L2_CTRL_WHICH_REQUEST_VAL) {
+        if (ctrls->request_fd < 0) {
+            errno = EINVAL;
+            goto out;
+        }
+
+        request = rkmpp_dec_find_request(stateless, ctrls->request_fd,
+                cmd == VIDIOC_S_EXT_CTRLS);
+
+        /* Requests are gone once queued, nothing to read back */
+        if (!request && cmd == VIDIOC_G_EXT_CTRLS) {
+            errno = EACCES;
+            goto out;
+        }
+    }
+
+    if (ctrls->which == V4L2_CTRL_WHICH_DEF_VAL)
+        memset(vals, 0, sizeof(*vals));
+    else
+        *vals = request ? request->ctrls : stateless->cur;
+
+    for (uint32_t i = 0; i < ctrls->count; i++) {
+        if (rkmpp_dec_stateless_ctrl(vals, &ctrl[i], cmd) < 0) {
+            ctrls->error_idx = i;
+            goto out;
+        }
+    }
+
+    if (cmd == VIDIOC_S_EXT_CTRLS) {
+        if (ctrls->which == V4L2_CTRL_WHICH_DEF_VAL) {
+            errno = EINVAL;
+            goto out;
+        }
+
+        if (request) {
+            request->ctrls = *vals;
+            request->age = ++stateless->age;
+        } else {
+            stateless->cur = *vals;
+        }
+    }
+
+    ret = 0;
+out:
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+    free(vals);
+
+write_back:
+    /* Values and the sizes asked for go back into the client's array */
+    if ((ret == 0 || errno == ENOSPC) && cmd != VIDIOC_TRY_EXT_CTRLS &&
+            cuse_write_client((unsigned long) ctrls->controls, ctrl,
+                    ctrls->count * sizeof(*ctrl)) < 0)
+        RETURN_ERR(EFAULT, -1);
 
-        if (!dec->mpp_streaming)
-            goto next_locked;
+    LEAVE();
+    return ret;
+}
 
-        /* Handle info change frame */
-        if (mpp_frame_get_info_change(frame)) {
-            rkmpp_apply_info_change(dec, frame);
-            goto next_locked;
+static int rkmpp_dec_g_ext_ctrls(void *userdata, const void *in_buf, void *out_buf) {
+    return rkmpp_dec_ext_ctrls(userdata, in_buf, out_buf, VIDIOC_G_EXT_CTRLS);
+}
+
+static int rkmpp_dec_s_ext_ctrls(void *userdata, const void *in_buf, void *out_buf) {
+    return rkmpp_dec_ext_ctrls(userdata, in_buf, out_buf, VIDIOC_S_EXT_CTRLS);
+}
+
+static int rkmpp_dec_try_ext_ctrls(void *userdata, const void *in_buf, void *out_buf) {
+    return rkmpp_dec_ext_ctrls(userdata, in_buf, out_buf, VIDIOC_TRY_EXT_CTRLS);
+}
+
+/*
+ * The decoder's own format is NV12, or NV16 for 4:2:2 jpegs, padded to the
+ * strides. Any other format, or NV12 with a smaller stride, is written by
+ * the post-processing stage, which can't make 4:2:2 out of 4:2:0. Coded
+ * formats are written by the encoder, at the asked size or the stream's.
+ */
+static int rkmpp_dec_try_capture_fmt(struct rkmpp_dec_context *dec,
+        struct v4l2_format *f, uint32_t *postproc_fourcc) {
+    struct rkmpp_context *ctx = dec->ctx;
+    struct v4l2_pix_format_mplane *pix = &f->fmt.pix_mp;
+    uint32_t native = rkmpp_dec_native_fourcc(dec);
+    const struct rkmpp_fmt *coded;
+    uint32_t fourcc = 0;
+
+    ENTER();
+
+    coded = rkmpp_dec_encoding(ctx, pix->pixelformat);
+    if (coded) {
+        if (dec->thumbnail.enable) {
+            LOGV(1, "thumbnails can't be transcoded\n");
+            RETURN_ERR(EINVAL, -1);
         }
 
-        /* Handle eos frame, returning eos packet to userspace */
-        if (mpp_frame_get_eos(frame)) {
-            if (dec->eos_packet) {
-                assert(ctx->output.streaming);
+        rkmpp_dec_fill_encoded_fmt(dec, pix, coded, pix->width, pix->height);
+        *postproc_fourcc = coded->fourcc;
 
-                dec->eos_packet->bytesused = 0;
+        LEAVE();
+        return 0;
+    }
 
-                LOGV(1, "return eos packet: %d\n", dec->eos_packet->index);
+    if (!rkmpp_find_fmt(ctx, pix->pixelformat, f->type)) {
+        LOGV(1, "unsupported format: %.4s\n", (char *) &pix->pixelformat);
+        RETURN_ERR(EINVAL, -1);
+    }
 
-                pthread_mutex_lock(&ctx->output.queue_mutex);
-                TAILQ_INSERT_TAIL(&ctx->output.avail_buffers, dec->eos_packet, entry);
-                rkmpp_buffer_set_available(dec->eos_packet);
-                pthread_mutex_unlock(&ctx->output.queue_mutex);
-                dec->eos_packet = NULL;
-            }
+    if (pix->pixelformat == V4L2_PIX_FMT_NV16)
+        fourcc = 0;
+    else if (pix->pixelformat != native)
+        fourcc = pix->pixelformat;
+    else if (dec->video_info.valid && pix->plane_fmt[0].bytesperline &&
+            pix->plane_fmt[0].bytesperline < dec->video_info.hor_stride)
+        fourcc = V4L2_PIX_FMT_NV12;
+
+    if (dec->video_info.valid || dec->thumbnail.enable) {
+        rkmpp_dec_fill_capture_fmt(dec, pix, fourcc);
+    } else {
+        /* Nothing decoded yet, the size comes with the info change */
+        if (rkmpp_try_fmt(ctx, f) < 0)
+            RETURN_ERR(errno, -1);
+    }
 
-            goto next_locked;
+    *postproc_fourcc = fourcc;
+
+    LEAVE();
+    return 0;
+}
+
+static int rkmpp_dec_try_fmt(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_dec_context *dec = ctx->subctx;
+    struct v4l2_format *f = out_buf;
+    uint32_t postproc_fourcc;
+    int ret;
+
+    ENTER();
+
+    *f = *(const struct v4l2_format *) in_buf;
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+    if (V4L2_TYPE_IS_OUTPUT(f->type))
+        ret = rkmpp_try_fmt(ctx, f);
+    else
+        ret = rkmpp_dec_try_capture_fmt(dec, f, &postproc_fourcc);
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LEAVE();
+    return ret;
+}
+
+/*
+ * Capture lists the raw formats, then the coded ones S_FMT takes for
+ * re-encoding the frames. Nothing of the session goes into the list, the
+ * replies of the node are probed with it.
+ */
+static int rkmpp_dec_enum_fmt(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct v4l2_fmtdesc *f = out_buf;
+    const struct rkmpp_fmt *fmt;
+    uint32_t index;
+
+    ENTER();
+
+    if (!rkmpp_ioctl_enum_fmt(userdata, in_buf, out_buf)) {
+        LEAVE();
+        return 0;
+    }
+
+    *f = *(const struct v4l2_fmtdesc *) in_buf;
+    if (errno != EINVAL || V4L2_TYPE_IS_OUTPUT(f->type))
+        RETURN_ERR(errno, -1);
+
+    /* Past the raw formats, which are the capture formats rkmpp_find_fmt finds */
+    index = f->index;
+    for (unsigned int i = 0; i < ctx->num_formats; i++) {
+        fmt = &ctx->formats[i];
+        if (rkmpp_find_fmt(ctx, fmt->fourcc, f->type) == fmt && !index--)
+            RETURN_ERR(EINVAL, -1);
+    }
+
+    for (unsigned int i = 0; i < ctx->num_formats; i++) {
+        fmt = &ctx->formats[i];
+        if (rkmpp_dec_encoding(ctx, fmt->fourcc) != fmt || index--)
+            continue;
+
+        f->pixelformat = fmt->fourcc;
+        f->flags = V4L2_FMT_FLAG_COMPRESSED;
+        strncpy((char *) f->description, fmt->name, sizeof(f->description) - 1);
+
+        LEAVE();
+        return 0;
+    }
+
+    RETURN_ERR(EINVAL, -1);
+}
+
+/*
+ * Stateless clients allocate their capture buffers right after setting the
+ * output format, without waiting for mpp to tell the stream's. They get the
+ * format mpp decodes the size to until it does.
+ */
+static void rkmpp_dec_prime_capture_fmt(struct rkmpp_dec_context *dec,
+        const struct v4l2_pix_format_mplane *output) {
+    struct rkmpp_context *ctx = dec->ctx;
+    struct v4l2_pix_format_mplane *fmt = &ctx->capture.format;
+    uint32_t width = round_up(output->width, RKMPP_MB_DIM);
+    uint32_t height = round_up(output->height, RKMPP_MB_DIM);
+
+    fmt->width = width;
+    fmt->height = height;
+    fmt->pixelformat = V4L2_PIX_FMT_NV12;
+    fmt->field = V4L2_FIELD_NONE;
+    fmt->num_planes = 1;
+    fmt->plane_fmt[0].bytesperline = width;
+    fmt->plane_fmt[0].sizeimage = width * height * 3 / 2;
+
+    ctx->capture.rkmpp_format = rkmpp_find_fmt(ctx, V4L2_PIX_FMT_NV12,
+            V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+}
+
+static int rkmpp_dec_s_fmt(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_dec_context *dec = ctx->subctx;
+    const struct v4l2_format *req = in_buf;
+    struct v4l2_format *f = out_buf;
+    struct rkmpp_buf_queue *queue;
+    uint32_t postproc_fourcc;
+    int ret = -1;
+
+    ENTER();
+
+    *f = *(const struct v4l2_format *) in_buf;
+
+    queue = rkmpp_get_queue(ctx, f->type);
+    if (!queue)
+        RETURN_ERR(EINVAL, -1);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    if (queue->num_buffers) {
+        LOGE("can't change format with buffers allocated\n");
+        errno = EBUSY;
+        goto out;
+    }
+
+    if (V4L2_TYPE_IS_OUTPUT(f->type)) {
+        if (rkmpp_try_fmt(ctx, f) < 0)
+            goto out;
+
+        if (f->fmt.pix_mp.pixelformat == V4L2_PIX_FMT_H264_SLICE) {
+            if (!rkmpp_dec_stateless_info(dec))
+                goto out;
+
+            if (!dec->video_info.valid && !ctx->capture.num_buffers)
+                rkmpp_dec_prime_capture_fmt(dec, &f->fmt.pix_mp);
+        }
+    } else {
+        if (rkmpp_dec_try_capture_fmt(dec, f, &postproc_fourcc) < 0)
+            goto out;
+
+        /* Mpp already decodes into the client buffers or the internal group */
+        if (dec->video_info.valid && !dec->video_info.dirty &&
+                !postproc_fourcc != !dec->postproc_fourcc) {
+            LOGE("can't switch post-processing before the next info change\n");
+            errno = EBUSY;
+            goto out;
         }
 
-        if (!ctx->capture.streaming)
-            goto next_locked;
+        dec->postproc_fourcc = postproc_fourcc;
+        LOGV(1, "capture post-processing: %.4s\n",
+                postproc_fourcc ? (char *) &postproc_fourcc : "none");
 
-        /* Handle normal frame */
-        buffer = mpp_frame_get_buffer(frame);
-        if (!buffer) {
-            LOGE("frame(%lld) doesn't have buf\n", mpp_frame_get_pts(frame));
+        /* The asked size is kept, a zero one follows the stream */
+        rkmpp_dec_drop_encoder(dec);
+        dec->transcode.fmt = rkmpp_dec_encoding(ctx, postproc_fourcc);
+        dec->transcode.width = dec->transcode.fmt ? req->fmt.pix_mp.width : 0;
+        dec->transcode.height = dec->transcode.fmt ? req->fmt.pix_mp.height : 0;
 
-            goto next_locked;
+        /* The pending info change can be acked now */
+        if (dec->video_info.dirty && rkmpp_dec_copy_out(dec))
+            rkmpp_dec_use_internal_group(dec);
+    }
+
+    queue->format = f->fmt.pix_mp;
+    queue->rkmpp_format = V4L2_TYPE_IS_OUTPUT(f->type) || !dec->transcode.fmt ?
+            rkmpp_find_fmt(ctx, f->fmt.pix_mp.pixelformat, f->type) : dec->transcode.fmt;
+    ret = 0;
+out:
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LEAVE();
+    return ret;
+}
+
+/*
+ * A stateless output buffer goes with the controls of the request it's
+ * queued in, which become the current ones. There is no media device to
+ * queue the request on, MEDIA_REQUEST_IOC_QUEUE is implied by the QBUF.
+ * Buffers queued without one use the current controls.
+ */
+static int rkmpp_dec_qbuf(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_dec_context *dec = ctx->subctx;
+    const struct v4l2_buffer *buffer = in_buf;
+    struct rkmpp_stateless_request *request;
+
+    ENTER();
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    if (rkmpp_dec_stateless(dec) && V4L2_TYPE_IS_OUTPUT(buffer->type) &&
+            buffer->index < VIDEO_MAX_FRAME) {
+        if (buffer->flags & V4L2_BUF_FLAG_REQUEST_FD) {
+            request = rkmpp_dec_find_request(dec->stateless, buffer->request_fd, false);
+            if (request) {
+                dec->stateless->cur = request->ctrls;
+                request->fd = -1;
+            }
         }
 
-        mpp_buffer_inc_ref(buffer);
+        /* The buffer isn't pending yet, the decoder thread can't look at it */
+        dec->stateless->frames[buffer->index] = dec->stateless->cur;
+    }
 
-        index = mpp_buffer_get_index(buffer);
-        rkmpp_buffer = &ctx->capture.buffers[index];
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
 
-        rkmpp_buffer->timestamp = mpp_frame_get_pts(frame);
-        rkmpp_buffer_set_locked(rkmpp_buffer);
+    /*
+     * A ring client's next packet brings back the frames it is done with.
+     * The decoder thread holds its mutex across a frame wait, so it is
+     * woken without it.
+     */
+    if (rkmpp_take_ring_buffers(ctx))
+        pthread_cond_signal(&dec->decoder_cond);
 
-        if (mpp_frame_get_errinfo(frame) || mpp_frame_get_discard(frame)) {
-            LOGE("frame err or discard\n");
-            rkmpp_buffer->bytesused = 0;
-            rkmpp_buffer_set_error(rkmpp_buffer);
-        } else {
-            /* Size of NV12 image */
-            rkmpp_buffer->bytesused = dec->video_info.hor_stride * dec->video_info.ver_stride * 3 / 2;
+    LEAVE();
+    return rkmpp_ioctl_qbuf(userdata, in_buf, out_buf);
+}
+
+/*
+ * Stop decoding and drop mpp with the frames it holds, which go back to the
+ * client flagged with an error. The stream info is kept, a seek keeps the
+ * capture buffers and the new mpp's info change is acked as unchanged.
+ * Called with the ioctl_mutex held.
+ */
+static void rkmpp_dec_stop(struct rkmpp_dec_context *dec) {
+    struct rkmpp_context *ctx = dec->ctx;
+    unsigned int returned;
+
+    /* Waits out a decode_get_frame, the thread then sees it stopped */
+    pthread_mutex_lock(&dec->decoder_mutex);
+    dec->mpp_streaming = false;
+    pthread_mutex_unlock(&dec->decoder_mutex);
+
+    if (!ctx->mpp)
+        return;
+
+    returned = rkmpp_dec_return_held(dec);
+
+    ctx->mpi->reset(ctx->mpp);
+    mpp_destroy(ctx->mpp);
+    ctx->mpp = NULL;
+
+    rkmpp_vpu_release(&dec->vpu);
+
+    dec->watchdog.wait_keyframe = false;
+    dec->watchdog.packets = 0;
+    dec->watchdog.last_pts = (uint64_t) -1;
+
+    LOGV(1, "ctx(%p): decoding stopped, %d frames returned empty\n",
+            (void *) ctx, returned);
+}
+
+/*
+ * Mpp is made for the coding of the output queue when it starts streaming
+ * and goes away when it stops, a seek starts over with a new one. A capture
+ * queue streaming again after an info change has the buffers for it.
+ */
+static int rkmpp_dec_streamon(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_dec_context *dec = ctx->subctx;
+    int type = *(const int *) in_buf;
+    int ret = 0;
+
+    ENTER();
+
+    if (rkmpp_ioctl_streamon(userdata, in_buf, out_buf) < 0)
+        RETURN_ERR(errno, -1);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    if (!V4L2_TYPE_IS_OUTPUT(type)) {
+        if (ctx->mpp && dec->video_info.dirty && !rkmpp_dec_copy_out(dec)) {
+            ctx->mpi->control(ctx->mpp, MPP_DEC_SET_INFO_CHANGE_READY, NULL);
+            dec->video_info.dirty = false;
         }
+        goto out;
+    }
 
-        LOGV(3, "return frame: %d(%" PRIu64 ")\n", index, rkmpp_buffer->timestamp);
+    if (dec->mpp_streaming)
+        goto out;
 
-        pthread_mutex_lock(&ctx->capture.queue_mutex);
-        TAILQ_INSERT_TAIL(&ctx->capture.avail_buffers, rkmpp_buffer, entry);
-        rkmpp_buffer_set_available(rkmpp_buffer);
-        pthread_mutex_unlock(&ctx->capture.queue_mutex);
-next_locked:
-        pthread_mutex_unlock(&ctx->ioctl_mutex);
-next:
-        /* Update poll event after every loop */
-        pthread_mutex_lock(&ctx->ioctl_mutex);
-        rkmpp_update_poll_event(ctx);
-        pthread_mutex_unlock(&ctx->ioctl_mutex);
+    if (!ctx->mpp && rkmpp_dec_open_mpp(dec) < 0) {
+        ret = -1;
+        goto out;
+    }
 
-        if (frame)
-            mpp_frame_deinit(&frame);
+    dec->watchdog.progress = rkmpp_now_us();
+
+    pthread_mutex_lock(&dec->decoder_mutex);
+    dec->mpp_streaming = true;
+    pthread_cond_signal(&dec->decoder_cond);
+    pthread_mutex_unlock(&dec->decoder_mutex);
+out:
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    /* The queue doesn't stream without a decoder behind it */
+    if (ret < 0) {
+        LOGE("ctx(%p): failed to start decoding\n", (void *) ctx);
+        rkmpp_ioctl_streamoff(userdata, in_buf, out_buf);
+        RETURN_ERR(ENODEV, -1);
     }
 
     LEAVE();
-    return NULL;
+    return 0;
+}
+
+static int rkmpp_dec_streamoff(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_dec_context *dec = ctx->subctx;
+    int type = *(const int *) in_buf;
+
+    ENTER();
+
+    if (!rkmpp_get_queue(ctx, type))
+        RETURN_ERR(EINVAL, -1);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    if (V4L2_TYPE_IS_OUTPUT(type)) {
+        rkmpp_dec_stop(dec);
+    } else {
+        /* Frames mpp holds are the client's again, mpp won't get them back */
+        pthread_mutex_lock(&dec->decoder_mutex);
+        rkmpp_dec_return_held(dec);
+        pthread_mutex_unlock(&dec->decoder_mutex);
+    }
+
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LEAVE();
+    return rkmpp_ioctl_streamoff(userdata, in_buf, out_buf);
 }
 
+/* What a session takes from its node, all the probe replies depend on */
+static void rkmpp_dec_setup_node(struct rkmpp_context *ctx, struct cuse_codec *codec) {
+    ctx->is_decoder = true;
+    ctx->formats = rkmpp_dec_fmts;
+    ctx->num_formats = ARRAY_SIZE(rkmpp_dec_fmts);
+
+    if (codec->codecs[0])
+        ctx->codecs = strdup(codec->codecs);
+    ctx->max_width = codec->max_width;
+    ctx->max_height = codec->max_height;
+}
+
+/* The probe queries don't reach the decoder, a bare context answers them */
+static struct cuse_replies *codec_probe(struct cuse_codec *node) {
+    struct cuse_codec codec = *node;
+    struct cuse_replies *replies;
+    struct rkmpp_context *ctx = context_init();
+
+    if (!ctx)
+        return NULL;
+
+    rkmpp_dec_setup_node(ctx, &codec);
+    ctx->codec = &codec;
+    codec.priv = ctx;
+
+    replies = rkmpp_probe_replies(&codec);
+
+    context_destroy(ctx);
+    return replies;
+}
 
 static int codec_init(void* userdata) {
     struct cuse_codec* codec = userdata;
@@ -368,13 +3221,52 @@ static int codec_init(void* userdata) {
         RETURN_ERR(errno, MPP_ERR_NOMEM);
     }
 
-    ctx->formats = rkmpp_dec_fmts;
-    ctx->num_formats = ARRAY_SIZE(rkmpp_dec_fmts);
+    /* Internal frames of mpp when copying out, apart from the client buffers */
+    ret = mpp_buffer_group_get_internal(&dec->frame_group, MPP_BUFFER_TYPE_DRM);
+    if (ret != MPP_OK) {
+        LOGE("failed to use mpp drm buf group\n");
+        errno = ENODEV;
+        free(dec);
+        RETURN_ERR(errno, MPP_ERR_NOMEM);
+    }
+
+    rkmpp_dec_setup_node(ctx, codec);
+
+    ctx->codec = codec;
+
+    ctx->mem_limit = (uint64_t) codec->max_session_mem << 20;
+    ctx->mem_limit_total = (uint64_t) codec->max_total_mem << 20;
+
+    ctx->output.min_buffers = RKMPP_MIN_OUTPUT_BUFFERS;
+    ctx->capture.min_buffers = 1;
+
+    dec->skip.output_nth = 1;
+    memset(dec->skip.key_pts, 0xff, sizeof(dec->skip.key_pts));
+
+    dec->thumbnail.width = 320;
+    dec->thumbnail.height = 180;
+
+    dec->transcode.gop = 60;
+
+    dec->watchdog.frames = RKMPP_WATCHDOG_FRAMES;
+    dec->watchdog.interval = RKMPP_WATCHDOG_INTERVAL_US;
+    dec->watchdog.last_pts = (uint64_t) -1;
+
+    dec->vpu.block = -1;
+    dec->vpu.hw_type = -1;
 
     pthread_cond_init(&dec->decoder_cond, NULL);
     pthread_mutex_init(&dec->decoder_mutex, NULL);
+    dec->decoder_cpu = -1;
     pthread_create(&dec->decoder_thread, NULL, decoder_thread_fn, dec);
 
+    if (codec->decoder_cpus || codec->decoder_prio)
+        cuse_set_thread_sched(dec->decoder_thread, codec->decoder_cpus,
+                codec->decoder_prio);
+
+    LOGV(1, "ctx(%p): decoder thread cpus: %x prio: %d\n", (void *) ctx,
+            rkmpp_dec_thread_cpus(dec), rkmpp_dec_thread_prio(dec));
+
     LEAVE();
     return MPP_OK;
 }
@@ -391,16 +3283,27 @@ static void codec_deinit(void *userdata) {
 
     ENTER();
 
-    if (dec->decoder_thread) {
-        pthread_cancel(dec->decoder_thread);
-        pthread_join(dec->decoder_thread, NULL);
-    }
+    if (dec->decoder_thread)
+        rkmpp_dec_cancel_thread(dec);
 
-    if (dec->mpp_streaming) {
+    if (ctx->mpp) {
         ctx->mpi->reset(ctx->mpp);
         mpp_destroy(ctx->mpp);
+        ctx->mpp = NULL;
     }
 
+    rkmpp_dec_drop_encoder(dec);
+    rkmpp_vpu_release(&dec->vpu);
+
+    if (dec->stateless) {
+        free(dec->stateless->au);
+        free(dec->stateless);
+    }
+
+    if (dec->frame_group)
+        mpp_buffer_group_put(dec->frame_group);
+    rkmpp_mem_uncharge(ctx, dec->frame_group_mem);
+
     LEAVE();
 
     free(dec);
@@ -410,19 +3313,286 @@ static void codec_deinit(void *userdata) {
     codec->priv = NULL;
 }
 
+/**
+ * struct rkmpp_dec_state - Decoder of a session as handed over to another daemon
+ * @streaming:  Mpp was streaming, the new daemon picks the stream up.
+ * @event_subscribed:   V4L2 event subscribed.
+ * @video_info: Stream info, kept so the new mpp's info change doesn't reach
+ *              the client again.
+ * @skip:       Frame skipping settings.
+ * @thumbnail:  Thumbnail mode settings.
+ * @error:      Error resilience settings and statistics.
+ * @transcode_width:    Encoded width asked for.
+ * @transcode_height:   Encoded height asked for.
+ * @transcode_bitrate:  Target bits per second.
+ * @transcode_gop:  Frames between keyframes.
+ * @watchdog_frames:    Frame intervals without progress before recovering.
+ * @watchdog_interval:  Frame interval in us.
+ * @recoveries: Times mpp was recreated.
+ * @postproc_fourcc:    Capture format written by post-processing, 0 for none.
+ * @dpb_size:   Reference frames of the stream.
+ * @stateless:  The stateless controls follow, the current ones and the ones
+ *              of each output buffer.
+ */
+struct rkmpp_dec_state {
+    uint32_t streaming;
+    uint32_t event_subscribed;
+    struct rkmpp_video_info video_info;
+    struct rkmpp_skip_info skip;
+    struct rkmpp_thumbnail_info thumbnail;
+    struct rkmpp_error_info error;
+    uint32_t transcode_width;
+    uint32_t transcode_height;
+    uint32_t transcode_bitrate;
+    uint32_t transcode_gop;
+    uint32_t watchdog_frames;
+    uint64_t watchdog_interval;
+    uint64_t recoveries;
+    uint32_t postproc_fourcc;
+    uint32_t dpb_size;
+    uint32_t stateless;
+};
+
+/* The structs codec_save puts as they are, the context's after them */
+static uint32_t codec_state_version(void) {
+    const size_t sizes[] = {
+        sizeof(struct rkmpp_dec_state),
+        sizeof(struct rkmpp_video_info),
+        sizeof(struct rkmpp_skip_info),
+        sizeof(struct rkmpp_thumbnail_info),
+        sizeof(struct rkmpp_error_info),
+        sizeof(struct rkmpp_h264_ctrls),
+        VIDEO_MAX_FRAME,
+    };
+
+    return rkmpp_state_version(cuse_handoff_version(CUSE_HANDOFF_VERSION, sizes,
+            ARRAY_SIZE(sizes)));
+}
+
+/*
+ * Hand the session over to another daemon. The decoder thread and mpp stop
+ * here, the frames mpp held go back to the client empty and the new daemon
+ * decodes the rest of the stream from its next keyframe. The session is done
+ * with in this daemon, which is about to exit.
+ */
+static int codec_save(void *userdata, struct cuse_state *state) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_dec_context *dec = ctx->subctx;
+    struct rkmpp_dec_state dec_state;
+    unsigned int returned;
+    bool streaming;
+
+    ENTER();
+
+    pthread_mutex_lock(&dec->decoder_mutex);
+    streaming = dec->mpp_streaming;
+    pthread_mutex_unlock(&dec->decoder_mutex);
+
+    rkmpp_dec_cancel_thread(dec);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    returned = streaming ? rkmpp_dec_return_held(dec) : 0;
+
+    memset(&dec_state, 0, sizeof(dec_state));
+    dec_state.streaming = streaming;
+    dec_state.event_subscribed = dec->event_subscribed;
+    dec_state.video_info = dec->video_info;
+    dec_state.skip = dec->skip;
+    dec_state.thumbnail = dec->thumbnail;
+    dec_state.error = dec->error;
+    dec_state.transcode_width = dec->transcode.width;
+    dec_state.transcode_height = dec->transcode.height;
+    dec_state.transcode_bitrate = dec->transcode.bitrate;
+    dec_state.transcode_gop = dec->transcode.gop;
+    dec_state.watchdog_frames = dec->watchdog.frames;
+    dec_state.watchdog_interval = dec->watchdog.interval;
+    dec_state.recoveries = dec->watchdog.recoveries;
+    dec_state.postproc_fourcc = dec->postproc_fourcc;
+    dec_state.dpb_size = dec->dpb_size;
+    dec_state.stateless = !!dec->stateless;
+
+    cuse_state_put(state, &dec_state, sizeof(dec_state));
+
+    if (dec->stateless) {
+        cuse_state_put(state, &dec->stateless->cur, sizeof(dec->stateless->cur));
+        cuse_state_put(state, dec->stateless->frames, sizeof(dec->stateless->frames));
+    }
+
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LOGV(1, "ctx(%p): handing over, %d frames returned empty\n", (void *) ctx, returned);
+
+    LEAVE();
+    return rkmpp_save_context(ctx, state);
+}
+
+/*
+ * Commit the taken over capture buffers to the external group mpp decodes
+ * into, held like fresh ones. The decoder thread puts the queued ones to
+ * mpp.
+ */
+static int rkmpp_dec_adopt_capture(struct rkmpp_dec_context *dec) {
+    struct rkmpp_buf_queue *queue = &dec->ctx->capture;
+    unsigned int i;
+
+    for (i = 0; i < queue->num_buffers; i++) {
+        if (queue->buffers[i].rkmpp_buf &&
+                rkmpp_commit_buffer(queue, &queue->buffers[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Pick a taken over stream up with a new mpp, from its next keyframe as
+ * after a recovery. Called with the ioctl_mutex held.
+ */
+static int rkmpp_dec_resume(struct rkmpp_dec_context *dec) {
+    struct rkmpp_context *ctx = dec->ctx;
+
+    if (!rkmpp_dec_copy_out(dec)) {
+        if (rkmpp_dec_adopt_capture(dec))
+            return -1;
+    } else if (dec->video_info.valid && !rkmpp_dec_charge_frame_group(dec)) {
+        LOGE("ctx(%p): internal frames exceed the drm memory cap\n", (void *) ctx);
+        RETURN_ERR(ENOMEM, -1);
+    }
+
+    if (rkmpp_dec_open_mpp(dec))
+        return -1;
+
+    dec->watchdog.wait_keyframe = true;
+    dec->watchdog.progress = rkmpp_now_us();
+
+    pthread_mutex_lock(&dec->decoder_mutex);
+    dec->mpp_streaming = true;
+    pthread_cond_signal(&dec->decoder_cond);
+    pthread_mutex_unlock(&dec->decoder_mutex);
+
+    return 0;
+}
+
+/* Take over a session saved by codec_save, on a context fresh from codec_init */
+static int codec_restore(void *userdata, struct cuse_state *state) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_dec_context *dec = ctx->subctx;
+    struct rkmpp_dec_state dec_state;
+    struct rkmpp_h264_ctrls ctrls;
+    struct rkmpp_stateless_info *stateless = NULL;
+    int ret = 0;
+
+    ENTER();
+
+    if (!cuse_state_get(state, &dec_state, sizeof(dec_state)))
+        RETURN_ERR(EPROTO, -1);
+
+    /* Read whole even without the memory for it, the sessions after it follow */
+    if (dec_state.stateless) {
+        stateless = rkmpp_dec_stateless_info(dec);
+
+        cuse_state_get(state, &ctrls, sizeof(ctrls));
+        if (stateless)
+            stateless->cur = ctrls;
+
+        for (unsigned int i = 0; i < VIDEO_MAX_FRAME; i++) {
+            cuse_state_get(state, &ctrls, sizeof(ctrls));
+            if (stateless)
+                stateless->frames[i] = ctrls;
+        }
+    }
+
+    if (rkmpp_restore_context(ctx, state) || (dec_state.stateless && !stateless))
+        RETURN_ERR(EPROTO, -1);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    dec->event_subscribed = dec_state.event_subscribed;
+    dec->video_info = dec_state.video_info;
+    dec->skip = dec_state.skip;
+    dec->thumbnail = dec_state.thumbnail;
+    dec->error = dec_state.error;
+    dec->watchdog.frames = dec_state.watchdog_frames;
+    dec->watchdog.interval = dec_state.watchdog_interval;
+    dec->watchdog.recoveries = dec_state.recoveries;
+    dec->postproc_fourcc = dec_state.postproc_fourcc;
+    dec->dpb_size = dec_state.dpb_size;
+
+    /* The client may not have reallocated for a pending change, it comes again */
+    if (dec->video_info.dirty)
+        dec->video_info.valid = false;
+    dec->video_info.dirty = false;
+
+    dec->transcode.fmt = rkmpp_dec_encoding(ctx, dec->postproc_fourcc);
+    dec->transcode.width = dec_state.transcode_width;
+    dec->transcode.height = dec_state.transcode_height;
+    dec->transcode.bitrate = dec_state.transcode_bitrate;
+    dec->transcode.gop = dec_state.transcode_gop;
+    if (dec->transcode.fmt)
+        ctx->capture.rkmpp_format = dec->transcode.fmt;
+
+    if (dec_state.streaming)
+        ret = rkmpp_dec_resume(dec);
+
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    if (ret) {
+        LOGE("ctx(%p): failed to pick the stream up\n", (void *) ctx);
+        RETURN_ERR(ENODEV, -1);
+    }
+
+    LOGV(1, "ctx(%p): taken over, %s\n", (void *) ctx,
+            dec_state.streaming ? "decoding from the next keyframe" : "not streaming");
+
+    LEAVE();
+    return 0;
+}
+
 static struct cuse_ioctl ioctls[] = {
-    { .cmd = (int)VIDIOC_QUERYCAP, .callback = rkmpp_ioctl_querycap }
+    { .cmd = (int)VIDIOC_QUERYCAP, .callback = rkmpp_ioctl_querycap },
+    { .cmd = (int)VIDIOC_ENUM_FMT, .callback = rkmpp_dec_enum_fmt },
+    { .cmd = (int)VIDIOC_ENUM_FRAMESIZES, .callback = rkmpp_ioctl_enum_framesizes },
+    { .cmd = (int)VIDIOC_G_FMT, .callback = rkmpp_ioctl_g_fmt },
+    { .cmd = (int)VIDIOC_TRY_FMT, .callback = rkmpp_dec_try_fmt },
+    { .cmd = (int)VIDIOC_S_FMT, .callback = rkmpp_dec_s_fmt },
+    { .cmd = (int)VIDIOC_REQBUFS, .callback = rkmpp_ioctl_reqbufs },
+    { .cmd = (int)VIDIOC_QUERYBUF, .callback = rkmpp_ioctl_querybuf },
+    { .cmd = (int)VIDIOC_EXPBUF, .callback = rkmpp_ioctl_expbuf },
+    { .cmd = (int)VIDIOC_QBUF, .callback = rkmpp_dec_qbuf },
+    { .cmd = (int)VIDIOC_DQBUF, .callback = rkmpp_ioctl_dqbuf },
+    { .cmd = (int)VIDIOC_STREAMON, .callback = rkmpp_dec_streamon },
+    { .cmd = (int)VIDIOC_STREAMOFF, .callback = rkmpp_dec_streamoff },
+    { .cmd = (int)VIDIOC_QUERYCTRL, .callback = rkmpp_dec_queryctrl },
+    { .cmd = (int)VIDIOC_QUERYMENU, .callback = rkmpp_dec_querymenu },
+    { .cmd = (int)VIDIOC_G_CTRL, .callback = rkmpp_dec_g_ctrl },
+    { .cmd = (int)VIDIOC_S_CTRL, .callback = rkmpp_dec_s_ctrl },
+    { .cmd = (int)VIDIOC_QUERY_EXT_CTRL, .callback = rkmpp_dec_query_ext_ctrl },
+    { .cmd = (int)VIDIOC_G_EXT_CTRLS, .callback = rkmpp_dec_g_ext_ctrls },
+    { .cmd = (int)VIDIOC_S_EXT_CTRLS, .callback = rkmpp_dec_s_ext_ctrls },
+    { .cmd = (int)VIDIOC_TRY_EXT_CTRLS, .callback = rkmpp_dec_try_ext_ctrls },
+    { .cmd = (int)VIDIOC_MPPV4L2_RING, .callback = rkmpp_ioctl_ring },
 };
 
-static struct cuse_codec decoder = {
+struct cuse_codec rkmpp_dec_codec = {
     .filename = "video0-mpp-dec",
     .init = codec_init,
     .deinit = codec_deinit,
     .ioctls = ioctls,
-    .num_ioctls = ARRAY_SIZE(ioctls)
+    .num_ioctls = ARRAY_SIZE(ioctls),
+    .poll = rkmpp_poll,
+    .interrupt = rkmpp_interrupt,
+    .probe = codec_probe,
+    .save = codec_save,
+    .restore = codec_restore,
+    .state_version = codec_state_version,
 };
 
+#ifndef RKMPP_LIBRARY
 int main(int argc, char **argv) {
-    return initcodec(&decoder, argc, argv);
+    return initcodec(&rkmpp_dec_codec, argc, argv);
 }
+#endif
 
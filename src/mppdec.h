@@ -8,7 +8,11 @@
 #ifndef SRC_MPPDEC_H_
 #define SRC_MPPDEC_H_
 
+#include "bitstream.h"
+#include "cusedev.h"
+#include "encoder.h"
 #include "rkmpp.h"
+#include "vpuload.h"
 
 #ifndef V4L2_PIX_FMT_VP9
 #define V4L2_PIX_FMT_VP9    v4l2_fourcc('V', 'P', '9', '0') /* VP9 */
@@ -18,10 +22,68 @@
 #define V4L2_PIX_FMT_HEVC   v4l2_fourcc('H', 'E', 'V', 'C') /* HEVC */
 #endif
 
+#ifndef V4L2_PIX_FMT_NV16
+#define V4L2_PIX_FMT_NV16   v4l2_fourcc('N', 'V', '1', '6') /* 16 Y/CbCr 4:2:2 */
+#endif
+
 #ifndef V4L2_PIX_FMT_AV1
 #define V4L2_PIX_FMT_AV1    v4l2_fourcc('A', 'V', '0', '1') /* AV1 */
 #endif
 
+#ifndef V4L2_PIX_FMT_H264_SLICE
+#define V4L2_PIX_FMT_H264_SLICE v4l2_fourcc('S', '2', '6', '4') /* H264 parsed slices */
+#endif
+
+/* Private controls, in the driver specific range of the user class */
+#define V4L2_CID_RKMPP_BASE             (V4L2_CID_USER_BASE + 0x1f00)
+#define V4L2_CID_RKMPP_SKIP_NONREF      (V4L2_CID_RKMPP_BASE + 0)
+#define V4L2_CID_RKMPP_KEYFRAME_ONLY    (V4L2_CID_RKMPP_BASE + 1)
+#define V4L2_CID_RKMPP_OUTPUT_NTH       (V4L2_CID_RKMPP_BASE + 2)
+#define V4L2_CID_RKMPP_THUMBNAIL        (V4L2_CID_RKMPP_BASE + 3)
+#define V4L2_CID_RKMPP_THUMBNAIL_WIDTH  (V4L2_CID_RKMPP_BASE + 4)
+#define V4L2_CID_RKMPP_THUMBNAIL_HEIGHT (V4L2_CID_RKMPP_BASE + 5)
+#define V4L2_CID_RKMPP_SESSION_MEM      (V4L2_CID_RKMPP_BASE + 6)
+#define V4L2_CID_RKMPP_TOTAL_MEM        (V4L2_CID_RKMPP_BASE + 7)
+#define V4L2_CID_RKMPP_DECODER_CPUS     (V4L2_CID_RKMPP_BASE + 8)
+#define V4L2_CID_RKMPP_DECODER_PRIO     (V4L2_CID_RKMPP_BASE + 9)
+#define V4L2_CID_RKMPP_DECODER_CPU      (V4L2_CID_RKMPP_BASE + 10)
+#define V4L2_CID_RKMPP_ERROR_POLICY     (V4L2_CID_RKMPP_BASE + 11)
+#define V4L2_CID_RKMPP_CORRUPTED_FRAMES (V4L2_CID_RKMPP_BASE + 12)
+#define V4L2_CID_RKMPP_DISCARDED_FRAMES (V4L2_CID_RKMPP_BASE + 13)
+#define V4L2_CID_RKMPP_CONCEALED_FRAMES (V4L2_CID_RKMPP_BASE + 14)
+#define V4L2_CID_RKMPP_DQBUF_WAIT_P99   (V4L2_CID_RKMPP_BASE + 15)
+#define V4L2_CID_RKMPP_FRAME_IDLE_P99   (V4L2_CID_RKMPP_BASE + 16)
+#define V4L2_CID_RKMPP_WATCHDOG_FRAMES  (V4L2_CID_RKMPP_BASE + 17)
+#define V4L2_CID_RKMPP_RECOVERIES       (V4L2_CID_RKMPP_BASE + 18)
+#define V4L2_CID_RKMPP_RECOVERY_TIME    (V4L2_CID_RKMPP_BASE + 19)
+#define V4L2_CID_RKMPP_VPU_BLOCK        (V4L2_CID_RKMPP_BASE + 20)
+#define V4L2_CID_RKMPP_VPU_LOAD         (V4L2_CID_RKMPP_BASE + 21)
+
+#define RKMPP_KEY_PTS_NUM   16
+
+/* Smallest capture buffer of a transcoding session, for the idrs of tiny streams */
+#define RKMPP_TRANSCODE_MIN_SIZE    (256 << 10)
+
+/* Frames mpp needs besides the dpb, the one being decoded and one in display */
+#define RKMPP_DPB_EXTRA_FRAMES  2
+
+/* Decoded keyframes kept by mpp in thumbnail mode */
+#define RKMPP_THUMBNAIL_FRAMES  4
+
+/* Packets are copied by mpp, one queued while the next is being filled */
+#define RKMPP_MIN_OUTPUT_BUFFERS    2
+
+/* Frame intervals without a frame out before mpp is taken for hung */
+#define RKMPP_WATCHDOG_FRAMES   30
+
+/* Frame interval until the timestamps tell, and the range they may tell */
+#define RKMPP_WATCHDOG_INTERVAL_US      33333
+#define RKMPP_WATCHDOG_MIN_INTERVAL_US  1000
+#define RKMPP_WATCHDOG_MAX_INTERVAL_US  200000
+
+/* Longest wait for a frame, so the watchdog gets to run while mpp hangs */
+#define RKMPP_DEC_FRAME_TIMEOUT_MS  100
+
 /**
  * struct rkmpp_video_info - Video information
  * @valid:      Data is valid.
@@ -48,13 +110,202 @@ struct rkmpp_video_info {
     uint32_t size;
 };
 
+/**
+ * struct rkmpp_skip_info - Frame skipping settings
+ * @skip_nonref:    Drop packets of non-reference frames.
+ * @keyframe_only:  Drop every packet except keyframes.
+ * @output_nth:     Return only every Nth decoded frame.
+ * @frame_count:    Number of decoded frames seen.
+ * @dropped:        Number of packets dropped before mpp.
+ * @key_pts:        Timestamps of the recent keyframe packets.
+ * @key_pts_idx:    Next slot of key_pts.
+ * @bs:             Stream state of the packet inspection.
+ */
+struct rkmpp_skip_info {
+    bool skip_nonref;
+    bool keyframe_only;
+    uint32_t output_nth;
+
+    uint64_t frame_count;
+    uint64_t dropped;
+
+    uint64_t key_pts[RKMPP_KEY_PTS_NUM];
+    uint32_t key_pts_idx;
+
+    struct rkmpp_bs_stream bs;
+};
+
+/**
+ * struct rkmpp_thumbnail_info - Thumbnail mode settings
+ * @enable:     Decode keyframes only and return them downscaled.
+ * @width:      Thumbnail width.
+ * @height:     Thumbnail height.
+ * @dropped:    Thumbnails dropped for lack of capture buffers.
+ */
+struct rkmpp_thumbnail_info {
+    bool enable;
+    uint32_t width;
+    uint32_t height;
+
+    uint64_t dropped;
+};
+
+/**
+ * enum rkmpp_error_policy - What is returned for frames decoded with errors
+ * @DROP:       Return the buffer empty, flagged with an error.
+ * @CONCEAL:    Return frames the vpu concealed, flagged with an error.
+ *              Frames mpp discarded are still returned empty.
+ * @ALL:        Return discarded frames with their content too.
+ */
+enum rkmpp_error_policy {
+    RKMPP_ERROR_POLICY_DROP = 0,
+    RKMPP_ERROR_POLICY_CONCEAL,
+    RKMPP_ERROR_POLICY_ALL,
+};
+
+/**
+ * struct rkmpp_error_info - Error resilience settings and statistics
+ * @policy:     Policy for corrupted frames.
+ * @corrupted:  Frames decoded with errors.
+ * @discarded:  Frames mpp marked unusable, like ones missing references.
+ * @concealed:  Corrupted or discarded frames returned with their content.
+ */
+struct rkmpp_error_info {
+    enum rkmpp_error_policy policy;
+
+    uint64_t corrupted;
+    uint64_t discarded;
+    uint64_t concealed;
+};
+
+/**
+ * struct rkmpp_transcode_info - Re-encoding of the decoded frames in the daemon
+ * @fmt:        Coded capture format, NULL when frames are returned raw.
+ * @width:      Encoded width asked for, 0 to follow the stream.
+ * @height:     Encoded height asked for, 0 to follow the stream.
+ * @bitrate:    Target bits per second, 0 picks one from the size and rate.
+ * @gop:        Frames between keyframes.
+ * @encoder:    Encoder of the current settings, made on the next frame when NULL.
+ * @mem:        Drm memory accounted for the encoder.
+ * @generation: Encoders dropped so far, for one busy meanwhile to tell it's stale.
+ */
+struct rkmpp_transcode_info {
+    const struct rkmpp_fmt *fmt;
+    uint32_t width;
+    uint32_t height;
+    uint32_t bitrate;
+    uint32_t gop;
+
+    struct rkmpp_encoder *encoder;
+    uint64_t mem;
+    unsigned int generation;
+};
+
+/**
+ * struct rkmpp_watchdog_info - Detection of and recovery from a hung mpp
+ * @frames:     Frame intervals without progress before recovering, 0 for never.
+ * @interval:   Frame interval in us, averaged from the packet timestamps.
+ * @last_pts:   Timestamp of the last packet fed.
+ * @packets:    Packets fed since the last frame out.
+ * @progress:   Monotonic us of the last frame out, or of the first packet
+ *              fed after it.
+ * @wait_keyframe:  Drop packets until the next keyframe, the references of
+ *              the others went with the old mpp.
+ * @recoveries: Times mpp was recreated.
+ * @recovery_time:  Us the last recovery took.
+ */
+struct rkmpp_watchdog_info {
+    uint32_t frames;
+    uint64_t interval;
+    uint64_t last_pts;
+    uint64_t packets;
+    uint64_t progress;
+    bool wait_keyframe;
+
+    uint64_t recoveries;
+    uint64_t recovery_time;
+};
+
+/* Requests of a stateless client whose controls are kept until queued */
+#define RKMPP_STATELESS_REQUESTS    32
+
+/* Controls of one extended control ioctl, a stateless frame sets 4 */
+#define RKMPP_EXT_CTRLS_MAX     16
+
+/**
+ * struct rkmpp_h264_ctrls - Stateless H.264 controls of a frame
+ * @sps:        Sequence parameter set.
+ * @pps:        Picture parameter set.
+ * @scaling:    Resolved scaling lists, used when the pps flags them.
+ * @decode:     Decode parameters.
+ */
+struct rkmpp_h264_ctrls {
+    struct v4l2_ctrl_h264_sps sps;
+    struct v4l2_ctrl_h264_pps pps;
+    struct v4l2_ctrl_h264_scaling_matrix scaling;
+    struct v4l2_ctrl_h264_decode_params decode;
+};
+
+/**
+ * struct rkmpp_stateless_request - Controls set in a request of the client
+ * @fd:         Request fd in the client, -1 for a free slot.
+ * @age:        Sequence number of the last set, the oldest slot is reused.
+ * @ctrls:      Controls of the request.
+ */
+struct rkmpp_stateless_request {
+    int fd;
+    uint64_t age;
+    struct rkmpp_h264_ctrls ctrls;
+};
+
+/**
+ * struct rkmpp_stateless_info - Frontend of the stateless decoder API
+ * @cur:        Current controls, the ones set without a request.
+ * @requests:   Controls set in requests, until their buffer is queued.
+ * @age:        Sequence number of the request sets.
+ * @frames:     Controls of the queued output buffers.
+ * @sent:       Controls whose parameter sets mpp got last.
+ * @sent_valid: Parameter sets were sent.
+ * @au:         Access unit of parameter sets and slices fed to mpp.
+ * @au_size:    Room of au.
+ */
+struct rkmpp_stateless_info {
+    struct rkmpp_h264_ctrls cur;
+    struct rkmpp_stateless_request requests[RKMPP_STATELESS_REQUESTS];
+    uint64_t age;
+    struct rkmpp_h264_ctrls frames[VIDEO_MAX_FRAME];
+
+    struct rkmpp_h264_ctrls sent;
+    bool sent_valid;
+
+    uint8_t *au;
+    size_t au_size;
+};
+
 /**
  * struct rkmpp_dec_context - Context private data for decoder
  * @ctx:        Common context data.
  * @video_info:     Video information.
  * @event_subscribed:   V4L2 event subscribed.
  * @mpp_streaming:  The mpp is streaming.
+ * @skip:       Frame skipping settings.
+ * @thumbnail:  Thumbnail mode settings.
+ * @error:      Error resilience settings and statistics.
+ * @transcode:  Transcoding settings and encoder.
+ * @watchdog:   Hang detection and recovery.
+ * @stateless:  Stateless frontend, NULL unless the output format is a
+ *              slice one.
+ * @vpu:        Placement on the decoder blocks.
+ * @postproc_fourcc:    Packed or coded capture format written by post-processing,
+ *              0 for none.
+ * @hdr:        Metadata of the last frame, whose HDR10 part the colorimetry
+ *              controls read.
+ * @dpb_size:   Reference frames of the current stream.
+ * @sps_dpb:    Dpb the last SPS fed to mpp asked for, 0 before any.
+ * @frame_group:    Internal frames of mpp when copying out.
+ * @frame_group_mem:    Drm memory accounted for frame_group.
  * @decoder_thread: Handler of the decoder thread.
+ * @decoder_cpu:    Cpu the decoder thread last ran on.
  * @decoder_cond:   Condition variable for streaming flag.
  * @decoder_mutex:  Mutex for streaming flag and buffers.
  */
@@ -66,11 +317,30 @@ struct rkmpp_dec_context {
 
     bool mpp_streaming;
 
+    struct rkmpp_skip_info skip;
+    struct rkmpp_thumbnail_info thumbnail;
+    struct rkmpp_error_info error;
+    struct rkmpp_transcode_info transcode;
+    struct rkmpp_watchdog_info watchdog;
+    struct rkmpp_stateless_info *stateless;
+    struct rkmpp_vpu_session vpu;
+    uint32_t postproc_fourcc;
+    struct rkmpp_frame_meta hdr;
+
+    uint32_t dpb_size;
+    uint32_t sps_dpb;
+    MppBufferGroup frame_group;
+    uint64_t frame_group_mem;
+
     struct rkmpp_buffer *eos_packet;
 
     pthread_t decoder_thread;
+    int decoder_cpu;
     pthread_cond_t decoder_cond;
     pthread_mutex_t decoder_mutex;
 };
 
+/* Template of decoder opens, for the daemon's nodes and the library */
+extern struct cuse_codec rkmpp_dec_codec;
+
 #endif /* SRC_MPPDEC_H_ */
@@ -0,0 +1,515 @@
+/*
+ * mppscale.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Scaler and color converter m2m node. Frames queued on the output queue
+ * come back on the capture queue at its size and format, through rga when
+ * it is there and the software kernels otherwise. Dma-bufs of both queues
+ * are used in place.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cusedev.h"
+#include "mppscale.h"
+
+#define RKMPP_SCALE_QUEUES \
+    (RKMPP_FMT_QUEUE(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) | \
+     RKMPP_FMT_QUEUE(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE))
+
+static struct rkmpp_fmt rkmpp_scale_fmts[] = {
+    {
+        .name = "4:2:0 1 plane Y/CbCr",
+        .fourcc = V4L2_PIX_FMT_NV12,
+        .num_planes = 1,
+        .type = MPP_VIDEO_CodingUnused,
+        .format = MPP_FMT_YUV420SP,
+        .depth = { 12 },
+        .frmsize = {
+            .min_width = 16,
+            .max_width = 8192,
+            .step_width = 2,
+            .min_height = 16,
+            .max_height = 8192,
+            .step_height = 2,
+        },
+        .queues = RKMPP_SCALE_QUEUES,
+    },
+    {
+        .name = "4:2:0 1 plane Y/CbCr 10-bit",
+        .fourcc = V4L2_PIX_FMT_NV15,
+        .num_planes = 1,
+        .type = MPP_VIDEO_CodingUnused,
+        .format = MPP_FMT_YUV420SP_10BIT,
+        .depth = { 15 },
+        .frmsize = {
+            .min_width = 16,
+            .max_width = 8192,
+            .step_width = 4,
+            .min_height = 16,
+            .max_height = 8192,
+            .step_height = 2,
+        },
+        .queues = RKMPP_FMT_QUEUE(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE),
+    },
+    {
+        .name = "RGB 1 plane 24 bit",
+        .fourcc = V4L2_PIX_FMT_RGB24,
+        .num_planes = 1,
+        .type = MPP_VIDEO_CodingUnused,
+        .format = MPP_FMT_RGB888,
+        .depth = { 24 },
+        .frmsize = {
+            .min_width = 16,
+            .max_width = 8192,
+            .step_width = 2,
+            .min_height = 16,
+            .max_height = 8192,
+            .step_height = 2,
+        },
+        .queues = RKMPP_FMT_QUEUE(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE),
+    },
+};
+
+/* Both queues stream and each has a buffer for the scaler */
+static bool rkmpp_scale_ready(struct rkmpp_scale_context *scale) {
+    struct rkmpp_context *ctx = scale->ctx;
+    bool ready;
+
+    pthread_mutex_lock(&ctx->output.queue_mutex);
+    ready = ctx->output.streaming && !TAILQ_EMPTY(&ctx->output.pending_buffers);
+    pthread_mutex_unlock(&ctx->output.queue_mutex);
+
+    if (!ready)
+        return false;
+
+    pthread_mutex_lock(&ctx->capture.queue_mutex);
+    ready = ctx->capture.streaming && !TAILQ_EMPTY(&ctx->capture.pending_buffers);
+    pthread_mutex_unlock(&ctx->capture.queue_mutex);
+
+    return ready;
+}
+
+static struct rkmpp_buffer *rkmpp_scale_take(struct rkmpp_buf_queue *queue) {
+    struct rkmpp_buffer *rkmpp_buffer;
+
+    pthread_mutex_lock(&queue->queue_mutex);
+    rkmpp_buffer = TAILQ_FIRST(&queue->pending_buffers);
+    TAILQ_REMOVE(&queue->pending_buffers, rkmpp_buffer, entry);
+    rkmpp_buffer_clr_pending(rkmpp_buffer);
+    pthread_mutex_unlock(&queue->queue_mutex);
+
+    return rkmpp_buffer;
+}
+
+static void rkmpp_scale_image(const struct rkmpp_buf_queue *queue,
+        const struct rkmpp_buffer *rkmpp_buffer, struct rkmpp_image *image) {
+    *image = (struct rkmpp_image) {
+        .ptr = mpp_buffer_get_ptr(rkmpp_buffer->rkmpp_buf),
+        .fd = rkmpp_buffer->fd,
+        .width = queue->format.width,
+        .height = queue->format.height,
+        .hor_stride = queue->format.plane_fmt[0].bytesperline,
+        .ver_stride = queue->format.height,
+        .ycbcr_enc = queue->format.ycbcr_enc,
+    };
+}
+
+/* Scale the frame of an output buffer into a capture buffer */
+static int rkmpp_scale_frame(struct rkmpp_scale_context *scale, struct rkmpp_buffer *src_buf,
+        struct rkmpp_buffer *dst_buf) {
+    struct rkmpp_context *ctx = scale->ctx;
+    struct rkmpp_image src, dst;
+    struct timespec start, end;
+    int ret;
+
+    if (src_buf->bytesused < ctx->output.format.plane_fmt[0].sizeimage) {
+        LOGE("frame(%" PRIu64 ") too short: %d < %d\n", src_buf->timestamp,
+                src_buf->bytesused, ctx->output.format.plane_fmt[0].sizeimage);
+        return -1;
+    }
+
+    rkmpp_scale_image(&ctx->output, src_buf, &src);
+    rkmpp_scale_image(&ctx->capture, dst_buf, &dst);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    mpp_buffer_sync_begin(src_buf->rkmpp_buf);
+    mpp_buffer_sync_begin(dst_buf->rkmpp_buf);
+
+    ret = rkmpp_image_blit(&src, ctx->output.format.pixelformat,
+            &dst, ctx->capture.format.pixelformat);
+
+    mpp_buffer_sync_end(dst_buf->rkmpp_buf);
+    mpp_buffer_sync_end(src_buf->rkmpp_buf);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    LOGV(3, "scaled frame(%" PRIu64 ") %.4s %dx%d to %.4s %dx%d in %ldus\n",
+            src_buf->timestamp, (char *) &ctx->output.format.pixelformat,
+            src.width, src.height, (char *) &ctx->capture.format.pixelformat,
+            dst.width, dst.height,
+            (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+
+    return ret;
+}
+
+static void *scaler_thread_fn(void *data) {
+    struct rkmpp_scale_context *scale = data;
+    struct rkmpp_context *ctx = scale->ctx;
+    struct rkmpp_buffer *src_buf, *dst_buf;
+    int ret;
+
+    ENTER();
+
+    LOGV(1, "ctx(%p): starting scaler thread\n", (void *) ctx);
+
+    while (1) {
+        pthread_mutex_lock(&scale->scaler_mutex);
+
+        while (!scale->stop && !rkmpp_scale_ready(scale))
+            pthread_cond_wait(&scale->scaler_cond, &scale->scaler_mutex);
+
+        if (scale->stop) {
+            pthread_mutex_unlock(&scale->scaler_mutex);
+            break;
+        }
+
+        src_buf = rkmpp_scale_take(&ctx->output);
+        dst_buf = rkmpp_scale_take(&ctx->capture);
+        scale->busy = true;
+
+        pthread_mutex_unlock(&scale->scaler_mutex);
+
+        /* Streamoff and close wait for the buffers to come back */
+        ret = rkmpp_scale_frame(scale, src_buf, dst_buf);
+
+        pthread_mutex_lock(&scale->scaler_mutex);
+
+        if (rkmpp_buffer_error(dst_buf))
+            rkmpp_buffer_clr_error(dst_buf);
+
+        if (ret) {
+            scale->failed++;
+            dst_buf->bytesused = 0;
+            rkmpp_buffer_set_error(dst_buf);
+        } else {
+            scale->frames++;
+            dst_buf->bytesused = ctx->capture.format.plane_fmt[0].sizeimage;
+        }
+
+        dst_buf->timestamp = src_buf->timestamp;
+        dst_buf->meta.field = V4L2_FIELD_NONE;
+
+        pthread_mutex_lock(&ctx->output.queue_mutex);
+        rkmpp_return_buffer(ctx, &ctx->output, src_buf);
+        rkmpp_queue_unlock(&ctx->output);
+
+        pthread_mutex_lock(&ctx->capture.queue_mutex);
+        rkmpp_return_buffer(ctx, &ctx->capture, dst_buf);
+        rkmpp_queue_unlock(&ctx->capture);
+
+        scale->busy = false;
+        pthread_cond_broadcast(&scale->scaler_cond);
+
+        pthread_mutex_unlock(&scale->scaler_mutex);
+    }
+
+    LEAVE();
+    return NULL;
+}
+
+static int rkmpp_scale_try_fmt_locked(struct rkmpp_context *ctx, struct v4l2_format *f) {
+    struct v4l2_pix_format_mplane *pix = &f->fmt.pix_mp;
+    const struct rkmpp_fmt *fmt;
+    uint32_t bytesperline;
+
+    ENTER();
+
+    if (!rkmpp_get_queue(ctx, f->type))
+        RETURN_ERR(EINVAL, -1);
+
+    fmt = rkmpp_find_fmt(ctx, pix->pixelformat, f->type);
+    if (!fmt) {
+        LOGV(1, "unsupported format: %.4s\n", (char *) &pix->pixelformat);
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    pix->width = clamp(pix->width, fmt->frmsize.min_width, fmt->frmsize.max_width);
+    pix->height = clamp(pix->height, fmt->frmsize.min_height, fmt->frmsize.max_height);
+    if (ctx->max_width && ctx->max_height) {
+        pix->width = min(pix->width, ctx->max_width);
+        pix->height = min(pix->height, ctx->max_height);
+    }
+    pix->width -= pix->width % fmt->frmsize.step_width;
+    pix->height -= pix->height % fmt->frmsize.step_height;
+
+    pix->num_planes = 1;
+    pix->field = V4L2_FIELD_NONE;
+
+    /* Padded lines are kept, frames of other devices come with them */
+    bytesperline = rkmpp_image_bytesperline(pix->pixelformat, pix->width);
+    pix->plane_fmt[0].bytesperline = max(pix->plane_fmt[0].bytesperline, bytesperline);
+    pix->plane_fmt[0].sizeimage = pix->plane_fmt[0].bytesperline * pix->height;
+    if (pix->pixelformat != V4L2_PIX_FMT_RGB24)
+        pix->plane_fmt[0].sizeimage = pix->plane_fmt[0].sizeimage * 3 / 2;
+
+    if (pix->pixelformat == V4L2_PIX_FMT_RGB24) {
+        pix->colorspace = V4L2_COLORSPACE_SRGB;
+        pix->ycbcr_enc = V4L2_YCBCR_ENC_DEFAULT;
+        pix->quantization = V4L2_QUANTIZATION_FULL_RANGE;
+    }
+
+    LEAVE();
+    return 0;
+}
+
+static int rkmpp_scale_try_fmt(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct v4l2_format *f = out_buf;
+    int ret;
+
+    ENTER();
+
+    *f = *(const struct v4l2_format *) in_buf;
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+    ret = rkmpp_scale_try_fmt_locked(ctx, f);
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LEAVE();
+    return ret;
+}
+
+static int rkmpp_scale_s_fmt(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct v4l2_format *f = out_buf;
+    struct rkmpp_buf_queue *queue;
+    int ret = -1;
+
+    ENTER();
+
+    *f = *(const struct v4l2_format *) in_buf;
+
+    queue = rkmpp_get_queue(ctx, f->type);
+    if (!queue)
+        RETURN_ERR(EINVAL, -1);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    if (queue->num_buffers) {
+        LOGE("can't change format with buffers allocated\n");
+        errno = EBUSY;
+        goto out;
+    }
+
+    if (rkmpp_scale_try_fmt_locked(ctx, f) < 0)
+        goto out;
+
+    queue->format = f->fmt.pix_mp;
+    queue->rkmpp_format = rkmpp_find_fmt(ctx, f->fmt.pix_mp.pixelformat, f->type);
+
+    LOGV(1, "queue %d: %.4s %dx%d, %d bytes per line\n", f->type,
+            (char *) &queue->format.pixelformat, queue->format.width,
+            queue->format.height, queue->format.plane_fmt[0].bytesperline);
+    ret = 0;
+out:
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LEAVE();
+    return ret;
+}
+
+static void rkmpp_scale_kick(struct rkmpp_scale_context *scale) {
+    pthread_mutex_lock(&scale->scaler_mutex);
+    pthread_cond_broadcast(&scale->scaler_cond);
+    pthread_mutex_unlock(&scale->scaler_mutex);
+}
+
+static int rkmpp_scale_qbuf(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    int ret = rkmpp_ioctl_qbuf(userdata, in_buf, out_buf);
+
+    if (!ret)
+        rkmpp_scale_kick(ctx->subctx);
+
+    return ret;
+}
+
+static int rkmpp_scale_streamon(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    int ret = rkmpp_ioctl_streamon(userdata, in_buf, out_buf);
+
+    if (!ret)
+        rkmpp_scale_kick(ctx->subctx);
+
+    return ret;
+}
+
+/* The frame being scaled finishes first, its buffers go back with the rest */
+static int rkmpp_scale_streamoff(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_scale_context *scale = ctx->subctx;
+    int ret;
+
+    pthread_mutex_lock(&scale->scaler_mutex);
+    while (scale->busy)
+        pthread_cond_wait(&scale->scaler_cond, &scale->scaler_mutex);
+
+    ret = rkmpp_ioctl_streamoff(userdata, in_buf, out_buf);
+    pthread_mutex_unlock(&scale->scaler_mutex);
+
+    return ret;
+}
+
+/* What a session takes from its node, all the probe replies depend on */
+static void rkmpp_scale_setup_node(struct rkmpp_context *ctx, struct cuse_codec *codec) {
+    ctx->formats = rkmpp_scale_fmts;
+    ctx->num_formats = ARRAY_SIZE(rkmpp_scale_fmts);
+
+    ctx->max_width = codec->max_width;
+    ctx->max_height = codec->max_height;
+}
+
+static struct cuse_replies *codec_probe(struct cuse_codec *node) {
+    struct cuse_codec codec = *node;
+    struct cuse_replies *replies;
+    struct rkmpp_context *ctx = context_init();
+
+    if (!ctx)
+        return NULL;
+
+    rkmpp_scale_setup_node(ctx, &codec);
+    ctx->codec = &codec;
+    codec.priv = ctx;
+
+    replies = rkmpp_probe_replies(&codec);
+
+    context_destroy(ctx);
+    return replies;
+}
+
+static void rkmpp_scale_default_fmt(struct rkmpp_context *ctx, enum v4l2_buf_type type) {
+    struct rkmpp_buf_queue *queue = rkmpp_get_queue(ctx, type);
+    struct v4l2_format f = { .type = type };
+
+    f.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_NV12;
+    f.fmt.pix_mp.width = RKMPP_SCALE_DEFAULT_WIDTH;
+    f.fmt.pix_mp.height = RKMPP_SCALE_DEFAULT_HEIGHT;
+
+    rkmpp_scale_try_fmt_locked(ctx, &f);
+    queue->format = f.fmt.pix_mp;
+    queue->rkmpp_format = rkmpp_find_fmt(ctx, V4L2_PIX_FMT_NV12, type);
+    queue->min_buffers = 1;
+}
+
+static int codec_init(void *userdata) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_scale_context *scale;
+    struct rkmpp_context *ctx = context_init();
+
+    ENTER();
+
+    if (!ctx)
+        RETURN_ERR(ENOMEM, -1);
+
+    scale = calloc(1, sizeof(*scale));
+    if (!scale) {
+        context_destroy(ctx);
+        RETURN_ERR(ENOMEM, -1);
+    }
+    ctx->subctx = scale;
+    codec->priv = ctx;
+    scale->ctx = ctx;
+
+    rkmpp_scale_setup_node(ctx, codec);
+
+    ctx->codec = codec;
+
+    ctx->mem_limit = (uint64_t) codec->max_session_mem << 20;
+    ctx->mem_limit_total = (uint64_t) codec->max_total_mem << 20;
+
+    rkmpp_scale_default_fmt(ctx, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+    rkmpp_scale_default_fmt(ctx, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+
+    pthread_cond_init(&scale->scaler_cond, NULL);
+    pthread_mutex_init(&scale->scaler_mutex, NULL);
+    pthread_create(&scale->scaler_thread, NULL, scaler_thread_fn, scale);
+
+    if (codec->decoder_cpus || codec->decoder_prio)
+        cuse_set_thread_sched(scale->scaler_thread, codec->decoder_cpus,
+                codec->decoder_prio);
+
+    LEAVE();
+    return 0;
+}
+
+static void codec_deinit(void *userdata) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_scale_context *scale;
+
+    if (!ctx || !ctx->subctx)
+        return;
+
+    scale = ctx->subctx;
+
+    ENTER();
+
+    /* The thread finishes the frame it is on, with no lock of ours held */
+    pthread_mutex_lock(&scale->scaler_mutex);
+    scale->stop = true;
+    pthread_cond_broadcast(&scale->scaler_cond);
+    pthread_mutex_unlock(&scale->scaler_mutex);
+
+    pthread_join(scale->scaler_thread, NULL);
+
+    LOGV(1, "ctx(%p): %" PRIu64 " frames scaled, %" PRIu64 " failed\n", (void *) ctx,
+            scale->frames, scale->failed);
+
+    LEAVE();
+
+    free(scale);
+    ctx->subctx = NULL;
+
+    context_destroy(ctx);
+    codec->priv = NULL;
+}
+
+static struct cuse_ioctl ioctls[] = {
+    { .cmd = (int)VIDIOC_QUERYCAP, .callback = rkmpp_ioctl_querycap },
+    { .cmd = (int)VIDIOC_ENUM_FMT, .callback = rkmpp_ioctl_enum_fmt },
+    { .cmd = (int)VIDIOC_G_FMT, .callback = rkmpp_ioctl_g_fmt },
+    { .cmd = (int)VIDIOC_TRY_FMT, .callback = rkmpp_scale_try_fmt },
+    { .cmd = (int)VIDIOC_S_FMT, .callback = rkmpp_scale_s_fmt },
+    { .cmd = (int)VIDIOC_REQBUFS, .callback = rkmpp_ioctl_reqbufs },
+    { .cmd = (int)VIDIOC_QUERYBUF, .callback = rkmpp_ioctl_querybuf },
+    { .cmd = (int)VIDIOC_QBUF, .callback = rkmpp_scale_qbuf },
+    { .cmd = (int)VIDIOC_DQBUF, .callback = rkmpp_ioctl_dqbuf },
+    { .cmd = (int)VIDIOC_STREAMON, .callback = rkmpp_scale_streamon },
+    { .cmd = (int)VIDIOC_STREAMOFF, .callback = rkmpp_scale_streamoff },
+};
+
+static struct cuse_codec rkmpp_scale_codec = {
+    .filename = "video0-mpp-scale",
+    .init = codec_init,
+    .deinit = codec_deinit,
+    .ioctls = ioctls,
+    .num_ioctls = ARRAY_SIZE(ioctls),
+    .poll = rkmpp_poll,
+    .interrupt = rkmpp_interrupt,
+    .probe = codec_probe,
+};
+
+int main(int argc, char **argv) {
+    return initcodec(&rkmpp_scale_codec, argc, argv);
+}
@@ -0,0 +1,45 @@
+/*
+ * mppscale.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ */
+
+#ifndef SRC_MPPSCALE_H_
+#define SRC_MPPSCALE_H_
+
+#include "cusedev.h"
+#include "imgproc.h"
+#include "rkmpp.h"
+
+/* Format of a fresh session, so buffers can be requested right away */
+#define RKMPP_SCALE_DEFAULT_WIDTH   1920
+#define RKMPP_SCALE_DEFAULT_HEIGHT  1080
+
+/**
+ * struct rkmpp_scale_context - Context private data for the scaler
+ * @ctx:        Common context data.
+ * @frames:     Frames scaled.
+ * @failed:     Frames returned with an error flag.
+ * @busy:       The scaler thread holds a buffer of each queue.
+ * @stop:       The scaler thread is to exit, set on close.
+ * @scaler_thread:  Handler of the scaler thread.
+ * @scaler_cond:    Signaled when buffers are queued, when busy clears and
+ *                  on stop.
+ * @scaler_mutex:   Mutex for busy, stop and for taking buffers off the queues.
+ */
+struct rkmpp_scale_context {
+    struct rkmpp_context *ctx;
+
+    uint64_t frames;
+    uint64_t failed;
+
+    bool busy;
+    bool stop;
+
+    pthread_t scaler_thread;
+    pthread_cond_t scaler_cond;
+    pthread_mutex_t scaler_mutex;
+};
+
+#endif /* SRC_MPPSCALE_H_ */
@@ -0,0 +1,122 @@
+/*
+ * mppv4l2_ring.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Shared completion ring of the mpp v4l2 decoder. A client that sets one up
+ * gets its decoded capture buffers in shared memory instead of through
+ * DQBUF, and hands them back the same way instead of through QBUF, so a
+ * stream that keeps up needs no system call per frame.
+ *
+ * The client creates a memfd of at least sizeof(struct mppv4l2_ring) bytes
+ * and an eventfd, passes both with VIDIOC_MPPV4L2_RING, then maps the memfd
+ * shared. The daemon fills in the header and takes the fds over, so the
+ * client may close its own. The ring carries the capture buffers, of
+ * whatever memory the queue takes: dma-buf through the daemon, mmap or
+ * dma-buf in process. A dma-buf buffer handed back is queued with the
+ * dma-buf it was last queued with, QBUF it to change that. Output buffers
+ * still go through QBUF and DQBUF.
+ *
+ * Both directions are single producer rings of free running counters, a
+ * slot being the counter modulo MPPV4L2_RING_SLOTS. Counters are read with
+ * acquire and written with release ordering, e.g. __atomic_load_n and
+ * __atomic_store_n. Before sleeping on the eventfd the client sets
+ * done_wait and checks done_head once more, both sequentially consistent,
+ * the daemon clears done_wait and signals the eventfd when it publishes
+ * the next buffer.
+ */
+
+#ifndef SRC_MPPV4L2_RING_H_
+#define SRC_MPPV4L2_RING_H_
+
+#include <stdint.h>
+#include <linux/videodev2.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MPPV4L2_RING_MAGIC      0x474e4952 /* "RING" */
+#define MPPV4L2_RING_VERSION    1
+#define MPPV4L2_RING_SLOTS      64
+
+/**
+ * struct mppv4l2_ring_setup - Argument of VIDIOC_MPPV4L2_RING
+ * @memfd:      Memfd of the ring, -1 to go back to DQBUF.
+ * @eventfd:    Eventfd signaled when done_wait is set and a buffer is done.
+ * @reserved:   Zeroed.
+ */
+struct mppv4l2_ring_setup {
+    int32_t memfd;
+    int32_t eventfd;
+    uint32_t reserved[6];
+};
+
+#define VIDIOC_MPPV4L2_RING \
+    _IOW('V', BASE_VIDIOC_PRIVATE + 0, struct mppv4l2_ring_setup)
+
+/**
+ * struct mppv4l2_ring_done - A capture buffer done by the decoder
+ * @index:      Buffer index, the buffer is dequeued.
+ * @flags:      V4L2_BUF_FLAG_ERROR and V4L2_BUF_FLAG_KEYFRAME.
+ * @bytesused:  Bytes of the frame, 0 for an empty buffer.
+ * @field:      V4L2 field order.
+ * @timestamp:  Timestamp of the packet, in us.
+ * @errinfo:    Error info of the decoder, 0 for a clean frame.
+ * @display_primaries:  HDR10 mastering display primaries, all zero without.
+ * @white_point:    HDR10 mastering display white point.
+ * @max_luminance:  HDR10 mastering display max luminance.
+ * @min_luminance:  HDR10 mastering display min luminance.
+ * @max_cll:    HDR10 max content light level, 0 without.
+ * @max_fall:   HDR10 max frame average light level, 0 without.
+ */
+struct mppv4l2_ring_done {
+    uint32_t index;
+    uint32_t flags;
+    uint32_t bytesused;
+    uint32_t field;
+    uint64_t timestamp;
+    uint32_t errinfo;
+    uint16_t display_primaries[3][2];
+    uint16_t white_point[2];
+    uint32_t max_luminance;
+    uint32_t min_luminance;
+    uint16_t max_cll;
+    uint16_t max_fall;
+};
+
+/**
+ * struct mppv4l2_ring - Layout of the ring memory
+ * @magic:      MPPV4L2_RING_MAGIC once the daemon set the ring up.
+ * @version:    MPPV4L2_RING_VERSION.
+ * @slots:      MPPV4L2_RING_SLOTS.
+ * @done_head:  Buffers published by the daemon.
+ * @done_wait:  Set by a client going to sleep on the eventfd.
+ * @done_tail:  Buffers consumed by the client.
+ * @queue_head: Buffers queued by the client.
+ * @queue_tail: Buffers taken by the daemon.
+ * @done:       Slots of the done buffers.
+ * @queue:      Slots of the indices of the queued buffers.
+ */
+struct mppv4l2_ring {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slots;
+
+    /* Each side writes its own cache lines */
+    uint32_t done_head __attribute__((aligned(64)));
+    uint32_t done_wait;
+    uint32_t done_tail __attribute__((aligned(64)));
+    uint32_t queue_head __attribute__((aligned(64)));
+    uint32_t queue_tail __attribute__((aligned(64)));
+
+    struct mppv4l2_ring_done done[MPPV4L2_RING_SLOTS] __attribute__((aligned(64)));
+    uint32_t queue[MPPV4L2_RING_SLOTS];
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SRC_MPPV4L2_RING_H_ */
@@ -0,0 +1,402 @@
+/*
+ * preload.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * LD_PRELOAD shim serving opens of the decoder's device node in process.
+ * Opens of MPPV4L2_DEVICE, /dev/video0-mpp-dec by default, get a dup of the
+ * session's eventfd to stand for the node, and ioctls on it run through
+ * libmppv4l2. Poll and select wait on the eventfd and report what the
+ * session has. Everything else goes to libc.
+ */
+#define _GNU_SOURCE
+/* Both open and open64 are defined here, keep the headers from renaming them */
+#undef _FILE_OFFSET_BITS
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+#include "libmppv4l2.h"
+
+#define PRELOAD_DEFAULT_DEVICE  "/dev/video0-mpp-dec"
+
+/* Opens of the node a process may have at once */
+#define PRELOAD_MAX_OPENS       32
+
+static struct {
+    int fd;
+    struct mppv4l2 *dev;
+} preload_opens[PRELOAD_MAX_OPENS];
+
+static pthread_mutex_t preload_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Sessions open, polls of processes without any go straight to libc */
+static int preload_num_opens;
+
+static int (*libc_open)(const char *, int, ...);
+static int (*libc_openat)(int, const char *, int, ...);
+static int (*libc_close)(int);
+static int (*libc_ioctl)(int, unsigned long, ...);
+static int (*libc_poll)(struct pollfd *, nfds_t, int);
+static int (*libc_ppoll)(struct pollfd *, nfds_t, const struct timespec *,
+        const sigset_t *);
+static int (*libc_select)(int, fd_set *, fd_set *, fd_set *, struct timeval *);
+
+static void preload_init(void) {
+    libc_open = dlsym(RTLD_NEXT, "open");
+    libc_openat = dlsym(RTLD_NEXT, "openat");
+    libc_close = dlsym(RTLD_NEXT, "close");
+    libc_ioctl = dlsym(RTLD_NEXT, "ioctl");
+    libc_poll = dlsym(RTLD_NEXT, "poll");
+    libc_ppoll = dlsym(RTLD_NEXT, "ppoll");
+    libc_select = dlsym(RTLD_NEXT, "select");
+}
+
+static pthread_once_t preload_once = PTHREAD_ONCE_INIT;
+
+static bool preload_is_device(const char *path) {
+    const char *device = getenv("MPPV4L2_DEVICE");
+
+    return path && !strcmp(path, device ? device : PRELOAD_DEFAULT_DEVICE);
+}
+
+static struct mppv4l2 *preload_find(int fd) {
+    struct mppv4l2 *dev = NULL;
+
+    /* Sessions are only ever closed through close(), racing it is a bug anyway */
+    pthread_mutex_lock(&preload_mutex);
+    for (int i = 0; i < PRELOAD_MAX_OPENS; i++) {
+        if (preload_opens[i].dev && preload_opens[i].fd == fd) {
+            dev = preload_opens[i].dev;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&preload_mutex);
+
+    return dev;
+}
+
+static int preload_open_device(int flags) {
+    struct mppv4l2 *dev;
+    int fd, i;
+
+    dev = mppv4l2_open(getenv("MPPV4L2_CODECS"), flags);
+    if (!dev)
+        return -1;
+
+    /* The session keeps its own, the caller closes this one */
+    fd = fcntl(mppv4l2_fd(dev), flags & O_CLOEXEC ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+    if (fd < 0) {
+        int err = errno;
+
+        mppv4l2_close(dev);
+        errno = err;
+        return -1;
+    }
+
+    pthread_mutex_lock(&preload_mutex);
+    for (i = 0; i < PRELOAD_MAX_OPENS; i++) {
+        if (!preload_opens[i].dev) {
+            preload_opens[i].fd = fd;
+            preload_opens[i].dev = dev;
+            __atomic_add_fetch(&preload_num_opens, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&preload_mutex);
+
+    if (i == PRELOAD_MAX_OPENS) {
+        mppv4l2_close(dev);
+        libc_close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+
+    return fd;
+}
+
+int open(const char *path, int flags, ...) {
+    mode_t mode = 0;
+    va_list ap;
+
+    pthread_once(&preload_once, preload_init);
+
+    if (preload_is_device(path))
+        return preload_open_device(flags);
+
+    /* O_TMPFILE has O_DIRECTORY in it, which takes no mode on its own */
+    if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+
+    return libc_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int openat(int dirfd, const char *path, int flags, ...) {
+    mode_t mode = 0;
+    va_list ap;
+
+    pthread_once(&preload_once, preload_init);
+
+    if (preload_is_device(path))
+        return preload_open_device(flags);
+
+    if ((flags & O_CREAT) || (flags & O_TMPFILE) == O_TMPFILE) {
+        va_start(ap, flags);
+        mode = va_arg(ap, mode_t);
+        va_end(ap);
+    }
+
+    return libc_openat(dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...) __attribute__((alias("openat")));
+
+int close(int fd) {
+    struct mppv4l2 *dev = NULL;
+
+    pthread_once(&preload_once, preload_init);
+
+    pthread_mutex_lock(&preload_mutex);
+    for (int i = 0; i < PRELOAD_MAX_OPENS; i++) {
+        if (preload_opens[i].dev && preload_opens[i].fd == fd) {
+            dev = preload_opens[i].dev;
+            preload_opens[i].dev = NULL;
+            __atomic_sub_fetch(&preload_num_opens, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&preload_mutex);
+
+    if (dev)
+        mppv4l2_close(dev);
+
+    return libc_close(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+    struct mppv4l2 *dev;
+    void *arg;
+    va_list ap;
+
+    pthread_once(&preload_once, preload_init);
+
+    va_start(ap, request);
+    arg = va_arg(ap, void *);
+    va_end(ap);
+
+    dev = preload_find(fd);
+    if (dev)
+        return mppv4l2_ioctl(dev, request, arg);
+
+    return libc_ioctl(fd, request, arg);
+}
+
+/* Time left until end, false once it's up */
+static bool preload_time_left(const struct timespec *end, struct timespec *left) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    left->tv_sec = end->tv_sec - now.tv_sec;
+    left->tv_nsec = end->tv_nsec - now.tv_nsec;
+    if (left->tv_nsec < 0) {
+        left->tv_sec--;
+        left->tv_nsec += 1000000000L;
+    }
+
+    return left->tv_sec >= 0;
+}
+
+/*
+ * Poll fds of which some stand for sessions. What a session has comes from
+ * mppv4l2_poll, its eventfd only wakes the wait up, which starts over until
+ * something is ready or the time is up.
+ */
+static int preload_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout,
+        const sigset_t *sigmask) {
+    static const struct timespec zero;
+    struct mppv4l2 **devs;
+    struct pollfd *waits;
+    struct timespec end, left;
+    bool any = false;
+    int ret = -1;
+
+    if (!nfds || !__atomic_load_n(&preload_num_opens, __ATOMIC_RELAXED))
+        return libc_ppoll(fds, nfds, timeout, sigmask);
+
+    devs = calloc(nfds, sizeof(*devs));
+    waits = malloc(nfds * sizeof(*waits));
+    if (!devs || !waits) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    for (nfds_t i = 0; i < nfds; i++) {
+        if (fds[i].fd >= 0)
+            devs[i] = preload_find(fds[i].fd);
+        any |= !!devs[i];
+    }
+
+    if (!any) {
+        ret = libc_ppoll(fds, nfds, timeout, sigmask);
+        goto out;
+    }
+
+    if (timeout) {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        end.tv_sec += timeout->tv_sec + (end.tv_nsec + timeout->tv_nsec) / 1000000000L;
+        end.tv_nsec = (end.tv_nsec + timeout->tv_nsec) % 1000000000L;
+    }
+
+    while (1) {
+        /* What is ready now, the sessions' from themselves */
+        memcpy(waits, fds, nfds * sizeof(*waits));
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (devs[i])
+                waits[i].fd = -1;
+        }
+
+        ret = libc_ppoll(waits, nfds, &zero, NULL);
+        if (ret < 0)
+            goto out;
+
+        for (nfds_t i = 0; i < nfds; i++) {
+            fds[i].revents = waits[i].revents;
+            if (!devs[i])
+                continue;
+
+            fds[i].revents = mppv4l2_poll(devs[i]) & (fds[i].events | POLLERR | POLLHUP);
+            if (fds[i].revents)
+                ret++;
+        }
+
+        if (ret || (timeout && !preload_time_left(&end, &left)))
+            goto out;
+
+        /* Nothing yet, wait for the fds or a session's eventfd */
+        memcpy(waits, fds, nfds * sizeof(*waits));
+        for (nfds_t i = 0; i < nfds; i++) {
+            if (devs[i])
+                waits[i].events = POLLIN;
+        }
+
+        ret = libc_ppoll(waits, nfds, timeout ? &left : NULL, sigmask);
+        if (ret <= 0)
+            goto out;
+    }
+
+out:
+    free(waits);
+    free(devs);
+    return ret;
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    struct timespec ts = { timeout / 1000, timeout % 1000 * 1000000L };
+
+    pthread_once(&preload_once, preload_init);
+
+    if (!__atomic_load_n(&preload_num_opens, __ATOMIC_RELAXED))
+        return libc_poll(fds, nfds, timeout);
+
+    return preload_ppoll(fds, nfds, timeout < 0 ? NULL : &ts, NULL);
+}
+
+int ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout,
+        const sigset_t *sigmask) {
+    pthread_once(&preload_once, preload_init);
+
+    return preload_ppoll(fds, nfds, timeout, sigmask);
+}
+
+/* Sets of fds below nfds with a session in them go through preload_ppoll */
+int select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds,
+        struct timeval *timeout) {
+    struct timespec ts;
+    struct pollfd *fds;
+    nfds_t num = 0;
+    bool any = false;
+    int ret;
+
+    pthread_once(&preload_once, preload_init);
+
+    if (!__atomic_load_n(&preload_num_opens, __ATOMIC_RELAXED))
+        return libc_select(nfds, readfds, writefds, exceptfds, timeout);
+
+    for (int fd = 0; fd < nfds && !any; fd++) {
+        if ((readfds && FD_ISSET(fd, readfds)) || (writefds && FD_ISSET(fd, writefds)) ||
+                (exceptfds && FD_ISSET(fd, exceptfds)))
+            any = preload_find(fd);
+    }
+
+    if (!any)
+        return libc_select(nfds, readfds, writefds, exceptfds, timeout);
+
+    fds = calloc(nfds, sizeof(*fds));
+    if (!fds) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (int fd = 0; fd < nfds; fd++) {
+        short events = (readfds && FD_ISSET(fd, readfds) ? POLLIN : 0) |
+                (writefds && FD_ISSET(fd, writefds) ? POLLOUT : 0) |
+                (exceptfds && FD_ISSET(fd, exceptfds) ? POLLPRI : 0);
+
+        if (events)
+            fds[num++] = (struct pollfd) { .fd = fd, .events = events };
+    }
+
+    if (timeout) {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_usec * 1000;
+    }
+
+    ret = preload_ppoll(fds, num, timeout ? &ts : NULL, NULL);
+    if (ret < 0)
+        goto out;
+
+    /* Select counts the bits it leaves set, errors wake readers and writers */
+    ret = 0;
+    for (nfds_t i = 0; i < num; i++) {
+        short revents = fds[i].revents;
+
+        if (revents & POLLNVAL) {
+            errno = EBADF;
+            ret = -1;
+            goto out;
+        }
+
+        if (readfds && FD_ISSET(fds[i].fd, readfds) &&
+                !(revents & (POLLIN | POLLHUP | POLLERR)))
+            FD_CLR(fds[i].fd, readfds);
+        if (writefds && FD_ISSET(fds[i].fd, writefds) && !(revents & (POLLOUT | POLLERR)))
+            FD_CLR(fds[i].fd, writefds);
+        if (exceptfds && FD_ISSET(fds[i].fd, exceptfds) && !(revents & POLLPRI))
+            FD_CLR(fds[i].fd, exceptfds);
+
+        ret += (readfds && FD_ISSET(fds[i].fd, readfds)) +
+                (writefds && FD_ISSET(fds[i].fd, writefds)) +
+                (exceptfds && FD_ISSET(fds[i].fd, exceptfds));
+    }
+
+out:
+    free(fds);
+    return ret;
+}
@@ -0,0 +1,487 @@
+/*
+ * replay.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Plays a session traced with --trace back against a device node, or
+ * against libmppv4l2 in process, at the traced pace or as fast as it goes,
+ * then reports how each ioctl fared against the trace.
+ *
+ * Records are in the order of issue, so a DQBUF of a blocking session may
+ * come before the QBUF it waited for. Those are replayed on threads of
+ * their own, what the trace issued after one completed waits for it.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "libmppv4l2.h"
+#include "trace.h"
+#include "utils.h"
+
+static const char *usage =
+"usage: mpp-v4l2m2m-replay [options] TRACE\n"
+"\n"
+"options:\n"
+"    -d DEVICE      replay against DEVICE, /dev/video0-mpp-dec by default\n"
+"    -l             replay against libmppv4l2 in process\n"
+"    -c CODECS      codecs of the in process session, like H.264+H.265\n"
+"    -f             issue ioctls back to back, not at the traced pace\n"
+"    -v             print every ioctl\n"
+"\n";
+
+/* How long what came after a DQBUF in the trace waits for it to complete */
+#define REPLAY_WAIT_NS      2000000000ULL
+
+/* DQBUFs waiting at once, a session has fewer buffers than that */
+#define REPLAY_MAX_ASYNC    32
+
+/* Last data record of each buffer, for its QBUF */
+struct replay_data {
+    struct v4l2_plane plane;
+    uint8_t *bytes;
+    size_t size;
+    bool valid;
+};
+
+struct replay_stat {
+    int cmd;
+    uint64_t count;
+    uint64_t mismatches;
+    uint64_t traced_ns;
+    uint64_t replayed_ns;
+    uint64_t replayed_max_ns;
+};
+
+/**
+ * struct replay_async - A DQBUF replayed on a thread of its own
+ * @thread:     The thread.
+ * @record:     Its trace record.
+ * @arg:        Its argument.
+ * @planes:     Planes of the argument.
+ * @start:      Monotonic ns it was issued.
+ * @elapsed:    Ns it took.
+ * @result:     Its errno, 0 for success.
+ * @done:       It completed, under replay_mutex.
+ * @late:       It didn't complete in time, nothing waits for it anymore.
+ */
+struct replay_async {
+    pthread_t thread;
+    struct rkmpp_trace_record record;
+    struct v4l2_buffer arg;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    uint64_t start;
+    uint64_t elapsed;
+    int result;
+    bool done;
+    bool late;
+};
+
+static struct mppv4l2 *replay_dev;
+static int replay_fd = -1;
+static bool replay_verbose;
+static uint64_t replay_first;
+
+static struct replay_stat replay_stats[64];
+static int replay_num_stats;
+
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t replay_cond;
+static struct replay_async *replay_asyncs[REPLAY_MAX_ASYNC];
+static int replay_num_asyncs;
+
+static int replay_ioctl(unsigned long cmd, void *arg) {
+    if (replay_dev)
+        return mppv4l2_ioctl(replay_dev, cmd, arg);
+
+    return ioctl(replay_fd, cmd, arg);
+}
+
+static struct replay_stat *replay_find_stat(int cmd) {
+    int i;
+
+    for (i = 0; i < replay_num_stats; i++)
+        if (replay_stats[i].cmd == cmd)
+            return &replay_stats[i];
+
+    /* There are fewer cmds than that handled */
+    if (i == (int) ARRAY_SIZE(replay_stats))
+        return NULL;
+
+    replay_stats[i].cmd = cmd;
+    replay_num_stats++;
+    return &replay_stats[i];
+}
+
+/* Count a replayed ioctl in, from the main thread only */
+static void replay_account(const struct rkmpp_trace_record *record, int result,
+        uint64_t start, uint64_t elapsed) {
+    struct replay_stat *stat = replay_find_stat(record->cmd);
+
+    if (stat) {
+        stat->count++;
+        stat->mismatches += result != record->result;
+        stat->traced_ns += record->duration;
+        stat->replayed_ns += elapsed;
+        stat->replayed_max_ns = max(stat->replayed_max_ns, elapsed);
+    }
+
+    if (replay_verbose || result != record->result)
+        printf("%+10.3fms %s: %s (traced %s) %" PRIu64 "us (traced %" PRIu64 "us)\n",
+                (start - replay_first) / 1e6, rkmpp_cmd2str(record->cmd),
+                strerror(result), strerror(record->result),
+                elapsed / 1000, record->duration / 1000);
+}
+
+static void *replay_async_thread(void *data) {
+    struct replay_async *async = data;
+    int result;
+
+    result = replay_ioctl(VIDIOC_DQBUF, &async->arg) < 0 ? errno : 0;
+
+    pthread_mutex_lock(&replay_mutex);
+    async->elapsed = rkmpp_trace_now() - async->start;
+    async->result = result;
+    async->done = true;
+    pthread_cond_broadcast(&replay_cond);
+    pthread_mutex_unlock(&replay_mutex);
+
+    return NULL;
+}
+
+/* Issue a DQBUF on a thread, false when it has to be issued inline */
+static bool replay_async_dqbuf(const struct rkmpp_trace_record *record, const void *arg) {
+    struct replay_async *async;
+
+    if (replay_num_asyncs == REPLAY_MAX_ASYNC)
+        return false;
+
+    async = calloc(1, sizeof(*async));
+    if (!async)
+        return false;
+
+    async->record = *record;
+    memcpy(&async->arg, arg, sizeof(async->arg));
+    if (V4L2_TYPE_IS_MULTIPLANAR(async->arg.type))
+        async->arg.m.planes = async->planes;
+    async->start = rkmpp_trace_now();
+
+    if (pthread_create(&async->thread, NULL, replay_async_thread, async)) {
+        free(async);
+        return false;
+    }
+
+    replay_asyncs[replay_num_asyncs++] = async;
+    return true;
+}
+
+/*
+ * Wait for the DQBUFs the trace had completed by traced_ns, all of them for
+ * UINT64_MAX, and count those that completed in. One that doesn't complete
+ * in REPLAY_WAIT_NS is left to itself.
+ */
+static void replay_settle(uint64_t traced_ns) {
+    struct replay_async *async;
+    struct timespec ts;
+    uint64_t deadline = 0;
+
+    pthread_mutex_lock(&replay_mutex);
+    for (int i = 0; i < replay_num_asyncs; i++) {
+        async = replay_asyncs[i];
+        if (async->late || async->record.time + async->record.duration > traced_ns)
+            continue;
+
+        if (!deadline) {
+            deadline = rkmpp_trace_now() + REPLAY_WAIT_NS;
+            ts.tv_sec = deadline / 1000000000ULL;
+            ts.tv_nsec = deadline % 1000000000ULL;
+        }
+
+        while (!async->done)
+            if (pthread_cond_timedwait(&replay_cond, &replay_mutex, &ts) == ETIMEDOUT)
+                break;
+
+        if (!async->done) {
+            printf("%+10.3fms %s still waiting after %llums\n",
+                    (async->start - replay_first) / 1e6, rkmpp_cmd2str(async->record.cmd),
+                    REPLAY_WAIT_NS / 1000000);
+            async->late = true;
+        }
+    }
+
+    /* Completed ones are counted in, whether waited for or not */
+    for (int i = 0; i < replay_num_asyncs; i++) {
+        async = replay_asyncs[i];
+        if (!async->done)
+            continue;
+
+        pthread_join(async->thread, NULL);
+        replay_account(&async->record, async->result, async->start, async->elapsed);
+        free(async);
+        replay_asyncs[i--] = replay_asyncs[--replay_num_asyncs];
+    }
+    pthread_mutex_unlock(&replay_mutex);
+}
+
+/* Stop both queues for the DQBUFs that still wait at the end of the trace */
+static void replay_finish(void) {
+    int types[] = { V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE };
+
+    replay_settle(UINT64_MAX);
+    if (!replay_num_asyncs)
+        return;
+
+    for (int i = 0; i < (int) ARRAY_SIZE(types); i++)
+        replay_ioctl(VIDIOC_STREAMOFF, &types[i]);
+
+    for (int i = 0; i < replay_num_asyncs; i++)
+        replay_asyncs[i]->late = false;
+    replay_settle(UINT64_MAX);
+}
+
+static void replay_sleep_until(uint64_t ns) {
+    struct timespec ts = {
+        .tv_sec = ns / 1000000000ULL,
+        .tv_nsec = ns % 1000000000ULL,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/*
+ * Point the nested pointers of a traced arg at memory of ours. The data a
+ * QBUF queues comes from the data record before it, zeroes when the trace
+ * only has its hash.
+ */
+static void replay_fixup(int cmd, void *arg, struct v4l2_plane *planes,
+        struct replay_data *data) {
+    struct v4l2_buffer *buffer = arg;
+    struct replay_data *d;
+
+    if (cmd != (int) VIDIOC_QBUF && cmd != (int) VIDIOC_DQBUF &&
+            cmd != (int) VIDIOC_QUERYBUF && cmd != (int) VIDIOC_PREPARE_BUF)
+        return;
+
+    if (!V4L2_TYPE_IS_MULTIPLANAR(buffer->type))
+        return;
+
+    memset(planes, 0, sizeof(*planes) * VIDEO_MAX_PLANES);
+    buffer->m.planes = planes;
+    if (buffer->length > VIDEO_MAX_PLANES)
+        buffer->length = VIDEO_MAX_PLANES;
+
+    if (cmd != (int) VIDIOC_QBUF || buffer->index >= VIDEO_MAX_FRAME)
+        return;
+
+    d = &data[buffer->index];
+    if (!d->valid)
+        return;
+
+    planes[0] = d->plane;
+    planes[0].data_offset = 0;
+    planes[0].bytesused = d->size;
+    if (buffer->memory == V4L2_MEMORY_USERPTR) {
+        planes[0].m.userptr = (unsigned long) d->bytes;
+        planes[0].length = d->size;
+    }
+    d->valid = false;
+}
+
+static int replay_data_record(const struct rkmpp_trace_header *header,
+        const struct rkmpp_trace_record *record, const uint8_t *payload,
+        struct replay_data *data) {
+    struct replay_data *d;
+
+    if (record->cmd < 0 || record->cmd >= VIDEO_MAX_FRAME ||
+            record->size < sizeof(struct v4l2_plane))
+        return -1;
+
+    d = &data[record->cmd];
+    memcpy(&d->plane, payload, sizeof(d->plane));
+
+    free(d->bytes);
+    if (header->flags & RKMPP_TRACE_HASHED) {
+        d->size = d->plane.bytesused - d->plane.data_offset;
+        d->bytes = calloc(1, d->size ? d->size : 1);
+    } else {
+        d->size = record->size - sizeof(d->plane);
+        d->bytes = malloc(d->size ? d->size : 1);
+        if (d->bytes)
+            memcpy(d->bytes, payload + sizeof(d->plane), d->size);
+    }
+
+    if (!d->bytes)
+        return -1;
+
+    d->valid = true;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *device = "/dev/video0-mpp-dec";
+    const char *codecs = NULL;
+    bool inprocess = false, fast = false, nonblock;
+    struct rkmpp_trace_header header;
+    struct rkmpp_trace_record record;
+    struct replay_data data[VIDEO_MAX_FRAME] = { 0 };
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    pthread_condattr_t attr;
+    uint64_t first_traced = 0, start, elapsed;
+    uint8_t *payload = NULL;
+    uint8_t arg[1024];
+    size_t argsize;
+    int result, opt;
+    int ret = 1;
+    FILE *file;
+
+    while ((opt = getopt(argc, argv, "d:lc:fvh")) != -1) {
+        switch (opt) {
+        case 'd':
+            device = optarg;
+            break;
+        case 'l':
+            inprocess = true;
+            break;
+        case 'c':
+            codecs = optarg;
+            break;
+        case 'f':
+            fast = true;
+            break;
+        case 'v':
+            replay_verbose = true;
+            break;
+        default:
+            fprintf(stderr, "%s", usage);
+            return opt != 'h';
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "%s", usage);
+        return 1;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&replay_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    file = fopen(argv[optind], "rb");
+    if (!file) {
+        fprintf(stderr, "failed to open %s: %s\n", argv[optind], strerror(errno));
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+            memcmp(header.magic, RKMPP_TRACE_MAGIC, sizeof(header.magic)) ||
+            header.version != RKMPP_TRACE_VERSION) {
+        fprintf(stderr, "not a trace of this version: %s\n", argv[optind]);
+        goto out;
+    }
+
+    /* A nonblocking session's DQBUFs never waited, those are issued inline */
+    nonblock = header.flags & RKMPP_TRACE_NONBLOCK;
+    if (inprocess)
+        replay_dev = mppv4l2_open(codecs, nonblock ? O_NONBLOCK : 0);
+    else
+        replay_fd = open(device, O_RDWR | (nonblock ? O_NONBLOCK : 0));
+
+    if (!replay_dev && replay_fd < 0) {
+        fprintf(stderr, "failed to open %s: %s\n", inprocess ? "libmppv4l2" : device,
+                strerror(errno));
+        goto out;
+    }
+
+    printf("replaying %s session%s\n", header.node,
+            header.flags & RKMPP_TRACE_HASHED ? ", bitstreams were hashed and are zeroes" : "");
+
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        uint8_t *tmp = realloc(payload, record.size ? record.size : 1);
+
+        if (!tmp)
+            goto out;
+        payload = tmp;
+
+        if (record.size && fread(payload, record.size, 1, file) != 1) {
+            fprintf(stderr, "truncated trace\n");
+            break;
+        }
+
+        if (record.type == RKMPP_TRACE_DATA) {
+            if (replay_data_record(&header, &record, payload, data))
+                fprintf(stderr, "bad data record of buffer %d\n", record.cmd);
+            continue;
+        }
+
+        if (record.type != RKMPP_TRACE_IOCTL)
+            continue;
+
+        argsize = getint(record.cmd, 16, 14);
+        if (argsize > sizeof(arg) || record.size > argsize) {
+            fprintf(stderr, "bad ioctl record: %x\n", record.cmd);
+            continue;
+        }
+
+        memset(arg, 0, argsize);
+        memcpy(arg, payload, record.size);
+        replay_fixup(record.cmd, arg, planes, data);
+
+        if (!first_traced) {
+            first_traced = record.time;
+            replay_first = rkmpp_trace_now();
+        } else if (!fast) {
+            replay_sleep_until(replay_first + record.time - first_traced);
+        }
+
+        /* What the trace issued after a DQBUF completed comes after it here too */
+        replay_settle(record.time);
+
+        if (record.cmd == (int) VIDIOC_DQBUF && !nonblock &&
+                replay_async_dqbuf(&record, arg))
+            continue;
+
+        start = rkmpp_trace_now();
+        result = replay_ioctl((unsigned) record.cmd, arg) < 0 ? errno : 0;
+        elapsed = rkmpp_trace_now() - start;
+
+        replay_account(&record, result, start, elapsed);
+    }
+
+    replay_finish();
+
+    printf("\n%-28s %8s %10s %12s %12s %12s\n", "ioctl", "count", "mismatch",
+            "traced avg", "replay avg", "replay max");
+    for (int i = 0; i < replay_num_stats; i++)
+        printf("%-28s %8" PRIu64 " %10" PRIu64 " %10" PRIu64 "us %10" PRIu64 "us %10" PRIu64 "us\n",
+                rkmpp_cmd2str(replay_stats[i].cmd), replay_stats[i].count,
+                replay_stats[i].mismatches,
+                replay_stats[i].traced_ns / replay_stats[i].count / 1000,
+                replay_stats[i].replayed_ns / replay_stats[i].count / 1000,
+                replay_stats[i].replayed_max_ns / 1000);
+
+    ret = 0;
+
+out:
+    replay_finish();
+    for (int i = 0; i < VIDEO_MAX_FRAME; i++)
+        free(data[i].bytes);
+    free(payload);
+    if (replay_dev)
+        mppv4l2_close(replay_dev);
+    if (replay_fd >= 0)
+        close(replay_fd);
+    fclose(file);
+    return ret;
+}
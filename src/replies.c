@@ -0,0 +1,76 @@
+/*
+ * replies.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Replies to the queries clients probe nodes with, worked out once at start
+ * so they are served without a session, a lock or a callback.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "replies.h"
+
+struct cuse_replies *cuse_replies_new(void) {
+    return calloc(1, sizeof(struct cuse_replies));
+}
+
+void cuse_replies_free(struct cuse_replies *replies) {
+    if (!replies)
+        return;
+
+    for (size_t i = 0; i < replies->num; i++)
+        free(replies->replies[i].arg);
+    free(replies->replies);
+    free(replies);
+}
+
+int cuse_replies_add(struct cuse_replies *replies, int cmd, int err, const void *arg,
+        size_t size, size_t key_size) {
+    struct cuse_reply *reply;
+
+    if (key_size > size)
+        return -1;
+
+    reply = realloc(replies->replies, (replies->num + 1) * sizeof(*reply));
+    if (!reply)
+        return -1;
+    replies->replies = reply;
+
+    reply = &replies->replies[replies->num];
+    reply->arg = malloc(size ? size : 1);
+    if (!reply->arg)
+        return -1;
+
+    memcpy(reply->arg, arg, size);
+    reply->cmd = cmd;
+    reply->err = err;
+    reply->key_size = key_size;
+    reply->size = size;
+    replies->num++;
+
+    return 0;
+}
+
+/* The member is always the second, its key_size goes for both */
+static int cuse_reply_cmp(const void *a, const void *b) {
+    const struct cuse_reply *ra = a, *rb = b;
+
+    if (ra->cmd != rb->cmd)
+        return ra->cmd < rb->cmd ? -1 : 1;
+
+    return rb->key_size ? memcmp(ra->arg, rb->arg, rb->key_size) : 0;
+}
+
+void cuse_replies_seal(struct cuse_replies *replies) {
+    qsort(replies->replies, replies->num, sizeof(*replies->replies), cuse_reply_cmp);
+}
+
+const struct cuse_reply *cuse_replies_find(const struct cuse_replies *replies, int cmd,
+        const void *in_buf) {
+    struct cuse_reply key = { .cmd = cmd, .arg = (uint8_t *) in_buf };
+
+    return bsearch(&key, replies->replies, replies->num, sizeof(*replies->replies),
+            cuse_reply_cmp);
+}
@@ -0,0 +1,55 @@
+/*
+ * replies.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ */
+
+#ifndef SRC_REPLIES_H_
+#define SRC_REPLIES_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * struct cuse_reply - Reply to an ioctl known ahead of time
+ * @cmd:        Ioctl cmd.
+ * @err:        Errno to reply, 0 to reply with arg.
+ * @key_size:   Leading bytes of the arg that tell the requests apart, like
+ *              the index and type of ENUM_FMT. The same for all of a cmd.
+ * @size:       Size of arg.
+ * @arg:        The reply, starting with the key it answers.
+ */
+struct cuse_reply {
+    int cmd;
+    int err;
+    uint32_t key_size;
+    uint32_t size;
+    uint8_t *arg;
+};
+
+/**
+ * struct cuse_replies - Replies of a node, sorted by cmd and key
+ * @replies:    The replies.
+ * @num:        Number of replies.
+ */
+struct cuse_replies {
+    struct cuse_reply *replies;
+    size_t num;
+};
+
+struct cuse_replies *cuse_replies_new(void);
+void cuse_replies_free(struct cuse_replies *replies);
+
+/* Keep a reply, the key being the first key_size bytes of arg */
+int cuse_replies_add(struct cuse_replies *replies, int cmd, int err, const void *arg,
+        size_t size, size_t key_size);
+
+/* Sort the replies once they are all added, for lookups */
+void cuse_replies_seal(struct cuse_replies *replies);
+
+/* The reply to cmd with the in_buf arg, NULL when it isn't known */
+const struct cuse_reply *cuse_replies_find(const struct cuse_replies *replies, int cmd,
+        const void *in_buf);
+
+#endif /* SRC_REPLIES_H_ */
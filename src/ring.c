@@ -0,0 +1,161 @@
+/*
+ * ring.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Daemon side of the shared completion ring, see mppv4l2_ring.h for the
+ * client's.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ring.h"
+#include "rkmpp.h"
+
+static struct rkmpp_ring *rkmpp_ring_map(int memfd, int eventfd) {
+    struct rkmpp_ring *ring;
+    struct stat st;
+
+    if (fstat(memfd, &st) < 0 || st.st_size < (off_t) sizeof(struct mppv4l2_ring)) {
+        LOGE("ring memfd too small: %lld < %zu\n", (long long) st.st_size,
+                sizeof(struct mppv4l2_ring));
+        errno = EINVAL;
+        goto err;
+    }
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        goto err;
+
+    ring->shm = mmap(NULL, sizeof(*ring->shm), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (ring->shm == MAP_FAILED) {
+        LOGE("failed to map ring: %s\n", strerror(errno));
+        free(ring);
+        goto err;
+    }
+
+    ring->memfd = memfd;
+    ring->eventfd = eventfd;
+
+    return ring;
+err:
+    close(memfd);
+    close(eventfd);
+    return NULL;
+}
+
+struct rkmpp_ring *rkmpp_ring_create(int memfd, int eventfd) {
+    struct rkmpp_ring *ring = rkmpp_ring_map(memfd, eventfd);
+
+    if (!ring)
+        return NULL;
+
+    memset(ring->shm, 0, sizeof(*ring->shm));
+    ring->shm->version = MPPV4L2_RING_VERSION;
+    ring->shm->slots = MPPV4L2_RING_SLOTS;
+    __atomic_store_n(&ring->shm->magic, MPPV4L2_RING_MAGIC, __ATOMIC_RELEASE);
+
+    return ring;
+}
+
+/* The counters go on where the previous daemon left them */
+struct rkmpp_ring *rkmpp_ring_adopt(int memfd, int eventfd) {
+    struct rkmpp_ring *ring = rkmpp_ring_map(memfd, eventfd);
+
+    if (!ring)
+        return NULL;
+
+    if (__atomic_load_n(&ring->shm->magic, __ATOMIC_ACQUIRE) != MPPV4L2_RING_MAGIC ||
+            ring->shm->version != MPPV4L2_RING_VERSION) {
+        LOGE("taken over ring isn't set up\n");
+        rkmpp_ring_destroy(ring);
+        RETURN_ERR(EINVAL, NULL);
+    }
+
+    return ring;
+}
+
+void rkmpp_ring_destroy(struct rkmpp_ring *ring) {
+    if (!ring)
+        return;
+
+    LOGV(1, "ring: %" PRIu64 " buffers published, %" PRIu64 " taken, %" PRIu64 " wakeups\n",
+            ring->published, ring->taken, ring->wakeups);
+
+    munmap(ring->shm, sizeof(*ring->shm));
+    close(ring->memfd);
+    close(ring->eventfd);
+    free(ring);
+}
+
+bool rkmpp_ring_publish(struct rkmpp_ring *ring, const struct rkmpp_buffer *buffer) {
+    struct mppv4l2_ring *shm = ring->shm;
+    uint32_t head = __atomic_load_n(&shm->done_head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&shm->done_tail, __ATOMIC_ACQUIRE);
+    struct mppv4l2_ring_done *done;
+    uint64_t one = 1;
+
+    if (head - tail >= MPPV4L2_RING_SLOTS)
+        return false;
+
+    done = &shm->done[head % MPPV4L2_RING_SLOTS];
+    done->index = buffer->index;
+    done->flags = 0;
+    if (rkmpp_buffer_error(buffer))
+        done->flags |= V4L2_BUF_FLAG_ERROR;
+    if (rkmpp_buffer_keyframe(buffer))
+        done->flags |= V4L2_BUF_FLAG_KEYFRAME;
+    done->bytesused = buffer->bytesused;
+    done->field = buffer->meta.field;
+    done->timestamp = buffer->timestamp;
+    done->errinfo = buffer->meta.errinfo;
+
+    memcpy(done->display_primaries, buffer->meta.mastering.display_primaries,
+            sizeof(done->display_primaries));
+    memcpy(done->white_point, buffer->meta.mastering.white_point,
+            sizeof(done->white_point));
+    done->max_luminance = buffer->meta.mastering.max_luminance;
+    done->min_luminance = buffer->meta.mastering.min_luminance;
+    done->max_cll = buffer->meta.content_light.MaxCLL;
+    done->max_fall = buffer->meta.content_light.MaxFALL;
+
+    /* Pairs with the client setting done_wait before its last look at the head */
+    __atomic_store_n(&shm->done_head, head + 1, __ATOMIC_SEQ_CST);
+    ring->published++;
+
+    if (__atomic_exchange_n(&shm->done_wait, 0, __ATOMIC_SEQ_CST)) {
+        if (write(ring->eventfd, &one, sizeof(one)) < 0)
+            LOGE("failed to signal ring eventfd: %s\n", strerror(errno));
+        ring->wakeups++;
+    }
+
+    return true;
+}
+
+int rkmpp_ring_next_queued(struct rkmpp_ring *ring) {
+    struct mppv4l2_ring *shm = ring->shm;
+    uint32_t tail = __atomic_load_n(&shm->queue_tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&shm->queue_head, __ATOMIC_ACQUIRE);
+    int index;
+
+    if (head == tail)
+        return -1;
+
+    /* A client writing past the ring lost the indices it overwrote */
+    if (head - tail > MPPV4L2_RING_SLOTS) {
+        LOGE("ring overrun: %u queued\n", head - tail);
+        __atomic_store_n(&shm->queue_tail, head, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    index = shm->queue[tail % MPPV4L2_RING_SLOTS];
+    __atomic_store_n(&shm->queue_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->taken++;
+
+    return index;
+}
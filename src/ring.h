@@ -0,0 +1,54 @@
+/*
+ * ring.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ */
+
+#ifndef SRC_RING_H_
+#define SRC_RING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mppv4l2_ring.h"
+
+struct rkmpp_buffer;
+
+/**
+ * struct rkmpp_ring - Daemon side of a shared completion ring
+ * @shm:        The shared ring.
+ * @memfd:      Memfd of the ring.
+ * @eventfd:    Eventfd of the client's wakeups.
+ * @published:  Buffers published.
+ * @taken:      Buffers taken back.
+ * @wakeups:    Times the eventfd was signaled.
+ */
+struct rkmpp_ring {
+    struct mppv4l2_ring *shm;
+    int memfd;
+    int eventfd;
+
+    uint64_t published;
+    uint64_t taken;
+    uint64_t wakeups;
+};
+
+/*
+ * Map the ring of the daemon's copies of the client's fds, taking them over.
+ * Returns NULL with errno set, and the fds closed, on failure.
+ */
+struct rkmpp_ring *rkmpp_ring_create(int memfd, int eventfd);
+
+/* Map a ring set up by the daemon the session was taken over from, as it is */
+struct rkmpp_ring *rkmpp_ring_adopt(int memfd, int eventfd);
+void rkmpp_ring_destroy(struct rkmpp_ring *ring);
+
+/* Publish a done capture buffer, false when the client is a ring behind */
+bool rkmpp_ring_publish(struct rkmpp_ring *ring, const struct rkmpp_buffer *buffer);
+
+/* Index of the next buffer queued by the client, -1 for none */
+int rkmpp_ring_next_queued(struct rkmpp_ring *ring);
+
+#endif /* SRC_RING_H_ */
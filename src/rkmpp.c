@@ -1,18 +1,212 @@
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <linux/version.h>
 
+#include "bufpool.h"
+#include "handoff.h"
 #include "logger.h"
 #include "rkmpp.h"
 #include "cusedev.h"
+#include "replies.h"
+#include "ring.h"
+#include "trace.h"
+
+/* Drm memory allocated by all sessions */
+static pthread_mutex_t rkmpp_mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t rkmpp_mem_used;
 
 int rkmpp_update_poll_event(struct rkmpp_context *ctx) {
     return 0;
 }
 
+/* Account drm memory to the session, failing if it exceeds either cap */
+int rkmpp_mem_charge(struct rkmpp_context *ctx, uint64_t size) {
+    int ret = 0;
+
+    pthread_mutex_lock(&rkmpp_mem_mutex);
+    if ((ctx->mem_limit && ctx->mem_used + size > ctx->mem_limit) ||
+            (ctx->mem_limit_total && rkmpp_mem_used + size > ctx->mem_limit_total)) {
+        LOGE("ctx(%p): drm memory cap hit, %" PRIu64 "KiB requested, "
+                "%" PRIu64 "KiB used, %" PRIu64 "KiB used in total\n", (void *) ctx,
+                size >> 10, ctx->mem_used >> 10, rkmpp_mem_used >> 10);
+        ret = -1;
+    } else {
+        ctx->mem_used += size;
+        rkmpp_mem_used += size;
+    }
+    pthread_mutex_unlock(&rkmpp_mem_mutex);
+
+    if (!ret)
+        LOGV(1, "ctx(%p): drm memory %" PRIu64 "KiB, %" PRIu64 "KiB in total\n",
+                (void *) ctx, ctx->mem_used >> 10, rkmpp_mem_used >> 10);
+
+    return ret;
+}
+
+void rkmpp_mem_uncharge(struct rkmpp_context *ctx, uint64_t size) {
+    pthread_mutex_lock(&rkmpp_mem_mutex);
+    ctx->mem_used -= size;
+    rkmpp_mem_used -= size;
+    pthread_mutex_unlock(&rkmpp_mem_mutex);
+}
+
+uint64_t rkmpp_mem_total(void) {
+    uint64_t used;
+
+    pthread_mutex_lock(&rkmpp_mem_mutex);
+    used = rkmpp_mem_used;
+    pthread_mutex_unlock(&rkmpp_mem_mutex);
+
+    return used;
+}
+
+static uint32_t rkmpp_slab_size(uint32_t size) {
+    uint32_t slab = RKMPP_SLAB_MIN_SIZE;
+
+    while (slab < size && slab < (1u << 31))
+        slab <<= 1;
+
+    return slab;
+}
+
+/* Drop the dma-buf a buffer was last queued with */
+static void rkmpp_release_import(struct rkmpp_buffer *buffer) {
+    if (!buffer->rkmpp_buf || rkmpp_buffer_locked(buffer))
+        return;
+
+    mpp_buffer_put(buffer->rkmpp_buf);
+    close(buffer->fd);
+
+    buffer->rkmpp_buf = NULL;
+    buffer->fd = -1;
+    buffer->size = 0;
+}
+
+/*
+ * Mpp only decodes into buffers of the external group of the capture queue,
+ * so the memory of a capture buffer is imported there. The import is what
+ * the buffer hands around from then on, held by us like a fresh buffer,
+ * while the memory stays in backing until it goes. Queues without a group
+ * have nothing to commit to.
+ */
+int rkmpp_commit_buffer(struct rkmpp_buf_queue *queue, struct rkmpp_buffer *buffer) {
+    MppBufferInfo info = { .type = MPP_BUFFER_TYPE_DRM };
+    MppBuffer rkmpp_buf;
+
+    if (!queue->external_group || V4L2_TYPE_IS_OUTPUT(buffer->type) || buffer->backing)
+        return 0;
+
+    info.fd = buffer->fd;
+    info.size = buffer->size;
+    info.index = buffer->index;
+    if (mpp_buffer_import_with_tag(queue->external_group, &info, &rkmpp_buf,
+            NULL, __func__) != MPP_OK) {
+        LOGE("failed to commit capture buffer %d\n", buffer->index);
+        RETURN_ERR(ENOMEM, -1);
+    }
+
+    if (rkmpp_buffer_locked(buffer))
+        rkmpp_buffer_set_pooled(buffer);
+    else
+        rkmpp_buffer_set_locked(buffer);
+
+    buffer->backing = buffer->rkmpp_buf;
+    buffer->rkmpp_buf = rkmpp_buf;
+
+    return 0;
+}
+
+/*
+ * Take the memory of a committed buffer back from the group. Once put, an
+ * import we hold is decoded into again, so the import of memory being
+ * replaced is retired instead, still held.
+ */
+static void rkmpp_uncommit_buffer(struct rkmpp_buf_queue *queue,
+        struct rkmpp_buffer *buffer, bool retire) {
+    MppBuffer *retired;
+
+    if (!buffer->backing)
+        return;
+
+    if (rkmpp_buffer_locked(buffer)) {
+        retired = retire ? realloc(queue->retired,
+                (queue->num_retired + 1) * sizeof(*retired)) : NULL;
+        if (retired) {
+            retired[queue->num_retired++] = buffer->rkmpp_buf;
+            queue->retired = retired;
+        } else {
+            mpp_buffer_put(buffer->rkmpp_buf);
+        }
+        rkmpp_buffer_clr_locked(buffer);
+    }
+
+    buffer->rkmpp_buf = buffer->backing;
+    buffer->backing = NULL;
+
+    if (rkmpp_buffer_pooled(buffer)) {
+        rkmpp_buffer_clr_pooled(buffer);
+        rkmpp_buffer_set_locked(buffer);
+    }
+}
+
+/*
+ * Make sure the buffer has an internal drm backing of at least size bytes.
+ * Growing leaves a quarter of headroom, so a stream whose packets creep up
+ * doesn't realloc on every packet. The data isn't preserved, and a buffer
+ * that fails to grow is left without a backing.
+ */
+int rkmpp_buffer_reserve(struct rkmpp_context *ctx, struct rkmpp_buf_queue *queue,
+        struct rkmpp_buffer *buffer, uint32_t size) {
+    MppBuffer rkmpp_buf;
+    uint32_t slab;
+
+    if (buffer->rkmpp_buf && size <= buffer->size)
+        return 0;
+
+    slab = rkmpp_slab_size(size + size / 4);
+
+    LOGV(2, "buffer %d grows from %d to %d bytes\n", buffer->index, buffer->size, slab);
+
+    /* The old backing goes first, so it doesn't count against the caps twice */
+    if (rkmpp_buffer_locked(buffer)) {
+        rkmpp_pool_put(MPP_BUFFER_TYPE_DRM, buffer->rkmpp_buf);
+        rkmpp_mem_uncharge(ctx, buffer->size);
+        rkmpp_buffer_clr_locked(buffer);
+    } else if (buffer->rkmpp_buf) {
+        /* Staging taken over from another daemon is an import */
+        rkmpp_mem_uncharge(ctx, buffer->size);
+        rkmpp_release_import(buffer);
+    }
+
+    buffer->rkmpp_buf = NULL;
+    buffer->fd = -1;
+    buffer->size = 0;
+
+    if (rkmpp_mem_charge(ctx, slab))
+        RETURN_ERR(ENOMEM, -1);
 
-static void rkmpp_destroy_buffers(struct rkmpp_buf_queue *queue) {
+    if (rkmpp_pool_get(MPP_BUFFER_TYPE_DRM, slab, &rkmpp_buf)) {
+        LOGE("failed to alloc buffer: %d size: %d\n", buffer->index, slab);
+        rkmpp_mem_uncharge(ctx, slab);
+        RETURN_ERR(ENOMEM, -1);
+    }
+
+    buffer->rkmpp_buf = rkmpp_buf;
+    buffer->fd = mpp_buffer_get_fd(rkmpp_buf);
+    buffer->size = slab;
+    rkmpp_buffer_set_locked(buffer);
+
+    return 0;
+}
+
+static void rkmpp_destroy_buffers(struct rkmpp_context *ctx, struct rkmpp_buf_queue *queue) {
+    uint64_t size = 0;
     unsigned int i;
 
     if (!queue->num_buffers)
@@ -20,19 +214,35 @@ static void rkmpp_destroy_buffers(struct rkmpp_buf_queue *queue) {
 
     if (queue->buffers) {
         for (i = 0; i < queue->num_buffers; i++) {
+            /* Mmap buffers and userptr staging are ours, imported or not */
+            if (queue->memory != V4L2_MEMORY_DMABUF)
+                size += queue->buffers[i].size;
+
+            rkmpp_uncommit_buffer(queue, &queue->buffers[i], false);
+
             if (rkmpp_buffer_locked(&queue->buffers[i]))
-                mpp_buffer_put(queue->buffers[i].rkmpp_buf);
+                rkmpp_pool_put(MPP_BUFFER_TYPE_DRM, queue->buffers[i].rkmpp_buf);
+            else
+                rkmpp_release_import(&queue->buffers[i]);
         }
 
         free(queue->buffers);
         queue->buffers = NULL;
     }
 
-    mpp_buffer_group_clear(queue->internal_group);
+    for (i = 0; i < queue->num_retired; i++)
+        mpp_buffer_put(queue->retired[i]);
+    free(queue->retired);
+    queue->retired = NULL;
+    queue->num_retired = 0;
 
     if (queue->external_group)
         mpp_buffer_group_clear(queue->external_group);
 
+    rkmpp_mem_uncharge(ctx, size);
+
+    TAILQ_INIT(&queue->avail_buffers);
+    TAILQ_INIT(&queue->pending_buffers);
     queue->num_buffers = 0;
 }
 
@@ -51,93 +261,1626 @@ struct rkmpp_buf_queue* rkmpp_get_queue(struct rkmpp_context *ctx, enum v4l2_buf
     }
 }
 
-int rkmpp_ioctl_querycap(void *userdata, const void* in_buf, void *out_buf) {
+/*
+ * Decoders take coded formats on the output queue, raw ones on capture,
+ * unless the format says otherwise.
+ */
+static bool rkmpp_fmt_on_queue(struct rkmpp_context *ctx, const struct rkmpp_fmt *fmt,
+        enum v4l2_buf_type type) {
+    bool coded = fmt->type != MPP_VIDEO_CodingUnused;
+
+    if (fmt->queues)
+        return fmt->queues & RKMPP_FMT_QUEUE(type);
+
+    return coded == (V4L2_TYPE_IS_OUTPUT(type) == ctx->is_decoder);
+}
+
+const struct rkmpp_fmt *rkmpp_find_fmt(struct rkmpp_context *ctx, uint32_t fourcc,
+        enum v4l2_buf_type type) {
+    const struct rkmpp_fmt *fmt;
+    unsigned int i;
+
+    for (i = 0; i < ctx->num_formats; i++) {
+        fmt = &ctx->formats[i];
+        if (fmt->fourcc == fourcc && rkmpp_fmt_on_queue(ctx, fmt, type) &&
+                RKMPP_HAS_FORMAT(ctx, fmt))
+            return fmt;
+    }
+
+    return NULL;
+}
+
+int rkmpp_try_fmt(struct rkmpp_context *ctx, struct v4l2_format *f) {
+    struct v4l2_pix_format_mplane *pix = &f->fmt.pix_mp;
+    const struct rkmpp_fmt *fmt;
+
+    ENTER();
+
+    if (!rkmpp_get_queue(ctx, f->type))
+        RETURN_ERR(EINVAL, -1);
+
+    fmt = rkmpp_find_fmt(ctx, pix->pixelformat, f->type);
+    if (!fmt) {
+        LOGV(1, "unsupported format: %.4s\n", (char *) &pix->pixelformat);
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    if (fmt->frmsize.max_width) {
+        pix->width = clamp(pix->width, fmt->frmsize.min_width, fmt->frmsize.max_width);
+        pix->height = clamp(pix->height, fmt->frmsize.min_height, fmt->frmsize.max_height);
+    }
+
+    if (ctx->max_width && ctx->max_height) {
+        pix->width = min(pix->width, ctx->max_width);
+        pix->height = min(pix->height, ctx->max_height);
+    }
+
+    pix->num_planes = 1;
+    pix->field = V4L2_FIELD_NONE;
+
+    if (fmt->type != MPP_VIDEO_CodingUnused) {
+        /* Half of the raw frame is plenty for a coded one */
+        pix->plane_fmt[0].bytesperline = 0;
+        if (!pix->plane_fmt[0].sizeimage)
+            pix->plane_fmt[0].sizeimage = pix->width * pix->height * 3 / 4;
+    } else {
+        pix->plane_fmt[0].bytesperline = pix->width * fmt->depth[0] / 8;
+        pix->plane_fmt[0].sizeimage = pix->width * pix->height * fmt->depth[0] / 8;
+    }
+
+    LEAVE();
+    return 0;
+}
+
+int rkmpp_ioctl_enum_fmt(void *userdata, const void *in_buf, void *out_buf) {
     struct cuse_codec *codec = userdata;
     struct rkmpp_context *ctx = codec->priv;
-    struct v4l2_capability *cap = out_buf;
+    struct v4l2_fmtdesc *f = out_buf;
+    const struct rkmpp_fmt *fmt;
+    uint32_t index;
+    unsigned int i;
 
     ENTER();
 
-    strncpy((char*) cap->driver, "rkmpp", sizeof(cap->driver));
-    strncpy((char*) cap->card, "rkmpp", sizeof(cap->card));
-    strncpy((char*) cap->bus_info, "platform: rkmpp", sizeof(cap->bus_info));
+    *f = *(const struct v4l2_fmtdesc *) in_buf;
+    index = f->index;
 
-    cap->version = LINUX_VERSION_CODE;
+    if (!rkmpp_get_queue(ctx, f->type))
+        RETURN_ERR(EINVAL, -1);
 
-    /* This is only a mem-to-mem video device. */
-    cap->device_caps = V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING;
-    cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+    for (i = 0; i < ctx->num_formats; i++) {
+        fmt = &ctx->formats[i];
+        if (!rkmpp_fmt_on_queue(ctx, fmt, f->type) || !RKMPP_HAS_FORMAT(ctx, fmt))
+            continue;
 
-    cap->capabilities |= V4L2_CAP_EXT_PIX_FORMAT;
-    cap->device_caps |= V4L2_CAP_EXT_PIX_FORMAT;
+        if (index--)
+            continue;
+
+        f->pixelformat = fmt->fourcc;
+        f->flags = fmt->type != MPP_VIDEO_CodingUnused ? V4L2_FMT_FLAG_COMPRESSED : 0;
+        strncpy((char *) f->description, fmt->name, sizeof(f->description) - 1);
+
+        LEAVE();
+        return 0;
+    }
+
+    RETURN_ERR(EINVAL, -1);
+}
+
+int rkmpp_ioctl_enum_framesizes(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct v4l2_frmsizeenum *fsize = out_buf;
+    const struct rkmpp_fmt *fmt = NULL;
+    unsigned int i;
+
+    ENTER();
+
+    *fsize = *(const struct v4l2_frmsizeenum *) in_buf;
+
+    for (i = 0; i < ctx->num_formats; i++) {
+        if (ctx->formats[i].fourcc == fsize->pixel_format &&
+                RKMPP_HAS_FORMAT(ctx, &ctx->formats[i])) {
+            fmt = &ctx->formats[i];
+            break;
+        }
+    }
+
+    /* Raw formats take whatever the coded one decodes to */
+    if (!fmt || !fmt->frmsize.max_width || fsize->index)
+        RETURN_ERR(EINVAL, -1);
+
+    fsize->type = V4L2_FRMSIZE_TYPE_STEPWISE;
+    fsize->stepwise = fmt->frmsize;
+
+    if (ctx->max_width && ctx->max_height) {
+        fsize->stepwise.max_width = min(fsize->stepwise.max_width, ctx->max_width);
+        fsize->stepwise.max_height = min(fsize->stepwise.max_height, ctx->max_height);
+    }
 
     LEAVE();
     return 0;
 }
 
-struct rkmpp_context* context_init() {
-    struct rkmpp_context *ctx = NULL;
-    MPP_RET ret;
+int rkmpp_ioctl_g_fmt(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct v4l2_format *f = out_buf;
+    struct rkmpp_buf_queue *queue;
 
     ENTER();
 
-    ctx = (struct rkmpp_context*) calloc(1, sizeof(struct rkmpp_context));
-    if (!ctx)
-        RETURN_ERR(ENOMEM, NULL);
+    *f = *(const struct v4l2_format *) in_buf;
 
-    pthread_mutex_init(&ctx->ioctl_mutex, NULL);
-    pthread_mutex_init(&ctx->output.queue_mutex, NULL);
-    pthread_mutex_init(&ctx->capture.queue_mutex, NULL);
+    queue = rkmpp_get_queue(ctx, f->type);
+    if (!queue)
+        RETURN_ERR(EINVAL, -1);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+    f->fmt.pix_mp = queue->format;
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LEAVE();
+    return 0;
+}
+
+int rkmpp_ioctl_reqbufs(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct v4l2_requestbuffers *reqbufs = out_buf;
+    struct rkmpp_buf_queue *queue;
+    struct rkmpp_buffer *buffer;
+    uint32_t count, size, alloc;
+    unsigned int i;
+    int ret = -1;
+
+    ENTER();
 
-    ret = mpp_buffer_group_get_internal(&ctx->output.internal_group, MPP_BUFFER_TYPE_DRM);
-    if (ret != MPP_OK) {
-        LOGE("failed to use mpp drm buf group\n");
-        errno = ENODEV;
-        goto err_free_ctx;
+    *reqbufs = *(const struct v4l2_requestbuffers *) in_buf;
+
+    queue = rkmpp_get_queue(ctx, reqbufs->type);
+    if (!queue)
+        RETURN_ERR(EINVAL, -1);
+
+    /* Userptr packets are staged into drm buffers sized on demand */
+    if ((reqbufs->memory == V4L2_MEMORY_MMAP &&
+             !(RKMPP_BUF_CAPS & V4L2_BUF_CAP_SUPPORTS_MMAP)) ||
+            (reqbufs->memory != V4L2_MEMORY_MMAP &&
+             reqbufs->memory != V4L2_MEMORY_DMABUF &&
+             (reqbufs->memory != V4L2_MEMORY_USERPTR ||
+              !V4L2_TYPE_IS_OUTPUT(reqbufs->type)))) {
+        LOGE("unsupported memory type: %d\n", reqbufs->memory);
+        RETURN_ERR(EINVAL, -1);
     }
 
-    ret = mpp_buffer_group_get_internal(&ctx->capture.internal_group, MPP_BUFFER_TYPE_DRM);
-    if (ret != MPP_OK) {
-        LOGE("failed to use mpp drm buf group\n");
-        errno = ENODEV;
-        goto err_put_group;
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    if (queue->streaming) {
+        LOGE("can't realloc buffers while streaming\n");
+        errno = EBUSY;
+        goto out;
     }
 
-    LOGV(1, "ctx(%p)): inited,\n", (void* )ctx);
+    /* The decoder thread looks at the buffers under the queue lock */
+    pthread_mutex_lock(&queue->queue_mutex);
+
+    rkmpp_destroy_buffers(ctx, queue);
+
+    if (!reqbufs->count)
+        goto done;
+
+    size = queue->format.plane_fmt[0].sizeimage;
+    if (!size) {
+        LOGE("format not set\n");
+        errno = EINVAL;
+        goto unlock;
+    }
+
+    /* Packets come in the size classes of the staging, frames as they are */
+    alloc = V4L2_TYPE_IS_OUTPUT(reqbufs->type) ? rkmpp_slab_size(size) : size;
+
+    /* Fewer buffers than the codec needs would only stall */
+    count = clamp(reqbufs->count, max(queue->min_buffers, 1), VIDEO_MAX_FRAME);
+
+    if (reqbufs->memory == V4L2_MEMORY_MMAP) {
+        /* Shrink towards the minimum to fit the memory caps */
+        while (rkmpp_mem_charge(ctx, (uint64_t) alloc * count)) {
+            if (count <= max(queue->min_buffers, 1)) {
+                errno = ENOMEM;
+                goto unlock;
+            }
+            count--;
+        }
+    }
+
+    queue->buffers = calloc(count, sizeof(*queue->buffers));
+    if (!queue->buffers) {
+        if (reqbufs->memory == V4L2_MEMORY_MMAP)
+            rkmpp_mem_uncharge(ctx, (uint64_t) alloc * count);
+        errno = ENOMEM;
+        goto unlock;
+    }
+
+    queue->memory = reqbufs->memory;
+    queue->num_buffers = count;
+
+    for (i = 0; i < count; i++) {
+        buffer = &queue->buffers[i];
+        buffer->index = i;
+        buffer->type = reqbufs->type;
+        buffer->fd = -1;
+        buffer->length = 1;
+        buffer->planes[0].fd = -1;
+        buffer->planes[0].length = size;
+
+        if (queue->memory != V4L2_MEMORY_MMAP)
+            continue;
+
+        /* Already charged, destroying uncharges it even if the alloc fails */
+        buffer->size = alloc;
+
+        if (rkmpp_pool_get(MPP_BUFFER_TYPE_DRM, alloc, &buffer->rkmpp_buf)) {
+            LOGE("failed to alloc buffer: %d size: %d\n", i, alloc);
+            rkmpp_destroy_buffers(ctx, queue);
+            errno = ENOMEM;
+            goto unlock;
+        }
+
+        buffer->fd = mpp_buffer_get_fd(buffer->rkmpp_buf);
+        buffer->planes[0].fd = buffer->fd;
+        rkmpp_buffer_set_locked(buffer);
+
+        if (rkmpp_commit_buffer(queue, buffer)) {
+            rkmpp_destroy_buffers(ctx, queue);
+            errno = ENOMEM;
+            goto unlock;
+        }
+    }
+
+    LOGV(1, "ctx(%p): %d buffers of %d bytes on queue %d\n", (void *) ctx,
+            count, size, reqbufs->type);
+
+done:
+    reqbufs->count = queue->num_buffers;
+    reqbufs->capabilities = RKMPP_BUF_CAPS;
+    ret = 0;
+unlock:
+    pthread_mutex_unlock(&queue->queue_mutex);
+out:
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
 
     LEAVE();
-    return ctx;
-err_put_group:
-    if (ctx->output.internal_group)
-        mpp_buffer_group_put(ctx->output.internal_group);
+    return ret;
+}
 
-    if (ctx->capture.internal_group)
-        mpp_buffer_group_put(ctx->capture.internal_group);
-err_free_ctx:
-    free(ctx);
-    RETURN_ERR(errno, NULL);
+/*
+ * Export a mmap buffer as a dma-buf for the client to map. The fd is only
+ * good in process, the daemon can't hand one to its clients, which is why
+ * mmap buffers are only offered there.
+ */
+int rkmpp_ioctl_expbuf(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct v4l2_exportbuffer *expbuf = out_buf;
+    struct rkmpp_buf_queue *queue;
+    int ret = -1;
+
+    ENTER();
+
+    *expbuf = *(const struct v4l2_exportbuffer *) in_buf;
+
+    queue = rkmpp_get_queue(ctx, expbuf->type);
+    if (!queue || expbuf->plane || (expbuf->flags & ~(O_CLOEXEC | O_ACCMODE)))
+        RETURN_ERR(EINVAL, -1);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    if (queue->memory != V4L2_MEMORY_MMAP || expbuf->index >= queue->num_buffers ||
+            queue->buffers[expbuf->index].fd < 0) {
+        errno = EINVAL;
+        goto out;
+    }
+
+    expbuf->fd = fcntl(queue->buffers[expbuf->index].fd,
+            expbuf->flags & O_CLOEXEC ? F_DUPFD_CLOEXEC : F_DUPFD, 0);
+    if (expbuf->fd < 0)
+        goto out;
+
+    LOGV(2, "ctx(%p): exported buffer %d of queue %d as fd %d\n", (void *) ctx,
+            expbuf->index, expbuf->type, expbuf->fd);
+
+    ret = 0;
+out:
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LEAVE();
+    return ret;
 }
 
-void context_destroy(struct rkmpp_context *ctx) {
+/* Copy a userptr packet into the buffer's drm staging, sized on demand */
+static int rkmpp_stage_userptr(struct rkmpp_context *ctx, struct rkmpp_buffer *buffer,
+        const struct v4l2_plane *plane) {
+    struct timespec start, end;
+    uint8_t *ptr;
+    int ret;
+
     ENTER();
 
-    LOGV(1, "ctx(%p): closing\n", (void* )ctx);
+    if (rkmpp_buffer_reserve(ctx, &ctx->output, buffer,
+            plane->bytesused - plane->data_offset) < 0)
+        RETURN_ERR(errno, -1);
 
-    rkmpp_destroy_buffers(&ctx->output);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    if (ctx->output.internal_group)
-        mpp_buffer_group_put(ctx->output.internal_group);
+    ptr = mpp_buffer_get_ptr(buffer->rkmpp_buf);
+    mpp_buffer_sync_begin(buffer->rkmpp_buf);
+    ret = cuse_read_client(ptr, plane->m.userptr + plane->data_offset,
+            plane->bytesused - plane->data_offset);
+    mpp_buffer_sync_end(buffer->rkmpp_buf);
 
-    if (ctx->output.external_group)
-        mpp_buffer_group_put(ctx->output.external_group);
+    if (ret < 0)
+        RETURN_ERR(EFAULT, -1);
 
-    rkmpp_destroy_buffers(&ctx->capture);
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    if (ctx->capture.external_group)
-        mpp_buffer_group_put(ctx->capture.external_group);
+    LOGV(3, "staged packet: %d, %d bytes in %ldus\n", buffer->index,
+            plane->bytesused - plane->data_offset,
+            (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+
+    buffer->planes[0].userptr = plane->m.userptr;
+
+    LEAVE();
+    return 0;
+}
+
+/*
+ * Import the dma-buf the client queued a buffer with. Clients cycle the same
+ * dma-bufs through the same buffers, so the import is kept until another one
+ * is queued in its place.
+ */
+static int rkmpp_import_dmabuf(struct rkmpp_context *ctx, struct rkmpp_buf_queue *queue,
+        struct rkmpp_buffer *buffer, int client_fd, uint32_t min_size) {
+    MppBufferInfo info = { .type = MPP_BUFFER_TYPE_EXT_DMA };
+    MppBuffer rkmpp_buf;
+    struct stat st, cur;
+    off_t size;
+    int fd;
+
+    ENTER();
+
+    fd = cuse_get_client_fd(client_fd);
+    if (fd < 0)
+        RETURN_ERR(EBADF, -1);
+
+    if (buffer->rkmpp_buf && !fstat(fd, &st) && !fstat(buffer->fd, &cur) &&
+            st.st_dev == cur.st_dev && st.st_ino == cur.st_ino) {
+        close(fd);
+        buffer->planes[0].fd = client_fd;
+        LEAVE();
+        return 0;
+    }
+
+    size = lseek(fd, 0, SEEK_END);
+    if (size < 0 || (uint64_t) size < min_size) {
+        LOGE("dma-buf of buffer %d too small: %lld < %d\n", buffer->index,
+                (long long) size, min_size);
+        close(fd);
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    info.fd = fd;
+    info.size = size;
+    info.index = buffer->index;
+    if (mpp_buffer_import(&rkmpp_buf, &info) != MPP_OK) {
+        LOGE("failed to import dma-buf of buffer %d\n", buffer->index);
+        close(fd);
+        RETURN_ERR(ENOMEM, -1);
+    }
+
+    rkmpp_uncommit_buffer(queue, buffer, true);
+    rkmpp_release_import(buffer);
+
+    LOGV(2, "imported dma-buf %d of %lld bytes for buffer %d\n", client_fd,
+            (long long) size, buffer->index);
+
+    buffer->rkmpp_buf = rkmpp_buf;
+    buffer->fd = fd;
+    buffer->size = size;
+    buffer->planes[0].fd = client_fd;
+    buffer->planes[0].length = size;
+
+    /* Mpp couldn't decode into it, the next QBUF imports it again */
+    if (rkmpp_commit_buffer(queue, buffer) < 0) {
+        rkmpp_release_import(buffer);
+        LEAVE();
+        return -1;
+    }
+
+    LEAVE();
+    return 0;
+}
+
+/*
+ * Output buffers carry data, capture buffers are only handed over to be
+ * filled. The planes array is client memory, read the same way as userptr
+ * data.
+ */
+int rkmpp_ioctl_qbuf(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct v4l2_buffer *buffer = out_buf;
+    struct v4l2_plane planes[VIDEO_MAX_PLANES];
+    struct rkmpp_buf_queue *queue;
+    struct rkmpp_buffer *rkmpp_buffer;
+    bool queued;
+    int ret = -1;
+
+    ENTER();
+
+    *buffer = *(const struct v4l2_buffer *) in_buf;
+
+    if (!V4L2_TYPE_IS_MULTIPLANAR(buffer->type)) {
+        LOGE("unsupported buffer type: %d\n", buffer->type);
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    if (buffer->length < 1 || buffer->length > VIDEO_MAX_PLANES)
+        RETURN_ERR(EINVAL, -1);
+
+    if (cuse_read_client(planes, (unsigned long) buffer->m.planes,
+            buffer->length * sizeof(*planes)) < 0)
+        RETURN_ERR(EFAULT, -1);
+
+    queue = rkmpp_get_queue(ctx, buffer->type);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    if (buffer->memory != queue->memory || buffer->index >= queue->num_buffers) {
+        LOGE("invalid buffer: %d memory: %d\n", buffer->index, buffer->memory);
+        errno = EINVAL;
+        goto out;
+    }
+
+    rkmpp_buffer = &queue->buffers[buffer->index];
+
+    /* A DQBUF clears it under the queue lock alone, done with the buffer by then */
+    pthread_mutex_lock(&queue->queue_mutex);
+    queued = rkmpp_buffer_queued(rkmpp_buffer);
+    pthread_mutex_unlock(&queue->queue_mutex);
+
+    if (queued) {
+        LOGE("buffer %d already queued\n", buffer->index);
+        errno = EINVAL;
+        goto out;
+    }
+
+    if (!V4L2_TYPE_IS_OUTPUT(buffer->type))
+        planes[0].bytesused = planes[0].data_offset = 0;
+
+    if (planes[0].data_offset > planes[0].bytesused) {
+        errno = EINVAL;
+        goto out;
+    }
+
+    switch (queue->memory) {
+    case V4L2_MEMORY_USERPTR:
+        if (planes[0].bytesused > planes[0].length) {
+            errno = EINVAL;
+            goto out;
+        }
+
+        if (rkmpp_stage_userptr(ctx, rkmpp_buffer, &planes[0]) < 0)
+            goto out;
+
+        rkmpp_buffer->bytesused = planes[0].bytesused - planes[0].data_offset;
+        break;
+    case V4L2_MEMORY_DMABUF:
+        if (rkmpp_import_dmabuf(ctx, queue, rkmpp_buffer, planes[0].m.fd,
+                V4L2_TYPE_IS_OUTPUT(buffer->type) ? planes[0].bytesused :
+                queue->format.plane_fmt[0].sizeimage) < 0)
+            goto out;
+        /* fallthrough */
+    case V4L2_MEMORY_MMAP:
+        /* Mpp reads from the start of the buffer */
+        if (planes[0].bytesused > rkmpp_buffer->size || planes[0].data_offset) {
+            errno = EINVAL;
+            goto out;
+        }
+
+        rkmpp_buffer->bytesused = planes[0].bytesused;
+        break;
+    default:
+        LOGE("unsupported memory type: %d\n", queue->memory);
+        errno = EINVAL;
+        goto out;
+    }
+
+    rkmpp_buffer->planes[0].bytesused = planes[0].bytesused;
+    rkmpp_buffer->planes[0].data_offset = planes[0].data_offset;
+    rkmpp_buffer->timestamp = buffer->timestamp.tv_sec * 1000000ULL +
+            buffer->timestamp.tv_usec;
+
+    LOGV(3, "queue buffer: %d(%" PRIu64 ") type: %d len=%d\n", rkmpp_buffer->index,
+            rkmpp_buffer->timestamp, buffer->type, rkmpp_buffer->bytesused);
+
+    if (codec->trace && V4L2_TYPE_IS_OUTPUT(buffer->type))
+        rkmpp_trace_data(codec->trace, rkmpp_buffer->index, &planes[0],
+                mpp_buffer_get_ptr(rkmpp_buffer->rkmpp_buf), rkmpp_buffer->bytesused);
+
+    pthread_mutex_lock(&queue->queue_mutex);
+    /* A new packet is inspected again, skipped the way this QBUF asks */
+    rkmpp_buffer->flags &= ~(RKMPP_BUFFER_INSPECTED | RKMPP_BUFFER_SKIP_NONREF |
+            RKMPP_BUFFER_SKIP_NONKEY);
+    if (V4L2_TYPE_IS_OUTPUT(buffer->type)) {
+        if (buffer->reserved2 & RKMPP_BUF_SKIP_NONREF)
+            rkmpp_buffer_set_skip_nonref(rkmpp_buffer);
+        if (buffer->reserved2 & RKMPP_BUF_SKIP_NONKEY)
+            rkmpp_buffer_set_skip_nonkey(rkmpp_buffer);
+    }
+    rkmpp_buffer_set_queued(rkmpp_buffer);
+    rkmpp_buffer_set_pending(rkmpp_buffer);
+    TAILQ_INSERT_TAIL(&queue->pending_buffers, rkmpp_buffer, entry);
+    pthread_mutex_unlock(&queue->queue_mutex);
+
+    buffer->flags |= V4L2_BUF_FLAG_QUEUED;
+    buffer->flags &= ~V4L2_BUF_FLAG_DONE;
+    ret = 0;
+out:
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LEAVE();
+    return ret;
+}
+
+/* Describe the buffer and its single plane the v4l2 way */
+void rkmpp_buffer_to_v4l2(const struct rkmpp_buf_queue *queue,
+        const struct rkmpp_buffer *rkmpp_buffer, struct v4l2_buffer *buffer,
+        struct v4l2_plane *plane) {
+    int64_t timestamp = rkmpp_buffer->timestamp;
+
+    buffer->index = rkmpp_buffer->index;
+    buffer->type = rkmpp_buffer->type;
+    buffer->memory = queue->memory;
+    buffer->length = rkmpp_buffer->length;
+    buffer->field = V4L2_TYPE_IS_OUTPUT(buffer->type) ?
+            V4L2_FIELD_NONE : rkmpp_buffer->meta.field;
+    buffer->timestamp.tv_sec = timestamp / 1000000;
+    buffer->timestamp.tv_usec = timestamp % 1000000;
+    memset(&buffer->timecode, 0, sizeof(buffer->timecode));
+
+    buffer->flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+    if (rkmpp_buffer_available(rkmpp_buffer))
+        buffer->flags |= V4L2_BUF_FLAG_DONE;
+    else if (rkmpp_buffer_queued(rkmpp_buffer))
+        buffer->flags |= V4L2_BUF_FLAG_QUEUED;
+    if (rkmpp_buffer_error(rkmpp_buffer))
+        buffer->flags |= V4L2_BUF_FLAG_ERROR;
+    if (rkmpp_buffer_keyframe(rkmpp_buffer))
+        buffer->flags |= V4L2_BUF_FLAG_KEYFRAME;
+
+    memset(plane, 0, sizeof(*plane));
+    plane->bytesused = rkmpp_buffer->bytesused + rkmpp_buffer->planes[0].data_offset;
+    plane->data_offset = rkmpp_buffer->planes[0].data_offset;
+    plane->length = rkmpp_buffer->planes[0].length;
+
+    if (queue->memory == V4L2_MEMORY_MMAP)
+        plane->m.mem_offset = RKMPP_MEM_OFFSET(buffer->type, buffer->index);
+    else if (queue->memory == V4L2_MEMORY_USERPTR)
+        plane->m.userptr = rkmpp_buffer->planes[0].userptr;
+    else if (queue->memory == V4L2_MEMORY_DMABUF)
+        plane->m.fd = rkmpp_buffer->planes[0].fd;
+}
+
+uint64_t rkmpp_now_us(void) {
+    struct timespec ts;
 
-    if (ctx->capture.internal_group)
-        mpp_buffer_group_put(ctx->capture.internal_group);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void rkmpp_hist_add(struct rkmpp_hist *hist, uint64_t us) {
+    int bucket = 0;
+
+    while (bucket < RKMPP_HIST_BUCKETS - 1 && us >= (1ULL << bucket))
+        bucket++;
+
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->total_us += us;
+    hist->max_us = max(hist->max_us, us);
+}
+
+uint64_t rkmpp_hist_percentile(const struct rkmpp_hist *hist, unsigned pct) {
+    uint64_t seen = 0, target = (hist->count * pct + 99) / 100;
+
+    if (!hist->count)
+        return 0;
+
+    for (int i = 0; i < RKMPP_HIST_BUCKETS - 1; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target)
+            return min(1ULL << i, hist->max_us);
+    }
+
+    return hist->max_us;
+}
+
+static void rkmpp_hist_log(struct rkmpp_context *ctx, const char *name,
+        const struct rkmpp_hist *hist) {
+    char line[RKMPP_HIST_BUCKETS * 24];
+    int len = 0;
+
+    if (!hist->count)
+        return;
+
+    for (int i = 0; i < RKMPP_HIST_BUCKETS; i++)
+        if (hist->buckets[i])
+            len += snprintf(line + len, sizeof(line) - len, " <%lluus:%" PRIu64,
+                    1ULL << i, hist->buckets[i]);
+
+    LOGV(1, "ctx(%p): %s: %" PRIu64 " waits, avg %" PRIu64 "us p50 %" PRIu64 "us "
+            "p99 %" PRIu64 "us max %" PRIu64 "us\n", (void *) ctx, name, hist->count,
+            hist->total_us / hist->count, rkmpp_hist_percentile(hist, 50),
+            rkmpp_hist_percentile(hist, 99), hist->max_us);
+    LOGV(1, "ctx(%p): %s:%s\n", (void *) ctx, name, line);
+}
+
+/* Take the first available buffer off the queue. Called with the queue_mutex held. */
+static void rkmpp_dequeue(struct rkmpp_buf_queue *queue, struct v4l2_buffer *buffer,
+        struct v4l2_plane *plane, uint64_t wait_start) {
+    struct rkmpp_buffer *rkmpp_buffer = TAILQ_FIRST(&queue->avail_buffers);
+    uint64_t now = rkmpp_now_us();
+
+    rkmpp_buffer_to_v4l2(queue, rkmpp_buffer, buffer, plane);
+
+    TAILQ_REMOVE(&queue->avail_buffers, rkmpp_buffer, entry);
+    rkmpp_buffer_clr_available(rkmpp_buffer);
+    rkmpp_buffer_clr_queued(rkmpp_buffer);
+
+    rkmpp_hist_add(&queue->client_wait, wait_start ? now - wait_start : 0);
+    rkmpp_hist_add(&queue->buffer_wait, now - rkmpp_buffer->avail_time);
+
+    LOGV(3, "dequeue buffer: %d type: %d\n", rkmpp_buffer->index, rkmpp_buffer->type);
+}
+
+/* The planes array of a parked DQBUF is in its client, not the current one */
+static void rkmpp_complete_dqbuf(struct rkmpp_dqbuf_waiter *waiter) {
+    pid_t client = cuse_get_client();
+    int err = waiter->err;
+
+    if (!err) {
+        cuse_set_client(waiter->client);
+        if (cuse_write_client((unsigned long) waiter->buffer.m.planes, &waiter->plane,
+                sizeof(waiter->plane)) < 0)
+            err = EFAULT;
+        cuse_set_client(client);
+    }
+
+    if (err)
+        cuse_complete_request(waiter->request, err, NULL, 0);
+    else
+        cuse_complete_request(waiter->request, 0, &waiter->buffer, sizeof(waiter->buffer));
+    free(waiter);
+}
+
+/*
+ * Writing to a client and replying to it are syscalls the decoder thread
+ * shouldn't make with a queue locked, parked DQBUFs a buffer went to are
+ * replied to here, on the way out.
+ */
+void rkmpp_queue_unlock(struct rkmpp_buf_queue *queue) {
+    struct rkmpp_waiter_head done = TAILQ_HEAD_INITIALIZER(done);
+    struct rkmpp_dqbuf_waiter *waiter;
+
+    while ((waiter = TAILQ_FIRST(&queue->done_waiters))) {
+        TAILQ_REMOVE(&queue->done_waiters, waiter, entry);
+        TAILQ_INSERT_TAIL(&done, waiter, entry);
+    }
+
+    pthread_mutex_unlock(&queue->queue_mutex);
+
+    while ((waiter = TAILQ_FIRST(&done))) {
+        TAILQ_REMOVE(&done, waiter, entry);
+        rkmpp_complete_dqbuf(waiter);
+    }
+}
+
+void rkmpp_return_buffer(struct rkmpp_context *ctx, struct rkmpp_buf_queue *queue,
+        struct rkmpp_buffer *buffer) {
+    struct rkmpp_dqbuf_waiter *waiter = TAILQ_FIRST(&queue->waiters);
+
+    /* A ring client gets its capture buffers dequeued right away */
+    if (ctx->ring && queue == &ctx->capture && rkmpp_ring_publish(ctx->ring, buffer)) {
+        rkmpp_buffer_clr_queued(buffer);
+        LOGV(3, "publish buffer: %d\n", buffer->index);
+        return;
+    }
+
+    buffer->avail_time = rkmpp_now_us();
+    TAILQ_INSERT_TAIL(&queue->avail_buffers, buffer, entry);
+    rkmpp_buffer_set_available(buffer);
+
+    if (waiter) {
+        TAILQ_REMOVE(&queue->waiters, waiter, entry);
+        rkmpp_dequeue(queue, &waiter->buffer, &waiter->plane, waiter->start);
+        TAILQ_INSERT_TAIL(&queue->done_waiters, waiter, entry);
+        return;
+    }
+
+    pthread_cond_broadcast(&queue->avail_cond);
+    cuse_notify_poll(ctx->codec);
+}
+
+void rkmpp_cancel_waiters(struct rkmpp_context *ctx, struct rkmpp_buf_queue *queue, int err) {
+    struct rkmpp_dqbuf_waiter *waiter;
+
+    pthread_mutex_lock(&queue->queue_mutex);
+    while ((waiter = TAILQ_FIRST(&queue->waiters))) {
+        TAILQ_REMOVE(&queue->waiters, waiter, entry);
+        waiter->err = err;
+        TAILQ_INSERT_TAIL(&queue->done_waiters, waiter, entry);
+    }
+    pthread_cond_broadcast(&queue->avail_cond);
+    rkmpp_queue_unlock(queue);
+}
+
+/*
+ * Fail the parked DQBUFs whose clients got a signal, for them to restart
+ * or give up. Called from the fuse thread the interrupt came in on.
+ */
+void rkmpp_interrupt(void *userdata) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_buf_queue *queues[] = { &ctx->output, &ctx->capture };
+    struct rkmpp_dqbuf_waiter *waiter, *next;
+
+    for (unsigned i = 0; i < ARRAY_SIZE(queues); i++) {
+        pthread_mutex_lock(&queues[i]->queue_mutex);
+        for (waiter = TAILQ_FIRST(&queues[i]->waiters); waiter; waiter = next) {
+            next = TAILQ_NEXT(waiter, entry);
+            if (!cuse_request_interrupted(waiter->request))
+                continue;
+
+            LOGV(3, "interrupted dqbuf of type: %d\n", waiter->buffer.type);
+            TAILQ_REMOVE(&queues[i]->waiters, waiter, entry);
+            waiter->err = EINTR;
+            TAILQ_INSERT_TAIL(&queues[i]->done_waiters, waiter, entry);
+        }
+        rkmpp_queue_unlock(queues[i]);
+    }
+}
+
+/*
+ * Without a buffer to return, a blocking DQBUF parks its request for the
+ * decoder thread to complete, so it doesn't hold a fuse worker while it
+ * waits. In process it just blocks its caller. The request is parked
+ * before the queue is locked, its interrupt op locks the queue under the
+ * lock of the request. Whether it waits at all is up to the flags its
+ * file has now, the client may have changed them since the open.
+ */
+int rkmpp_ioctl_dqbuf(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct v4l2_buffer *buffer = out_buf;
+    struct rkmpp_dqbuf_waiter *waiter;
+    struct cuse_request *request = NULL;
+    struct rkmpp_buf_queue *queue;
+    struct v4l2_plane plane;
+    bool nonblock = false, asked = false;
+    uint64_t start = 0;
+
+    ENTER();
+
+    *buffer = *(const struct v4l2_buffer *) in_buf;
+
+    queue = rkmpp_get_queue(ctx, buffer->type);
+    if (!queue || !V4L2_TYPE_IS_MULTIPLANAR(buffer->type) || buffer->length < 1)
+        RETURN_ERR(EINVAL, -1);
+
+relock:
+    pthread_mutex_lock(&queue->queue_mutex);
+
+    if (!queue->streaming || buffer->memory != queue->memory) {
+        pthread_mutex_unlock(&queue->queue_mutex);
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    if (TAILQ_EMPTY(&queue->avail_buffers)) {
+        /* Only a DQBUF that would wait looks up the flags of its file */
+        if (!asked) {
+            pthread_mutex_unlock(&queue->queue_mutex);
+            nonblock = cuse_request_nonblock(codec);
+            if (!nonblock)
+                request = cuse_park_request();
+            asked = true;
+            goto relock;
+        }
+
+        if (nonblock) {
+            pthread_mutex_unlock(&queue->queue_mutex);
+            RETURN_ERR(EAGAIN, -1);
+        }
+
+        start = rkmpp_now_us();
+        /* Its client may have been interrupted before the waiter was there */
+        if (request && cuse_request_interrupted(request)) {
+            pthread_mutex_unlock(&queue->queue_mutex);
+            RETURN_ERR(EINTR, -1);
+        }
+
+        waiter = calloc(1, sizeof(*waiter));
+        if (waiter)
+            waiter->request = request;
+
+        if (waiter && waiter->request) {
+            waiter->client = cuse_get_client();
+            waiter->buffer = *buffer;
+            waiter->start = start;
+            TAILQ_INSERT_TAIL(&queue->waiters, waiter, entry);
+            pthread_mutex_unlock(&queue->queue_mutex);
+
+            LOGV(3, "parked dqbuf of type: %d\n", buffer->type);
+            LEAVE();
+            return CUSE_IOCTL_PARKED;
+        }
+        free(waiter);
+
+        while (TAILQ_EMPTY(&queue->avail_buffers) && queue->streaming)
+            pthread_cond_wait(&queue->avail_cond, &queue->queue_mutex);
+
+        /* Stopped by STREAMOFF, as vb2 fails it */
+        if (TAILQ_EMPTY(&queue->avail_buffers)) {
+            pthread_mutex_unlock(&queue->queue_mutex);
+            RETURN_ERR(EINVAL, -1);
+        }
+    }
+
+    rkmpp_dequeue(queue, buffer, &plane, start);
+
+    pthread_mutex_unlock(&queue->queue_mutex);
+
+    if (cuse_write_client((unsigned long) buffer->m.planes, &plane, sizeof(plane)) < 0)
+        RETURN_ERR(EFAULT, -1);
+
+    LEAVE();
+    return 0;
+}
+
+/*
+ * Streaming only gates the queue here, codecs wrap these to start and stop
+ * their own work around them.
+ */
+int rkmpp_ioctl_streamon(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_buf_queue *queue;
+
+    ENTER();
+
+    queue = rkmpp_get_queue(ctx, *(const int *) in_buf);
+    if (!queue)
+        RETURN_ERR(EINVAL, -1);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    if (!queue->num_buffers) {
+        pthread_mutex_unlock(&ctx->ioctl_mutex);
+        LOGE("can't stream without buffers\n");
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    pthread_mutex_lock(&queue->queue_mutex);
+    queue->streaming = true;
+    pthread_mutex_unlock(&queue->queue_mutex);
+
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LOGV(1, "ctx(%p): queue %d streaming\n", (void *) ctx, *(const int *) in_buf);
+
+    LEAVE();
+    return 0;
+}
+
+/* Every buffer comes back dequeued, whether the codec or the client had it */
+int rkmpp_ioctl_streamoff(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct rkmpp_buf_queue *queue;
+
+    ENTER();
+
+    queue = rkmpp_get_queue(ctx, *(const int *) in_buf);
+    if (!queue)
+        RETURN_ERR(EINVAL, -1);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+    pthread_mutex_lock(&queue->queue_mutex);
+
+    queue->streaming = false;
+    for (unsigned int i = 0; i < queue->num_buffers; i++)
+        queue->buffers[i].flags &= ~(RKMPP_BUFFER_QUEUED | RKMPP_BUFFER_PENDING |
+                RKMPP_BUFFER_AVAILABLE);
+    TAILQ_INIT(&queue->avail_buffers);
+    TAILQ_INIT(&queue->pending_buffers);
+
+    pthread_mutex_unlock(&queue->queue_mutex);
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    rkmpp_cancel_waiters(ctx, queue, EINVAL);
+    cuse_notify_poll(ctx->codec);
+
+    LOGV(1, "ctx(%p): queue %d stopped\n", (void *) ctx, *(const int *) in_buf);
+
+    LEAVE();
+    return 0;
+}
+
+/*
+ * Set up, or with a memfd of -1 drop, the shared completion ring of the
+ * capture queue. The fds are the client's, the ring gets copies of them.
+ */
+int rkmpp_ioctl_ring(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    const struct mppv4l2_ring_setup *setup = in_buf;
+    struct rkmpp_ring *ring = NULL, *old;
+    int memfd, eventfd;
+
+    ENTER();
+
+    if (setup->memfd >= 0) {
+        memfd = cuse_get_client_fd(setup->memfd);
+        if (memfd < 0)
+            RETURN_ERR(EBADF, -1);
+
+        eventfd = cuse_get_client_fd(setup->eventfd);
+        if (eventfd < 0) {
+            close(memfd);
+            RETURN_ERR(EBADF, -1);
+        }
+
+        ring = rkmpp_ring_create(memfd, eventfd);
+        if (!ring)
+            RETURN_ERR(errno, -1);
+    }
+
+    pthread_mutex_lock(&ctx->capture.queue_mutex);
+    old = ctx->ring;
+    ctx->ring = ring;
+    pthread_mutex_unlock(&ctx->capture.queue_mutex);
+
+    rkmpp_ring_destroy(old);
+
+    LOGV(1, "ctx(%p): %s shared ring\n", (void *) ctx, ring ? "using" : "dropped");
+
+    LEAVE();
+    return 0;
+}
+
+/*
+ * Queue the capture buffers a ring client handed back, as a QBUF of each
+ * would. A dma-buf buffer goes back with the dma-buf it was last queued
+ * with. Called by the codec thread before it gives buffers to mpp,
+ * and on the client's ioctls. Returns the number of buffers taken.
+ */
+int rkmpp_take_ring_buffers(struct rkmpp_context *ctx) {
+    struct rkmpp_buf_queue *queue = &ctx->capture;
+    struct rkmpp_buffer *rkmpp_buffer;
+    int index, taken = 0;
+
+    pthread_mutex_lock(&queue->queue_mutex);
+
+    while (ctx->ring && (index = rkmpp_ring_next_queued(ctx->ring)) >= 0) {
+        if (index >= (int) queue->num_buffers) {
+            LOGE("invalid ring buffer: %d\n", index);
+            continue;
+        }
+
+        rkmpp_buffer = &queue->buffers[index];
+        if (!rkmpp_buffer->rkmpp_buf) {
+            LOGE("ring buffer %d has no memory\n", index);
+            continue;
+        }
+
+        if (rkmpp_buffer_queued(rkmpp_buffer)) {
+            LOGE("ring buffer %d already queued\n", index);
+            continue;
+        }
+
+        rkmpp_buffer->bytesused = 0;
+        rkmpp_buffer->planes[0].bytesused = 0;
+        rkmpp_buffer->planes[0].data_offset = 0;
+
+        LOGV(3, "take buffer: %d\n", index);
+
+        rkmpp_buffer_set_queued(rkmpp_buffer);
+        rkmpp_buffer_set_pending(rkmpp_buffer);
+        TAILQ_INSERT_TAIL(&queue->pending_buffers, rkmpp_buffer, entry);
+        taken++;
+    }
+
+    pthread_mutex_unlock(&queue->queue_mutex);
+
+    return taken;
+}
+
+unsigned rkmpp_poll(void *userdata) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    unsigned revents = 0;
+    bool streaming;
+
+    pthread_mutex_lock(&ctx->capture.queue_mutex);
+    if (!TAILQ_EMPTY(&ctx->capture.avail_buffers))
+        revents |= POLLIN | POLLRDNORM;
+    streaming = ctx->capture.streaming;
+    pthread_mutex_unlock(&ctx->capture.queue_mutex);
+
+    pthread_mutex_lock(&ctx->output.queue_mutex);
+    if (!TAILQ_EMPTY(&ctx->output.avail_buffers))
+        revents |= POLLOUT | POLLWRNORM;
+    streaming |= ctx->output.streaming;
+    pthread_mutex_unlock(&ctx->output.queue_mutex);
+
+    /* Nothing will ever come out of a stopped session */
+    if (!streaming)
+        revents |= POLLERR;
+
+    return revents;
+}
+
+int rkmpp_ioctl_querybuf(void *userdata, const void *in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct v4l2_buffer *buffer = out_buf;
+    struct rkmpp_buf_queue *queue;
+    struct v4l2_plane plane;
+    int ret = -1;
+
+    ENTER();
+
+    *buffer = *(const struct v4l2_buffer *) in_buf;
+
+    queue = rkmpp_get_queue(ctx, buffer->type);
+    if (!queue || !V4L2_TYPE_IS_MULTIPLANAR(buffer->type) || buffer->length < 1)
+        RETURN_ERR(EINVAL, -1);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    if (buffer->index >= queue->num_buffers) {
+        errno = EINVAL;
+        goto out;
+    }
+
+    rkmpp_buffer_to_v4l2(queue, &queue->buffers[buffer->index], buffer, &plane);
+
+    /* The planes array stays in the client, written back in place */
+    if (cuse_write_client((unsigned long) buffer->m.planes, &plane, sizeof(plane)) < 0) {
+        errno = EFAULT;
+        goto out;
+    }
+
+    ret = 0;
+out:
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LEAVE();
+    return ret;
+}
+
+int rkmpp_ioctl_querycap(void *userdata, const void* in_buf, void *out_buf) {
+    struct cuse_codec *codec = userdata;
+    struct rkmpp_context *ctx = codec->priv;
+    struct v4l2_capability *cap = out_buf;
+
+    ENTER();
+
+    strncpy((char*) cap->driver, "rkmpp", sizeof(cap->driver));
+    strncpy((char*) cap->card, "rkmpp", sizeof(cap->card));
+    strncpy((char*) cap->bus_info, "platform: rkmpp", sizeof(cap->bus_info));
+
+    cap->version = LINUX_VERSION_CODE;
+
+    /* This is only a mem-to-mem video device. */
+    cap->device_caps = V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING;
+    cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+
+    cap->capabilities |= V4L2_CAP_EXT_PIX_FORMAT;
+    cap->device_caps |= V4L2_CAP_EXT_PIX_FORMAT;
+
+    LEAVE();
+    return 0;
+}
+
+static int rkmpp_probe(struct cuse_codec *codec, struct cuse_replies *replies, int cmd,
+        void *arg, size_t key_size) {
+    uint8_t out_buf[256];
+    size_t size = getint(cmd, 16, 14);
+    int ret = -1;
+
+    for (int i = 0; i < codec->num_ioctls; i++) {
+        if (codec->ioctls[i].cmd != cmd)
+            continue;
+
+        memset(out_buf, 0, size);
+        errno = 0;
+        ret = codec->ioctls[i].callback(codec, getbit(cmd, 30) ? arg : NULL, out_buf);
+        if (ret < 0) {
+            /* The key the error answers has to be there */
+            cuse_replies_add(replies, cmd, errno ? errno : EIO, arg, size, key_size);
+        } else {
+            memcpy(arg, out_buf, size);
+            cuse_replies_add(replies, cmd, 0, out_buf, size, key_size);
+        }
+        break;
+    }
+
+    return ret;
+}
+
+/*
+ * Work out the replies of the queries clients probe a node with, which only
+ * depend on its formats and limits, with a session made for it. The
+ * enumerations get their terminating error replies too.
+ */
+struct cuse_replies *rkmpp_probe_replies(struct cuse_codec *codec) {
+    static const enum v4l2_buf_type types[] = {
+        V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+    };
+    static const uint32_t next_flags[] = {
+        V4L2_CTRL_FLAG_NEXT_CTRL,
+        V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND,
+    };
+    struct rkmpp_context *ctx = codec->priv;
+    struct cuse_replies *replies = cuse_replies_new();
+    struct v4l2_capability cap;
+    struct v4l2_fmtdesc fmtdesc;
+    struct v4l2_frmsizeenum fsize;
+    struct v4l2_queryctrl qctrl;
+    struct v4l2_querymenu menu;
+    uint32_t id = 0;
+
+    if (!replies)
+        return NULL;
+
+    memset(&cap, 0, sizeof(cap));
+    rkmpp_probe(codec, replies, VIDIOC_QUERYCAP, &cap, 0);
+
+    for (unsigned int t = 0; t < ARRAY_SIZE(types); t++) {
+        for (uint32_t index = 0; ; index++) {
+            memset(&fmtdesc, 0, sizeof(fmtdesc));
+            fmtdesc.index = index;
+            fmtdesc.type = types[t];
+            if (rkmpp_probe(codec, replies, VIDIOC_ENUM_FMT, &fmtdesc,
+                    offsetof(struct v4l2_fmtdesc, flags)) < 0)
+                break;
+        }
+    }
+
+    for (unsigned int i = 0; i < ctx->num_formats; i++) {
+        if (!RKMPP_HAS_FORMAT(ctx, &ctx->formats[i]))
+            continue;
+
+        for (uint32_t index = 0; index < 2; index++) {
+            memset(&fsize, 0, sizeof(fsize));
+            fsize.index = index;
+            fsize.pixel_format = ctx->formats[i].fourcc;
+            if (rkmpp_probe(codec, replies, VIDIOC_ENUM_FRAMESIZES, &fsize,
+                    offsetof(struct v4l2_frmsizeenum, type)) < 0)
+                break;
+        }
+    }
+
+    /* Walk the controls the way clients do, answering plain queries on the way */
+    while (1) {
+        struct v4l2_queryctrl found;
+        int ret = 0;
+
+        for (unsigned int f = 0; f < ARRAY_SIZE(next_flags); f++) {
+            memset(&qctrl, 0, sizeof(qctrl));
+            qctrl.id = id | next_flags[f];
+            ret = rkmpp_probe(codec, replies, VIDIOC_QUERYCTRL, &qctrl, sizeof(qctrl.id));
+            found = qctrl;
+        }
+
+        if (ret < 0)
+            break;
+
+        id = found.id;
+        memset(&qctrl, 0, sizeof(qctrl));
+        qctrl.id = id;
+        rkmpp_probe(codec, replies, VIDIOC_QUERYCTRL, &qctrl, sizeof(qctrl.id));
+
+        if (found.type != V4L2_CTRL_TYPE_MENU)
+            continue;
+
+        for (int32_t index = found.minimum; index <= found.maximum + 1; index++) {
+            memset(&menu, 0, sizeof(menu));
+            menu.id = id;
+            menu.index = index;
+            rkmpp_probe(codec, replies, VIDIOC_QUERYMENU, &menu,
+                    offsetof(struct v4l2_querymenu, name));
+        }
+    }
+
+    cuse_replies_seal(replies);
+
+    LOGV(1, "node %s: %zu probe replies\n", codec->filename, replies->num);
+
+    return replies;
+}
+
+/**
+ * struct rkmpp_queue_state - A queue as handed over to another daemon
+ * @memory:         V4L2 memory type.
+ * @streaming:      The queue is streaming.
+ * @min_buffers:    Buffers the codec needs on the queue.
+ * @num_buffers:    Number of buffers, each followed by its rkmpp_buffer_state.
+ * @fourcc:         Fourcc of the format, 0 when none was set.
+ * @format:         V4L2 multi-plane format.
+ * @num_avail:      Buffers ready to be dequeued, their indices follow the
+ *                  buffers in order.
+ * @num_pending:    Buffers pending for the codec, their indices follow.
+ */
+struct rkmpp_queue_state {
+    uint32_t memory;
+    uint32_t streaming;
+    uint32_t min_buffers;
+    uint32_t num_buffers;
+    uint32_t fourcc;
+    struct v4l2_pix_format_mplane format;
+    uint32_t num_avail;
+    uint32_t num_pending;
+};
+
+/**
+ * struct rkmpp_buffer_state - A buffer as handed over, its dma-buf goes along
+ * @flags:      Queue and frame flags, the ownership ones are worked out again.
+ * @timestamp:  Buffer's timestamp.
+ * @bytesused:  Number of bytes occupied by data in the buffer.
+ * @userptr:    Userptr of the plane in the client.
+ * @client_fd:  Dma-buf fd of the plane in the client.
+ * @data_offset:    Offset of the data in the plane.
+ * @plane_bytesused:    Bytes of the plane.
+ * @plane_length:   Length of the plane.
+ * @meta:       Metadata of the frame in a capture buffer.
+ */
+struct rkmpp_buffer_state {
+    uint32_t flags;
+    uint64_t timestamp;
+    uint32_t bytesused;
+    uint64_t userptr;
+    int32_t client_fd;
+    uint32_t data_offset;
+    uint32_t plane_bytesused;
+    uint32_t plane_length;
+    struct rkmpp_frame_meta meta;
+};
+
+uint32_t rkmpp_state_version(uint32_t version) {
+    const size_t sizes[] = {
+        sizeof(struct rkmpp_queue_state),
+        sizeof(struct v4l2_pix_format_mplane),
+        sizeof(struct rkmpp_buffer_state),
+        sizeof(struct rkmpp_frame_meta),
+    };
+
+    return cuse_handoff_version(version, sizes, ARRAY_SIZE(sizes));
+}
+
+#define RKMPP_BUFFER_STATE_FLAGS \
+    (RKMPP_BUFFER_ERROR | RKMPP_BUFFER_QUEUED | RKMPP_BUFFER_PENDING | \
+     RKMPP_BUFFER_AVAILABLE | RKMPP_BUFFER_KEYFRAME)
+
+static void rkmpp_save_queue(struct rkmpp_buf_queue *queue, struct cuse_state *state) {
+    struct rkmpp_queue_state queue_state = {
+        .memory = queue->memory,
+        .streaming = queue->streaming,
+        .min_buffers = queue->min_buffers,
+        .num_buffers = queue->num_buffers,
+        .fourcc = queue->rkmpp_format ? queue->format.pixelformat : 0,
+        .format = queue->format,
+    };
+    struct rkmpp_buffer_state buffer_state;
+    struct rkmpp_buffer *buffer;
+    uint32_t index;
+
+    pthread_mutex_lock(&queue->queue_mutex);
+
+    TAILQ_FOREACH(buffer, &queue->avail_buffers, entry)
+        queue_state.num_avail++;
+    TAILQ_FOREACH(buffer, &queue->pending_buffers, entry)
+        queue_state.num_pending++;
+
+    cuse_state_put(state, &queue_state, sizeof(queue_state));
+
+    for (uint32_t i = 0; i < queue->num_buffers; i++) {
+        buffer = &queue->buffers[i];
+
+        memset(&buffer_state, 0, sizeof(buffer_state));
+        buffer_state.flags = buffer->flags & RKMPP_BUFFER_STATE_FLAGS;
+        buffer_state.timestamp = buffer->timestamp;
+        buffer_state.bytesused = buffer->bytesused;
+        buffer_state.userptr = buffer->planes[0].userptr;
+        buffer_state.client_fd = buffer->planes[0].fd;
+        buffer_state.data_offset = buffer->planes[0].data_offset;
+        buffer_state.plane_bytesused = buffer->planes[0].bytesused;
+        buffer_state.plane_length = buffer->planes[0].length;
+        buffer_state.meta = buffer->meta;
+
+        cuse_state_put(state, &buffer_state, sizeof(buffer_state));
+        cuse_state_put_fd(state, buffer->rkmpp_buf ? buffer->fd : -1);
+    }
+
+    TAILQ_FOREACH(buffer, &queue->avail_buffers, entry) {
+        index = buffer->index;
+        cuse_state_put(state, &index, sizeof(index));
+    }
+    TAILQ_FOREACH(buffer, &queue->pending_buffers, entry) {
+        index = buffer->index;
+        cuse_state_put(state, &index, sizeof(index));
+    }
+
+    pthread_mutex_unlock(&queue->queue_mutex);
+}
+
+/*
+ * Import the dma-buf a buffer had in the daemon it was taken over from. It
+ * keeps its contents, so frames not dequeued yet and packets not decoded yet
+ * survive. Mmap buffers and userptr staging stay the session's memory.
+ */
+static int rkmpp_adopt_buffer(struct rkmpp_context *ctx, struct rkmpp_buf_queue *queue,
+        struct rkmpp_buffer *buffer, int fd) {
+    MppBufferInfo info = { .type = MPP_BUFFER_TYPE_EXT_DMA };
+    off_t size;
+
+    size = lseek(fd, 0, SEEK_END);
+    if (size <= 0) {
+        close(fd);
+        RETURN_ERR(EINVAL, -1);
+    }
+
+    if (queue->memory != V4L2_MEMORY_DMABUF && rkmpp_mem_charge(ctx, size)) {
+        close(fd);
+        RETURN_ERR(ENOMEM, -1);
+    }
+
+    info.fd = fd;
+    info.size = size;
+    info.index = buffer->index;
+    if (mpp_buffer_import(&buffer->rkmpp_buf, &info) != MPP_OK) {
+        LOGE("failed to import dma-buf of buffer %d\n", buffer->index);
+        if (queue->memory != V4L2_MEMORY_DMABUF)
+            rkmpp_mem_uncharge(ctx, size);
+        buffer->rkmpp_buf = NULL;
+        close(fd);
+        RETURN_ERR(ENOMEM, -1);
+    }
+
+    buffer->fd = fd;
+    buffer->size = size;
+    if (queue->memory == V4L2_MEMORY_MMAP)
+        buffer->planes[0].fd = fd;
+
+    return 0;
+}
+
+/* Put the buffers of the saved indices back on a list, in their order */
+static int rkmpp_restore_list(struct rkmpp_buf_queue *queue, struct rkmpp_buf_head *head,
+        uint32_t num, uint32_t flag, struct cuse_state *state) {
+    struct rkmpp_buffer *buffer;
+    uint32_t index;
+
+    for (uint32_t i = 0; i < num; i++) {
+        if (!cuse_state_get(state, &index, sizeof(index)) || index >= queue->num_buffers)
+            RETURN_ERR(EPROTO, -1);
+
+        buffer = &queue->buffers[index];
+        if (!(buffer->flags & flag))
+            RETURN_ERR(EPROTO, -1);
+
+        buffer->avail_time = rkmpp_now_us();
+        TAILQ_INSERT_TAIL(head, buffer, entry);
+    }
+
+    return 0;
+}
+
+static int rkmpp_restore_queue(struct rkmpp_context *ctx, struct rkmpp_buf_queue *queue,
+        enum v4l2_buf_type type, struct cuse_state *state) {
+    struct rkmpp_queue_state queue_state;
+    struct rkmpp_buffer_state buffer_state;
+    struct rkmpp_buffer *buffer;
+    uint32_t i;
+    int fd, ret = 0;
+
+    if (!cuse_state_get(state, &queue_state, sizeof(queue_state)) ||
+            queue_state.num_buffers > VIDEO_MAX_FRAME ||
+            queue_state.num_avail > queue_state.num_buffers ||
+            queue_state.num_pending > queue_state.num_buffers)
+        RETURN_ERR(EPROTO, -1);
+
+    pthread_mutex_lock(&queue->queue_mutex);
+
+    queue->format = queue_state.format;
+    queue->rkmpp_format = queue_state.fourcc ?
+            rkmpp_find_fmt(ctx, queue_state.fourcc, type) : NULL;
+    queue->min_buffers = queue_state.min_buffers;
+    queue->memory = queue_state.memory;
+    queue->streaming = queue_state.streaming;
+
+    if (queue_state.num_buffers) {
+        queue->buffers = calloc(queue_state.num_buffers, sizeof(*queue->buffers));
+        if (!queue->buffers) {
+            errno = ENOMEM;
+            ret = -1;
+        } else {
+            queue->num_buffers = queue_state.num_buffers;
+        }
+    }
+
+    /* Everything is read even after a failure, for the sessions that follow */
+    for (i = 0; i < queue_state.num_buffers; i++) {
+        cuse_state_get(state, &buffer_state, sizeof(buffer_state));
+        fd = cuse_state_get_fd(state);
+
+        if (ret) {
+            if (fd >= 0)
+                close(fd);
+            continue;
+        }
+
+        buffer = &queue->buffers[i];
+        buffer->index = i;
+        buffer->type = type;
+        buffer->fd = -1;
+        buffer->length = 1;
+        buffer->flags = buffer_state.flags & RKMPP_BUFFER_STATE_FLAGS;
+        buffer->timestamp = buffer_state.timestamp;
+        buffer->bytesused = buffer_state.bytesused;
+        buffer->planes[0].userptr = buffer_state.userptr;
+        buffer->planes[0].fd = buffer_state.client_fd;
+        buffer->planes[0].data_offset = buffer_state.data_offset;
+        buffer->planes[0].bytesused = buffer_state.plane_bytesused;
+        buffer->planes[0].plane_size = buffer_state.plane_bytesused -
+                buffer_state.data_offset;
+        buffer->planes[0].length = buffer_state.plane_length;
+        buffer->meta = buffer_state.meta;
+
+        if (fd >= 0)
+            ret = rkmpp_adopt_buffer(ctx, queue, buffer, fd);
+    }
+
+    if (!ret)
+        ret = rkmpp_restore_list(queue, &queue->avail_buffers, queue_state.num_avail,
+                RKMPP_BUFFER_AVAILABLE, state);
+    if (!ret)
+        ret = rkmpp_restore_list(queue, &queue->pending_buffers, queue_state.num_pending,
+                RKMPP_BUFFER_PENDING, state);
+
+    pthread_mutex_unlock(&queue->queue_mutex);
+
+    return ret;
+}
+
+/*
+ * Parked DQBUFs can't go along, they fail with EINTR for their clients to
+ * retry them against the daemon taking over.
+ */
+int rkmpp_save_context(struct rkmpp_context *ctx, struct cuse_state *state) {
+    ENTER();
+
+    rkmpp_cancel_waiters(ctx, &ctx->output, EINTR);
+    rkmpp_cancel_waiters(ctx, &ctx->capture, EINTR);
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    rkmpp_save_queue(&ctx->output, state);
+    rkmpp_save_queue(&ctx->capture, state);
+
+    cuse_state_put_fd(state, ctx->ring ? ctx->ring->memfd : -1);
+    cuse_state_put_fd(state, ctx->ring ? ctx->ring->eventfd : -1);
+
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    LOGV(1, "ctx(%p): saved %d output and %d capture buffers\n", (void *) ctx,
+            ctx->output.num_buffers, ctx->capture.num_buffers);
+
+    LEAVE();
+    return state->error ? -1 : 0;
+}
+
+int rkmpp_restore_context(struct rkmpp_context *ctx, struct cuse_state *state) {
+    int memfd, eventfd;
+    int ret;
+
+    ENTER();
+
+    pthread_mutex_lock(&ctx->ioctl_mutex);
+
+    ret = rkmpp_restore_queue(ctx, &ctx->output, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, state);
+    ret |= rkmpp_restore_queue(ctx, &ctx->capture, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+            state);
+
+    memfd = cuse_state_get_fd(state);
+    eventfd = cuse_state_get_fd(state);
+    if (memfd >= 0 && eventfd >= 0) {
+        ctx->ring = rkmpp_ring_adopt(memfd, eventfd);
+        if (!ctx->ring)
+            ret = -1;
+    } else if (memfd >= 0 || eventfd >= 0) {
+        close(max(memfd, eventfd));
+    }
+
+    pthread_mutex_unlock(&ctx->ioctl_mutex);
+
+    if (ret || state->error) {
+        LOGE("ctx(%p): failed to take the queues over\n", (void *) ctx);
+        RETURN_ERR(EPROTO, -1);
+    }
+
+    LOGV(1, "ctx(%p): took over %d output and %d capture buffers\n", (void *) ctx,
+            ctx->output.num_buffers, ctx->capture.num_buffers);
+
+    LEAVE();
+    return 0;
+}
+
+struct rkmpp_context* context_init() {
+    struct rkmpp_context *ctx = NULL;
+
+    ENTER();
+
+    ctx = (struct rkmpp_context*) calloc(1, sizeof(struct rkmpp_context));
+    if (!ctx)
+        RETURN_ERR(ENOMEM, NULL);
+
+    pthread_mutex_init(&ctx->ioctl_mutex, NULL);
+    pthread_mutex_init(&ctx->output.queue_mutex, NULL);
+    pthread_mutex_init(&ctx->capture.queue_mutex, NULL);
+    pthread_cond_init(&ctx->output.avail_cond, NULL);
+    pthread_cond_init(&ctx->capture.avail_cond, NULL);
+
+    TAILQ_INIT(&ctx->output.waiters);
+    TAILQ_INIT(&ctx->capture.waiters);
+    TAILQ_INIT(&ctx->output.done_waiters);
+    TAILQ_INIT(&ctx->capture.done_waiters);
+    TAILQ_INIT(&ctx->output.avail_buffers);
+    TAILQ_INIT(&ctx->output.pending_buffers);
+    TAILQ_INIT(&ctx->capture.avail_buffers);
+    TAILQ_INIT(&ctx->capture.pending_buffers);
+
+    LOGV(1, "ctx(%p)): inited,\n", (void* )ctx);
+
+    LEAVE();
+    return ctx;
+}
+
+void context_destroy(struct rkmpp_context *ctx) {
+    ENTER();
+
+    LOGV(1, "ctx(%p): closing\n", (void* )ctx);
+
+    rkmpp_cancel_waiters(ctx, &ctx->output, EPIPE);
+    rkmpp_cancel_waiters(ctx, &ctx->capture, EPIPE);
+
+    rkmpp_hist_log(ctx, "output dqbuf wait", &ctx->output.client_wait);
+    rkmpp_hist_log(ctx, "output buffer idle", &ctx->output.buffer_wait);
+    rkmpp_hist_log(ctx, "capture dqbuf wait", &ctx->capture.client_wait);
+    rkmpp_hist_log(ctx, "capture buffer idle", &ctx->capture.buffer_wait);
+
+    rkmpp_ring_destroy(ctx->ring);
+
+    rkmpp_destroy_buffers(ctx, &ctx->output);
+
+    if (ctx->output.external_group)
+        mpp_buffer_group_put(ctx->output.external_group);
+
+    rkmpp_destroy_buffers(ctx, &ctx->capture);
+
+    if (ctx->capture.external_group)
+        mpp_buffer_group_put(ctx->capture.external_group);
 
     if (ctx->codecs)
         free(ctx->codecs);
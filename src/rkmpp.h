@@ -18,16 +18,38 @@
 #include "utils.h"
 
 
+struct cuse_codec;
+struct cuse_request;
+struct cuse_replies;
+struct cuse_state;
+struct rkmpp_ring;
+
 #define RKMPP_MB_DIM        16
 #define RKMPP_SB_DIM        64
 
 #define RKMPP_MAX_PLANE     3
 
+/* Clients of the daemon can't map its buffers, only in process are they shared */
+#ifdef RKMPP_LIBRARY
+#define RKMPP_BUF_CAPS  (V4L2_BUF_CAP_SUPPORTS_MMAP | V4L2_BUF_CAP_SUPPORTS_DMABUF)
+#else
+#define RKMPP_BUF_CAPS  V4L2_BUF_CAP_SUPPORTS_DMABUF
+#endif
+
+/*
+ * Packet buffers are allocated in power of two size classes from this one
+ * up, so the pool recycles buffers freed by one size for the next of its class.
+ */
+#define RKMPP_SLAB_MIN_SIZE     (64 << 10)
+
 #define RKMPP_MEM_OFFSET(type, index) \
     ((int64_t) ((type) << 16 | (index)))
 #define RKMPP_MEM_OFFSET_TYPE(offset)   (int)((offset) >> 16)
 #define RKMPP_MEM_OFFSET_INDEX(offset)  (int)((offset) & ((1 << 16) - 1))
 
+/* Mask of the buffer types a format is limited to */
+#define RKMPP_FMT_QUEUE(type)   (1 << (type))
+
 #define RKMPP_HAS_FORMAT(ctx, format) \
     (!((format)->type != MPP_VIDEO_CodingUnused && (ctx)->codecs && \
        !strstr((ctx)->codecs, (format)->name)))
@@ -41,6 +63,8 @@
  * @format:     Format's mpp frame format.
  * @depth:      Format's pixel depth.
  * @frmsize:    V4L2 frmsize_stepwise.
+ * @queues:     RKMPP_FMT_QUEUE mask of the queues the format is on, 0 for
+ *              the one its coding puts it on.
  */
 struct rkmpp_fmt {
     char *name;
@@ -50,6 +74,7 @@ struct rkmpp_fmt {
     MppFrameFormat format;
     uint8_t depth[VIDEO_MAX_PLANES];
     struct v4l2_frmsize_stepwise frmsize;
+    uint32_t queues;
 };
 
 /**
@@ -60,6 +85,12 @@ struct rkmpp_fmt {
  * @QUEUED:     Buffer been queued.
  * @PENDING:        Buffer is in pending queue.
  * @AVAILABLE:      Buffer is in available queue.
+ * @KEYFRAME:       Packet is a keyframe, or frame decoded from one.
+ * @POOLED:     Memory behind a committed buffer is a pool buffer of ours.
+ * @INSPECTED:      Packet was inspected since it was queued.
+ * @NONREF:     Packet is a frame nothing references.
+ * @SKIP_NONREF:    Drop the packet if it's NONREF, from RKMPP_BUF_SKIP_NONREF.
+ * @SKIP_NONKEY:    Drop the packet unless it's a KEYFRAME, from RKMPP_BUF_SKIP_NONKEY.
  */
 enum rkmpp_buffer_flag {
     RKMPP_BUFFER_ERROR  = 1 << 0,
@@ -69,12 +100,37 @@ enum rkmpp_buffer_flag {
     RKMPP_BUFFER_PENDING    = 1 << 4,
     RKMPP_BUFFER_AVAILABLE  = 1 << 5,
     RKMPP_BUFFER_KEYFRAME   = 1 << 6,
+    RKMPP_BUFFER_POOLED = 1 << 7,
+    RKMPP_BUFFER_INSPECTED  = 1 << 8,
+    RKMPP_BUFFER_NONREF = 1 << 9,
+    RKMPP_BUFFER_SKIP_NONREF    = 1 << 10,
+    RKMPP_BUFFER_SKIP_NONKEY    = 1 << 11,
+};
+
+/* Skip flags of an output buffer, in v4l2_buffer.reserved2 at QBUF */
+#define RKMPP_BUF_SKIP_NONREF   (1 << 0)
+#define RKMPP_BUF_SKIP_NONKEY   (1 << 1)
+
+/**
+ * struct rkmpp_frame_meta - Metadata of a decoded frame
+ * @field:      V4L2 field order.
+ * @errinfo:    Error info from mpp, 0 for a clean frame.
+ * @mastering:  HDR10 mastering display, zeroed when the stream has none.
+ * @content_light:  HDR10 content light level, zeroed when the stream has none.
+ */
+struct rkmpp_frame_meta {
+    uint32_t field;
+    uint32_t errinfo;
+    MppFrameMasteringDisplayMetadata mastering;
+    MppFrameContentLightMetadata content_light;
 };
 
 /**
  * struct rkmpp_buffer - Information about mpp buffer
  * @entry:      Queue entry.
  * @rkmpp_buf:  Handle of mpp buffer.
+ * @backing:    Memory of a capture buffer committed to the external group,
+ *              whose import there rkmpp_buf is. NULL when not committed.
  * @index:      Buffer's index.
  * @fd:         Buffer's dma fd.
  * @timestamp:  Buffer's timestamp.
@@ -83,10 +139,13 @@ enum rkmpp_buffer_flag {
  * @size:       Buffer's size.
  * @flags:      Buffer's flags.
  * @planes:     Buffer's planes info.
+ * @meta:       Metadata of the frame in a capture buffer.
+ * @avail_time: Monotonic us the buffer became available.
  */
 struct rkmpp_buffer {
     TAILQ_ENTRY(rkmpp_buffer) entry;
     MppBuffer rkmpp_buf;
+    MppBuffer backing;
 
     int index;
 
@@ -106,33 +165,89 @@ struct rkmpp_buffer {
         uint32_t plane_size; /* bytesused - data_offset */
         uint32_t length;
     } planes[RKMPP_MAX_PLANE];
+
+    struct rkmpp_frame_meta meta;
+    uint64_t avail_time;
 };
 
 TAILQ_HEAD(rkmpp_buf_head, rkmpp_buffer);
 
+/* Log2 buckets of us, the last one takes all longer waits */
+#define RKMPP_HIST_BUCKETS  24
+
+/**
+ * struct rkmpp_hist - Histogram of wait times
+ * @buckets:    Waits shorter than 2^i us in bucket i.
+ * @count:      Number of waits.
+ * @total_us:   Sum of the waits.
+ * @max_us:     Longest wait.
+ */
+struct rkmpp_hist {
+    uint64_t buckets[RKMPP_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+};
+
+/**
+ * struct rkmpp_dqbuf_waiter - A blocking DQBUF waiting for a buffer
+ * @entry:      Queue entry.
+ * @request:    The parked request, completed when a buffer is available.
+ * @client:     Client whose planes array gets the buffer.
+ * @buffer:     Arg of the DQBUF.
+ * @plane:      Plane of the buffer it got, for its planes array.
+ * @start:      Monotonic us the wait began.
+ * @err:        Error to complete it with, 0 for the buffer.
+ */
+struct rkmpp_dqbuf_waiter {
+    TAILQ_ENTRY(rkmpp_dqbuf_waiter) entry;
+    struct cuse_request *request;
+    pid_t client;
+    struct v4l2_buffer buffer;
+    struct v4l2_plane plane;
+    uint64_t start;
+    int err;
+};
+
+TAILQ_HEAD(rkmpp_waiter_head, rkmpp_dqbuf_waiter);
+
 /**
  * struct rkmpp_buf_head - Information about mpp buffer queue
  * @memory:         V4L2 memory type.
  * @streaming:      The queue is streaming.
- * @internal_group: Handle of mpp internal buffer group.
  * @external_group: Handle of mpp external buffer group.
  * @buffers:        List of buffers.
  * @num_buffers:    Number of buffers.
+ * @retired:        Imports of dma-bufs replaced by another, held so mpp
+ *                  never decodes into them again until the buffers go.
+ * @num_retired:    Number of retired imports.
  * @avail_buffers:  Buffers ready to be dequeued.
  * @pending_buffers:Pending buffers for mpp.
  * @queue_mutex:    Mutex for buffer lists.
  * @rkmpp_format:   Mpp format.
  * @format:     V4L2 multi-plane format.
+ * @min_buffers:    Buffers the codec needs on this queue to make progress.
+ * @waiters:        Blocking DQBUFs parked until a buffer is available.
+ * @done_waiters:   Parked DQBUFs that got a buffer or an error, replied to
+ *                  by rkmpp_queue_unlock() once the queue_mutex is dropped.
+ * @avail_cond:     Signaled when a buffer is available, for DQBUFs that
+ *                  block in process instead of parking.
+ * @client_wait:    How long DQBUFs waited for a buffer, long ones make a
+ *                  decoder bound session.
+ * @buffer_wait:    How long available buffers waited for a DQBUF, long ones
+ *                  make a client bound session.
  */
 struct rkmpp_buf_queue {
     enum v4l2_memory memory;
 
     bool streaming;
+    uint32_t min_buffers;
 
-    MppBufferGroup internal_group;
     MppBufferGroup external_group;
     struct rkmpp_buffer *buffers;
     uint32_t num_buffers;
+    MppBuffer *retired;
+    uint32_t num_retired;
 
     struct rkmpp_buf_head avail_buffers;
     struct rkmpp_buf_head pending_buffers;
@@ -140,6 +255,12 @@ struct rkmpp_buf_queue {
 
     const struct rkmpp_fmt *rkmpp_format;
     struct v4l2_pix_format_mplane format;
+
+    struct rkmpp_waiter_head waiters;
+    struct rkmpp_waiter_head done_waiters;
+    pthread_cond_t avail_cond;
+    struct rkmpp_hist client_wait;
+    struct rkmpp_hist buffer_wait;
 };
 
 /**
@@ -147,7 +268,6 @@ struct rkmpp_buf_queue {
  * @formats:        Supported formats.
  * @num_formats:    Number of formats.
  * @is_decoder:     Is decoder mode.
- * @nonblock:       Nonblock mode.
  * @eventfd:        File descriptor of eventfd.
  * @avail_buffers:  Buffers ready to be dequeued.
  * @pending_buffers:Pending buffers for mpp.
@@ -158,6 +278,12 @@ struct rkmpp_buf_queue {
  * @ioctl_mutex:    Mutex.
  * @frames:         Number of frames reported.
  * @last_fps_time:  The last time to count fps.
+ * @mem_used:       Drm memory allocated by the session.
+ * @mem_limit:      Cap of mem_used, 0 for none.
+ * @mem_limit_total:    Cap of the drm memory of all sessions, 0 for none.
+ * @codec:          The open served by the context.
+ * @ring:           Shared completion ring of the capture queue, NULL when
+ *                  the client uses DQBUF.
  * @data:           Private data.
  */
 struct rkmpp_context {
@@ -165,7 +291,6 @@ struct rkmpp_context {
     uint32_t num_formats;
 
     bool is_decoder;
-    bool nonblock;
     int event_fd;
     int eventin_fd;
     int eventout_fd;
@@ -181,15 +306,21 @@ struct rkmpp_context {
     uint64_t frames;
     uint64_t last_fps_time;
 
+    uint64_t mem_used;
+    uint64_t mem_limit;
+    uint64_t mem_limit_total;
+
     unsigned int max_width;
     unsigned int max_height;
     char *codecs;
 
+    struct cuse_codec *codec;
+    struct rkmpp_ring *ring;
     void *subctx;
 };
 
 #define RKMPP_BUFFER_FLAG_HELPER_GET(flag, name) \
-static inline bool rkmpp_buffer_## name(struct rkmpp_buffer *buffer) \
+static inline bool rkmpp_buffer_## name(const struct rkmpp_buffer *buffer) \
 { \
     return !!(buffer->flags & flag); \
 }
@@ -226,11 +357,76 @@ RKMPP_BUFFER_FLAG_HELPERS(RKMPP_BUFFER_QUEUED, queued)
 RKMPP_BUFFER_FLAG_HELPERS(RKMPP_BUFFER_PENDING, pending)
 RKMPP_BUFFER_FLAG_HELPERS(RKMPP_BUFFER_AVAILABLE, available)
 RKMPP_BUFFER_FLAG_HELPERS(RKMPP_BUFFER_KEYFRAME, keyframe)
+RKMPP_BUFFER_FLAG_HELPERS(RKMPP_BUFFER_POOLED, pooled)
+RKMPP_BUFFER_FLAG_HELPERS(RKMPP_BUFFER_INSPECTED, inspected)
+RKMPP_BUFFER_FLAG_HELPERS(RKMPP_BUFFER_NONREF, nonref)
+RKMPP_BUFFER_FLAG_HELPERS(RKMPP_BUFFER_SKIP_NONREF, skip_nonref)
+RKMPP_BUFFER_FLAG_HELPERS(RKMPP_BUFFER_SKIP_NONKEY, skip_nonkey)
 
 struct rkmpp_context *context_init();
 void context_destroy(struct rkmpp_context *ctx);
 int rkmpp_update_poll_event(struct rkmpp_context *ctx);
 struct rkmpp_buf_queue* rkmpp_get_queue(struct rkmpp_context *ctx, enum v4l2_buf_type type);
+int rkmpp_buffer_reserve(struct rkmpp_context *ctx, struct rkmpp_buf_queue *queue,
+        struct rkmpp_buffer *buffer, uint32_t size);
+int rkmpp_commit_buffer(struct rkmpp_buf_queue *queue, struct rkmpp_buffer *buffer);
+int rkmpp_mem_charge(struct rkmpp_context *ctx, uint64_t size);
+void rkmpp_mem_uncharge(struct rkmpp_context *ctx, uint64_t size);
+uint64_t rkmpp_mem_total(void);
+const struct rkmpp_fmt *rkmpp_find_fmt(struct rkmpp_context *ctx, uint32_t fourcc,
+        enum v4l2_buf_type type);
+int rkmpp_try_fmt(struct rkmpp_context *ctx, struct v4l2_format *f);
 int rkmpp_ioctl_querycap(void *userdata, const void* in_buf, void *out_buf);
+int rkmpp_ioctl_enum_fmt(void *userdata, const void *in_buf, void *out_buf);
+int rkmpp_ioctl_enum_framesizes(void *userdata, const void *in_buf, void *out_buf);
+int rkmpp_ioctl_g_fmt(void *userdata, const void *in_buf, void *out_buf);
+int rkmpp_ioctl_reqbufs(void *userdata, const void *in_buf, void *out_buf);
+int rkmpp_ioctl_qbuf(void *userdata, const void *in_buf, void *out_buf);
+int rkmpp_ioctl_querybuf(void *userdata, const void *in_buf, void *out_buf);
+int rkmpp_ioctl_dqbuf(void *userdata, const void *in_buf, void *out_buf);
+int rkmpp_ioctl_expbuf(void *userdata, const void *in_buf, void *out_buf);
+int rkmpp_ioctl_streamon(void *userdata, const void *in_buf, void *out_buf);
+int rkmpp_ioctl_streamoff(void *userdata, const void *in_buf, void *out_buf);
+int rkmpp_ioctl_ring(void *userdata, const void *in_buf, void *out_buf);
+unsigned rkmpp_poll(void *userdata);
+struct cuse_replies *rkmpp_probe_replies(struct cuse_codec *codec);
+
+/*
+ * Hand a buffer back to the client, to a parked DQBUF if there is one.
+ * Called with the queue_mutex held, dropped with rkmpp_queue_unlock().
+ */
+void rkmpp_return_buffer(struct rkmpp_context *ctx, struct rkmpp_buf_queue *queue,
+        struct rkmpp_buffer *buffer);
+
+/* Queue the capture buffers handed back through the shared ring */
+int rkmpp_take_ring_buffers(struct rkmpp_context *ctx);
+
+/* Unlock the queue_mutex, then reply to the DQBUFs buffers went to */
+void rkmpp_queue_unlock(struct rkmpp_buf_queue *queue);
+
+/* Fail every parked DQBUF of the queue with err */
+void rkmpp_cancel_waiters(struct rkmpp_context *ctx, struct rkmpp_buf_queue *queue, int err);
+
+/* Fail the parked DQBUFs of interrupted clients with EINTR */
+void rkmpp_interrupt(void *userdata);
+
+/*
+ * Hand the queues of a session to another daemon, with the dma-bufs of the
+ * buffers and the fds of the ring, and take them over in that one.
+ */
+int rkmpp_save_context(struct rkmpp_context *ctx, struct cuse_state *state);
+int rkmpp_restore_context(struct rkmpp_context *ctx, struct cuse_state *state);
+
+/* Mix the layout of the queue and buffer states into a codec's handoff version */
+uint32_t rkmpp_state_version(uint32_t version);
+
+uint64_t rkmpp_now_us(void);
+void rkmpp_hist_add(struct rkmpp_hist *hist, uint64_t us);
+
+/* Upper bound of the wait pct percent of the waits were shorter than */
+uint64_t rkmpp_hist_percentile(const struct rkmpp_hist *hist, unsigned pct);
+void rkmpp_buffer_to_v4l2(const struct rkmpp_buf_queue *queue,
+        const struct rkmpp_buffer *rkmpp_buffer, struct v4l2_buffer *buffer,
+        struct v4l2_plane *plane);
 
 #endif /* SRC_RKMPP_H_ */
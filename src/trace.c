@@ -0,0 +1,227 @@
+/*
+ * trace.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Binary traces of ioctl sessions, for mpp-v4l2m2m-replay to play back.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#include "logger.h"
+#include "trace.h"
+
+/**
+ * struct rkmpp_trace_pending - A record waiting to be written
+ * @entry:      Entry in the queue of the trace.
+ * @done:       Its result is in, it goes out once those before it are.
+ * @record:     The record.
+ * @payload:    Its payload.
+ */
+struct rkmpp_trace_pending {
+    TAILQ_ENTRY(rkmpp_trace_pending) entry;
+    bool done;
+    struct rkmpp_trace_record record;
+    uint8_t payload[];
+};
+
+/**
+ * struct rkmpp_trace - A trace file being written
+ * @file:       The trace file.
+ * @payload:    Store bitstreams whole.
+ * @mutex:      Keeps the records of concurrent ioctls apart.
+ * @pending:    Records behind a parked ioctl, in the order they came in.
+ */
+struct rkmpp_trace {
+    FILE *file;
+    bool payload;
+    pthread_mutex_t mutex;
+    TAILQ_HEAD(, rkmpp_trace_pending) pending;
+};
+
+/* Tells apart the sessions of a client */
+static atomic_uint rkmpp_trace_seq;
+
+uint64_t rkmpp_trace_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint64_t rkmpp_trace_hash(const void *data, size_t size) {
+    const uint8_t *ptr = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= ptr[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+struct rkmpp_trace *rkmpp_trace_open(const char *dir, const char *node, pid_t pid,
+        bool payload, bool nonblock) {
+    struct rkmpp_trace_header header = { .version = RKMPP_TRACE_VERSION };
+    struct rkmpp_trace *trace;
+    char path[256];
+
+    trace = calloc(1, sizeof(*trace));
+    if (!trace)
+        return NULL;
+
+    snprintf(path, sizeof(path), "%s/%s-%d-%u.trace", dir, node, (int) pid,
+            atomic_fetch_add(&rkmpp_trace_seq, 1));
+
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        LOGE("failed to open trace %s: %s\n", path, strerror(errno));
+        free(trace);
+        return NULL;
+    }
+
+    memcpy(header.magic, RKMPP_TRACE_MAGIC, sizeof(header.magic));
+    header.flags = (payload ? 0 : RKMPP_TRACE_HASHED) | (nonblock ? RKMPP_TRACE_NONBLOCK : 0);
+    snprintf(header.node, sizeof(header.node), "%s", node);
+    fwrite(&header, sizeof(header), 1, trace->file);
+
+    trace->payload = payload;
+    pthread_mutex_init(&trace->mutex, NULL);
+    TAILQ_INIT(&trace->pending);
+
+    LOGV(1, "tracing session to %s\n", path);
+
+    return trace;
+}
+
+/* Called with the mutex held */
+static void rkmpp_trace_flush(struct rkmpp_trace *trace, bool all) {
+    struct rkmpp_trace_pending *pending;
+
+    while ((pending = TAILQ_FIRST(&trace->pending)) && (pending->done || all)) {
+        TAILQ_REMOVE(&trace->pending, pending, entry);
+        fwrite(&pending->record, sizeof(pending->record), 1, trace->file);
+        if (pending->record.size)
+            fwrite(pending->payload, pending->record.size, 1, trace->file);
+        free(pending);
+    }
+}
+
+void rkmpp_trace_close(struct rkmpp_trace *trace) {
+    if (!trace)
+        return;
+
+    /* Parked ioctls are all completed by then, unless one leaked */
+    rkmpp_trace_flush(trace, true);
+    fclose(trace->file);
+    pthread_mutex_destroy(&trace->mutex);
+    free(trace);
+}
+
+/* Called with the mutex held */
+static struct rkmpp_trace_pending *rkmpp_trace_queue(struct rkmpp_trace *trace,
+        const struct rkmpp_trace_record *record, const void *data1, size_t size1,
+        const void *data2, size_t size2) {
+    struct rkmpp_trace_pending *pending;
+
+    pending = malloc(sizeof(*pending) + size1 + size2);
+    if (!pending) {
+        LOGE("trace record of %x lost\n", record->cmd);
+        return NULL;
+    }
+
+    pending->done = false;
+    pending->record = *record;
+    if (size1)
+        memcpy(pending->payload, data1, size1);
+    if (size2)
+        memcpy(pending->payload + size1, data2, size2);
+    TAILQ_INSERT_TAIL(&trace->pending, pending, entry);
+
+    return pending;
+}
+
+/* Records queue behind a parked ioctl, they are in the order they came in */
+static void rkmpp_trace_write(struct rkmpp_trace *trace, struct rkmpp_trace_record *record,
+        const void *data1, size_t size1, const void *data2, size_t size2) {
+    struct rkmpp_trace_pending *pending;
+
+    record->size = size1 + size2;
+
+    pthread_mutex_lock(&trace->mutex);
+    if (TAILQ_EMPTY(&trace->pending)) {
+        fwrite(record, sizeof(*record), 1, trace->file);
+        if (size1)
+            fwrite(data1, size1, 1, trace->file);
+        if (size2)
+            fwrite(data2, size2, 1, trace->file);
+    } else if ((pending = rkmpp_trace_queue(trace, record, data1, size1, data2, size2))) {
+        pending->done = true;
+    }
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+void rkmpp_trace_ioctl(struct rkmpp_trace *trace, int cmd, uint64_t start, int result,
+        const void *arg, size_t size) {
+    struct rkmpp_trace_record record = {
+        .type = RKMPP_TRACE_IOCTL,
+        .time = start,
+        .duration = rkmpp_trace_now() - start,
+        .cmd = cmd,
+        .result = result,
+    };
+
+    rkmpp_trace_write(trace, &record, arg, arg ? size : 0, NULL, 0);
+}
+
+struct rkmpp_trace_pending *rkmpp_trace_park(struct rkmpp_trace *trace, int cmd,
+        uint64_t start, const void *arg, size_t size) {
+    struct rkmpp_trace_record record = {
+        .type = RKMPP_TRACE_IOCTL,
+        .size = arg ? size : 0,
+        .time = start,
+        .cmd = cmd,
+    };
+    struct rkmpp_trace_pending *pending;
+
+    pthread_mutex_lock(&trace->mutex);
+    pending = rkmpp_trace_queue(trace, &record, arg, record.size, NULL, 0);
+    pthread_mutex_unlock(&trace->mutex);
+
+    return pending;
+}
+
+void rkmpp_trace_complete(struct rkmpp_trace *trace, struct rkmpp_trace_pending *pending,
+        int result) {
+    pthread_mutex_lock(&trace->mutex);
+    pending->record.duration = rkmpp_trace_now() - pending->record.time;
+    pending->record.result = result;
+    pending->done = true;
+    rkmpp_trace_flush(trace, false);
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+void rkmpp_trace_data(struct rkmpp_trace *trace, int index, const struct v4l2_plane *plane,
+        const void *data, size_t size) {
+    struct rkmpp_trace_record record = {
+        .type = RKMPP_TRACE_DATA,
+        .time = rkmpp_trace_now(),
+        .cmd = index,
+    };
+    uint64_t hash;
+
+    if (trace->payload) {
+        rkmpp_trace_write(trace, &record, plane, sizeof(*plane), data, size);
+    } else {
+        hash = rkmpp_trace_hash(data, size);
+        rkmpp_trace_write(trace, &record, plane, sizeof(*plane), &hash, sizeof(hash));
+    }
+}
@@ -0,0 +1,107 @@
+/*
+ * trace.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ */
+
+#ifndef SRC_TRACE_H_
+#define SRC_TRACE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "linux/videodev2.h"
+
+#define RKMPP_TRACE_MAGIC       "RKMPPTRC"
+#define RKMPP_TRACE_VERSION     1
+
+/* Data records hold a hash of the bitstream instead of the bitstream */
+#define RKMPP_TRACE_HASHED      (1 << 0)
+/* The session was opened O_NONBLOCK, its DQBUFs never waited */
+#define RKMPP_TRACE_NONBLOCK    (1 << 1)
+
+/**
+ * enum rkmpp_trace_type - Type of a trace record
+ * @IOCTL:      An ioctl of the session, its payload is the argument struct
+ *              as the client passed it, empty for _IOR cmds.
+ * @DATA:       The bitstream of a queued buffer, its payload is the
+ *              struct v4l2_plane the client passed, then the bytes or
+ *              their 64 bit FNV-1a hash. Written before its QBUF record.
+ */
+enum rkmpp_trace_type {
+    RKMPP_TRACE_IOCTL = 1,
+    RKMPP_TRACE_DATA,
+};
+
+/**
+ * struct rkmpp_trace_header - Header of a trace file
+ * @magic:      RKMPP_TRACE_MAGIC.
+ * @version:    RKMPP_TRACE_VERSION.
+ * @flags:      RKMPP_TRACE_* flags.
+ * @node:       Device node the session opened.
+ */
+struct rkmpp_trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    char node[64];
+};
+
+/**
+ * struct rkmpp_trace_record - Header of a trace record, its payload follows
+ *
+ * Records are in the order their requests came in, a parked DQBUF before
+ * the QBUFs that let it complete.
+ *
+ * @type:       Record type.
+ * @size:       Bytes of payload.
+ * @time:       Monotonic ns the request came in.
+ * @duration:   Ns the daemon took to serve it.
+ * @cmd:        Ioctl cmd, or the buffer index of data.
+ * @result:     Errno of the ioctl, 0 for success.
+ */
+struct rkmpp_trace_record {
+    uint32_t type;
+    uint32_t size;
+    uint64_t time;
+    uint64_t duration;
+    int32_t cmd;
+    int32_t result;
+};
+
+struct rkmpp_trace;
+struct rkmpp_trace_pending;
+
+uint64_t rkmpp_trace_now(void);
+
+/* 64 bit FNV-1a, the hash of hashed data records */
+uint64_t rkmpp_trace_hash(const void *data, size_t size);
+
+/*
+ * Start a trace of a session in dir, named after the node and the client
+ * pid. Bitstreams are stored whole with payload, hashed otherwise, nonblock
+ * is how the session was opened. Returns NULL on failure, the session just
+ * goes untraced.
+ */
+struct rkmpp_trace *rkmpp_trace_open(const char *dir, const char *node, pid_t pid,
+        bool payload, bool nonblock);
+void rkmpp_trace_close(struct rkmpp_trace *trace);
+
+void rkmpp_trace_ioctl(struct rkmpp_trace *trace, int cmd, uint64_t start, int result,
+        const void *arg, size_t size);
+/*
+ * Hold the place of an ioctl that completes later, like a parked DQBUF, in
+ * the order of issue. The records after it wait until it has its result.
+ * Returns NULL when out of memory, its record is then lost.
+ */
+struct rkmpp_trace_pending *rkmpp_trace_park(struct rkmpp_trace *trace, int cmd,
+        uint64_t start, const void *arg, size_t size);
+/* Give a parked ioctl its result and write out what waited for it */
+void rkmpp_trace_complete(struct rkmpp_trace *trace, struct rkmpp_trace_pending *pending,
+        int result);
+void rkmpp_trace_data(struct rkmpp_trace *trace, int index, const struct v4l2_plane *plane,
+        const void *data, size_t size);
+
+#endif /* SRC_TRACE_H_ */
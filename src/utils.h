@@ -34,7 +34,7 @@
            offsetof(typeof(*(p)), field) - sizeof((p)->field))
 
 #define getbit(var, bit)    (((int)var >> bit) & 1)
-#define getint(var, start, len)    (((int)var >> start) & (unsigned)((2 << len) - 1))
+#define getint(var, start, len)    (((int)var >> start) & (unsigned)((1 << len) - 1))
 
 static inline
 const char* rkmpp_cmd2str(int cmd)
@@ -0,0 +1,387 @@
+/*
+ * vpuload.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Placement of decoder sessions on the decoder blocks of the soc. Mpp has
+ * no say over the cores of a block, the kernel spreads the tasks of every
+ * session over them, but a coding more than one block decodes can be put on
+ * either. Sessions go to the least loaded one, by the pixel rates placed on
+ * it and the time its frames take to come out. The blocks and their cores
+ * are the enabled decoder nodes of the device tree.
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "utils.h"
+#include "vpuload.h"
+
+/* Mpp client types of the blocks, VPU_CLIENT_* of its mpp_dev_defs.h */
+#define RKMPP_VPU_CLIENT_VDPU1      0
+#define RKMPP_VPU_CLIENT_VDPU2      1
+#define RKMPP_VPU_CLIENT_AV1DEC     4
+#define RKMPP_VPU_CLIENT_RKVDEC     9
+
+/* Device tree nodes are no deeper than under a bus under the root */
+#define RKMPP_VPU_PROBE_DEPTH       3
+
+/**
+ * struct rkmpp_vpu_kind - What a device tree node of a decoder core is
+ * @compatible: Compatible string of the core.
+ * @soc:        Compatible prefix of the root of the socs it applies to, NULL
+ *              for any.
+ * @block:      Block the core belongs to, its cores left for the probe.
+ */
+struct rkmpp_vpu_kind {
+    const char *compatible;
+    const char *soc;
+    struct rkmpp_vpu_block block;
+};
+
+/* The first entry a core matches is its kind, socs of their own go first */
+static const struct rkmpp_vpu_kind rkmpp_vpu_kinds[] = {
+    {
+        /* Cores of 8K of H.265 and VP9 or 4K60 of H.264 each */
+        .compatible = "rockchip,rkv-decoder-v2",
+        .soc = "rockchip,rk3588",
+        .block = {
+            .name = "rkvdec",
+            .hw_type = RKMPP_VPU_CLIENT_RKVDEC,
+            .core_rate = 3840ULL * 2160 * 60,
+            .max_width = 7680,
+            .max_height = 4320,
+            .codings = { MPP_VIDEO_CodingAVC, MPP_VIDEO_CodingHEVC, MPP_VIDEO_CodingVP9 },
+        },
+    },
+    {
+        .compatible = "rockchip,rkv-decoder-v2",
+        .block = {
+            .name = "rkvdec",
+            .hw_type = RKMPP_VPU_CLIENT_RKVDEC,
+            .core_rate = 3840ULL * 2160 * 60,
+            .max_width = 4096,
+            .max_height = 2304,
+            .codings = { MPP_VIDEO_CodingAVC, MPP_VIDEO_CodingHEVC, MPP_VIDEO_CodingVP9 },
+        },
+    },
+    {
+        .compatible = "rockchip,rkv-decoder-v1",
+        .block = {
+            .name = "rkvdec",
+            .hw_type = RKMPP_VPU_CLIENT_RKVDEC,
+            .core_rate = 3840ULL * 2160 * 30,
+            .max_width = 4096,
+            .max_height = 2304,
+            .codings = { MPP_VIDEO_CodingAVC, MPP_VIDEO_CodingHEVC, MPP_VIDEO_CodingVP9 },
+        },
+    },
+    {
+        /* The vpu121 and its like, 1080p60 */
+        .compatible = "rockchip,vpu-decoder-v2",
+        .block = {
+            .name = "vdpu",
+            .hw_type = RKMPP_VPU_CLIENT_VDPU2,
+            .core_rate = 1920ULL * 1088 * 60,
+            .max_width = 1920,
+            .max_height = 1088,
+            .codings = { MPP_VIDEO_CodingAVC, MPP_VIDEO_CodingVP8 },
+        },
+    },
+    {
+        .compatible = "rockchip,vpu-decoder-v1",
+        .block = {
+            .name = "vdpu",
+            .hw_type = RKMPP_VPU_CLIENT_VDPU1,
+            .core_rate = 1920ULL * 1088 * 30,
+            .max_width = 1920,
+            .max_height = 1088,
+            .codings = { MPP_VIDEO_CodingAVC, MPP_VIDEO_CodingVP8 },
+        },
+    },
+    {
+        .compatible = "rockchip,av1-decoder",
+        .block = {
+            .name = "av1d",
+            .hw_type = RKMPP_VPU_CLIENT_AV1DEC,
+            .core_rate = 3840ULL * 2160 * 60,
+            .max_width = 7680,
+            .max_height = 4320,
+            .codings = { MPP_VIDEO_CodingAV1 },
+        },
+    },
+};
+
+/* Blocks of the soc, probed on the first placement, and their loads */
+static pthread_mutex_t rkmpp_vpu_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct rkmpp_vpu_block rkmpp_vpu_blocks[RKMPP_VPU_MAX_BLOCKS];
+static int rkmpp_vpu_num_blocks = -1;
+static struct rkmpp_vpu_load rkmpp_vpu_loads[RKMPP_VPU_MAX_BLOCKS];
+
+static bool rkmpp_vpu_decodes(const struct rkmpp_vpu_block *block, MppCodingType type) {
+    for (unsigned int i = 0; i < ARRAY_SIZE(block->codings); i++) {
+        if (block->codings[i] == MPP_VIDEO_CodingUnused)
+            break;
+        if (block->codings[i] == type)
+            return true;
+    }
+
+    return false;
+}
+
+uint32_t rkmpp_vpu_block_load(const struct rkmpp_vpu_block *block,
+        const struct rkmpp_vpu_load *load, uint64_t rate) {
+    uint64_t pixels = (load->rate + rate) * 100 / (block->cores * block->core_rate);
+    uint64_t latency = load->latency * 100 / RKMPP_VPU_SATURATED_US;
+
+    return min(max(pixels, latency), UINT32_MAX);
+}
+
+int rkmpp_vpu_pick(const struct rkmpp_vpu_block *blocks,
+        const struct rkmpp_vpu_load *loads, int num, MppCodingType type,
+        uint32_t width, uint32_t height, uint64_t rate) {
+    uint32_t load, best_load = 0;
+    bool fits, best_fits = false;
+    int best = -1;
+
+    for (int i = 0; i < num; i++) {
+        const struct rkmpp_vpu_block *block = &blocks[i];
+
+        if (!rkmpp_vpu_decodes(block, type) || width > block->max_width ||
+                height > block->max_height)
+            continue;
+
+        fits = rate <= block->cores * block->core_rate;
+        load = rkmpp_vpu_block_load(block, &loads[i], rate);
+
+        /* Ties go to the block of more cores, which absorbs bursts better */
+        if (best < 0 || (fits && !best_fits) || (fits == best_fits &&
+                (load < best_load || (load == best_load &&
+                block->cores > blocks[best].cores)))) {
+            best = i;
+            best_load = load;
+            best_fits = fits;
+        }
+    }
+
+    return best;
+}
+
+/* A property of a device tree node, a list of nul terminated strings */
+static ssize_t rkmpp_vpu_read_prop(const char *node, const char *prop, char *buf,
+        size_t size) {
+    char path[PATH_MAX];
+    ssize_t len;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/%s", node, prop);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    len = read(fd, buf, size - 1);
+    close(fd);
+    if (len < 0)
+        return -1;
+
+    buf[len] = '\0';
+    return len;
+}
+
+static bool rkmpp_vpu_has_string(const char *list, ssize_t len, const char *str,
+        bool prefix) {
+    for (const char *p = list; p < list + len; p += strlen(p) + 1) {
+        if (prefix ? !strncmp(p, str, strlen(str)) : !strcmp(p, str))
+            return true;
+    }
+
+    return false;
+}
+
+/* The kind of core a node is, NULL for none or one that's disabled */
+static const struct rkmpp_vpu_kind *rkmpp_vpu_node_kind(const char *node,
+        const char *soc, ssize_t soc_len) {
+    char compatible[256], status[16];
+    ssize_t len;
+
+    len = rkmpp_vpu_read_prop(node, "compatible", compatible, sizeof(compatible));
+    if (len <= 0)
+        return NULL;
+
+    if (rkmpp_vpu_read_prop(node, "status", status, sizeof(status)) > 0 &&
+            strcmp(status, "okay") && strcmp(status, "ok"))
+        return NULL;
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(rkmpp_vpu_kinds); i++) {
+        const struct rkmpp_vpu_kind *kind = &rkmpp_vpu_kinds[i];
+
+        if (rkmpp_vpu_has_string(compatible, len, kind->compatible, false) &&
+                (!kind->soc || rkmpp_vpu_has_string(soc, soc_len, kind->soc, true)))
+            return kind;
+    }
+
+    return NULL;
+}
+
+static int rkmpp_vpu_probe_dir(const char *dir, int depth, const char *soc, ssize_t soc_len,
+        struct rkmpp_vpu_block *blocks, const struct rkmpp_vpu_kind **kinds,
+        int num, int max) {
+    const struct rkmpp_vpu_kind *kind;
+    char path[PATH_MAX];
+    struct dirent *entry;
+    DIR *d;
+    int i;
+
+    d = opendir(dir);
+    if (!d)
+        return num;
+
+    while ((entry = readdir(d))) {
+        if ((entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) ||
+                entry->d_name[0] == '.')
+            continue;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+        kind = rkmpp_vpu_node_kind(path, soc, soc_len);
+        if (kind) {
+            for (i = 0; i < num && kinds[i] != kind; i++)
+                ;
+
+            if (i < num) {
+                blocks[i].cores++;
+            } else if (num < max) {
+                kinds[num] = kind;
+                blocks[num] = kind->block;
+                blocks[num].cores = 1;
+                num++;
+            }
+            continue;
+        }
+
+        if (depth > 1)
+            num = rkmpp_vpu_probe_dir(path, depth - 1, soc, soc_len, blocks, kinds, num, max);
+    }
+
+    closedir(d);
+    return num;
+}
+
+int rkmpp_vpu_probe(const char *root, struct rkmpp_vpu_block *blocks, int max) {
+    const struct rkmpp_vpu_kind *kinds[RKMPP_VPU_MAX_BLOCKS];
+    char soc[256];
+    ssize_t soc_len;
+
+    soc_len = rkmpp_vpu_read_prop(root, "compatible", soc, sizeof(soc));
+    if (soc_len < 0)
+        soc_len = 0;
+
+    return rkmpp_vpu_probe_dir(root, RKMPP_VPU_PROBE_DEPTH, soc, soc_len, blocks, kinds, 0,
+            min(max, RKMPP_VPU_MAX_BLOCKS));
+}
+
+static void rkmpp_vpu_find_blocks(void) {
+    if (rkmpp_vpu_num_blocks >= 0)
+        return;
+
+    rkmpp_vpu_num_blocks = rkmpp_vpu_probe("/proc/device-tree", rkmpp_vpu_blocks,
+            RKMPP_VPU_MAX_BLOCKS);
+
+    for (int i = 0; i < rkmpp_vpu_num_blocks; i++)
+        LOGV(1, "decoder block %s: %u cores\n", rkmpp_vpu_blocks[i].name,
+                rkmpp_vpu_blocks[i].cores);
+}
+
+void rkmpp_vpu_place(struct rkmpp_vpu_session *session, MppCodingType type,
+        uint32_t width, uint32_t height, uint64_t rate) {
+    const struct rkmpp_vpu_block *block = NULL;
+    uint32_t load = 0;
+    int index;
+
+    pthread_mutex_lock(&rkmpp_vpu_mutex);
+
+    rkmpp_vpu_find_blocks();
+
+    index = rkmpp_vpu_pick(rkmpp_vpu_blocks, rkmpp_vpu_loads, rkmpp_vpu_num_blocks,
+            type, width, height, rate);
+    if (index >= 0) {
+        block = &rkmpp_vpu_blocks[index];
+        rkmpp_vpu_loads[index].sessions++;
+        rkmpp_vpu_loads[index].rate += rate;
+        load = rkmpp_vpu_block_load(block, &rkmpp_vpu_loads[index], 0);
+    }
+
+    session->placed = true;
+    session->block = index;
+    session->hw_type = block ? block->hw_type : -1;
+    session->rate = rate;
+
+    pthread_mutex_unlock(&rkmpp_vpu_mutex);
+
+    if (block)
+        LOGV(1, "%ux%u at %" PRIu64 " pixels/s placed on %s, %u%% loaded\n",
+                width, height, rate, block->name, load);
+}
+
+void rkmpp_vpu_release(struct rkmpp_vpu_session *session) {
+    struct rkmpp_vpu_load *load;
+
+    if (!session->placed)
+        return;
+
+    pthread_mutex_lock(&rkmpp_vpu_mutex);
+    if (session->block >= 0) {
+        load = &rkmpp_vpu_loads[session->block];
+        load->sessions--;
+        load->rate -= session->rate;
+
+        /* The next session starts from a clean slate */
+        if (!load->sessions)
+            load->latency = 0;
+    }
+    pthread_mutex_unlock(&rkmpp_vpu_mutex);
+
+    session->placed = false;
+    session->block = -1;
+    session->hw_type = -1;
+    session->rate = 0;
+}
+
+void rkmpp_vpu_update(struct rkmpp_vpu_session *session, uint64_t rate,
+        uint64_t latency) {
+    struct rkmpp_vpu_load *load;
+
+    if (!session->placed || session->block < 0)
+        return;
+
+    pthread_mutex_lock(&rkmpp_vpu_mutex);
+    load = &rkmpp_vpu_loads[session->block];
+
+    load->rate += rate - session->rate;
+    session->rate = rate;
+
+    if (latency)
+        load->latency = load->latency ? (load->latency * 15 + latency) / 16 : latency;
+    pthread_mutex_unlock(&rkmpp_vpu_mutex);
+}
+
+uint32_t rkmpp_vpu_session_load(const struct rkmpp_vpu_session *session) {
+    uint32_t load = 0;
+
+    if (!session->placed || session->block < 0)
+        return 0;
+
+    pthread_mutex_lock(&rkmpp_vpu_mutex);
+    load = rkmpp_vpu_block_load(&rkmpp_vpu_blocks[session->block],
+            &rkmpp_vpu_loads[session->block], 0);
+    pthread_mutex_unlock(&rkmpp_vpu_mutex);
+
+    return load;
+}
@@ -0,0 +1,104 @@
+/*
+ * vpuload.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ */
+
+#ifndef SRC_VPULOAD_H_
+#define SRC_VPULOAD_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <rockchip/rk_mpi.h>
+
+/* Decoder blocks of a soc, more than any has */
+#define RKMPP_VPU_MAX_BLOCKS    4
+
+/* Frame latency a block is taken for saturated at */
+#define RKMPP_VPU_SATURATED_US  40000
+
+/**
+ * struct rkmpp_vpu_block - A decoder block of the soc
+ * @name:       Name in the logs.
+ * @hw_type:    Mpp client type of the block, for the base:hw_type config.
+ * @cores:      Cores of the block, the kernel spreads its tasks over them.
+ * @core_rate:  Pixels per second one core decodes.
+ * @max_width:  Largest width it decodes.
+ * @max_height: Largest height it decodes.
+ * @codings:    Codings it decodes, MPP_VIDEO_CodingUnused terminated.
+ */
+struct rkmpp_vpu_block {
+    const char *name;
+    int hw_type;
+    uint32_t cores;
+    uint64_t core_rate;
+    uint32_t max_width;
+    uint32_t max_height;
+    MppCodingType codings[8];
+};
+
+/**
+ * struct rkmpp_vpu_load - Load placed on a block
+ * @sessions:   Sessions placed on it.
+ * @rate:       Pixels per second of its sessions.
+ * @latency:    Us from a packet to its frame, averaged over its sessions.
+ */
+struct rkmpp_vpu_load {
+    uint32_t sessions;
+    uint64_t rate;
+    uint64_t latency;
+};
+
+/**
+ * struct rkmpp_vpu_session - Placement of a decoder session
+ * @placed:     The session is accounted to a block.
+ * @block:      Index of its block, -1 when mpp picks one.
+ * @hw_type:    Mpp client type of its block, -1 when mpp picks one.
+ * @rate:       Pixels per second accounted for it.
+ */
+struct rkmpp_vpu_session {
+    bool placed;
+    int block;
+    int hw_type;
+    uint64_t rate;
+};
+
+/*
+ * Pick the block a session of the coding, size and pixel rate is to be
+ * decoded on, the least loaded of the ones able to, from blocks and their
+ * loads. Blocks whose cores together can't keep up with the session are
+ * only picked when none can. Returns -1 for none.
+ */
+int rkmpp_vpu_pick(const struct rkmpp_vpu_block *blocks,
+        const struct rkmpp_vpu_load *loads, int num, MppCodingType type,
+        uint32_t width, uint32_t height, uint64_t rate);
+
+/*
+ * Find the decoder blocks of the device tree at root, like
+ * /proc/device-tree, counting the enabled cores of each. Returns the number
+ * of blocks filled in, up to max.
+ */
+int rkmpp_vpu_probe(const char *root, struct rkmpp_vpu_block *blocks, int max);
+
+/* Load of a block in percent of what its cores decode */
+uint32_t rkmpp_vpu_block_load(const struct rkmpp_vpu_block *block,
+        const struct rkmpp_vpu_load *load, uint64_t rate);
+
+/*
+ * Place a session on a block of the soc the daemon runs on, the block's mpp
+ * client type to init mpp with is left in the session.
+ */
+void rkmpp_vpu_place(struct rkmpp_vpu_session *session, MppCodingType type,
+        uint32_t width, uint32_t height, uint64_t rate);
+void rkmpp_vpu_release(struct rkmpp_vpu_session *session);
+
+/* Account the session's pixel rate and the latency of its last frame, 0 for none */
+void rkmpp_vpu_update(struct rkmpp_vpu_session *session, uint64_t rate,
+        uint64_t latency);
+
+/* Load of the session's block in percent, 0 when it's not placed */
+uint32_t rkmpp_vpu_session_load(const struct rkmpp_vpu_session *session);
+
+#endif /* SRC_VPULOAD_H_ */
@@ -0,0 +1,705 @@
+/*
+ * fuzz_cuse.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Fuzzes the daemon's ioctl dispatch, codec_ioctl, with requests as fuse
+ * hands them over: any cmd, any in and out sizes, retries or not. It's built
+ * with cusedev.c in it, for the static dispatch, and plays the kernel's part
+ * in the fuse calls it makes. A retry is served as the kernel does, with the
+ * regions it asks for copied from the client's memory, and replies are
+ * checked against what the kernel takes: one per request, no bigger than its
+ * out size. The client is simulated, its memory an array of the harness
+ * that process_vm_readv and process_vm_writev stand in for, denying access
+ * when the input says so. The callbacks are the harness's too, reading the
+ * client regions their args give, failing or parking as they say, next to
+ * replies known ahead for some of their cmds.
+ *
+ * Built with -fsanitize=fuzzer and MPPV4L2_LIBFUZZER it's a libFuzzer
+ * target. Otherwise it runs the files given, as AFL does with @@, or with
+ * no arguments a seed and mutations of it, as a smoke test.
+ */
+#include "cusedev.c"
+
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+
+/* Requests of one input */
+#define FUZZ_MAX_OPS        64
+
+/*
+ * Retries of a request the callbacks here can need: one for the arg, then
+ * one for each client read, as a callback stops at the first that runs short
+ */
+#define FUZZ_MAX_RETRIES    (CUSE_CLIENT_MAX_IOV + 2)
+
+/* What the kernel takes of a retry, FUSE_IOCTL_MAX_IOV and default max_pages */
+#define FUZZ_MAX_IOV        256
+#define FUZZ_MAX_RETRY_SIZE (32 * 4096)
+
+/* The client's memory, at an address of its own the input can point at */
+#define FUZZ_CLIENT_BASE    0x10000000UL
+#define FUZZ_CLIENT_SIZE    (64 << 10)
+
+/*
+ * Op of an input request: the low byte picks the cmd of the harness, a raw
+ * one past them, the high byte has these
+ */
+#define FUZZ_OP_CMD         0xff
+#define FUZZ_OP_DENIED      0x100   /* no ptrace access to the client */
+#define FUZZ_OP_COMPAT      0x200   /* a 32 bit client */
+#define FUZZ_OP_NO_OPEN     0x400   /* an fh nobody knows */
+#define FUZZ_OP_LOST        0x800   /* an open taken over without its state */
+#define FUZZ_OP_INTERRUPT   0x1000  /* a signal for a parked request */
+
+/* Mutated runs of the seed without arguments */
+#define FUZZ_SMOKE_RUNS     500
+
+#define FUZZ_CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/**
+ * struct fuzz_region - Client memory a callback reads
+ * @addr:       Its address in the client.
+ * @size:       Bytes to read.
+ */
+struct fuzz_region {
+    uint64_t addr;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+#define FUZZ_REGIONS        4
+
+/**
+ * struct fuzz_arg - Argument of the harness's ioctls
+ * @index:      Key of the replies known ahead.
+ * @err:        Errno to fail with, 0 to succeed.
+ * @num_reads:  Client reads, of the regions in turn.
+ * @write:      Write the arg back over the first region.
+ * @regions:    Regions to read.
+ * @data:       What was read, folded.
+ */
+struct fuzz_arg {
+    uint32_t index;
+    uint32_t err;
+    uint32_t num_reads;
+    uint32_t write;
+    struct fuzz_region regions[FUZZ_REGIONS];
+    uint8_t data[32];
+};
+
+/* An arg the size of a page or two */
+struct fuzz_big {
+    uint8_t data[6000];
+};
+
+#define FUZZ_IOC_IN         _IOW('F', 1, struct fuzz_arg)
+#define FUZZ_IOC_OUT        _IOR('F', 2, struct fuzz_arg)
+#define FUZZ_IOC_INOUT      _IOWR('F', 3, struct fuzz_arg)
+#define FUZZ_IOC_NONE       _IO('F', 4)
+#define FUZZ_IOC_PARK       _IOWR('F', 5, struct fuzz_arg)
+#define FUZZ_IOC_BIG        _IOR('F', 6, struct fuzz_big)
+#define FUZZ_IOC_QUERY      _IOR('F', 7, struct fuzz_arg)
+#define FUZZ_IOC_ENUM       _IOWR('F', 8, struct fuzz_arg)
+
+/* Replies of FUZZ_IOC_ENUM known ahead, the last an error */
+#define FUZZ_ENUM_REPLIES   4
+
+/**
+ * struct fuzz_req - A request, the fuse_req_t of the fuse calls
+ * @ctx:        Its client.
+ * @out_size:   Out size it was sent with.
+ * @replies:    Replies it got.
+ * @err:        Errno of the reply, 0 for an ioctl reply.
+ * @out:        What an ioctl reply had.
+ * @size:       Its size.
+ * @retry:      The reply was a retry.
+ * @in_iov:     Client memory the retry wants in.
+ * @num_in:     Its regions.
+ * @out_iov:    Client memory the reply goes out to.
+ * @num_out:    Its regions.
+ * @interrupt:  Interrupt callback set while parked.
+ * @data:       Its data.
+ * @interrupted: The client got a signal.
+ */
+struct fuzz_req {
+    struct fuse_ctx ctx;
+    size_t out_size;
+    int replies;
+    int err;
+    uint8_t out[FUZZ_MAX_RETRY_SIZE];
+    size_t size;
+    bool retry;
+    struct iovec in_iov[FUZZ_MAX_IOV];
+    size_t num_in;
+    struct iovec out_iov[FUZZ_MAX_IOV];
+    size_t num_out;
+    fuse_interrupt_func_t interrupt;
+    void *data;
+    bool interrupted;
+};
+
+static uint8_t fuzz_client[FUZZ_CLIENT_SIZE];
+static bool fuzz_denied;
+
+static struct cuse_codec fuzz_codec;
+static struct cuse_request *fuzz_parked;
+static struct fuzz_arg fuzz_parked_arg;
+
+/* The part of the client's memory at addr, NULL when it isn't there */
+static uint8_t *fuzz_client_at(unsigned long addr, size_t size) {
+    if (addr < FUZZ_CLIENT_BASE || size > FUZZ_CLIENT_SIZE ||
+            addr - FUZZ_CLIENT_BASE > FUZZ_CLIENT_SIZE - size)
+        return NULL;
+
+    return fuzz_client + (addr - FUZZ_CLIENT_BASE);
+}
+
+static ssize_t fuzz_access_client(const struct iovec *local, unsigned long liovcnt,
+        const struct iovec *remote, unsigned long riovcnt, bool write) {
+    uint8_t *client;
+
+    FUZZ_CHECK(liovcnt == 1 && riovcnt == 1 && local->iov_len == remote->iov_len);
+
+    if (fuzz_denied) {
+        errno = EPERM;
+        return -1;
+    }
+
+    client = fuzz_client_at((unsigned long) remote->iov_base, remote->iov_len);
+    if (!client) {
+        errno = EFAULT;
+        return -1;
+    }
+
+    if (write)
+        memcpy(client, local->iov_base, local->iov_len);
+    else
+        memcpy(local->iov_base, client, local->iov_len);
+    return local->iov_len;
+}
+
+ssize_t process_vm_readv(pid_t pid, const struct iovec *local_iov, unsigned long liovcnt,
+        const struct iovec *remote_iov, unsigned long riovcnt, unsigned long flags) {
+    return fuzz_access_client(local_iov, liovcnt, remote_iov, riovcnt, false);
+}
+
+ssize_t process_vm_writev(pid_t pid, const struct iovec *local_iov, unsigned long liovcnt,
+        const struct iovec *remote_iov, unsigned long riovcnt, unsigned long flags) {
+    return fuzz_access_client(local_iov, liovcnt, remote_iov, riovcnt, true);
+}
+
+/* The fuse calls of the dispatch, answered as the kernel would take them */
+const struct fuse_ctx *fuse_req_ctx(fuse_req_t req) {
+    return &((struct fuzz_req *) req)->ctx;
+}
+
+void fuse_req_interrupt_func(fuse_req_t req, fuse_interrupt_func_t func, void *data) {
+    struct fuzz_req *fuzz_req = (struct fuzz_req *) req;
+
+    fuzz_req->interrupt = func;
+    fuzz_req->data = data;
+}
+
+int fuse_req_interrupted(fuse_req_t req) {
+    return ((struct fuzz_req *) req)->interrupted;
+}
+
+int fuse_reply_err(fuse_req_t req, int err) {
+    struct fuzz_req *fuzz_req = (struct fuzz_req *) req;
+
+    FUZZ_CHECK(++fuzz_req->replies == 1);
+    FUZZ_CHECK(err >= 0 && err < 4096);
+
+    fuzz_req->err = err;
+    return 0;
+}
+
+int fuse_reply_ioctl(fuse_req_t req, int result, const void *buf, size_t size) {
+    struct fuzz_req *fuzz_req = (struct fuzz_req *) req;
+
+    FUZZ_CHECK(++fuzz_req->replies == 1);
+    FUZZ_CHECK(!result);
+
+    /* The kernel fails the ioctl with EIO for more than it asked for */
+    FUZZ_CHECK(size <= fuzz_req->out_size);
+    FUZZ_CHECK(!size || buf);
+
+    if (size)
+        memcpy(fuzz_req->out, buf, size);
+    fuzz_req->size = size;
+    return 0;
+}
+
+int fuse_reply_ioctl_retry(fuse_req_t req, const struct iovec *in_iov, size_t in_count,
+        const struct iovec *out_iov, size_t out_count) {
+    struct fuzz_req *fuzz_req = (struct fuzz_req *) req;
+
+    FUZZ_CHECK(++fuzz_req->replies == 1);
+    FUZZ_CHECK(in_count + out_count <= FUZZ_MAX_IOV);
+    FUZZ_CHECK(!in_count || in_iov);
+    FUZZ_CHECK(!out_count || out_iov);
+
+    if (in_count)
+        memcpy(fuzz_req->in_iov, in_iov, in_count * sizeof(*in_iov));
+    fuzz_req->num_in = in_count;
+    if (out_count)
+        memcpy(fuzz_req->out_iov, out_iov, out_count * sizeof(*out_iov));
+    fuzz_req->num_out = out_count;
+    fuzz_req->retry = true;
+    return 0;
+}
+
+static int fuzz_result(const struct fuzz_arg *arg) {
+    /* No errno at all, the dispatch makes it EIO */
+    if (arg->err) {
+        errno = arg->err % 134;
+        return -1;
+    }
+
+    return 0;
+}
+
+static int fuzz_ioctl_in(void *userdata, const void *in_buf, void *out_buf) {
+    FUZZ_CHECK(in_buf && !out_buf);
+
+    return fuzz_result(in_buf);
+}
+
+static int fuzz_ioctl_out(void *userdata, const void *in_buf, void *out_buf) {
+    FUZZ_CHECK(!in_buf && out_buf);
+
+    memset(out_buf, 0xa5, sizeof(struct fuzz_arg));
+    return 0;
+}
+
+/* Reads the regions of the arg, more of them than a retry can bring if it says so */
+static int fuzz_ioctl_inout(void *userdata, const void *in_buf, void *out_buf) {
+    const struct fuzz_arg *in = in_buf;
+    struct fuzz_arg *out = out_buf;
+    const struct fuzz_region *region;
+    uint8_t data[1024];
+    uint32_t size;
+
+    FUZZ_CHECK(in_buf && out_buf);
+
+    *out = *in;
+    for (uint32_t i = 0; i < in->num_reads % (CUSE_CLIENT_MAX_IOV + 2); i++) {
+        region = &in->regions[i % FUZZ_REGIONS];
+        size = region->size % (sizeof(data) + 1);
+        if (cuse_read_client(data, region->addr, size) < 0)
+            return -1;
+
+        for (uint32_t j = 0; j < size; j++)
+            out->data[j % sizeof(out->data)] ^= data[j];
+    }
+
+    if (in->write && cuse_write_client(in->regions[0].addr, out,
+            min(sizeof(*out), in->regions[0].size)) < 0)
+        return -1;
+
+    return fuzz_result(in);
+}
+
+static int fuzz_ioctl_none(void *userdata, const void *in_buf, void *out_buf) {
+    FUZZ_CHECK(!in_buf && !out_buf);
+
+    return 0;
+}
+
+/* Replies after the dispatch is done with it, unless interrupted first */
+static int fuzz_ioctl_park(void *userdata, const void *in_buf, void *out_buf) {
+    FUZZ_CHECK(in_buf && out_buf && !fuzz_parked);
+
+    fuzz_parked = cuse_park_request();
+    FUZZ_CHECK(fuzz_parked);
+
+    fuzz_parked_arg = *(const struct fuzz_arg *) in_buf;
+    return CUSE_IOCTL_PARKED;
+}
+
+static int fuzz_ioctl_big(void *userdata, const void *in_buf, void *out_buf) {
+    FUZZ_CHECK(!in_buf && out_buf);
+
+    memset(out_buf, 0x5a, sizeof(struct fuzz_big));
+    return 0;
+}
+
+static void fuzz_interrupt(void *userdata) {
+    if (!fuzz_parked)
+        return;
+
+    cuse_complete_request(fuzz_parked, EINTR, NULL, 0);
+    fuzz_parked = NULL;
+}
+
+static struct cuse_ioctl fuzz_ioctls[] = {
+    { FUZZ_IOC_IN, fuzz_ioctl_in },
+    { FUZZ_IOC_OUT, fuzz_ioctl_out },
+    { FUZZ_IOC_INOUT, fuzz_ioctl_inout },
+    { FUZZ_IOC_NONE, fuzz_ioctl_none },
+    { FUZZ_IOC_PARK, fuzz_ioctl_park },
+    { FUZZ_IOC_BIG, fuzz_ioctl_big },
+    /* Always answered ahead */
+    { FUZZ_IOC_QUERY, fuzz_ioctl_out },
+    /* Answered ahead for a few indices */
+    { FUZZ_IOC_ENUM, fuzz_ioctl_inout },
+};
+
+/* Replies as a probe leaves them, keyed on the index for the enumeration */
+static struct cuse_replies *fuzz_replies(void) {
+    struct cuse_replies *replies = cuse_replies_new();
+    struct fuzz_arg arg;
+
+    FUZZ_CHECK(replies);
+
+    memset(&arg, 0x3c, sizeof(arg));
+    FUZZ_CHECK(!cuse_replies_add(replies, FUZZ_IOC_QUERY, 0, &arg, sizeof(arg), 0));
+
+    for (uint32_t index = 0; index < FUZZ_ENUM_REPLIES; index++) {
+        memset(&arg, index, sizeof(arg));
+        arg.index = index;
+        FUZZ_CHECK(!cuse_replies_add(replies, FUZZ_IOC_ENUM,
+                index == FUZZ_ENUM_REPLIES - 1 ? EINVAL : 0, &arg, sizeof(arg),
+                sizeof(arg.index)));
+    }
+
+    cuse_replies_seal(replies);
+    return replies;
+}
+
+static void fuzz_setup(void) {
+    snprintf(fuzz_codec.filename, sizeof(fuzz_codec.filename), "fuzz_cuse");
+    fuzz_codec.fh = (uintptr_t) &fuzz_codec;
+    pthread_mutex_init(&fuzz_codec.poll_mutex, NULL);
+    fuzz_codec.interrupt = fuzz_interrupt;
+    fuzz_codec.replies = fuzz_replies();
+    fuzz_codec.ioctls = fuzz_ioctls;
+    fuzz_codec.num_ioctls = ARRAY_SIZE(fuzz_ioctls);
+}
+
+/*
+ * Copy the regions of a retry from the client into buf, as the kernel does
+ * before sending it again. Returns their size, or -1 for a retry the kernel
+ * fails the client's ioctl for.
+ */
+static ssize_t fuzz_gather(const struct iovec *iov, size_t num, uint8_t *buf) {
+    size_t size = 0;
+    uint8_t *client;
+
+    for (size_t i = 0; i < num; i++) {
+        if (iov[i].iov_len > FUZZ_MAX_RETRY_SIZE - size)
+            return -1;
+
+        /* Nothing to copy, nothing to fault on */
+        if (!iov[i].iov_len)
+            continue;
+
+        client = fuzz_client_at((unsigned long) iov[i].iov_base, iov[i].iov_len);
+        if (!client)
+            return -1;
+
+        memcpy(buf + size, client, iov[i].iov_len);
+        size += iov[i].iov_len;
+    }
+
+    return size;
+}
+
+static ssize_t fuzz_out_size(const struct iovec *iov, size_t num) {
+    size_t size = 0;
+
+    for (size_t i = 0; i < num; i++) {
+        if (iov[i].iov_len > FUZZ_MAX_RETRY_SIZE - size)
+            return -1;
+        size += iov[i].iov_len;
+    }
+
+    return size;
+}
+
+/* The reply back into the client, where the last retry said it goes */
+static void fuzz_scatter(const struct fuzz_req *req) {
+    size_t pos = 0, size;
+    uint8_t *client;
+
+    for (size_t i = 0; i < req->num_out && pos < req->size; i++) {
+        size = min(req->out_iov[i].iov_len, req->size - pos);
+        client = fuzz_client_at((unsigned long) req->out_iov[i].iov_base, size);
+        if (client)
+            memcpy(client, req->out + pos, size);
+        pos += size;
+    }
+}
+
+/* Serve a request until it has its reply, retrying as the kernel would */
+static void fuzz_request(int cmd, uint16_t op, size_t in_size, size_t out_size) {
+    static struct fuzz_req req;
+    static uint8_t retry_in[FUZZ_MAX_RETRY_SIZE];
+    struct fuse_file_info fi = { .fh = (uintptr_t) &fuzz_codec };
+    unsigned flags = op & FUZZ_OP_COMPAT ? FUSE_IOCTL_COMPAT : 0;
+    uint8_t *in_buf;
+    ssize_t size;
+
+    if (op & FUZZ_OP_NO_OPEN)
+        fi.fh = 0;
+    fuzz_codec.lost = op & FUZZ_OP_LOST;
+    fuzz_denied = op & FUZZ_OP_DENIED;
+
+    req.ctx.pid = getpid();
+    req.num_out = 0;
+    memcpy(retry_in, fuzz_client, in_size);
+
+    for (int retries = 0; ; retries++) {
+        /* Exactly what the kernel sends, for the sanitizers to see overreads */
+        in_buf = malloc(in_size ? in_size : 1);
+        FUZZ_CHECK(in_buf);
+        memcpy(in_buf, retry_in, in_size);
+
+        req.out_size = out_size;
+        req.replies = 0;
+        req.err = 0;
+        req.size = 0;
+        req.retry = false;
+        req.interrupt = NULL;
+        req.interrupted = false;
+
+        codec_ioctl((fuse_req_t) &req, cmd, (void *) FUZZ_CLIENT_BASE, &fi, flags, in_buf,
+                in_size, out_size);
+        free(in_buf);
+
+        if (fuzz_parked) {
+            FUZZ_CHECK(!req.replies && req.interrupt);
+            if (op & FUZZ_OP_INTERRUPT) {
+                req.interrupted = true;
+                req.interrupt((fuse_req_t) &req, req.data);
+            }
+            if (fuzz_parked) {
+                cuse_complete_request(fuzz_parked, fuzz_parked_arg.err ? EIO : 0,
+                        &fuzz_parked_arg, sizeof(fuzz_parked_arg));
+                fuzz_parked = NULL;
+            }
+        }
+
+        FUZZ_CHECK(req.replies == 1);
+        if (!req.retry)
+            break;
+
+        /* Every retry brings what a callback read last, it gets there */
+        FUZZ_CHECK(retries < FUZZ_MAX_RETRIES);
+
+        size = fuzz_gather(req.in_iov, req.num_in, retry_in);
+        if (size < 0)
+            return;
+        in_size = size;
+
+        size = fuzz_out_size(req.out_iov, req.num_out);
+        if (size < 0)
+            return;
+        out_size = size;
+    }
+
+    if (!req.err)
+        fuzz_scatter(&req);
+}
+
+static uint32_t fuzz_take(const uint8_t **data, size_t *size, size_t bytes) {
+    uint32_t value = 0;
+
+    bytes = min(bytes, *size);
+    memcpy(&value, *data, bytes);
+    *data += bytes;
+    *size -= bytes;
+
+    return value;
+}
+
+/*
+ * An input is a run of requests, each an op, a raw cmd when the op doesn't
+ * pick one of the harness's, the bytes of the client's memory at the arg
+ * with their count, and the in and out sizes of the first send.
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static const uint8_t none[1];
+    size_t in_size, out_size, count;
+    uint16_t op;
+    int cmd;
+
+    if (!fuzz_codec.ioctls)
+        fuzz_setup();
+
+    memset(fuzz_client, 0, sizeof(fuzz_client));
+
+    for (int i = 0; i < FUZZ_MAX_OPS && size; i++) {
+        op = fuzz_take(&data, &size, 2);
+        if ((op & FUZZ_OP_CMD) < ARRAY_SIZE(fuzz_ioctls))
+            cmd = fuzz_ioctls[op & FUZZ_OP_CMD].cmd;
+        else
+            cmd = fuzz_take(&data, &size, 4);
+
+        count = fuzz_take(&data, &size, 2);
+        count = min(count, size);
+        memcpy(fuzz_client, size ? data : none, count);
+        data += count;
+        size -= count;
+
+        in_size = fuzz_take(&data, &size, 2);
+        out_size = fuzz_take(&data, &size, 2);
+
+        fuzz_request(cmd, op, in_size, out_size);
+    }
+
+    return 0;
+}
+
+#ifndef MPPV4L2_LIBFUZZER
+
+static size_t fuzz_seed_op(uint8_t *seed, size_t pos, uint16_t op, int cmd, const void *arg,
+        uint16_t count, uint16_t in_size, uint16_t out_size) {
+    memcpy(seed + pos, &op, sizeof(op));
+    pos += sizeof(op);
+    if ((op & FUZZ_OP_CMD) >= ARRAY_SIZE(fuzz_ioctls)) {
+        memcpy(seed + pos, &cmd, sizeof(cmd));
+        pos += sizeof(cmd);
+    }
+
+    memcpy(seed + pos, &count, sizeof(count));
+    pos += sizeof(count);
+    memcpy(seed + pos, arg, count);
+    pos += count;
+
+    memcpy(seed + pos, &in_size, sizeof(in_size));
+    pos += sizeof(in_size);
+    memcpy(seed + pos, &out_size, sizeof(out_size));
+    return pos + sizeof(out_size);
+}
+
+/* The op of a cmd of the harness */
+static uint16_t fuzz_seed_cmd(int cmd) {
+    for (unsigned int i = 0; i < ARRAY_SIZE(fuzz_ioctls); i++) {
+        if (fuzz_ioctls[i].cmd == cmd)
+            return i;
+    }
+
+    abort();
+}
+
+/* Requests down every path of the dispatch, to mutate from */
+static size_t fuzz_seed(uint8_t *seed) {
+    const uint16_t argsize = sizeof(struct fuzz_arg);
+    struct fuzz_arg arg = {
+        .num_reads = 3,
+        .write = 1,
+        .regions = {
+            { FUZZ_CLIENT_BASE + 4096, 100 },
+            { FUZZ_CLIENT_BASE + 8192, 1000 },
+            { FUZZ_CLIENT_BASE, argsize },
+            { FUZZ_CLIENT_BASE + 16384, 16 },
+        },
+    };
+    struct fuzz_arg failing = { .err = EBUSY };
+    struct fuzz_arg no_errno = { .err = 134 };
+    struct fuzz_arg enum_arg = { .index = 1 };
+    size_t pos = 0;
+
+    /* As the kernel sends them, the arg asked for with a retry */
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_IN), 0, &failing, argsize, 0, 0);
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_IN), 0, &no_errno, argsize, 0, 0);
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_OUT), 0, &arg, 0, 0, 0);
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_NONE), 0, &arg, 0, 0, 0);
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_BIG), 0, &arg, 0, 0, 0);
+
+    /* Client reads, through ptrace and through retries, more than they can bring */
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_INOUT), 0, &arg, argsize, 0, 0);
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_INOUT) | FUZZ_OP_DENIED, 0, &arg,
+            argsize, 0, 0);
+    arg.num_reads = CUSE_CLIENT_MAX_IOV + 1;
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_INOUT) | FUZZ_OP_DENIED, 0, &arg,
+            argsize, 0, 0);
+    arg.num_reads = 3;
+
+    /* Parked, completed after or interrupted */
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_PARK), 0, &arg, argsize, 0, 0);
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_PARK) | FUZZ_OP_INTERRUPT, 0, &arg,
+            argsize, argsize, argsize);
+
+    /* Answered ahead, or not for an index that isn't known */
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_QUERY), 0, &arg, 0, 0, 0);
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_ENUM), 0, &enum_arg, argsize, 0, 0);
+    enum_arg.index = FUZZ_ENUM_REPLIES - 1;
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_ENUM), 0, &enum_arg, argsize, 0, 0);
+    enum_arg.index = FUZZ_ENUM_REPLIES;
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_ENUM), 0, &enum_arg, argsize,
+            argsize, argsize);
+
+    /* Buffers short of the arg, 32 bit clients, opens gone, unknown cmds */
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_INOUT), 0, &arg, argsize,
+            argsize - 1, argsize);
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_IN) | FUZZ_OP_COMPAT, 0, &arg,
+            0, 0, 0);
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_IN) | FUZZ_OP_NO_OPEN, 0, &arg,
+            0, 0, 0);
+    pos = fuzz_seed_op(seed, pos, fuzz_seed_cmd(FUZZ_IOC_IN) | FUZZ_OP_LOST, 0, &arg,
+            0, 0, 0);
+    pos = fuzz_seed_op(seed, pos, ARRAY_SIZE(fuzz_ioctls), _IOWR('F', 9, struct fuzz_arg),
+            &arg, 0, 0, 0);
+    pos = fuzz_seed_op(seed, pos, ARRAY_SIZE(fuzz_ioctls), VIDIOC_QUERYCAP, &arg, 0, 0, 0);
+
+    return pos;
+}
+
+static int fuzz_file(const char *path) {
+    static uint8_t input[1 << 20];
+    size_t size;
+    FILE *file;
+
+    file = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+
+    size = fread(input, 1, sizeof(input), file);
+    if (file != stdin)
+        fclose(file);
+
+    LLVMFuzzerTestOneInput(input, size);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static uint8_t seed[1 << 16], input[1 << 16];
+    size_t size;
+    int ret = 0;
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++)
+            ret |= fuzz_file(argv[i]);
+        return ret;
+    }
+
+    size = fuzz_seed(seed);
+    LLVMFuzzerTestOneInput(seed, size);
+
+    /* Same runs every time, a failure shows up again */
+    srand(1);
+    for (int run = 0; run < FUZZ_SMOKE_RUNS; run++) {
+        memcpy(input, seed, size);
+        for (int flips = rand() % 16 + 1; flips; flips--)
+            input[rand() % size] ^= 1 << (rand() % 8);
+
+        LLVMFuzzerTestOneInput(input, size);
+    }
+
+    return 0;
+}
+
+#endif /* MPPV4L2_LIBFUZZER */
@@ -0,0 +1,291 @@
+/*
+ * fuzz_ioctl.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Fuzzes the decoder's ioctl callbacks through the library on the mock mpp.
+ * An input is a run of ioctls on a fresh session, each an op byte picking
+ * the ioctl from the decoder's table and the bytes of its argument struct.
+ * The pointers and fds in the structs are pointed at memory and fds of the
+ * harness, the daemon reads those through the kernel and fails cleanly on
+ * bad ones, while the library takes them as the caller's own.
+ *
+ * Built with -fsanitize=fuzzer and MPPV4L2_LIBFUZZER it's a libFuzzer
+ * target. Otherwise it runs the files given, as AFL does with @@, or with
+ * no arguments a seed session and mutations of it, as a smoke test.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "libmppv4l2.h"
+#include "mppdec.h"
+#include "mppv4l2_ring.h"
+
+/* Ioctls of one input, a session doesn't get anywhere new after that */
+#define FUZZ_MAX_OPS        64
+
+/* Planes and controls an argument may point at */
+#define FUZZ_MAX_PLANES     VIDEO_MAX_PLANES
+#define FUZZ_MAX_CTRLS      16
+
+/* Memory the pointers of the structs point into */
+#define FUZZ_CLIENT_SIZE    (64 << 10)
+
+/* Mutated runs of the seed without arguments */
+#define FUZZ_SMOKE_RUNS     200
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static struct v4l2_plane fuzz_planes[FUZZ_MAX_PLANES];
+static struct v4l2_ext_control fuzz_ctrls[FUZZ_MAX_CTRLS];
+static uint8_t fuzz_client[FUZZ_CLIENT_SIZE];
+static int fuzz_memfd = -1, fuzz_eventfd = -1;
+
+/* Keep the memory a plane or a userptr buffer points at in fuzz_client */
+static void fuzz_fix_memory(uint32_t memory, unsigned long *userptr, int32_t *fd,
+        uint32_t *length, uint32_t *bytesused, uint32_t *data_offset) {
+    if (memory == V4L2_MEMORY_USERPTR)
+        *userptr = (unsigned long) fuzz_client;
+    else if (memory == V4L2_MEMORY_DMABUF)
+        *fd = fuzz_memfd;
+
+    *length %= FUZZ_CLIENT_SIZE + 1;
+    if (data_offset)
+        *data_offset %= FUZZ_CLIENT_SIZE;
+    if (bytesused)
+        *bytesused %= FUZZ_CLIENT_SIZE - (data_offset ? *data_offset : 0) + 1;
+}
+
+static void fuzz_fix_buffer(struct v4l2_buffer *buffer, const uint8_t *planes, size_t size) {
+    if (!V4L2_TYPE_IS_MULTIPLANAR(buffer->type)) {
+        fuzz_fix_memory(buffer->memory, &buffer->m.userptr, &buffer->m.fd, &buffer->length,
+                &buffer->bytesused, NULL);
+        return;
+    }
+
+    /* The planes come from the input too, after the struct */
+    memset(fuzz_planes, 0, sizeof(fuzz_planes));
+    memcpy(fuzz_planes, planes, size < sizeof(fuzz_planes) ? size : sizeof(fuzz_planes));
+
+    buffer->length %= FUZZ_MAX_PLANES + 1;
+    buffer->m.planes = fuzz_planes;
+    for (int i = 0; i < FUZZ_MAX_PLANES; i++)
+        fuzz_fix_memory(buffer->memory, &fuzz_planes[i].m.userptr, &fuzz_planes[i].m.fd,
+                &fuzz_planes[i].length, &fuzz_planes[i].bytesused,
+                &fuzz_planes[i].data_offset);
+}
+
+static void fuzz_fix_ctrls(struct v4l2_ext_controls *ctrls, const uint8_t *data, size_t size) {
+    memset(fuzz_ctrls, 0, sizeof(fuzz_ctrls));
+    memcpy(fuzz_ctrls, data, size < sizeof(fuzz_ctrls) ? size : sizeof(fuzz_ctrls));
+
+    ctrls->count %= FUZZ_MAX_CTRLS + 1;
+    ctrls->controls = fuzz_ctrls;
+    for (int i = 0; i < FUZZ_MAX_CTRLS; i++) {
+        fuzz_ctrls[i].size %= FUZZ_CLIENT_SIZE + 1;
+        fuzz_ctrls[i].ptr = fuzz_client;
+    }
+}
+
+/* Input bytes after the struct of cmd for what it points at */
+static size_t fuzz_arg_extra(unsigned long cmd) {
+    switch (cmd) {
+    case VIDIOC_QUERYBUF:
+    case VIDIOC_QBUF:
+    case VIDIOC_DQBUF:
+        return sizeof(fuzz_planes);
+    case VIDIOC_G_EXT_CTRLS:
+    case VIDIOC_S_EXT_CTRLS:
+    case VIDIOC_TRY_EXT_CTRLS:
+        return sizeof(fuzz_ctrls);
+    default:
+        return 0;
+    }
+}
+
+/* Point what the struct of cmd points at to the harness */
+static void fuzz_fix_arg(unsigned long cmd, void *arg, const uint8_t *data, size_t size) {
+    struct mppv4l2_ring_setup *setup = arg;
+
+    switch (cmd) {
+    case VIDIOC_QUERYBUF:
+    case VIDIOC_QBUF:
+    case VIDIOC_DQBUF:
+        fuzz_fix_buffer(arg, data, size);
+        break;
+    case VIDIOC_G_EXT_CTRLS:
+    case VIDIOC_S_EXT_CTRLS:
+    case VIDIOC_TRY_EXT_CTRLS:
+        fuzz_fix_ctrls(arg, data, size);
+        break;
+    case VIDIOC_MPPV4L2_RING:
+        if (setup->memfd >= 0) {
+            setup->memfd = fuzz_memfd;
+            setup->eventfd = fuzz_eventfd;
+        }
+        break;
+    }
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    const int num_ioctls = rkmpp_dec_codec.num_ioctls;
+    uint8_t arg[1024] __attribute__((aligned(8)));
+    struct v4l2_exportbuffer *expbuf = (void *) arg;
+    struct mppv4l2 *dev;
+    unsigned long cmd;
+    size_t argsize, taken;
+
+    if (fuzz_memfd < 0) {
+        fuzz_memfd = memfd_create("fuzz_ioctl", MFD_CLOEXEC);
+        fuzz_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fuzz_memfd < 0 || fuzz_eventfd < 0 || ftruncate(fuzz_memfd, FUZZ_CLIENT_SIZE))
+            abort();
+    }
+
+    dev = mppv4l2_open(NULL, O_NONBLOCK);
+    if (!dev)
+        return 0;
+
+    for (int op = 0; op < FUZZ_MAX_OPS && size; op++) {
+        cmd = (unsigned int) rkmpp_dec_codec.ioctls[*data % num_ioctls].cmd;
+        data++;
+        size--;
+
+        argsize = _IOC_SIZE(cmd);
+        if (argsize > sizeof(arg))
+            continue;
+
+        memset(arg, 0, argsize);
+        memcpy(arg, data, size < argsize ? size : argsize);
+        data += size < argsize ? size : argsize;
+        size -= size < argsize ? size : argsize;
+
+        fuzz_fix_arg(cmd, arg, data, size);
+        taken = fuzz_arg_extra(cmd);
+        data += size < taken ? size : taken;
+        size -= size < taken ? size : taken;
+
+        if (!mppv4l2_ioctl(dev, cmd, arg) && cmd == VIDIOC_EXPBUF)
+            close(expbuf->fd);
+
+        mppv4l2_poll(dev);
+    }
+
+    mppv4l2_close(dev);
+    return 0;
+}
+
+#ifndef MPPV4L2_LIBFUZZER
+
+static size_t fuzz_seed_op(uint8_t *seed, size_t pos, unsigned long cmd, const void *arg,
+        const void *extra, size_t extra_size) {
+    for (int i = 0; i < rkmpp_dec_codec.num_ioctls; i++) {
+        if ((unsigned int) rkmpp_dec_codec.ioctls[i].cmd != cmd)
+            continue;
+
+        seed[pos++] = i;
+        memcpy(seed + pos, arg, _IOC_SIZE(cmd));
+        pos += _IOC_SIZE(cmd);
+        if (extra)
+            memcpy(seed + pos, extra, extra_size);
+        return pos + fuzz_arg_extra(cmd);
+    }
+
+    return pos;
+}
+
+/* A session that gets to decoding, to mutate from */
+static size_t fuzz_seed(uint8_t *seed) {
+    struct v4l2_format fmt = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .fmt.pix_mp = {
+            .width = 1920,
+            .height = 1080,
+            .pixelformat = V4L2_PIX_FMT_H264,
+            .num_planes = 1,
+            .plane_fmt[0].sizeimage = 1 << 20,
+        },
+    };
+    struct v4l2_requestbuffers reqbufs = {
+        .count = 2,
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_USERPTR,
+    };
+    struct v4l2_buffer buffer = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_USERPTR,
+        .length = 1,
+    };
+    struct v4l2_plane plane = { .bytesused = 64, .length = 4096 };
+    struct v4l2_ext_controls ctrls = { .count = 0 };
+    int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    size_t pos = 0;
+
+    pos = fuzz_seed_op(seed, pos, VIDIOC_S_FMT, &fmt, NULL, 0);
+    pos = fuzz_seed_op(seed, pos, VIDIOC_REQBUFS, &reqbufs, NULL, 0);
+    pos = fuzz_seed_op(seed, pos, VIDIOC_STREAMON, &type, NULL, 0);
+    pos = fuzz_seed_op(seed, pos, VIDIOC_QBUF, &buffer, &plane, sizeof(plane));
+    pos = fuzz_seed_op(seed, pos, VIDIOC_DQBUF, &buffer, &plane, sizeof(plane));
+    pos = fuzz_seed_op(seed, pos, VIDIOC_G_EXT_CTRLS, &ctrls, NULL, 0);
+    pos = fuzz_seed_op(seed, pos, VIDIOC_STREAMOFF, &type, NULL, 0);
+
+    return pos;
+}
+
+static int fuzz_file(const char *path) {
+    static uint8_t input[1 << 20];
+    size_t size;
+    FILE *file;
+
+    file = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+
+    size = fread(input, 1, sizeof(input), file);
+    if (file != stdin)
+        fclose(file);
+
+    LLVMFuzzerTestOneInput(input, size);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static uint8_t seed[1 << 16], input[1 << 16];
+    size_t size;
+    int ret = 0;
+
+    if (argc > 1) {
+        for (int i = 1; i < argc; i++)
+            ret |= fuzz_file(argv[i]);
+        return ret;
+    }
+
+    size = fuzz_seed(seed);
+    LLVMFuzzerTestOneInput(seed, size);
+
+    /* Same runs every time, a failure shows up again */
+    srand(1);
+    for (int run = 0; run < FUZZ_SMOKE_RUNS; run++) {
+        memcpy(input, seed, size);
+        for (int flips = rand() % 16 + 1; flips; flips--)
+            input[rand() % size] ^= 1 << (rand() % 8);
+
+        LLVMFuzzerTestOneInput(input, size);
+    }
+
+    return 0;
+}
+
+#endif /* MPPV4L2_LIBFUZZER */
@@ -0,0 +1,699 @@
+/*
+ * mock_mpp.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * The part of the mpp api the library uses, in memory.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <rockchip/rk_mpi.h>
+
+#include "mock_mpp.h"
+
+/* Packets kept for the test, the first ones are enough */
+#define MOCK_MPP_PACKETS    64
+
+/* Packets an mpp takes before it has decoded them, more are BUFFER_FULL */
+#define MOCK_MPP_INPUT      16
+
+/**
+ * struct mock_buffer - A buffer, kept by its group when unreferenced
+ * @refs:       References, all of them the group's when 0.
+ * @group:      Group it's in, NULL for one freed at its last put.
+ * @next:       Next buffer of the group.
+ */
+struct mock_buffer {
+    int refs;
+    int fd;
+    int index;
+    void *ptr;
+    size_t size;
+    struct mock_group *group;
+    struct mock_buffer *next;
+};
+
+struct mock_group {
+    struct mock_buffer *buffers;
+};
+
+struct mock_packet {
+    void *data;
+    size_t length;
+    RK_S64 pts;
+    RK_U32 eos;
+};
+
+struct mock_frame {
+    RK_U32 width, height, hor_stride, ver_stride;
+    MppFrameFormat fmt;
+    RK_S64 pts;
+    RK_U32 eos;
+    RK_U32 info_change;
+    MppBuffer buffer;
+};
+
+/* A packet taken and not decoded yet */
+struct mock_input {
+    RK_S64 pts;
+    bool data;
+    bool eos;
+};
+
+/**
+ * struct mock_ctx - An mpp
+ * @group:      Its external group, where frames are decoded into.
+ * @info_sent:  The info change frame came out.
+ * @info_ready: The decoder said it has buffers for it.
+ * @input:      Packets not decoded yet, from input_tail to input_head.
+ */
+struct mock_ctx {
+    struct mock_group *group;
+    bool info_sent;
+    bool info_ready;
+    struct mock_input input[MOCK_MPP_INPUT];
+    unsigned int input_head;
+    unsigned int input_tail;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct mock_packet packets[MOCK_MPP_PACKETS];
+    unsigned int num_packets;
+    RK_U32 width;
+    RK_U32 height;
+    unsigned int fail_puts;
+} mock = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* Something to point at for the handles nothing looks into */
+static int mock_handle;
+
+size_t mock_mpp_packet(unsigned int index, uint8_t *buf, size_t size, int timeout_ms) {
+    struct timespec deadline;
+    size_t length = 0;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += timeout_ms % 1000 * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&mock.mutex);
+    while (index >= mock.num_packets && index < MOCK_MPP_PACKETS) {
+        if (pthread_cond_timedwait(&mock.cond, &mock.mutex, &deadline) == ETIMEDOUT)
+            break;
+    }
+
+    if (index < mock.num_packets) {
+        length = mock.packets[index].length;
+        memcpy(buf, mock.packets[index].data, length < size ? length : size);
+    }
+    pthread_mutex_unlock(&mock.mutex);
+
+    return length;
+}
+
+void mock_mpp_decode(uint32_t width, uint32_t height) {
+    pthread_mutex_lock(&mock.mutex);
+    mock.width = width;
+    mock.height = height;
+    pthread_mutex_unlock(&mock.mutex);
+}
+
+unsigned int mock_mpp_fail_puts(unsigned int count) {
+    unsigned int left;
+
+    pthread_mutex_lock(&mock.mutex);
+    left = mock.fail_puts;
+    mock.fail_puts = count;
+    pthread_mutex_unlock(&mock.mutex);
+
+    return left;
+}
+
+static MPP_RET mock_decode_put_packet(MppCtx ctx, MppPacket packet) {
+    struct mock_ctx *c = ctx;
+    struct mock_packet *p = packet;
+    struct mock_input *input;
+    void *data = malloc(p->length);
+
+    if (!data)
+        return MPP_ERR_MALLOC;
+    memcpy(data, p->data, p->length);
+
+    pthread_mutex_lock(&mock.mutex);
+    if (mock.fail_puts || (mock.width && c->input_head - c->input_tail >= MOCK_MPP_INPUT)) {
+        if (mock.fail_puts)
+            mock.fail_puts--;
+        pthread_mutex_unlock(&mock.mutex);
+        free(data);
+        return MPP_ERR_BUFFER_FULL;
+    }
+
+    if (mock.num_packets < MOCK_MPP_PACKETS) {
+        mock.packets[mock.num_packets] = *p;
+        mock.packets[mock.num_packets++].data = data;
+        data = NULL;
+    }
+
+    if (mock.width) {
+        input = &c->input[c->input_head++ % MOCK_MPP_INPUT];
+        input->pts = p->pts;
+        input->data = p->length;
+        input->eos = p->eos;
+    }
+    pthread_cond_broadcast(&mock.cond);
+    pthread_mutex_unlock(&mock.mutex);
+
+    free(data);
+    return MPP_OK;
+}
+
+static struct mock_frame *mock_frame_alloc(void) {
+    struct mock_frame *f = calloc(1, sizeof(*f));
+
+    if (!f)
+        return NULL;
+
+    f->width = mock.width;
+    f->height = mock.height;
+    f->hor_stride = (mock.width + 15) & ~15;
+    f->ver_stride = (mock.height + 15) & ~15;
+    f->fmt = MPP_FMT_YUV420SP;
+    return f;
+}
+
+/* An unused buffer of the group big enough for a frame, referenced */
+static struct mock_buffer *mock_group_take(struct mock_group *group, size_t size) {
+    struct mock_buffer *b;
+
+    for (b = group ? group->buffers : NULL; b; b = b->next) {
+        if (!b->refs && b->size >= size) {
+            b->refs = 1;
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Without a frame size the vpu never finishes, like one given nothing it can
+ * decode. With one, the first packet brings an info change, and once the
+ * decoder is ready each packet a frame in a buffer of the external group
+ * with its pts in the first bytes, an eos one an eos frame after it.
+ */
+static MPP_RET mock_decode_get_frame(MppCtx ctx, MppFrame *frame) {
+    struct mock_ctx *c = ctx;
+    struct mock_input *input;
+    struct mock_frame *f = NULL;
+    struct mock_buffer *b;
+
+    *frame = NULL;
+
+    pthread_mutex_lock(&mock.mutex);
+    while (c->input_head != c->input_tail) {
+        input = &c->input[c->input_tail % MOCK_MPP_INPUT];
+
+        if (!c->info_sent) {
+            f = mock_frame_alloc();
+            if (f) {
+                f->info_change = 1;
+                c->info_sent = true;
+            }
+            break;
+        }
+
+        if (!c->info_ready)
+            break;
+
+        if (input->data) {
+            b = mock_group_take(c->group, mock.width * mock.height * 3 / 2);
+            if (!b)
+                break;
+
+            f = mock_frame_alloc();
+            if (!f) {
+                b->refs = 0;
+                break;
+            }
+
+            f->pts = input->pts;
+            f->buffer = b;
+            memcpy(b->ptr, &input->pts, sizeof(input->pts));
+            input->data = false;
+        } else if (input->eos) {
+            f = mock_frame_alloc();
+            if (f)
+                f->eos = 1;
+            input->eos = false;
+        }
+
+        if (!input->data && !input->eos)
+            c->input_tail++;
+        if (f)
+            break;
+    }
+    pthread_mutex_unlock(&mock.mutex);
+
+    if (!f) {
+        usleep(2000);
+        return MPP_ERR_TIMEOUT;
+    }
+
+    *frame = f;
+    return MPP_OK;
+}
+
+static MPP_RET mock_encode_put_frame(MppCtx ctx, MppFrame frame) {
+    return MPP_OK;
+}
+
+static MPP_RET mock_encode_get_packet(MppCtx ctx, MppPacket *packet) {
+    *packet = NULL;
+    return MPP_ERR_TIMEOUT;
+}
+
+/* Packets not decoded yet go, the stream info stays */
+static MPP_RET mock_reset(MppCtx ctx) {
+    struct mock_ctx *c = ctx;
+
+    pthread_mutex_lock(&mock.mutex);
+    c->input_tail = c->input_head;
+    pthread_mutex_unlock(&mock.mutex);
+    return MPP_OK;
+}
+
+static MPP_RET mock_control(MppCtx ctx, MpiCmd cmd, MppParam param) {
+    struct mock_ctx *c = ctx;
+
+    pthread_mutex_lock(&mock.mutex);
+    if (cmd == MPP_DEC_SET_EXT_BUF_GROUP)
+        c->group = param;
+    else if (cmd == MPP_DEC_SET_INFO_CHANGE_READY)
+        c->info_ready = true;
+    pthread_mutex_unlock(&mock.mutex);
+    return MPP_OK;
+}
+
+static MppApi mock_api = {
+    .size = sizeof(MppApi),
+    .decode_put_packet = mock_decode_put_packet,
+    .decode_get_frame = mock_decode_get_frame,
+    .encode_put_frame = mock_encode_put_frame,
+    .encode_get_packet = mock_encode_get_packet,
+    .reset = mock_reset,
+    .control = mock_control,
+};
+
+MPP_RET mpp_create(MppCtx *ctx, MppApi **mpi) {
+    *ctx = calloc(1, sizeof(struct mock_ctx));
+    *mpi = &mock_api;
+    return *ctx ? MPP_OK : MPP_ERR_MALLOC;
+}
+
+MPP_RET mpp_init(MppCtx ctx, MppCtxType type, MppCodingType coding) {
+    return MPP_OK;
+}
+
+MPP_RET mpp_destroy(MppCtx ctx) {
+    free(ctx);
+    return MPP_OK;
+}
+
+MPP_RET mpp_check_support_format(MppCtxType type, MppCodingType coding) {
+    return MPP_OK;
+}
+
+MPP_RET mpp_packet_init(MppPacket *packet, void *data, size_t size) {
+    struct mock_packet *p = calloc(1, sizeof(*p));
+
+    if (!p)
+        return MPP_ERR_MALLOC;
+
+    p->data = data;
+    p->length = size;
+    *packet = p;
+    return MPP_OK;
+}
+
+MPP_RET mpp_packet_init_with_buffer(MppPacket *packet, MppBuffer buffer) {
+    struct mock_buffer *b = buffer;
+
+    return mpp_packet_init(packet, b->ptr, b->size);
+}
+
+MPP_RET mpp_packet_deinit(MppPacket *packet) {
+    free(*packet);
+    *packet = NULL;
+    return MPP_OK;
+}
+
+void mpp_packet_set_pts(MppPacket packet, RK_S64 pts) {
+    ((struct mock_packet *) packet)->pts = pts;
+}
+
+MPP_RET mpp_packet_set_eos(MppPacket packet) {
+    ((struct mock_packet *) packet)->eos = 1;
+    return MPP_OK;
+}
+
+size_t mpp_packet_get_length(const MppPacket packet) {
+    return ((struct mock_packet *) packet)->length;
+}
+
+void mpp_packet_set_length(MppPacket packet, size_t size) {
+    ((struct mock_packet *) packet)->length = size;
+}
+
+MppMeta mpp_packet_get_meta(const MppPacket packet) {
+    return NULL;
+}
+
+MPP_RET mpp_frame_init(MppFrame *frame) {
+    *frame = calloc(1, sizeof(struct mock_frame));
+    return *frame ? MPP_OK : MPP_ERR_MALLOC;
+}
+
+/* A frame holds a reference on its buffer, as in mpp */
+MPP_RET mpp_frame_deinit(MppFrame *frame) {
+    struct mock_frame *f = *frame;
+
+    if (f->buffer)
+        mpp_buffer_put(f->buffer);
+    free(f);
+    *frame = NULL;
+    return MPP_OK;
+}
+
+#define MOCK_FRAME_FIELD(type, field) \
+    type mpp_frame_get_##field(const MppFrame frame) { \
+        return ((struct mock_frame *) frame)->field; \
+    } \
+    void mpp_frame_set_##field(MppFrame frame, type field) { \
+        ((struct mock_frame *) frame)->field = field; \
+    }
+
+MOCK_FRAME_FIELD(RK_U32, width)
+MOCK_FRAME_FIELD(RK_U32, height)
+MOCK_FRAME_FIELD(RK_U32, hor_stride)
+MOCK_FRAME_FIELD(RK_U32, ver_stride)
+MOCK_FRAME_FIELD(RK_S64, pts)
+MOCK_FRAME_FIELD(MppFrameFormat, fmt)
+
+MppBuffer mpp_frame_get_buffer(MppFrame frame) {
+    return ((struct mock_frame *) frame)->buffer;
+}
+
+void mpp_frame_set_buffer(MppFrame frame, MppBuffer buffer) {
+    struct mock_frame *f = frame;
+
+    if (buffer)
+        mpp_buffer_inc_ref(buffer);
+    if (f->buffer)
+        mpp_buffer_put(f->buffer);
+    f->buffer = buffer;
+}
+
+RK_U32 mpp_frame_get_eos(const MppFrame frame) {
+    return ((struct mock_frame *) frame)->eos;
+}
+
+RK_U32 mpp_frame_get_mode(const MppFrame frame) {
+    return MPP_FRAME_FLAG_FRAME;
+}
+
+RK_U32 mpp_frame_get_discard(const MppFrame frame) {
+    return 0;
+}
+
+RK_U32 mpp_frame_get_errinfo(const MppFrame frame) {
+    return 0;
+}
+
+RK_U32 mpp_frame_get_info_change(const MppFrame frame) {
+    return ((struct mock_frame *) frame)->info_change;
+}
+
+size_t mpp_frame_get_buf_size(const MppFrame frame) {
+    struct mock_frame *f = frame;
+
+    return f->hor_stride * f->ver_stride * 3 / 2;
+}
+
+MppFrameColorRange mpp_frame_get_color_range(const MppFrame frame) {
+    return MPP_FRAME_RANGE_UNSPECIFIED;
+}
+
+MppFrameColorPrimaries mpp_frame_get_color_primaries(const MppFrame frame) {
+    return MPP_FRAME_PRI_UNSPECIFIED;
+}
+
+MppFrameColorTransferCharacteristic mpp_frame_get_color_trc(const MppFrame frame) {
+    return MPP_FRAME_TRC_UNSPECIFIED;
+}
+
+MppFrameColorSpace mpp_frame_get_colorspace(const MppFrame frame) {
+    return MPP_FRAME_SPC_UNSPECIFIED;
+}
+
+MppFrameMasteringDisplayMetadata mpp_frame_get_mastering_display(const MppFrame frame) {
+    return (MppFrameMasteringDisplayMetadata) { 0 };
+}
+
+MppFrameContentLightMetadata mpp_frame_get_content_light(const MppFrame frame) {
+    return (MppFrameContentLightMetadata) { 0 };
+}
+
+MppMeta mpp_frame_get_meta(const MppFrame frame) {
+    return NULL;
+}
+
+MPP_RET mpp_meta_set_packet(MppMeta meta, MppMetaKey key, MppPacket packet) {
+    return MPP_NOK;
+}
+
+MPP_RET mpp_meta_get_s32(MppMeta meta, MppMetaKey key, RK_S32 *val) {
+    return MPP_NOK;
+}
+
+/* A memfd stands in for the dma-buf, so the fd can be mapped and passed on */
+static struct mock_buffer *mock_buffer_alloc(size_t size, int fd) {
+    struct mock_buffer *b = calloc(1, sizeof(*b));
+
+    if (!b)
+        return NULL;
+
+    b->refs = 1;
+    b->size = size;
+    b->fd = fd >= 0 ? dup(fd) : memfd_create("mock-mpp", MFD_CLOEXEC);
+    if (b->fd < 0 || (fd < 0 && ftruncate(b->fd, size) < 0))
+        goto err;
+
+    b->ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, b->fd, 0);
+    if (b->ptr == MAP_FAILED)
+        goto err;
+
+    return b;
+err:
+    if (b->fd >= 0)
+        close(b->fd);
+    free(b);
+    return NULL;
+}
+
+static void mock_buffer_free(struct mock_buffer *b) {
+    munmap(b->ptr, b->size);
+    close(b->fd);
+    free(b);
+}
+
+/* Called with the mutex held */
+static void mock_group_add(struct mock_group *group, struct mock_buffer *b) {
+    b->group = group;
+    b->next = group->buffers;
+    group->buffers = b;
+}
+
+/* An unused buffer of the size is reused, as mpp's internal groups do */
+MPP_RET mpp_buffer_get_with_tag(MppBufferGroup group, MppBuffer *buffer, size_t size,
+        const char *tag, const char *caller) {
+    struct mock_group *g = group;
+    struct mock_buffer *b;
+
+    pthread_mutex_lock(&mock.mutex);
+    for (b = g ? g->buffers : NULL; b; b = b->next) {
+        if (!b->refs && b->size == size) {
+            b->refs = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mock.mutex);
+
+    if (!b) {
+        b = mock_buffer_alloc(size, -1);
+        if (!b)
+            return MPP_ERR_MALLOC;
+
+        if (g) {
+            pthread_mutex_lock(&mock.mutex);
+            mock_group_add(g, b);
+            pthread_mutex_unlock(&mock.mutex);
+        }
+    }
+
+    *buffer = b;
+    return MPP_OK;
+}
+
+MPP_RET mpp_buffer_import_with_tag(MppBufferGroup group, MppBufferInfo *info,
+        MppBuffer *buffer, const char *tag, const char *caller) {
+    struct mock_buffer *b = mock_buffer_alloc(info->size, info->fd);
+
+    if (!b)
+        return MPP_ERR_VALUE;
+
+    b->index = info->index;
+
+    pthread_mutex_lock(&mock.mutex);
+    if (group)
+        mock_group_add(group, b);
+
+    /* Committed to a group, mpp keeps it */
+    if (buffer)
+        *buffer = b;
+    else
+        b->refs = 0;
+    pthread_mutex_unlock(&mock.mutex);
+
+    return MPP_OK;
+}
+
+#ifndef mpp_buffer_commit
+MPP_RET mpp_buffer_commit(MppBufferGroup group, MppBufferInfo *info) {
+    return mpp_buffer_import_with_tag(group, info, NULL, NULL, __func__);
+}
+#endif
+
+/* One in a group stays there unused, one out of any is freed */
+MPP_RET mpp_buffer_put_with_caller(MppBuffer buffer, const char *caller) {
+    struct mock_buffer *b = buffer;
+    bool gone;
+
+    pthread_mutex_lock(&mock.mutex);
+    gone = !--b->refs && !b->group;
+    pthread_mutex_unlock(&mock.mutex);
+
+    if (gone)
+        mock_buffer_free(b);
+    return MPP_OK;
+}
+
+MPP_RET mpp_buffer_inc_ref_with_caller(MppBuffer buffer, const char *caller) {
+    pthread_mutex_lock(&mock.mutex);
+    ((struct mock_buffer *) buffer)->refs++;
+    pthread_mutex_unlock(&mock.mutex);
+    return MPP_OK;
+}
+
+void *mpp_buffer_get_ptr_with_caller(MppBuffer buffer, const char *caller) {
+    return ((struct mock_buffer *) buffer)->ptr;
+}
+
+int mpp_buffer_get_fd_with_caller(MppBuffer buffer, const char *caller) {
+    return ((struct mock_buffer *) buffer)->fd;
+}
+
+size_t mpp_buffer_get_size_with_caller(MppBuffer buffer, const char *caller) {
+    return ((struct mock_buffer *) buffer)->size;
+}
+
+int mpp_buffer_get_index_with_caller(MppBuffer buffer, const char *caller) {
+    return ((struct mock_buffer *) buffer)->index;
+}
+
+MPP_RET mpp_buffer_sync_begin_f(MppBuffer buffer, RK_S32 ro, const char *caller) {
+    return MPP_OK;
+}
+
+MPP_RET mpp_buffer_sync_end_f(MppBuffer buffer, RK_S32 ro, const char *caller) {
+    return MPP_OK;
+}
+
+MPP_RET mpp_buffer_group_get(MppBufferGroup *group, MppBufferType type,
+        MppBufferMode mode, const char *tag, const char *caller) {
+    *group = calloc(1, sizeof(struct mock_group));
+    return *group ? MPP_OK : MPP_ERR_MALLOC;
+}
+
+/* Unused buffers are freed, used ones leave the group to go at their last put */
+MPP_RET mpp_buffer_group_clear(MppBufferGroup group) {
+    struct mock_group *g = group;
+    struct mock_buffer *b, *unused = NULL;
+
+    pthread_mutex_lock(&mock.mutex);
+    while ((b = g->buffers)) {
+        g->buffers = b->next;
+        b->group = NULL;
+        if (!b->refs) {
+            b->next = unused;
+            unused = b;
+        }
+    }
+    pthread_mutex_unlock(&mock.mutex);
+
+    while ((b = unused)) {
+        unused = b->next;
+        mock_buffer_free(b);
+    }
+    return MPP_OK;
+}
+
+MPP_RET mpp_buffer_group_put(MppBufferGroup group) {
+    mpp_buffer_group_clear(group);
+    free(group);
+    return MPP_OK;
+}
+
+MPP_RET mpp_buffer_group_limit_config(MppBufferGroup group, size_t size, RK_S32 count) {
+    return MPP_OK;
+}
+
+MPP_RET mpp_dec_cfg_init(MppDecCfg *cfg) {
+    *cfg = &mock_handle;
+    return MPP_OK;
+}
+
+MPP_RET mpp_dec_cfg_deinit(MppDecCfg cfg) {
+    return MPP_OK;
+}
+
+MPP_RET mpp_dec_cfg_set_s32(MppDecCfg cfg, const char *name, RK_S32 val) {
+    return MPP_OK;
+}
+
+MPP_RET mpp_enc_cfg_init(MppEncCfg *cfg) {
+    *cfg = &mock_handle;
+    return MPP_OK;
+}
+
+MPP_RET mpp_enc_cfg_deinit(MppEncCfg cfg) {
+    return MPP_OK;
+}
+
+MPP_RET mpp_enc_cfg_set_s32(MppEncCfg cfg, const char *name, RK_S32 val) {
+    return MPP_OK;
+}
@@ -0,0 +1,39 @@
+/*
+ * mock_mpp.h
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * An mpp with no vpu behind it, for running the decoder in process. Buffers
+ * are memfds and packets are kept as they were put. No frame ever comes,
+ * unless the test gives mpp a frame size to decode every packet into.
+ */
+
+#ifndef TESTS_MOCK_MPP_H_
+#define TESTS_MOCK_MPP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Copy the index-th packet put to any mpp into buf, waiting up to timeout_ms
+ * for it. Returns its size, which may be more than size, or 0 when it
+ * didn't come.
+ */
+size_t mock_mpp_packet(unsigned int index, uint8_t *buf, size_t size, int timeout_ms);
+
+/*
+ * Decode every packet into a width x height frame from then on, after an
+ * info change for the size. The frame is in a buffer of the external group
+ * given to mpp, with the pts of the packet in its first bytes. 0x0, the
+ * default, decodes nothing.
+ */
+void mock_mpp_decode(uint32_t width, uint32_t height);
+
+/*
+ * Refuse the next count packets put to any mpp with MPP_ERR_BUFFER_FULL.
+ * Returns how many of the last count were still to be refused.
+ */
+unsigned int mock_mpp_fail_puts(unsigned int count);
+
+#endif /* TESTS_MOCK_MPP_H_ */
@@ -0,0 +1,364 @@
+/*
+ * stress_sessions.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Sessions on the mock mpp opened and closed over and over, several at a
+ * time, each with threads racing QBUF, blocking DQBUF, STREAMOFF/STREAMON
+ * and poll on both queues against its decoder thread, which decodes every
+ * packet into a capture buffer. Meant to run under ThreadSanitizer,
+ * meson setup -Db_sanitize=thread, where a race or a lock order inversion
+ * fails it. Without, it catches deadlocks and ioctls failing the wrong way.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "libmppv4l2.h"
+#include "mock_mpp.h"
+#include "utils.h"
+
+/* Sessions at a time, and the rounds each opens and closes one */
+#define STRESS_SESSIONS     4
+#define STRESS_ROUNDS       8
+
+/* Output buffers of a session and the QBUFs a round makes */
+#define STRESS_BUFFERS      4
+#define STRESS_QBUFS        200
+
+/* Frame size the mock decodes into, and the capture buffers of a session */
+#define STRESS_WIDTH        320
+#define STRESS_HEIGHT       240
+#define STRESS_CAPTURES     6
+
+static const uint8_t stress_packet[] = { 0, 0, 0, 1, 0x65, 0x88, 0x80, 0x40 };
+
+/**
+ * struct stress_round - One session and the threads racing on it
+ * @dev:        The session.
+ * @done:       The queuer made its QBUFs, the others wind down.
+ * @dequeued:   Buffers the dequeuer got back.
+ * @captured:   Frames the capturer got back.
+ * @capture_ready:  The capturer set the capture queue up, the capture
+ *              toggler may start.
+ * @capture_size:   Size of a capture buffer.
+ * @failed:     An ioctl failed with an errno the race doesn't explain.
+ */
+struct stress_round {
+    struct mppv4l2 *dev;
+    bool done;
+    unsigned int dequeued;
+    unsigned int captured;
+    bool capture_ready;
+    uint32_t capture_size;
+    bool failed;
+};
+
+static int stress_ioctl(struct stress_round *round, unsigned long request, void *arg,
+        const char *name) {
+    if (!mppv4l2_ioctl(round->dev, request, arg))
+        return 0;
+
+    /* A queue the toggler stopped, or a buffer that isn't where it's asked for */
+    if (errno == EINVAL || errno == EAGAIN || errno == EBUSY)
+        return -1;
+
+    fprintf(stderr, "%s: %s\n", name, strerror(errno));
+    __atomic_store_n(&round->failed, true, __ATOMIC_RELAXED);
+    return -1;
+}
+
+#define STRESS_IOCTL(round, request, arg) stress_ioctl(round, request, arg, #request)
+
+static bool stress_done(struct stress_round *round) {
+    return __atomic_load_n(&round->done, __ATOMIC_ACQUIRE);
+}
+
+static void *stress_queuer(void *data) {
+    struct stress_round *round = data;
+    struct v4l2_plane plane;
+    struct v4l2_buffer buffer;
+
+    for (unsigned int i = 0; i < STRESS_QBUFS; i++) {
+        plane = (struct v4l2_plane) {
+            .bytesused = sizeof(stress_packet),
+            .length = sizeof(stress_packet),
+            .m.userptr = (unsigned long) stress_packet,
+        };
+        buffer = (struct v4l2_buffer) {
+            .index = i % STRESS_BUFFERS,
+            .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+            .memory = V4L2_MEMORY_USERPTR,
+            .timestamp.tv_usec = i,
+            .length = 1,
+            .m.planes = &plane,
+        };
+
+        if (STRESS_IOCTL(round, VIDIOC_QBUF, &buffer) < 0)
+            sched_yield();
+    }
+
+    __atomic_store_n(&round->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *stress_dequeuer(void *data) {
+    struct stress_round *round = data;
+    struct v4l2_plane plane;
+    struct v4l2_buffer buffer;
+
+    while (!stress_done(round)) {
+        buffer = (struct v4l2_buffer) {
+            .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+            .memory = V4L2_MEMORY_USERPTR,
+            .length = 1,
+            .m.planes = &plane,
+        };
+
+        /* Blocks until a packet went to mpp or the toggler stops the queue */
+        if (!STRESS_IOCTL(round, VIDIOC_DQBUF, &buffer))
+            round->dequeued++;
+        else
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+static void *stress_toggler(void *data) {
+    struct stress_round *round = data;
+    int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+
+    while (!stress_done(round)) {
+        STRESS_IOCTL(round, VIDIOC_STREAMOFF, &type);
+        sched_yield();
+        STRESS_IOCTL(round, VIDIOC_STREAMON, &type);
+        for (int i = 0; i < 8; i++)
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+static int stress_queue_capture(struct stress_round *round, uint32_t index) {
+    struct v4l2_plane plane = { .length = round->capture_size };
+    struct v4l2_buffer buffer = {
+        .index = index,
+        .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+        .memory = V4L2_MEMORY_MMAP,
+        .length = 1,
+        .m.planes = &plane,
+    };
+
+    return STRESS_IOCTL(round, VIDIOC_QBUF, &buffer);
+}
+
+/* Mmap capture buffers once the info change is in, all queued and streaming */
+static int stress_setup_capture(struct stress_round *round) {
+    struct v4l2_format fmt = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE };
+    struct v4l2_requestbuffers reqbufs = {
+        .count = STRESS_CAPTURES,
+        .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+        .memory = V4L2_MEMORY_MMAP,
+    };
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+    if (STRESS_IOCTL(round, VIDIOC_G_FMT, &fmt) < 0 ||
+            fmt.fmt.pix_mp.width != STRESS_WIDTH ||
+            STRESS_IOCTL(round, VIDIOC_REQBUFS, &reqbufs) < 0)
+        return -1;
+
+    round->capture_size = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+    for (uint32_t i = 0; i < reqbufs.count; i++)
+        stress_queue_capture(round, i);
+
+    return STRESS_IOCTL(round, VIDIOC_STREAMON, &type);
+}
+
+/* Takes decoded frames and hands their buffers straight back */
+static void *stress_capturer(void *data) {
+    struct stress_round *round = data;
+    struct v4l2_plane plane;
+    struct v4l2_buffer buffer;
+
+    while (!stress_done(round) && stress_setup_capture(round) < 0)
+        sched_yield();
+    __atomic_store_n(&round->capture_ready, true, __ATOMIC_RELEASE);
+
+    while (!stress_done(round)) {
+        buffer = (struct v4l2_buffer) {
+            .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+            .memory = V4L2_MEMORY_MMAP,
+            .length = 1,
+            .m.planes = &plane,
+        };
+
+        /* Blocks until a frame came or the capture toggler stops the queue */
+        if (STRESS_IOCTL(round, VIDIOC_DQBUF, &buffer) < 0) {
+            sched_yield();
+            continue;
+        }
+
+        round->captured++;
+        stress_queue_capture(round, buffer.index);
+    }
+
+    return NULL;
+}
+
+/* Stops the capture queue under the decoder, then queues all buffers again */
+static void *stress_capture_toggler(void *data) {
+    struct stress_round *round = data;
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+
+    while (!stress_done(round)) {
+        if (!__atomic_load_n(&round->capture_ready, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+            continue;
+        }
+
+        STRESS_IOCTL(round, VIDIOC_STREAMOFF, &type);
+        sched_yield();
+        STRESS_IOCTL(round, VIDIOC_STREAMON, &type);
+        for (uint32_t i = 0; i < STRESS_CAPTURES; i++)
+            stress_queue_capture(round, i);
+        for (int i = 0; i < 16; i++)
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+static void *stress_poller(void *data) {
+    struct stress_round *round = data;
+
+    while (!stress_done(round)) {
+        mppv4l2_poll(round->dev);
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+static int stress_setup(struct stress_round *round) {
+    struct v4l2_format fmt = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .fmt.pix_mp = {
+            .width = 1920,
+            .height = 1080,
+            .pixelformat = V4L2_PIX_FMT_H264,
+            .num_planes = 1,
+            .plane_fmt[0].sizeimage = 1 << 20,
+        },
+    };
+    struct v4l2_requestbuffers reqbufs = {
+        .count = STRESS_BUFFERS,
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_USERPTR,
+    };
+    int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+
+    if (STRESS_IOCTL(round, VIDIOC_S_FMT, &fmt) < 0 ||
+            STRESS_IOCTL(round, VIDIOC_REQBUFS, &reqbufs) < 0 ||
+            STRESS_IOCTL(round, VIDIOC_STREAMON, &type) < 0) {
+        fprintf(stderr, "session setup failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Rounds of one session slot, each a session closed with its decoder running */
+static void *stress_session(void *data) {
+    void *(*const fns[])(void *) = {
+        stress_queuer, stress_dequeuer, stress_capturer, stress_toggler,
+        stress_capture_toggler, stress_poller,
+    };
+    int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    int capture_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    pthread_t threads[ARRAY_SIZE(fns)];
+    unsigned int *counts = data;
+    struct stress_round round;
+    intptr_t failed = 0;
+
+    for (int i = 0; i < STRESS_ROUNDS && !failed; i++) {
+        memset(&round, 0, sizeof(round));
+        round.dev = mppv4l2_open(NULL, 0);
+        if (!round.dev) {
+            fprintf(stderr, "mppv4l2_open: %s\n", strerror(errno));
+            return (void *) 1;
+        }
+
+        if (stress_setup(&round) < 0) {
+            mppv4l2_close(round.dev);
+            return (void *) 1;
+        }
+
+        for (unsigned int t = 0; t < ARRAY_SIZE(fns); t++)
+            pthread_create(&threads[t], NULL, fns[t], &round);
+
+        pthread_join(threads[0], NULL);
+
+        /* Releases the dequeuers blocked after the queuer was done */
+        while (pthread_tryjoin_np(threads[1], NULL) == EBUSY) {
+            STRESS_IOCTL(&round, VIDIOC_STREAMOFF, &type);
+            sched_yield();
+        }
+        while (pthread_tryjoin_np(threads[2], NULL) == EBUSY) {
+            STRESS_IOCTL(&round, VIDIOC_STREAMOFF, &capture_type);
+            sched_yield();
+        }
+
+        for (unsigned int t = 3; t < ARRAY_SIZE(fns); t++)
+            pthread_join(threads[t], NULL);
+
+        /* Every other round closes a streaming session */
+        if (i % 2)
+            STRESS_IOCTL(&round, VIDIOC_STREAMON, &type);
+
+        mppv4l2_close(round.dev);
+
+        counts[0] += round.dequeued;
+        counts[1] += round.captured;
+        failed = round.failed;
+    }
+
+    return (void *) failed;
+}
+
+int main(void) {
+    unsigned int counts[STRESS_SESSIONS][2] = { { 0 } }, dequeued = 0, captured = 0;
+    pthread_t threads[STRESS_SESSIONS];
+    void *failed;
+    int ret = 0;
+
+    mock_mpp_decode(STRESS_WIDTH, STRESS_HEIGHT);
+
+    for (int i = 0; i < STRESS_SESSIONS; i++)
+        pthread_create(&threads[i], NULL, stress_session, counts[i]);
+
+    for (int i = 0; i < STRESS_SESSIONS; i++) {
+        pthread_join(threads[i], &failed);
+        ret |= failed != NULL;
+        dequeued += counts[i][0];
+        captured += counts[i][1];
+    }
+
+    /* Packets and frames went through, or the races were never run */
+    if (!dequeued || !captured) {
+        fprintf(stderr, "no %s was ever dequeued\n", dequeued ? "frame" : "buffer");
+        ret = 1;
+    }
+
+    printf("%u buffers and %u frames dequeued\n", dequeued, captured);
+    return ret;
+}
@@ -0,0 +1,134 @@
+/*
+ * test_bitstream.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Packet inspection of hand made annex-b packets, and the stateless H.264
+ * parameter sets read back by the parser.
+ */
+#include <stdio.h>
+
+#include "bitstream.h"
+#include "utils.h"
+
+/**
+ * struct bs_case - A packet and what inspecting it says
+ * @name:       What the packet is.
+ * @type:       Coding type.
+ * @data:       Packet.
+ * @size:       Size of data.
+ * @flags:      Expected rkmpp_bs_flag mask.
+ */
+struct bs_case {
+    const char *name;
+    MppCodingType type;
+    const uint8_t *data;
+    size_t size;
+    uint32_t flags;
+};
+
+#define BS_CASE(name, type, flags, ...) \
+    { name, type, (const uint8_t []) { __VA_ARGS__ }, \
+      sizeof((const uint8_t []) { __VA_ARGS__ }), flags }
+
+static const struct bs_case inspect_cases[] = {
+    BS_CASE("h264 idr", MPP_VIDEO_CodingAVC, RKMPP_BS_KEYFRAME,
+            0, 0, 1, 0x65, 0x88, 0x80),
+    BS_CASE("h264 p", MPP_VIDEO_CodingAVC, 0,
+            0, 0, 1, 0x61, 0xc0, 0x80),
+    BS_CASE("h264 non-ref p", MPP_VIDEO_CodingAVC, RKMPP_BS_NONREF,
+            0, 0, 1, 0x01, 0xc0, 0x80),
+    /* slice_type 7, every slice of the picture is I */
+    BS_CASE("h264 all i", MPP_VIDEO_CodingAVC, RKMPP_BS_KEYFRAME,
+            0, 0, 1, 0x61, 0x88, 0x80),
+    BS_CASE("h264 i slices", MPP_VIDEO_CodingAVC, RKMPP_BS_KEYFRAME,
+            0, 0, 1, 0x61, 0xb0, 0x80,
+            0, 0, 1, 0x61, 0x16, 0xc0, 0x80),
+    BS_CASE("h264 i and p slices", MPP_VIDEO_CodingAVC, 0,
+            0, 0, 1, 0x61, 0xb0, 0x80,
+            0, 0, 1, 0x61, 0x17, 0x80),
+    BS_CASE("h264 recovery point", MPP_VIDEO_CodingAVC, RKMPP_BS_KEYFRAME,
+            0, 0, 1, 0x06, 0x06, 0x01, 0x84, 0x80,
+            0, 0, 1, 0x61, 0xb0, 0x80,
+            0, 0, 1, 0x61, 0x17, 0x80),
+    BS_CASE("h264 sps only", MPP_VIDEO_CodingAVC, RKMPP_BS_KEYFRAME,
+            0, 0, 1, 0x67, 0x42, 0x00, 0x1e),
+    BS_CASE("hevc cra", MPP_VIDEO_CodingHEVC, RKMPP_BS_KEYFRAME,
+            0, 0, 1, 0x2a, 0x01, 0xaf),
+    /* Nothing tells the sub-layers yet */
+    BS_CASE("hevc trail_n before sps", MPP_VIDEO_CodingHEVC, 0,
+            0, 0, 1, 0x00, 0x01, 0xaf),
+    /* sps_max_sub_layers_minus1 2 */
+    BS_CASE("hevc sps", MPP_VIDEO_CodingHEVC, RKMPP_BS_KEYFRAME,
+            0, 0, 1, 0x42, 0x01, 0x05, 0xff),
+    BS_CASE("hevc trail_n of a lower sub-layer", MPP_VIDEO_CodingHEVC, 0,
+            0, 0, 1, 0x00, 0x02, 0xaf),
+    BS_CASE("hevc trail_n of the highest sub-layer", MPP_VIDEO_CodingHEVC, RKMPP_BS_NONREF,
+            0, 0, 1, 0x00, 0x03, 0xaf),
+    BS_CASE("hevc trail_r", MPP_VIDEO_CodingHEVC, 0,
+            0, 0, 1, 0x02, 0x03, 0xaf),
+    BS_CASE("vp8 keyframe", MPP_VIDEO_CodingVP8, RKMPP_BS_KEYFRAME,
+            0x10, 0x02, 0x00, 0x9d, 0x01, 0x2a),
+    BS_CASE("vp8 interframe", MPP_VIDEO_CodingVP8, 0,
+            0x31, 0x02, 0x00),
+};
+
+/* 1080p main profile in constraint_set1, what a stateless client sends */
+static int check_h264_headers(void) {
+    const struct v4l2_ctrl_h264_sps sps = {
+        .profile_idc = 77,
+        .constraint_set_flags = V4L2_H264_SPS_CONSTRAINT_SET1_FLAG,
+        .level_idc = 40,
+        .chroma_format_idc = 1,
+        .max_num_ref_frames = 4,
+        .pic_width_in_mbs_minus1 = 119,
+        .pic_height_in_map_units_minus1 = 67,
+        .flags = V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY |
+                V4L2_H264_SPS_FLAG_DIRECT_8X8_INFERENCE,
+    };
+    const struct v4l2_ctrl_h264_pps pps = { 0 };
+    const struct v4l2_ctrl_h264_scaling_matrix scaling = { 0 };
+    uint8_t buf[RKMPP_BS_H264_HEADERS_MAX];
+    uint32_t dpb;
+    size_t size;
+
+    size = rkmpp_bs_write_h264_headers(buf, sizeof(buf), &sps, &pps, &scaling, 1920, 1080);
+    if (size < 8 || buf[4] != 0x67) {
+        fprintf(stderr, "h264 headers: no sps in %zu bytes\n", size);
+        return 1;
+    }
+
+    /* profile_idc, then constraint_set0_flag in the top bit */
+    if (buf[5] != 77 || buf[6] != 0x40 || buf[7] != 40) {
+        fprintf(stderr, "h264 headers: sps starts %02x %02x %02x\n", buf[5], buf[6], buf[7]);
+        return 1;
+    }
+
+    /* Level 4 fits 4 frames of 8160 macroblocks */
+    dpb = rkmpp_bs_dpb_size(MPP_VIDEO_CodingAVC, buf, size);
+    if (dpb != 4) {
+        fprintf(stderr, "h264 headers: dpb %u, not 4\n", dpb);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(void) {
+    struct rkmpp_bs_stream stream = { 0 };
+    int ret = check_h264_headers();
+
+    /* In order, the stream state carries over */
+    for (unsigned i = 0; i < ARRAY_SIZE(inspect_cases); i++) {
+        const struct bs_case *c = &inspect_cases[i];
+        uint32_t flags = rkmpp_bs_inspect(&stream, c->type, c->data, c->size);
+
+        if (flags != c->flags) {
+            fprintf(stderr, "%s: flags 0x%x, not 0x%x\n", c->name, flags, c->flags);
+            ret = 1;
+        }
+    }
+
+    return ret;
+}
@@ -0,0 +1,158 @@
+/*
+ * test_client.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Fds of a client taken for a request from each of its threads, as the
+ * daemon takes dma-bufs and the ring's fds, and the flags of its opens of a
+ * device, which a request doesn't carry. The client is this process.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cusedev.h"
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__, #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+/**
+ * struct client_thread - A thread of the client, parked until the test is done
+ * @tid:        Its thread id, what a request carries.
+ * @ready:      The tid is there.
+ * @done:       The thread may exit.
+ */
+struct client_thread {
+    pid_t tid;
+    bool ready;
+    bool done;
+};
+
+static pthread_mutex_t client_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t client_cond = PTHREAD_COND_INITIALIZER;
+
+static void *client_thread_fn(void *data) {
+    struct client_thread *thread = data;
+
+    pthread_mutex_lock(&client_mutex);
+    thread->tid = gettid();
+    thread->ready = true;
+    pthread_cond_broadcast(&client_cond);
+    while (!thread->done)
+        pthread_cond_wait(&client_cond, &client_mutex);
+    pthread_mutex_unlock(&client_mutex);
+
+    return NULL;
+}
+
+/* Both fds are the same open file */
+static int same_file(int a, int b) {
+    struct stat sa, sb;
+
+    return !fstat(a, &sa) && !fstat(b, &sb) && sa.st_dev == sb.st_dev &&
+            sa.st_ino == sb.st_ino;
+}
+
+/* The fd of a request from tid, a thread of this process */
+static int check_fd_of(pid_t tid, int memfd) {
+    int fd;
+
+    cuse_set_client(tid);
+    CHECK(cuse_get_client_tgid() == getpid());
+
+    fd = cuse_get_client_fd(memfd);
+    cuse_set_client(0);
+
+    CHECK(fd >= 0 && fd != memfd);
+    CHECK(same_file(fd, memfd));
+    close(fd);
+    return 0;
+}
+
+/* Opens of /dev/zero, the flags of one changed after it */
+static int check_flags_of(pid_t tid) {
+    int a, b, flags;
+
+    a = open("/dev/zero", O_RDWR | O_CLOEXEC);
+    b = open("/dev/zero", O_RDWR);
+    CHECK(a >= 0 && b >= 0);
+
+    cuse_set_client(tid);
+    flags = cuse_get_client_flags("/dev/zero");
+    CHECK(flags >= 0 && (flags & O_ACCMODE) == O_RDWR && !(flags & O_NONBLOCK));
+
+    /* Opens that differ can't be told apart */
+    CHECK(!fcntl(a, F_SETFL, O_NONBLOCK));
+    CHECK(cuse_get_client_flags("/dev/zero") < 0 && errno == EEXIST);
+
+    CHECK(!fcntl(b, F_SETFL, O_NONBLOCK));
+    flags = cuse_get_client_flags("/dev/zero");
+    CHECK(flags >= 0 && (flags & O_NONBLOCK));
+
+    CHECK(cuse_get_client_flags("/dev/test_client") < 0 && errno == ENOENT);
+    cuse_set_client(0);
+
+    close(a);
+    close(b);
+    return 0;
+}
+
+int main(void) {
+    struct client_thread thread = { 0 };
+    pthread_t handle;
+    int memfd, ret = 0;
+
+    memfd = memfd_create("test_client", MFD_CLOEXEC);
+    if (memfd < 0) {
+        perror("memfd_create");
+        return 1;
+    }
+
+    if (pthread_create(&handle, NULL, client_thread_fn, &thread)) {
+        fprintf(stderr, "failed to start the client thread\n");
+        return 1;
+    }
+
+    pthread_mutex_lock(&client_mutex);
+    while (!thread.ready)
+        pthread_cond_wait(&client_cond, &client_mutex);
+    pthread_mutex_unlock(&client_mutex);
+
+    /* The main thread, whose tid is the pid, and one that isn't */
+    ret |= check_fd_of(getpid(), memfd);
+    ret |= check_fd_of(thread.tid, memfd);
+
+    /* In process, the fd is just duplicated */
+    ret |= check_fd_of(0, memfd);
+
+    ret |= check_flags_of(thread.tid);
+    ret |= check_flags_of(0);
+
+    pthread_mutex_lock(&client_mutex);
+    thread.done = true;
+    pthread_cond_broadcast(&client_cond);
+    pthread_mutex_unlock(&client_mutex);
+    pthread_join(handle, NULL);
+
+    /* A client gone before its request was served */
+    cuse_set_client(thread.tid);
+    if (cuse_get_client_fd(memfd) >= 0 || cuse_get_client_tgid() >= 0) {
+        fprintf(stderr, "fd of a client thread that exited\n");
+        ret = 1;
+    }
+    cuse_set_client(0);
+
+    close(memfd);
+    return ret;
+}
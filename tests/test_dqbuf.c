@@ -0,0 +1,153 @@
+/*
+ * test_dqbuf.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * DQBUF with nothing to dequeue through the library on the mock mpp: a
+ * blocked one fails with EINVAL when its queue is stopped, and one on a
+ * file made O_NONBLOCK after the open fails with EAGAIN right away.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#include "libmppv4l2.h"
+
+#define TEST_BUFFERS    4
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__, #cond); \
+            return -1; \
+        } \
+    } while (0)
+
+/**
+ * struct dqbuf_thread - A DQBUF of the output queue on a thread of its own
+ * @dev:        Session it's on.
+ * @ret:        What the ioctl returned.
+ * @err:        Its errno.
+ * @done:       It returned.
+ */
+struct dqbuf_thread {
+    struct mppv4l2 *dev;
+    int ret;
+    int err;
+    bool done;
+};
+
+static int output_dqbuf(struct mppv4l2 *dev) {
+    struct v4l2_plane plane = { 0 };
+    struct v4l2_buffer buffer = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_USERPTR,
+        .length = 1,
+        .m.planes = &plane,
+    };
+
+    return mppv4l2_ioctl(dev, VIDIOC_DQBUF, &buffer);
+}
+
+static void *dqbuf_thread_fn(void *data) {
+    struct dqbuf_thread *thread = data;
+
+    thread->ret = output_dqbuf(thread->dev);
+    thread->err = errno;
+    __atomic_store_n(&thread->done, true, __ATOMIC_RELEASE);
+
+    return NULL;
+}
+
+static int stream(struct mppv4l2 *dev, bool on) {
+    int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+
+    return mppv4l2_ioctl(dev, on ? VIDIOC_STREAMON : VIDIOC_STREAMOFF, &type);
+}
+
+/* Nothing was queued, so the DQBUF waits until STREAMOFF stops it */
+static int test_streamoff(struct mppv4l2 *dev) {
+    struct dqbuf_thread thread = { .dev = dev };
+    pthread_t handle;
+
+    CHECK(!stream(dev, true));
+    CHECK(!pthread_create(&handle, NULL, dqbuf_thread_fn, &thread));
+
+    usleep(50000);
+    if (__atomic_load_n(&thread.done, __ATOMIC_ACQUIRE)) {
+        pthread_join(handle, NULL);
+        fprintf(stderr, "dqbuf didn't wait: %s\n", strerror(thread.err));
+        return -1;
+    }
+
+    CHECK(!stream(dev, false));
+    pthread_join(handle, NULL);
+
+    CHECK(thread.ret < 0 && thread.err == EINVAL);
+    return 0;
+}
+
+/* Set on a dup, as a client of the preload gets, the session has it too */
+static int test_nonblock(struct mppv4l2 *dev) {
+    int fd = fcntl(mppv4l2_fd(dev), F_DUPFD_CLOEXEC, 0);
+    int flags = fcntl(fd, F_GETFL);
+
+    CHECK(fd >= 0 && flags >= 0 && !(flags & O_NONBLOCK));
+    CHECK(!fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+
+    CHECK(!stream(dev, true));
+    CHECK(output_dqbuf(dev) < 0 && errno == EAGAIN);
+    CHECK(!(mppv4l2_poll(dev) & POLLIN));
+    CHECK(!stream(dev, false));
+
+    /* And waits again once it's cleared */
+    CHECK(!fcntl(fd, F_SETFL, flags));
+    close(fd);
+    return test_streamoff(dev);
+}
+
+int main(void) {
+    struct v4l2_format fmt = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .fmt.pix_mp = {
+            .width = 320,
+            .height = 240,
+            .pixelformat = V4L2_PIX_FMT_H264,
+            .num_planes = 1,
+            .plane_fmt[0].sizeimage = 1 << 16,
+        },
+    };
+    struct v4l2_requestbuffers reqbufs = {
+        .count = TEST_BUFFERS,
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_USERPTR,
+    };
+    struct mppv4l2 *dev;
+    int ret = 1;
+
+    dev = mppv4l2_open("H.264", 0);
+    if (!dev) {
+        fprintf(stderr, "mppv4l2_open: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (mppv4l2_ioctl(dev, VIDIOC_S_FMT, &fmt) < 0 ||
+            mppv4l2_ioctl(dev, VIDIOC_REQBUFS, &reqbufs) < 0) {
+        fprintf(stderr, "output setup: %s\n", strerror(errno));
+        goto out;
+    }
+
+    if (!test_streamoff(dev) && !test_nonblock(dev))
+        ret = 0;
+out:
+    mppv4l2_close(dev);
+    return ret;
+}
@@ -0,0 +1,256 @@
+/*
+ * test_handoff.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * The handoff state written and read back, its pieces, its fds and the trip
+ * over a socket pair, with more fds than one message carries, and the
+ * version a layout of other struct sizes makes it refused with.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "handoff.h"
+
+int app_log_level;
+
+/* Past the fds of one message, so they go in batches */
+#define TEST_NUM_FDS    260
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__, #cond); \
+            return 1; \
+        } \
+    } while (0)
+
+/* Both fds are the same open file */
+static int same_file(int a, int b) {
+    struct stat sa, sb;
+
+    return !fstat(a, &sa) && !fstat(b, &sb) && sa.st_dev == sb.st_dev &&
+            sa.st_ino == sb.st_ino;
+}
+
+static int check_put_get(void) {
+    struct cuse_state state;
+    char name[32] = "video0-mpp-dec";
+    uint64_t fh = 0x1234, got_fh;
+    char got_name[32];
+    uint8_t byte;
+
+    cuse_state_init(&state);
+    cuse_state_put(&state, name, sizeof(name));
+    cuse_state_put(&state, &fh, sizeof(fh));
+    CHECK(!state.error && state.len == sizeof(name) + sizeof(fh));
+
+    CHECK(cuse_state_get(&state, got_name, sizeof(got_name)));
+    CHECK(!strcmp(got_name, name));
+    CHECK(cuse_state_get(&state, &got_fh, sizeof(got_fh)) && got_fh == fh);
+
+    /* Past the end fails, and so does everything after */
+    CHECK(!cuse_state_get(&state, &byte, 1) && state.error);
+    state.pos = 0;
+    CHECK(!cuse_state_get(&state, got_name, sizeof(got_name)));
+
+    cuse_state_free(&state);
+    CHECK(!state.data && !state.len && !state.error);
+    return 0;
+}
+
+static int check_fds(void) {
+    struct cuse_state state;
+    int32_t slot = 3;
+    int fds[2], fd;
+
+    CHECK(!pipe(fds));
+
+    cuse_state_init(&state);
+    cuse_state_put_fd(&state, fds[0]);
+    cuse_state_put_fd(&state, -1);
+    cuse_state_put_fd(&state, fds[1]);
+    CHECK(!state.error && state.num_fds == 2);
+
+    /* The state holds copies, the originals go */
+    close(fds[0]);
+    close(fds[1]);
+
+    fd = cuse_state_get_fd(&state);
+    CHECK(fd >= 0 && fd != state.fds[0] && state.fds[0] == -1);
+    CHECK(fcntl(fd, F_GETFD) & FD_CLOEXEC);
+    close(fd);
+
+    CHECK(cuse_state_get_fd(&state) == -1 && !state.error);
+
+    /* The one nobody took is closed with the state */
+    fd = state.fds[1];
+    cuse_state_free(&state);
+    CHECK(fcntl(fd, F_GETFD) < 0 && errno == EBADF);
+
+    /* A slot the state has no fd of */
+    cuse_state_init(&state);
+    cuse_state_put(&state, &slot, sizeof(slot));
+    CHECK(cuse_state_get_fd(&state) == -1 && state.error);
+    cuse_state_free(&state);
+    return 0;
+}
+
+static int check_sub_states(void) {
+    struct cuse_state state, sub, got;
+    uint32_t a = 1, b = 2, value;
+    uint64_t len = 1 << 20;
+    int fds[2], fd;
+
+    CHECK(!pipe(fds));
+
+    cuse_state_init(&state);
+
+    cuse_state_init(&sub);
+    cuse_state_put(&sub, &a, sizeof(a));
+    cuse_state_put_fd(&sub, fds[0]);
+    cuse_state_put_state(&state, &sub);
+    cuse_state_free(&sub);
+
+    /* A piece that failed fails the state it goes in */
+    cuse_state_init(&sub);
+    sub.error = true;
+    cuse_state_put_state(&state, &sub);
+    CHECK(state.error);
+    cuse_state_free(&sub);
+    state.error = false;
+
+    cuse_state_init(&sub);
+    cuse_state_put(&sub, &b, sizeof(b));
+    cuse_state_put_state(&state, &sub);
+    cuse_state_free(&sub);
+    CHECK(!state.error);
+
+    CHECK(cuse_state_get_state(&state, &got));
+    CHECK(cuse_state_get(&got, &value, sizeof(value)) && value == a);
+    fd = cuse_state_get_fd(&got);
+    CHECK(fd >= 0 && same_file(fd, fds[0]));
+    close(fd);
+    cuse_state_free(&got);
+
+    CHECK(cuse_state_get_state(&state, &got));
+    CHECK(cuse_state_get(&got, &value, sizeof(value)) && value == b);
+    CHECK(!cuse_state_get(&got, &value, sizeof(value)));
+    cuse_state_free(&got);
+
+    CHECK(!cuse_state_get_state(&state, &got) && state.error);
+
+    /* A piece longer than what's left of the state */
+    cuse_state_free(&state);
+    cuse_state_init(&state);
+    cuse_state_put(&state, &len, sizeof(len));
+    CHECK(!cuse_state_get_state(&state, &got) && state.error && !got.data);
+
+    cuse_state_free(&state);
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
+
+static int check_socket(void) {
+    struct cuse_state state, got;
+    int pipes[TEST_NUM_FDS / 2][2];
+    uint32_t i, value;
+    int sv[2], fd, ret = 0;
+
+    CHECK(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv));
+
+    cuse_state_init(&state);
+    for (i = 0; i < TEST_NUM_FDS / 2; i++) {
+        CHECK(!pipe(pipes[i]));
+        cuse_state_put(&state, &i, sizeof(i));
+        cuse_state_put_fd(&state, pipes[i][0]);
+        cuse_state_put_fd(&state, pipes[i][1]);
+    }
+    CHECK(!state.error && state.num_fds == TEST_NUM_FDS);
+
+    CHECK(!cuse_state_send(sv[0], &state, CUSE_HANDOFF_VERSION));
+    cuse_state_free(&state);
+    CHECK(!cuse_state_recv(sv[1], &got, CUSE_HANDOFF_VERSION));
+    CHECK(got.num_fds == TEST_NUM_FDS);
+
+    for (i = 0; i < TEST_NUM_FDS / 2 && !ret; i++) {
+        CHECK(cuse_state_get(&got, &value, sizeof(value)) && value == i);
+        for (int end = 0; end < 2; end++) {
+            fd = cuse_state_get_fd(&got);
+            if (fd < 0 || !same_file(fd, pipes[i][end])) {
+                fprintf(stderr, "%s: fd %u of %d isn't its pipe\n", __func__, i, end);
+                ret = 1;
+            }
+            if (fd >= 0)
+                close(fd);
+        }
+    }
+    cuse_state_free(&got);
+
+    for (i = 0; i < TEST_NUM_FDS / 2; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+
+    /* Anything but a state is refused */
+    CHECK(write(sv[0], "not a state, just bytes", 24) == 24);
+    CHECK(cuse_state_recv(sv[1], &got, CUSE_HANDOFF_VERSION) < 0 && errno == EPROTO);
+
+    /* A state cut short by the other end */
+    close(sv[0]);
+    CHECK(cuse_state_recv(sv[1], &got, CUSE_HANDOFF_VERSION) < 0);
+    close(sv[1]);
+
+    return ret;
+}
+
+/* Any size of any struct changes the version, and a state of another is refused */
+static int check_version(void) {
+    const size_t sizes[] = { 24, 16, 136 };
+    const size_t grown[] = { 24, 16, 144 };
+    const size_t swapped[] = { 16, 24, 136 };
+    uint32_t version = cuse_handoff_version(CUSE_HANDOFF_VERSION, sizes, 3);
+    struct cuse_state state, got;
+    uint32_t value = 1;
+    int sv[2];
+
+    CHECK(version == cuse_handoff_version(CUSE_HANDOFF_VERSION, sizes, 3));
+    CHECK(version != cuse_handoff_version(CUSE_HANDOFF_VERSION, sizes, 2));
+    CHECK(version != cuse_handoff_version(CUSE_HANDOFF_VERSION, grown, 3));
+    CHECK(version != cuse_handoff_version(CUSE_HANDOFF_VERSION, swapped, 3));
+    CHECK(version != cuse_handoff_version(CUSE_HANDOFF_VERSION + 1, sizes, 3));
+
+    CHECK(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv));
+    cuse_state_init(&state);
+    cuse_state_put(&state, &value, sizeof(value));
+    CHECK(!cuse_state_send(sv[0], &state,
+            cuse_handoff_version(CUSE_HANDOFF_VERSION, grown, 3)));
+    cuse_state_free(&state);
+
+    CHECK(cuse_state_recv(sv[1], &got, version) < 0 && errno == EPROTO);
+    close(sv[0]);
+    close(sv[1]);
+
+    return 0;
+}
+
+int main(void) {
+    int ret = 0;
+
+    ret |= check_put_get();
+    ret |= check_fds();
+    ret |= check_sub_states();
+    ret |= check_socket();
+    ret |= check_version();
+
+    return ret;
+}
@@ -0,0 +1,296 @@
+/*
+ * test_ring.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * The shared completion ring through the library on the mock mpp: frames
+ * decoded into mmap capture buffers show up as done slots in the memfd, the
+ * eventfd wakes a client that said it sleeps, and buffers handed back
+ * through the queue slots are decoded into again without a QBUF.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include "libmppv4l2.h"
+#include "mppv4l2_ring.h"
+#include "mock_mpp.h"
+
+#define TEST_WIDTH      320
+#define TEST_HEIGHT     240
+
+/* More frames than capture buffers, so they go around the ring */
+#define TEST_FRAMES     24
+#define TEST_PACKETS    4
+#define TEST_CAPTURES   8
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__, #cond); \
+            return -1; \
+        } \
+    } while (0)
+
+static const uint8_t test_packet[] = { 0, 0, 0, 1, 0x65, 0x88, 0x80, 0x40 };
+
+static int test_ioctl(struct mppv4l2 *dev, unsigned long request, void *arg,
+        const char *name) {
+    if (mppv4l2_ioctl(dev, request, arg) < 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+#define TEST_IOCTL(dev, request, arg) test_ioctl(dev, request, arg, #request)
+
+/* Packet n, its timestamp n + 1 us, in an output buffer the decoder gave back */
+static int queue_packet(struct mppv4l2 *dev, unsigned int n) {
+    struct v4l2_plane plane;
+    struct v4l2_buffer buffer = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_USERPTR,
+        .length = 1,
+        .m.planes = &plane,
+    };
+
+    if (n >= TEST_PACKETS && TEST_IOCTL(dev, VIDIOC_DQBUF, &buffer) < 0)
+        return -1;
+
+    plane = (struct v4l2_plane) {
+        .bytesused = sizeof(test_packet),
+        .length = sizeof(test_packet),
+        .m.userptr = (unsigned long) test_packet,
+    };
+    buffer.index = n % TEST_PACKETS;
+    buffer.timestamp.tv_usec = n + 1;
+    return TEST_IOCTL(dev, VIDIOC_QBUF, &buffer);
+}
+
+static int setup_output(struct mppv4l2 *dev) {
+    struct v4l2_format fmt = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .fmt.pix_mp = {
+            .width = TEST_WIDTH,
+            .height = TEST_HEIGHT,
+            .pixelformat = V4L2_PIX_FMT_H264,
+            .num_planes = 1,
+            .plane_fmt[0].sizeimage = 1 << 16,
+        },
+    };
+    struct v4l2_requestbuffers reqbufs = {
+        .count = TEST_PACKETS,
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_USERPTR,
+    };
+    int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+
+    if (TEST_IOCTL(dev, VIDIOC_S_FMT, &fmt) < 0 ||
+            TEST_IOCTL(dev, VIDIOC_REQBUFS, &reqbufs) < 0 ||
+            TEST_IOCTL(dev, VIDIOC_STREAMON, &type) < 0)
+        return -1;
+
+    CHECK(reqbufs.count == TEST_PACKETS);
+    return 0;
+}
+
+/* The capture format once the info change of the first packet is in */
+static int wait_info_change(struct mppv4l2 *dev, struct v4l2_format *fmt) {
+    for (int i = 0; i < 2000; i++) {
+        *fmt = (struct v4l2_format) { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE };
+        if (TEST_IOCTL(dev, VIDIOC_G_FMT, fmt) < 0)
+            return -1;
+        if (fmt->fmt.pix_mp.width == TEST_WIDTH)
+            return 0;
+        usleep(1000);
+    }
+
+    fprintf(stderr, "no info change\n");
+    return -1;
+}
+
+/* Mmap capture buffers, all queued, mapped through their exported dma-bufs */
+static int setup_capture(struct mppv4l2 *dev, const struct v4l2_format *fmt,
+        uint8_t *maps[VIDEO_MAX_FRAME], unsigned int *count) {
+    struct v4l2_requestbuffers reqbufs = {
+        .count = TEST_CAPTURES,
+        .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+        .memory = V4L2_MEMORY_MMAP,
+    };
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    size_t size = fmt->fmt.pix_mp.plane_fmt[0].sizeimage;
+    struct v4l2_exportbuffer expbuf;
+    struct v4l2_plane plane;
+    struct v4l2_buffer buffer;
+
+    if (TEST_IOCTL(dev, VIDIOC_REQBUFS, &reqbufs) < 0)
+        return -1;
+
+    CHECK(reqbufs.count >= 1 && reqbufs.count <= VIDEO_MAX_FRAME);
+    *count = reqbufs.count;
+
+    for (unsigned int i = 0; i < *count; i++) {
+        expbuf = (struct v4l2_exportbuffer) {
+            .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+            .index = i,
+            .flags = O_CLOEXEC,
+        };
+        if (TEST_IOCTL(dev, VIDIOC_EXPBUF, &expbuf) < 0)
+            return -1;
+
+        maps[i] = mmap(NULL, size, PROT_READ, MAP_SHARED, expbuf.fd, 0);
+        close(expbuf.fd);
+        CHECK(maps[i] != MAP_FAILED);
+
+        plane = (struct v4l2_plane) { .length = size };
+        buffer = (struct v4l2_buffer) {
+            .index = i,
+            .type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+            .memory = V4L2_MEMORY_MMAP,
+            .length = 1,
+            .m.planes = &plane,
+        };
+        if (TEST_IOCTL(dev, VIDIOC_QBUF, &buffer) < 0)
+            return -1;
+    }
+
+    return TEST_IOCTL(dev, VIDIOC_STREAMON, &type);
+}
+
+/*
+ * The frame of packet n wakes the client asleep on the eventfd. Its buffer
+ * is handed back through the ring once checked.
+ */
+static int wait_frame(struct mppv4l2_ring *ring, int eventfd,
+        uint8_t *maps[VIDEO_MAX_FRAME], unsigned int count, unsigned int n) {
+    uint32_t tail = __atomic_load_n(&ring->done_tail, __ATOMIC_RELAXED);
+    uint32_t queued = __atomic_load_n(&ring->queue_head, __ATOMIC_RELAXED);
+    struct pollfd pfd = { .fd = eventfd, .events = POLLIN };
+    const struct mppv4l2_ring_done *done;
+    uint64_t value;
+    int64_t pts;
+
+    CHECK(poll(&pfd, 1, 2000) == 1);
+    CHECK(read(eventfd, &value, sizeof(value)) == sizeof(value) && value == 1);
+    CHECK(!__atomic_load_n(&ring->done_wait, __ATOMIC_SEQ_CST));
+    CHECK(__atomic_load_n(&ring->done_head, __ATOMIC_ACQUIRE) == tail + 1);
+
+    done = &ring->done[tail % ring->slots];
+    CHECK(done->index < count);
+    CHECK(done->timestamp == n + 1);
+    CHECK(done->bytesused >= TEST_WIDTH * TEST_HEIGHT * 3 / 2);
+    CHECK(!(done->flags & V4L2_BUF_FLAG_ERROR));
+
+    /* Decoded into the client's memory, not a copy of it */
+    memcpy(&pts, maps[done->index], sizeof(pts));
+    CHECK(pts == n + 1);
+
+    ring->queue[queued % ring->slots] = done->index;
+    __atomic_store_n(&ring->queue_head, queued + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->done_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/* The client goes to sleep with nothing done, then packet n goes in */
+static int decode_frame(struct mppv4l2 *dev, struct mppv4l2_ring *ring, int eventfd,
+        uint8_t *maps[VIDEO_MAX_FRAME], unsigned int count, unsigned int n) {
+    CHECK(__atomic_load_n(&ring->done_head, __ATOMIC_ACQUIRE) ==
+            __atomic_load_n(&ring->done_tail, __ATOMIC_RELAXED));
+    __atomic_store_n(&ring->done_wait, 1, __ATOMIC_SEQ_CST);
+
+    if (queue_packet(dev, n) < 0)
+        return -1;
+
+    return wait_frame(ring, eventfd, maps, count, n);
+}
+
+static int test_ring(struct mppv4l2 *dev, uint8_t *maps[VIDEO_MAX_FRAME]) {
+    struct mppv4l2_ring_setup setup = { .memfd = -1, .eventfd = -1 };
+    struct mppv4l2_ring *ring = MAP_FAILED;
+    struct v4l2_format fmt = { 0 };
+    unsigned int count = 0;
+    int ret = -1;
+
+    setup.memfd = memfd_create("test_ring", MFD_CLOEXEC);
+    setup.eventfd = eventfd(0, EFD_CLOEXEC);
+    if (setup.memfd < 0 || setup.eventfd < 0 ||
+            ftruncate(setup.memfd, sizeof(*ring)) < 0) {
+        perror("ring fds");
+        goto out;
+    }
+
+    if (setup_output(dev) < 0 || queue_packet(dev, 0) < 0 ||
+            wait_info_change(dev, &fmt) < 0)
+        goto out;
+
+    if (TEST_IOCTL(dev, VIDIOC_MPPV4L2_RING, &setup) < 0)
+        goto out;
+
+    ring = mmap(NULL, sizeof(*ring), PROT_READ | PROT_WRITE, MAP_SHARED, setup.memfd, 0);
+    if (ring == MAP_FAILED) {
+        perror("mmap ring");
+        goto out;
+    }
+
+    if (ring->magic != MPPV4L2_RING_MAGIC || ring->version != MPPV4L2_RING_VERSION ||
+            ring->slots != MPPV4L2_RING_SLOTS) {
+        fprintf(stderr, "ring header not set up\n");
+        goto out;
+    }
+
+    /* The first packet is decoded once there are buffers for its frame */
+    __atomic_store_n(&ring->done_wait, 1, __ATOMIC_SEQ_CST);
+    if (setup_capture(dev, &fmt, maps, &count) < 0 ||
+            wait_frame(ring, setup.eventfd, maps, count, 0) < 0)
+        goto out;
+
+    for (unsigned int n = 1; n < TEST_FRAMES; n++) {
+        if (decode_frame(dev, ring, setup.eventfd, maps, count, n) < 0) {
+            fprintf(stderr, "frame %u\n", n);
+            goto out;
+        }
+    }
+
+    ret = 0;
+out:
+    if (ring != MAP_FAILED)
+        munmap(ring, sizeof(*ring));
+    for (unsigned int i = 0; i < count; i++) {
+        if (maps[i] && maps[i] != MAP_FAILED)
+            munmap(maps[i], fmt.fmt.pix_mp.plane_fmt[0].sizeimage);
+    }
+    if (setup.memfd >= 0)
+        close(setup.memfd);
+    if (setup.eventfd >= 0)
+        close(setup.eventfd);
+    return ret;
+}
+
+int main(void) {
+    uint8_t *maps[VIDEO_MAX_FRAME] = { 0 };
+    struct mppv4l2 *dev;
+    int ret;
+
+    mock_mpp_decode(TEST_WIDTH, TEST_HEIGHT);
+
+    dev = mppv4l2_open("H.264", 0);
+    if (!dev) {
+        fprintf(stderr, "mppv4l2_open: %s\n", strerror(errno));
+        return 1;
+    }
+
+    ret = test_ring(dev, maps);
+
+    mppv4l2_close(dev);
+    return ret ? 1 : 0;
+}
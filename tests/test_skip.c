@@ -0,0 +1,211 @@
+/*
+ * test_skip.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Packets queued with skip flags in reserved2 through the library on the
+ * mock mpp: those the flags drop never reach mpp and come back to the
+ * client, the others do, and the flags go with the QBUF that set them. A
+ * packet mpp refused is dropped or not the way it was the first time.
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#include "libmppv4l2.h"
+#include "mock_mpp.h"
+#include "rkmpp.h"
+
+#define TEST_BUFFERS    4
+#define TEST_SIZE       (1 << 16)
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __func__, __LINE__, #cond); \
+            return -1; \
+        } \
+    } while (0)
+
+/* An IDR slice, a P slice and a P slice nothing references, all I and P */
+static const uint8_t idr_packet[] = { 0, 0, 0, 1, 0x65, 0x88, 0x80 };
+static const uint8_t p_packet[] = { 0, 0, 0, 1, 0x41, 0xc0, 0x80 };
+static const uint8_t nonref_packet[] = { 0, 0, 0, 1, 0x01, 0xc0, 0x80 };
+
+static int test_ioctl(struct mppv4l2 *dev, unsigned long request, void *arg,
+        const char *name) {
+    if (mppv4l2_ioctl(dev, request, arg) < 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+#define TEST_IOCTL(dev, request, arg) test_ioctl(dev, request, arg, #request)
+
+/* The packet, already in the mapped buffer index, queued with the skip flags */
+static int queue_packet(struct mppv4l2 *dev, uint32_t index, uint32_t skip) {
+    struct v4l2_plane plane = {
+        .bytesused = sizeof(idr_packet),
+        .length = TEST_SIZE,
+    };
+    struct v4l2_buffer buffer = {
+        .index = index,
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_MMAP,
+        .timestamp.tv_usec = index + 1,
+        .length = 1,
+        .m.planes = &plane,
+        .reserved2 = skip,
+    };
+
+    return TEST_IOCTL(dev, VIDIOC_QBUF, &buffer);
+}
+
+/* Buffer index back from the decoder, put or dropped */
+static int dequeue_packet(struct mppv4l2 *dev, uint32_t index) {
+    struct v4l2_plane plane;
+    struct v4l2_buffer buffer = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_MMAP,
+        .length = 1,
+        .m.planes = &plane,
+    };
+
+    if (TEST_IOCTL(dev, VIDIOC_DQBUF, &buffer) < 0)
+        return -1;
+
+    CHECK(buffer.index == index);
+    return 0;
+}
+
+/*
+ * The packet in buffer index, queued with the skip flags and back from the
+ * decoder, is the next one mpp got when it's put.
+ */
+static int check_packet(struct mppv4l2 *dev, uint8_t *maps[TEST_BUFFERS],
+        uint32_t index, const uint8_t *packet, uint32_t skip, unsigned int *put,
+        bool dropped) {
+    uint8_t got[TEST_SIZE];
+
+    memcpy(maps[index], packet, sizeof(idr_packet));
+    if (queue_packet(dev, index, skip) < 0 || dequeue_packet(dev, index) < 0)
+        return -1;
+
+    if (dropped) {
+        CHECK(!mock_mpp_packet(*put, got, sizeof(got), 50));
+        return 0;
+    }
+
+    CHECK(mock_mpp_packet(*put, got, sizeof(got), 2000) == sizeof(idr_packet));
+    CHECK(!memcmp(got, packet, sizeof(idr_packet)));
+    (*put)++;
+    return 0;
+}
+
+/*
+ * A keyframe mpp refuses is rewritten into a packet its flags drop. Its
+ * retry is still put, as inspected the first time.
+ */
+static int check_retry(struct mppv4l2 *dev, uint8_t *maps[TEST_BUFFERS],
+        unsigned int put) {
+    uint8_t got[TEST_SIZE];
+
+    memcpy(maps[0], idr_packet, sizeof(idr_packet));
+    mock_mpp_fail_puts(1000);
+    if (queue_packet(dev, 0, RKMPP_BUF_SKIP_NONKEY) < 0)
+        return -1;
+
+    for (int i = 0; mock_mpp_fail_puts(1000) == 1000; i++) {
+        CHECK(i < 2000);
+        usleep(1000);
+    }
+
+    memcpy(maps[0], nonref_packet, sizeof(nonref_packet));
+    mock_mpp_fail_puts(0);
+
+    CHECK(mock_mpp_packet(put, got, sizeof(got), 2000) == sizeof(nonref_packet));
+    CHECK(!memcmp(got, nonref_packet, sizeof(nonref_packet)));
+    return dequeue_packet(dev, 0);
+}
+
+/* Mmap output buffers, mapped through their exported dma-bufs */
+static int setup_output(struct mppv4l2 *dev, uint8_t *maps[TEST_BUFFERS]) {
+    struct v4l2_requestbuffers reqbufs = {
+        .count = TEST_BUFFERS,
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_MMAP,
+    };
+    int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    struct v4l2_exportbuffer expbuf;
+
+    if (TEST_IOCTL(dev, VIDIOC_REQBUFS, &reqbufs) < 0)
+        return -1;
+
+    CHECK(reqbufs.count == TEST_BUFFERS);
+
+    for (unsigned int i = 0; i < TEST_BUFFERS; i++) {
+        expbuf = (struct v4l2_exportbuffer) {
+            .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+            .index = i,
+            .flags = O_CLOEXEC,
+        };
+        if (TEST_IOCTL(dev, VIDIOC_EXPBUF, &expbuf) < 0)
+            return -1;
+
+        maps[i] = mmap(NULL, TEST_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+                expbuf.fd, 0);
+        close(expbuf.fd);
+        CHECK(maps[i] != MAP_FAILED);
+    }
+
+    return TEST_IOCTL(dev, VIDIOC_STREAMON, &type);
+}
+
+int main(void) {
+    struct v4l2_format fmt = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .fmt.pix_mp = {
+            .width = 320,
+            .height = 240,
+            .pixelformat = V4L2_PIX_FMT_H264,
+            .num_planes = 1,
+            .plane_fmt[0].sizeimage = TEST_SIZE,
+        },
+    };
+    const uint32_t both = RKMPP_BUF_SKIP_NONREF | RKMPP_BUF_SKIP_NONKEY;
+    uint8_t *maps[TEST_BUFFERS];
+    struct mppv4l2 *dev;
+    unsigned int put = 0;
+    int ret = 1;
+
+    dev = mppv4l2_open("H.264", 0);
+    if (!dev) {
+        fprintf(stderr, "mppv4l2_open: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (TEST_IOCTL(dev, VIDIOC_S_FMT, &fmt) < 0 || setup_output(dev, maps) < 0)
+        goto out;
+
+    if (check_packet(dev, maps, 0, nonref_packet, RKMPP_BUF_SKIP_NONREF, &put, true) ||
+            check_packet(dev, maps, 1, idr_packet, both, &put, false) ||
+            check_packet(dev, maps, 2, p_packet, RKMPP_BUF_SKIP_NONKEY, &put, true) ||
+            check_packet(dev, maps, 3, p_packet, RKMPP_BUF_SKIP_NONREF, &put, false) ||
+            /* The flags of the last QBUF of the buffer are gone */
+            check_packet(dev, maps, 0, nonref_packet, 0, &put, false) ||
+            check_retry(dev, maps, put))
+        goto out;
+
+    ret = 0;
+out:
+    mppv4l2_close(dev);
+    return ret;
+}
@@ -0,0 +1,197 @@
+/*
+ * test_stateless.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Stateless H.264 requests through the library on the mock mpp: the access
+ * units mpp gets have the parameter sets of the controls in front of the
+ * slices of an IDR, and nothing in front of the next slice. New parameter
+ * sets mpp refused the first time go in front of the packet again.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "libmppv4l2.h"
+#include "mock_mpp.h"
+
+/* Any fd number, nothing ever looks at the request behind it */
+#define TEST_REQUEST_FD     42
+
+static const uint8_t idr_slice[] = { 0, 0, 0, 1, 0x65, 0x88, 0x80 };
+static const uint8_t p_slice[] = { 0, 0, 0, 1, 0x41, 0x9a, 0x02 };
+
+static int test_ioctl(struct mppv4l2 *dev, unsigned long request, void *arg,
+        const char *name) {
+    if (mppv4l2_ioctl(dev, request, arg) < 0) {
+        fprintf(stderr, "%s: %s\n", name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+#define TEST_IOCTL(dev, request, arg) test_ioctl(dev, request, arg, #request)
+
+static int set_ctrls(struct mppv4l2 *dev, int request_fd,
+        struct v4l2_ctrl_h264_sps *sps, struct v4l2_ctrl_h264_pps *pps,
+        struct v4l2_ctrl_h264_decode_params *decode) {
+    struct v4l2_ext_control ctrl[] = {
+        { .id = V4L2_CID_STATELESS_H264_SPS, .size = sizeof(*sps), .ptr = sps },
+        { .id = V4L2_CID_STATELESS_H264_PPS, .size = sizeof(*pps), .ptr = pps },
+        { .id = V4L2_CID_STATELESS_H264_DECODE_PARAMS, .size = sizeof(*decode),
+          .ptr = decode },
+    };
+    struct v4l2_ext_controls ctrls = {
+        .which = request_fd >= 0 ? V4L2_CTRL_WHICH_REQUEST_VAL : V4L2_CTRL_WHICH_CUR_VAL,
+        .count = 3,
+        .request_fd = request_fd,
+        .controls = ctrl,
+    };
+
+    return TEST_IOCTL(dev, VIDIOC_S_EXT_CTRLS, &ctrls);
+}
+
+static int queue_slice(struct mppv4l2 *dev, uint32_t index, int request_fd,
+        const uint8_t *slice, size_t size) {
+    struct v4l2_plane plane = {
+        .bytesused = size,
+        .length = size,
+        .m.userptr = (unsigned long) slice,
+    };
+    struct v4l2_buffer buffer = {
+        .index = index,
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_USERPTR,
+        .flags = request_fd >= 0 ? V4L2_BUF_FLAG_REQUEST_FD : 0,
+        .request_fd = request_fd,
+        .timestamp.tv_usec = index + 1,
+        .length = 1,
+        .m.planes = &plane,
+    };
+
+    return TEST_IOCTL(dev, VIDIOC_QBUF, &buffer);
+}
+
+/* Output buffer index back from the decoder, for the next slice */
+static int dequeue_slice(struct mppv4l2 *dev, uint32_t index) {
+    struct v4l2_plane plane;
+    struct v4l2_buffer buffer = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_USERPTR,
+        .length = 1,
+        .m.planes = &plane,
+    };
+
+    if (TEST_IOCTL(dev, VIDIOC_DQBUF, &buffer) < 0)
+        return -1;
+
+    if (buffer.index != index) {
+        fprintf(stderr, "dequeued buffer %u, not %u\n", buffer.index, index);
+        return -1;
+    }
+    return 0;
+}
+
+int main(void) {
+    struct v4l2_ctrl_h264_sps sps = {
+        .profile_idc = 77,
+        .constraint_set_flags = V4L2_H264_SPS_CONSTRAINT_SET1_FLAG,
+        .level_idc = 40,
+        .chroma_format_idc = 1,
+        .max_num_ref_frames = 4,
+        .pic_width_in_mbs_minus1 = 119,
+        .pic_height_in_map_units_minus1 = 67,
+        .flags = V4L2_H264_SPS_FLAG_FRAME_MBS_ONLY |
+                V4L2_H264_SPS_FLAG_DIRECT_8X8_INFERENCE,
+    };
+    struct v4l2_ctrl_h264_pps pps = { 0 };
+    struct v4l2_ctrl_h264_decode_params decode = {
+        .flags = V4L2_H264_DECODE_PARAM_FLAG_IDR_PIC,
+    };
+    struct v4l2_format fmt = {
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .fmt.pix_mp = {
+            .width = 1920,
+            .height = 1080,
+            .pixelformat = V4L2_PIX_FMT_H264_SLICE,
+            .num_planes = 1,
+            .plane_fmt[0].sizeimage = 1 << 20,
+        },
+    };
+    struct v4l2_requestbuffers reqbufs = {
+        .count = 2,
+        .type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+        .memory = V4L2_MEMORY_USERPTR,
+    };
+    int type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    struct mppv4l2 *dev;
+    uint8_t au[4096];
+    size_t size;
+    int ret = 1;
+
+    dev = mppv4l2_open(NULL, 0);
+    if (!dev) {
+        fprintf(stderr, "mppv4l2_open: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (TEST_IOCTL(dev, VIDIOC_S_FMT, &fmt) < 0 ||
+            TEST_IOCTL(dev, VIDIOC_REQBUFS, &reqbufs) < 0 ||
+            TEST_IOCTL(dev, VIDIOC_STREAMON, &type) < 0)
+        goto out;
+
+    /* The IDR in a request, the P slice on the current controls it left */
+    if (set_ctrls(dev, TEST_REQUEST_FD, &sps, &pps, &decode) < 0 ||
+            queue_slice(dev, 0, TEST_REQUEST_FD, idr_slice, sizeof(idr_slice)) < 0)
+        goto out;
+
+    decode.flags = 0;
+    if (set_ctrls(dev, -1, &sps, &pps, &decode) < 0 ||
+            queue_slice(dev, 1, -1, p_slice, sizeof(p_slice)) < 0)
+        goto out;
+
+    size = mock_mpp_packet(0, au, sizeof(au), 2000);
+    if (size <= sizeof(idr_slice) || size > sizeof(au)) {
+        fprintf(stderr, "idr: access unit of %zu bytes\n", size);
+        goto out;
+    }
+
+    /* The SPS first, constraint_set1_flag being the second bit */
+    if (memcmp(au, "\0\0\0\1\x67\x4d\x40\x28", 8)) {
+        fprintf(stderr, "idr: sps starts %02x %02x %02x %02x\n", au[4], au[5], au[6], au[7]);
+        goto out;
+    }
+
+    if (memcmp(au + size - sizeof(idr_slice), idr_slice, sizeof(idr_slice))) {
+        fprintf(stderr, "idr: slice isn't at the end of the access unit\n");
+        goto out;
+    }
+
+    size = mock_mpp_packet(1, au, sizeof(au), 2000);
+    if (size != sizeof(p_slice) || memcmp(au, p_slice, size)) {
+        fprintf(stderr, "p: access unit of %zu bytes, not the slice alone\n", size);
+        goto out;
+    }
+
+    /* A new PPS on a P slice mpp refuses the first time */
+    pps.pic_init_qp_minus26 = 2;
+    mock_mpp_fail_puts(1);
+    if (dequeue_slice(dev, 0) < 0 || set_ctrls(dev, -1, &sps, &pps, &decode) < 0 ||
+            queue_slice(dev, 0, -1, p_slice, sizeof(p_slice)) < 0)
+        goto out;
+
+    size = mock_mpp_packet(2, au, sizeof(au), 2000);
+    if (size <= sizeof(p_slice) || size > sizeof(au) ||
+            memcmp(au, "\0\0\0\1\x67", 5) ||
+            memcmp(au + size - sizeof(p_slice), p_slice, sizeof(p_slice))) {
+        fprintf(stderr, "retry: access unit of %zu bytes without the parameter sets\n", size);
+        goto out;
+    }
+
+    ret = 0;
+out:
+    mppv4l2_close(dev);
+    return ret;
+}
@@ -0,0 +1,303 @@
+/*
+ * test_vpuload.c
+ *
+ *  Created on: Oct 18, 2026
+ *      Author: boogie
+ *
+ * Decoder blocks probed from a device tree made in a temporary directory,
+ * and the pick of a block for a session among blocks of one to four cores.
+ */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "utils.h"
+#include "vpuload.h"
+
+int app_log_level;
+
+/* Pixel rates of a core */
+#define RATE_1080P60    (1920ULL * 1080 * 60)
+#define RATE_4K60       (3840ULL * 2160 * 60)
+
+/**
+ * struct dt_node - A node of the fake device tree
+ * @path:       Path under the root.
+ * @compatible: Its compatible strings.
+ * @compatible_size: Size of compatible, with the nul of each string.
+ * @status:     Its status, NULL for none.
+ */
+struct dt_node {
+    const char *path;
+    const char *compatible;
+    size_t compatible_size;
+    const char *status;
+};
+
+#define DT_NODE(path, compatible, status) \
+    { path, compatible, sizeof(compatible), status }
+
+/* What an rk3588 has, one rkvdec core disabled and a ccu that's no core */
+static const struct dt_node rk3588_nodes[] = {
+    DT_NODE("", "radxa,rock-5b\0rockchip,rk3588", NULL),
+    DT_NODE("rkvdec-ccu@fdc30000", "rockchip,rkv-decoder-v2-ccu", "okay"),
+    DT_NODE("rkvdec-core@fdc38000", "rockchip,rkv-decoder-v2", "okay"),
+    DT_NODE("rkvdec-core@fdc48000", "rockchip,rkv-decoder-v2", NULL),
+    DT_NODE("rkvdec-core@fdc58000", "rockchip,rkv-decoder-v2", "disabled"),
+    DT_NODE("vpu@fdb50400", "rockchip,vpu-decoder-v2", "okay"),
+    DT_NODE("bus@fd000000/av1d@fdc70000", "rockchip,av1-decoder", "okay"),
+    DT_NODE("uart@feb50000", "rockchip,rk3588-uart\0snps,dw-apb-uart", "okay"),
+};
+
+/* The same decoder cores on a soc without 8K */
+static const struct dt_node rk3568_nodes[] = {
+    DT_NODE("", "rockchip,rk3568", NULL),
+    DT_NODE("rkvdec@fdf80200", "rockchip,rkv-decoder-v2", "okay"),
+    DT_NODE("vdpu@fdea0400", "rockchip,vpu-decoder-v2", "okay"),
+};
+
+static int write_prop(const char *node, const char *prop, const char *data, size_t size) {
+    char path[PATH_MAX];
+    int fd, ret;
+
+    snprintf(path, sizeof(path), "%s/%s", node, prop);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    ret = write(fd, data, size) == (ssize_t) size ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+static int make_tree(const char *root, const struct dt_node *nodes, int num) {
+    char path[PATH_MAX];
+
+    for (int i = 0; i < num; i++) {
+        const struct dt_node *node = &nodes[i];
+        char *slash;
+
+        snprintf(path, sizeof(path), "%s/%s", root, node->path);
+        for (slash = path + strlen(root) + 1; (slash = strchr(slash, '/')); slash++) {
+            *slash = '\0';
+            mkdir(path, 0755);
+            *slash = '/';
+        }
+        mkdir(path, 0755);
+
+        if (write_prop(path, "compatible", node->compatible, node->compatible_size) < 0 ||
+                (node->status && write_prop(path, "status", node->status,
+                strlen(node->status) + 1) < 0))
+            return -1;
+    }
+
+    return 0;
+}
+
+static const struct rkmpp_vpu_block *find_block(const struct rkmpp_vpu_block *blocks,
+        int num, const char *name) {
+    for (int i = 0; i < num; i++) {
+        if (!strcmp(blocks[i].name, name))
+            return &blocks[i];
+    }
+
+    return NULL;
+}
+
+static int check_block(const struct rkmpp_vpu_block *blocks, int num, const char *soc,
+        const char *name, uint32_t cores, uint32_t max_width) {
+    const struct rkmpp_vpu_block *block = find_block(blocks, num, name);
+
+    if (!block) {
+        fprintf(stderr, "%s: no %s\n", soc, name);
+        return 1;
+    }
+
+    if (block->cores != cores || block->max_width != max_width) {
+        fprintf(stderr, "%s: %s has %u cores up to %u wide, not %u up to %u\n", soc,
+                name, block->cores, block->max_width, cores, max_width);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int check_probe(void) {
+    struct rkmpp_vpu_block blocks[RKMPP_VPU_MAX_BLOCKS];
+    char root[] = "/tmp/test_vpuload.XXXXXX", cmd[PATH_MAX + 16];
+    int num, ret = 0;
+
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    if (make_tree(root, rk3588_nodes, ARRAY_SIZE(rk3588_nodes)) < 0) {
+        perror("rk3588 tree");
+        ret = 1;
+        goto out;
+    }
+
+    num = rkmpp_vpu_probe(root, blocks, ARRAY_SIZE(blocks));
+    if (num != 3) {
+        fprintf(stderr, "rk3588: %d blocks, not 3\n", num);
+        ret = 1;
+        goto out;
+    }
+
+    ret |= check_block(blocks, num, "rk3588", "rkvdec", 2, 7680);
+    ret |= check_block(blocks, num, "rk3588", "vdpu", 1, 1920);
+    ret |= check_block(blocks, num, "rk3588", "av1d", 1, 7680);
+
+    /* Up to max, the rest left out */
+    if (rkmpp_vpu_probe(root, blocks, 1) != 1) {
+        fprintf(stderr, "rk3588: more blocks than room for\n");
+        ret = 1;
+    }
+
+    snprintf(cmd, sizeof(cmd), "rm -rf %s/*", root);
+    if (system(cmd) || make_tree(root, rk3568_nodes, ARRAY_SIZE(rk3568_nodes)) < 0) {
+        perror("rk3568 tree");
+        ret = 1;
+        goto out;
+    }
+
+    num = rkmpp_vpu_probe(root, blocks, ARRAY_SIZE(blocks));
+    if (num != 2) {
+        fprintf(stderr, "rk3568: %d blocks, not 2\n", num);
+        ret = 1;
+        goto out;
+    }
+
+    ret |= check_block(blocks, num, "rk3568", "rkvdec", 1, 4096);
+    ret |= check_block(blocks, num, "rk3568", "vdpu", 1, 1920);
+
+    if (rkmpp_vpu_probe("/nonexistent", blocks, ARRAY_SIZE(blocks)) != 0) {
+        fprintf(stderr, "blocks without a device tree\n");
+        ret = 1;
+    }
+
+out:
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", root);
+    if (system(cmd))
+        fprintf(stderr, "failed to remove %s\n", root);
+    return ret;
+}
+
+#define BLOCK(cores_, rate, ...) { \
+        .name = #cores_ " cores", .cores = cores_, .core_rate = rate, \
+        .max_width = 4096, .max_height = 2304, .codings = { __VA_ARGS__ } }
+
+/**
+ * struct pick_case - Blocks with their loads and the block a session gets
+ * @name:       What it checks.
+ * @blocks:     Blocks to pick from.
+ * @loads:      Their loads.
+ * @num:        Number of blocks.
+ * @type:       Coding of the session.
+ * @width:      Width of the session.
+ * @height:     Height of the session.
+ * @rate:       Pixel rate of the session.
+ * @expect:     Index of the block it gets, -1 for none.
+ */
+struct pick_case {
+    const char *name;
+    struct rkmpp_vpu_block blocks[RKMPP_VPU_MAX_BLOCKS];
+    struct rkmpp_vpu_load loads[RKMPP_VPU_MAX_BLOCKS];
+    int num;
+    MppCodingType type;
+    uint32_t width;
+    uint32_t height;
+    uint64_t rate;
+    int expect;
+};
+
+static const struct pick_case pick_cases[] = {
+    {
+        .name = "least loaded",
+        .blocks = { BLOCK(2, RATE_4K60, MPP_VIDEO_CodingAVC),
+                    BLOCK(2, RATE_4K60, MPP_VIDEO_CodingAVC),
+                    BLOCK(2, RATE_4K60, MPP_VIDEO_CodingAVC) },
+        .loads = { { 2, RATE_4K60, 0 }, { 1, RATE_1080P60, 0 }, { 1, RATE_4K60, 0 } },
+        .num = 3, .type = MPP_VIDEO_CodingAVC, .width = 1920, .height = 1080,
+        .rate = RATE_1080P60, .expect = 1,
+    },
+    {
+        .name = "latency over pixels",
+        .blocks = { BLOCK(1, RATE_4K60, MPP_VIDEO_CodingAVC),
+                    BLOCK(1, RATE_4K60, MPP_VIDEO_CodingAVC) },
+        .loads = { { 1, RATE_1080P60, RKMPP_VPU_SATURATED_US }, { 2, RATE_4K60 / 2, 0 } },
+        .num = 2, .type = MPP_VIDEO_CodingAVC, .width = 1920, .height = 1080,
+        .rate = RATE_1080P60, .expect = 1,
+    },
+    {
+        .name = "tie to more cores",
+        .blocks = { BLOCK(1, RATE_4K60, MPP_VIDEO_CodingHEVC),
+                    BLOCK(4, RATE_4K60, MPP_VIDEO_CodingHEVC),
+                    BLOCK(2, RATE_4K60, MPP_VIDEO_CodingHEVC) },
+        .num = 3, .type = MPP_VIDEO_CodingHEVC, .width = 1920, .height = 1080,
+        .rate = 0, .expect = 1,
+    },
+    {
+        .name = "4 cores keep up where 1 can't",
+        .blocks = { BLOCK(1, RATE_4K60, MPP_VIDEO_CodingHEVC),
+                    BLOCK(4, RATE_4K60, MPP_VIDEO_CodingHEVC) },
+        .loads = { { 0 }, { 3, 3 * RATE_4K60, 0 } },
+        .num = 2, .type = MPP_VIDEO_CodingHEVC, .width = 3840, .height = 2160,
+        .rate = 2 * RATE_4K60, .expect = 1,
+    },
+    {
+        .name = "none keeps up, least loaded",
+        .blocks = { BLOCK(1, RATE_1080P60, MPP_VIDEO_CodingAVC),
+                    BLOCK(2, RATE_1080P60, MPP_VIDEO_CodingAVC) },
+        .loads = { { 0 }, { 4, 6 * RATE_1080P60, 0 } },
+        .num = 2, .type = MPP_VIDEO_CodingAVC, .width = 3840, .height = 2160,
+        .rate = RATE_4K60, .expect = 0,
+    },
+    {
+        .name = "coding of one block",
+        .blocks = { BLOCK(4, RATE_4K60, MPP_VIDEO_CodingAVC, MPP_VIDEO_CodingHEVC),
+                    BLOCK(1, RATE_1080P60, MPP_VIDEO_CodingAVC, MPP_VIDEO_CodingVP8) },
+        .num = 2, .type = MPP_VIDEO_CodingVP8, .width = 1280, .height = 720,
+        .rate = 1280ULL * 720 * 30, .expect = 1,
+    },
+    {
+        .name = "too wide for all",
+        .blocks = { BLOCK(2, RATE_4K60, MPP_VIDEO_CodingAVC),
+                    BLOCK(1, RATE_4K60, MPP_VIDEO_CodingAVC) },
+        .num = 2, .type = MPP_VIDEO_CodingAVC, .width = 7680, .height = 4320,
+        .rate = RATE_4K60, .expect = -1,
+    },
+    {
+        .name = "no block",
+        .num = 0, .type = MPP_VIDEO_CodingAVC, .width = 1920, .height = 1080,
+        .rate = RATE_1080P60, .expect = -1,
+    },
+};
+
+static int check_pick(const struct pick_case *c) {
+    int index = rkmpp_vpu_pick(c->blocks, c->loads, c->num, c->type, c->width, c->height,
+            c->rate);
+
+    if (index != c->expect) {
+        fprintf(stderr, "pick %s: block %d, not %d\n", c->name, index, c->expect);
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(void) {
+    int ret = check_probe();
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(pick_cases); i++)
+        ret |= check_pick(&pick_cases[i]);
+
+    return ret;
+}